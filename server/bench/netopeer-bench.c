@@ -0,0 +1,647 @@
+/**
+ * @file netopeer-bench.c
+ * @brief Load generator and latency benchmark for the Netopeer server
+ *
+ * Copyright (C) 2015 CESNET, z.s.p.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of the Company nor the names of its contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * ALTERNATIVELY, provided that this notice is retained in full, this
+ * product may be distributed under the terms of the GNU General Public
+ * License (GPL) version 2 or later, in which case the provisions
+ * of the GPL apply INSTEAD OF those given above.
+ *
+ * This software is provided ``as is, and any express or implied
+ * warranties, including, but not limited to, the implied warranties of
+ * merchantability and fitness for a particular purpose are disclaimed.
+ * In no event shall the company or contributors be liable for any
+ * direct, indirect, incidental, special, exemplary, or consequential
+ * damages (including, but not limited to, procurement of substitute
+ * goods or services; loss of use, data, or profits; or business
+ * interruption) however caused and on any theory of liability, whether
+ * in contract, strict liability, or tort (including negligence or
+ * otherwise) arising in any way out of the use of this software, even
+ * if advised of the possibility of such damage.
+ */
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libnetconf.h>
+#include <libnetconf_ssh.h>
+#ifdef NP_TLS
+#	include <libnetconf_tls.h>
+#endif
+
+static const char rcsid[] __attribute__((used)) ="$Id: "__FILE__": "RCSID" $";
+
+#ifdef __GNUC__
+#	define UNUSED(x) UNUSED_ ## x __attribute__((__unused__))
+#else
+#	define UNUSED(x) UNUSED_ ## x
+#endif
+
+#ifndef CERTS_DIR
+#	define CERTS_DIR "./certs"
+#endif
+
+#define DEFAULT_PORT_SSH 830
+#define DEFAULT_PORT_TLS 6513
+
+/* every number-of-msecs the server process is sampled */
+#define SAMPLE_INTERVAL 100
+
+enum bench_op {
+	OP_GET,
+	OP_GETCONFIG,
+	OP_EDITCONFIG,
+	OP_LOCK,
+	OP_SUBSCRIBE,
+	OP_COUNT
+};
+
+static const char* op_names[OP_COUNT] = {"get", "get-config", "edit-config", "lock", "create-subscription"};
+
+/* measured durations in usec */
+struct samples {
+	unsigned long long* usec;
+	size_t count;
+	size_t size;
+};
+
+/* for each session thread */
+struct bench_thread {
+	pthread_t tid;
+	NC_TRANSPORT transport;
+	unsigned int seed;
+
+	struct samples ops[OP_COUNT];
+	unsigned long errors[OP_COUNT];
+	struct samples connects;
+	unsigned long connect_failures;
+};
+
+/* sampled server process status */
+struct server_sample {
+	unsigned long rss_kb;
+	unsigned long threads;
+};
+
+static struct {
+	const char* host;
+	unsigned short ssh_port;
+	unsigned short tls_port;
+	unsigned int ssh_sessions;
+	unsigned int tls_sessions;
+	unsigned int duration;
+	unsigned int weights[OP_COUNT];
+	unsigned int weight_sum;
+	const char* username;
+	const char* password;
+	const char* privkey;
+	const char* cert;
+	const char* key;
+	const char* ca;
+	char* edit_config;
+	pid_t server_pid;
+	volatile int stop;
+} opts = {
+	.host = "localhost",
+	.ssh_port = DEFAULT_PORT_SSH,
+	.tls_port = DEFAULT_PORT_TLS,
+	.ssh_sessions = 4,
+	.tls_sessions = 0,
+	.duration = 10,
+	.weights = {40, 40, 10, 10, 0},
+	.cert = CERTS_DIR "/client.crt",
+	.key = CERTS_DIR "/client.key",
+	.ca = CERTS_DIR "/ca.pem",
+};
+
+static void usage(const char* progname) {
+	fprintf(stdout, "Usage: %s [options]\n\n", progname);
+	fprintf(stdout, "Opens concurrent NETCONF sessions to a local netopeer-server, each sending\n");
+	fprintf(stdout, "a random mix of RPCs until the time runs out, and reports the latencies.\n\n");
+	fprintf(stdout, "  -s NUM       number of SSH sessions (default 4)\n");
+#ifdef NP_TLS
+	fprintf(stdout, "  -t NUM       number of TLS sessions (default 0)\n");
+#endif
+	fprintf(stdout, "  -d SECS      duration of the benchmark (default 10)\n");
+	fprintf(stdout, "  -m MIX       RPC weights, e.g. \"get=40,get-config=40,edit-config=10,lock=10,create-subscription=0\"\n");
+	fprintf(stdout, "               (default); a session is reconnected after create-subscription\n");
+	fprintf(stdout, "  -e FILE      edit-config content (default sets netopeer/hello-timeout to 600)\n");
+	fprintf(stdout, "  -H HOST      server host (default localhost)\n");
+	fprintf(stdout, "  -p PORT      SSH port (default %d)\n", DEFAULT_PORT_SSH);
+#ifdef NP_TLS
+	fprintf(stdout, "  -P PORT      TLS port (default %d)\n", DEFAULT_PORT_TLS);
+#endif
+	fprintf(stdout, "  -u USER      SSH username (default the current user)\n");
+	fprintf(stdout, "  -w PASSWORD  SSH password\n");
+	fprintf(stdout, "  -i KEY       SSH private key, the public key is expected in KEY.pub\n");
+#ifdef NP_TLS
+	fprintf(stdout, "  -c CERT      TLS client certificate (default %s/client.crt)\n", CERTS_DIR);
+	fprintf(stdout, "  -k KEY       TLS client key (default %s/client.key)\n", CERTS_DIR);
+	fprintf(stdout, "  -a CA        TLS trusted CA certificates (default %s/ca.pem)\n", CERTS_DIR);
+#endif
+	fprintf(stdout, "  -x PID       server process to sample (default the running netopeer-server)\n");
+	fprintf(stdout, "  -h           display this help\n");
+}
+
+static unsigned long long now_usec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void samples_add(struct samples* samples, unsigned long long usec) {
+	if (samples->count == samples->size) {
+		samples->size = (samples->size ? samples->size * 2 : 1024);
+		samples->usec = realloc(samples->usec, samples->size * sizeof *samples->usec);
+		if (samples->usec == NULL) {
+			fprintf(stderr, "Memory allocation failed (%s).\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	samples->usec[samples->count++] = usec;
+}
+
+static void samples_merge(struct samples* dst, const struct samples* src) {
+	size_t i;
+
+	for (i = 0; i < src->count; ++i) {
+		samples_add(dst, src->usec[i]);
+	}
+}
+
+static int samples_cmp(const void* a, const void* b) {
+	unsigned long long x = *(const unsigned long long*)a, y = *(const unsigned long long*)b;
+
+	return (x > y) - (x < y);
+}
+
+/* samples must be sorted */
+static double samples_percentile_ms(const struct samples* samples, double percentile) {
+	if (samples->count == 0) {
+		return 0;
+	}
+	return samples->usec[(size_t)(percentile * (samples->count - 1))] / 1000.0;
+}
+
+static int parse_mix(const char* mix) {
+	char* dup, *item, *save = NULL, *eq;
+	int i;
+
+	memset(opts.weights, 0, sizeof opts.weights);
+	dup = strdup(mix);
+	for (item = strtok_r(dup, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+		if ((eq = strchr(item, '=')) == NULL) {
+			fprintf(stderr, "Invalid RPC mix item \"%s\".\n", item);
+			free(dup);
+			return EXIT_FAILURE;
+		}
+		*eq = '\0';
+		for (i = 0; i < OP_COUNT && strcmp(op_names[i], item) != 0; ++i);
+		if (i == OP_COUNT || !isdigit(eq[1])) {
+			fprintf(stderr, "Invalid RPC mix item \"%s=%s\".\n", item, eq+1);
+			free(dup);
+			return EXIT_FAILURE;
+		}
+		opts.weights[i] = atoi(eq+1);
+	}
+	free(dup);
+
+	return EXIT_SUCCESS;
+}
+
+static char* read_file(const char* path) {
+	FILE* f;
+	char* buf;
+	long len;
+
+	if ((f = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "Unable to open \"%s\" (%s).\n", path, strerror(errno));
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	buf = malloc(len + 1);
+	if (fread(buf, 1, len, f) != (size_t)len) {
+		fprintf(stderr, "Unable to read \"%s\".\n", path);
+		free(buf);
+		fclose(f);
+		return NULL;
+	}
+	buf[len] = '\0';
+	fclose(f);
+
+	return buf;
+}
+
+/* return: 0 - no netopeer-server found */
+static pid_t server_find(void) {
+	DIR* dir;
+	struct dirent* proc;
+	char path[64], comm[32];
+	FILE* f;
+	pid_t pid = 0;
+
+	if ((dir = opendir("/proc")) == NULL) {
+		return 0;
+	}
+	while (pid == 0 && (proc = readdir(dir)) != NULL) {
+		if (!isdigit(proc->d_name[0])) {
+			continue;
+		}
+		snprintf(path, sizeof path, "/proc/%s/comm", proc->d_name);
+		if ((f = fopen(path, "r")) == NULL) {
+			continue;
+		}
+		if (fgets(comm, sizeof comm, f) != NULL && strcmp(comm, "netopeer-server\n") == 0) {
+			pid = atoi(proc->d_name);
+		}
+		fclose(f);
+	}
+	closedir(dir);
+
+	return pid;
+}
+
+/* return: 0 - sampled, 1 - the process is gone */
+static int server_sample(pid_t pid, struct server_sample* sample) {
+	char path[64], line[128];
+	FILE* f;
+
+	snprintf(path, sizeof path, "/proc/%d/status", pid);
+	if ((f = fopen(path, "r")) == NULL) {
+		return 1;
+	}
+	while (fgets(line, sizeof line, f) != NULL) {
+		sscanf(line, "VmRSS: %lu", &sample->rss_kb);
+		sscanf(line, "Threads: %lu", &sample->threads);
+	}
+	fclose(f);
+
+	return 0;
+}
+
+static char* clb_password(const char* UNUSED(username), const char* UNUSED(hostname)) {
+	return strdup(opts.password);
+}
+
+static void clb_print(NC_VERB_LEVEL UNUSED(level), const char* msg) {
+	if (!opts.stop) {
+		fprintf(stderr, "libnetconf: %s\n", msg);
+	}
+}
+
+static struct nc_session* bench_connect(struct bench_thread* thread) {
+	struct nc_session* session;
+	unsigned long long start;
+
+	nc_session_transport(thread->transport);
+
+	start = now_usec();
+	if (thread->transport == NC_TRANSPORT_TLS) {
+		session = nc_session_connect(opts.host, opts.tls_port, NULL, NULL);
+	} else {
+		session = nc_session_connect(opts.host, opts.ssh_port, opts.username, NULL);
+	}
+
+	if (session == NULL) {
+		++thread->connect_failures;
+		return NULL;
+	}
+
+	samples_add(&thread->connects, now_usec() - start);
+	return session;
+}
+
+/* return: 0 - session can be used again, 1 - session must be reconnected */
+static int bench_rpc(struct bench_thread* thread, struct nc_session* session, enum bench_op op) {
+	nc_rpc* rpc = NULL;
+	nc_reply* reply = NULL;
+	NC_MSG_TYPE msg_type;
+	unsigned long long start;
+	int ret = 0;
+
+	switch (op) {
+	case OP_GET:
+		rpc = nc_rpc_get(NULL);
+		break;
+	case OP_GETCONFIG:
+		rpc = nc_rpc_getconfig(NC_DATASTORE_RUNNING, NULL);
+		break;
+	case OP_EDITCONFIG:
+		rpc = nc_rpc_editconfig(NC_DATASTORE_RUNNING, NC_DATASTORE_CONFIG, NC_EDIT_DEFOP_NOTSET, NC_EDIT_ERROPT_NOTSET, NC_EDIT_TESTOPT_NOTSET, opts.edit_config);
+		break;
+	case OP_LOCK:
+		rpc = nc_rpc_lock(NC_DATASTORE_RUNNING);
+		break;
+	case OP_SUBSCRIBE:
+		rpc = nc_rpc_subscribe(NULL, NULL, NULL, NULL);
+		/* no other RPCs are accepted on a subscribed session */
+		ret = 1;
+		break;
+	default:
+		break;
+	}
+	if (rpc == NULL) {
+		fprintf(stderr, "Creating a %s RPC failed.\n", op_names[op]);
+		++thread->errors[op];
+		return 1;
+	}
+
+	start = now_usec();
+	msg_type = nc_session_send_recv(session, rpc, &reply);
+	if (msg_type != NC_MSG_REPLY) {
+		++thread->errors[op];
+		nc_rpc_free(rpc);
+		nc_reply_free(reply);
+		return 1;
+	}
+	samples_add(&thread->ops[op], now_usec() - start);
+
+	if (nc_reply_get_type(reply) == NC_REPLY_ERROR) {
+		++thread->errors[op];
+	} else if (op == OP_LOCK) {
+		/* unlock is not measured, it only keeps the datastore free for the other sessions */
+		nc_rpc_free(rpc);
+		nc_reply_free(reply);
+		reply = NULL;
+		rpc = nc_rpc_unlock(NC_DATASTORE_RUNNING);
+		if (rpc == NULL || nc_session_send_recv(session, rpc, &reply) != NC_MSG_REPLY) {
+			ret = 1;
+		}
+	}
+
+	nc_rpc_free(rpc);
+	nc_reply_free(reply);
+	return ret;
+}
+
+static void* bench_thread(void* arg) {
+	struct bench_thread* thread = (struct bench_thread*)arg;
+	struct nc_session* session = NULL;
+	unsigned int pick;
+	int op;
+
+#ifdef NP_TLS
+	if (thread->transport == NC_TRANSPORT_TLS && nc_tls_init(opts.cert, opts.key, opts.ca, NULL, NULL, NULL) != EXIT_SUCCESS) {
+		fprintf(stderr, "Initiating TLS failed.\n");
+		return NULL;
+	}
+#endif
+
+	while (!opts.stop) {
+		if (session == NULL && (session = bench_connect(thread)) == NULL) {
+			/* do not flood the server */
+			usleep(100000);
+			continue;
+		}
+
+		pick = rand_r(&thread->seed) % opts.weight_sum;
+		for (op = 0; pick >= opts.weights[op]; pick -= opts.weights[op], ++op);
+
+		if (bench_rpc(thread, session, op)) {
+			nc_session_free(session);
+			session = NULL;
+		}
+	}
+
+	nc_session_free(session);
+#ifdef NP_TLS
+	if (thread->transport == NC_TRANSPORT_TLS) {
+		nc_tls_destroy();
+	}
+#endif
+	return NULL;
+}
+
+static void report(struct bench_thread* threads, unsigned int count, double elapsed, const struct server_sample* server) {
+	struct samples all = {NULL, 0, 0}, op_samples, connects = {NULL, 0, 0};
+	unsigned long errors, connect_failures = 0;
+	unsigned int i, op;
+
+	fprintf(stdout, "\n%-20s %10s %8s %10s %10s %10s %10s\n", "RPC", "count", "errors", "per sec", "p50 ms", "p99 ms", "p999 ms");
+	for (op = 0; op < OP_COUNT; ++op) {
+		memset(&op_samples, 0, sizeof op_samples);
+		errors = 0;
+		for (i = 0; i < count; ++i) {
+			samples_merge(&op_samples, &threads[i].ops[op]);
+			errors += threads[i].errors[op];
+		}
+		if (op_samples.count == 0 && errors == 0) {
+			continue;
+		}
+		qsort(op_samples.usec, op_samples.count, sizeof *op_samples.usec, samples_cmp);
+		fprintf(stdout, "%-20s %10zu %8lu %10.1f %10.3f %10.3f %10.3f\n", op_names[op], op_samples.count, errors,
+				op_samples.count / elapsed, samples_percentile_ms(&op_samples, 0.5),
+				samples_percentile_ms(&op_samples, 0.99), samples_percentile_ms(&op_samples, 0.999));
+		samples_merge(&all, &op_samples);
+		free(op_samples.usec);
+	}
+	qsort(all.usec, all.count, sizeof *all.usec, samples_cmp);
+	fprintf(stdout, "%-20s %10zu %8s %10.1f %10.3f %10.3f %10.3f\n", "total", all.count, "",
+			all.count / elapsed, samples_percentile_ms(&all, 0.5),
+			samples_percentile_ms(&all, 0.99), samples_percentile_ms(&all, 0.999));
+	free(all.usec);
+
+	for (i = 0; i < count; ++i) {
+		samples_merge(&connects, &threads[i].connects);
+		connect_failures += threads[i].connect_failures;
+	}
+	qsort(connects.usec, connects.count, sizeof *connects.usec, samples_cmp);
+	fprintf(stdout, "\nConnections: %zu established, %lu failed, %.1f per sec, setup p50 %.3f ms, p99 %.3f ms\n",
+			connects.count, connect_failures, connects.count / elapsed,
+			samples_percentile_ms(&connects, 0.5), samples_percentile_ms(&connects, 0.99));
+	free(connects.usec);
+
+	if (opts.server_pid > 0) {
+		fprintf(stdout, "Server (PID %d): RSS %lu/%lu/%lu kB, threads %lu/%lu/%lu (start/max/end)\n", opts.server_pid,
+				server[0].rss_kb, server[1].rss_kb, server[2].rss_kb, server[0].threads, server[1].threads, server[2].threads);
+	}
+}
+
+int main(int argc, char** argv) {
+	struct bench_thread* threads;
+	struct server_sample server[3], sample;	/* start, max, end */
+	unsigned long long start, elapsed;
+	unsigned int i, count;
+	char* pubkey;
+	int c, ret = EXIT_SUCCESS;
+
+	opts.username = getenv("USER");
+
+	while ((c = getopt(argc, argv, "s:t:d:m:e:H:p:P:u:w:i:c:k:a:x:h")) != -1) {
+		switch (c) {
+		case 's':
+			opts.ssh_sessions = atoi(optarg);
+			break;
+		case 't':
+			opts.tls_sessions = atoi(optarg);
+			break;
+		case 'd':
+			opts.duration = atoi(optarg);
+			break;
+		case 'm':
+			if (parse_mix(optarg) != EXIT_SUCCESS) {
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'e':
+			if ((opts.edit_config = read_file(optarg)) == NULL) {
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'H':
+			opts.host = optarg;
+			break;
+		case 'p':
+			opts.ssh_port = atoi(optarg);
+			break;
+		case 'P':
+			opts.tls_port = atoi(optarg);
+			break;
+		case 'u':
+			opts.username = optarg;
+			break;
+		case 'w':
+			opts.password = optarg;
+			break;
+		case 'i':
+			opts.privkey = optarg;
+			break;
+		case 'c':
+			opts.cert = optarg;
+			break;
+		case 'k':
+			opts.key = optarg;
+			break;
+		case 'a':
+			opts.ca = optarg;
+			break;
+		case 'x':
+			opts.server_pid = atoi(optarg);
+			break;
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+#ifndef NP_TLS
+	if (opts.tls_sessions) {
+		fprintf(stderr, "Built without TLS support.\n");
+		return EXIT_FAILURE;
+	}
+#endif
+	count = opts.ssh_sessions + opts.tls_sessions;
+	for (i = 0, opts.weight_sum = 0; i < OP_COUNT; ++i) {
+		opts.weight_sum += opts.weights[i];
+	}
+	if (count == 0 || opts.duration == 0 || opts.weight_sum == 0) {
+		fprintf(stderr, "Nothing to do, there must be some sessions, duration and RPCs.\n");
+		return EXIT_FAILURE;
+	}
+	if (opts.edit_config == NULL) {
+		opts.edit_config = strdup("<netopeer xmlns=\"urn:cesnet:tmc:netopeer:1.0\"><hello-timeout>600</hello-timeout></netopeer>");
+	}
+	if (opts.server_pid == 0) {
+		opts.server_pid = server_find();
+	}
+
+	nc_init(NC_INIT_CLIENT | NC_INIT_LIBSSH_PTHREAD);
+	nc_verbosity(NC_VERB_ERROR);
+	nc_callback_print(clb_print);
+	if (opts.password != NULL) {
+		nc_callback_sshauth_password(clb_password);
+	}
+	if (opts.privkey != NULL) {
+		if (asprintf(&pubkey, "%s.pub", opts.privkey) == -1 || nc_set_keypair_path(opts.privkey, pubkey) != EXIT_SUCCESS) {
+			fprintf(stderr, "Setting the SSH key pair failed.\n");
+			return EXIT_FAILURE;
+		}
+		free(pubkey);
+	}
+
+	memset(server, 0, sizeof server);
+	if (opts.server_pid > 0 && server_sample(opts.server_pid, &server[0]) != 0) {
+		fprintf(stderr, "Server process %d not found, it will not be sampled.\n", opts.server_pid);
+		opts.server_pid = 0;
+	}
+	server[1] = server[0];
+
+	fprintf(stdout, "Running %u SSH and %u TLS sessions against %s for %u seconds...\n", opts.ssh_sessions, opts.tls_sessions, opts.host, opts.duration);
+
+	threads = calloc(count, sizeof *threads);
+	start = now_usec();
+	for (i = 0; i < count; ++i) {
+		threads[i].transport = (i < opts.ssh_sessions ? NC_TRANSPORT_SSH : NC_TRANSPORT_TLS);
+		threads[i].seed = start + i;
+		if ((c = pthread_create(&threads[i].tid, NULL, bench_thread, &threads[i])) != 0) {
+			fprintf(stderr, "Creating a session thread failed (%s).\n", strerror(c));
+			count = i;
+			ret = EXIT_FAILURE;
+			break;
+		}
+	}
+
+	/* sample the server meanwhile */
+	while (now_usec() - start < opts.duration * 1000000ULL) {
+		usleep(SAMPLE_INTERVAL * 1000);
+		if (opts.server_pid > 0 && server_sample(opts.server_pid, &sample) == 0) {
+			if (sample.rss_kb > server[1].rss_kb) {
+				server[1].rss_kb = sample.rss_kb;
+			}
+			if (sample.threads > server[1].threads) {
+				server[1].threads = sample.threads;
+			}
+			server[2] = sample;
+		}
+	}
+
+	opts.stop = 1;
+	for (i = 0; i < count; ++i) {
+		pthread_join(threads[i].tid, NULL);
+	}
+	elapsed = now_usec() - start;
+
+	report(threads, count, elapsed / 1000000.0, server);
+
+	for (i = 0; i < count; ++i) {
+		for (c = 0; c < OP_COUNT; ++c) {
+			free(threads[i].ops[c].usec);
+		}
+		free(threads[i].connects.usec);
+	}
+	free(threads);
+	free(opts.edit_config);
+	nc_close();
+
+	return ret;
+}
@@ -86,6 +86,23 @@ struct np_options netopeer_options = {
 extern struct transapi server_transapi;
 struct transapi netopeer_transapi;
 
+/*
+ * Modules enabled while the device of another module is being initialized
+ * (the Netopeer module enabling all the configured ones) wait until it is
+ * done, then the datastores of all of them are consolidated only once.
+ */
+static struct {
+	int depth;							// device initializations in progress
+	int consolidate;					// a module was disabled without consolidating
+	struct module_pending {
+		struct np_module* module;
+		int add;
+		struct module_pending* next;
+	} *pending, **pending_last;
+} module_batch = {
+	.pending_last = &module_batch.pending
+};
+
 char* get_node_content(const xmlNodePtr node) {
 	if (node == NULL || node->children == NULL) {
 		return NULL;
@@ -214,9 +231,82 @@ static int parse_model_cfg(struct np_module* module, xmlNodePtr node, NCDS_TYPE
 	return (EXIT_SUCCESS);
 }
 
-int module_enable(struct np_module* module, int add) {
+static int module_device_init(struct np_module* module, int add) {
+	int ret, prof;
+
+	/* remove datastore locks if any kept */
+	if (server_start) {
+		ncds_break_locks(NULL);
+	}
+
+	prof = np_profile_begin("ncds-device-init", module->name);
+	++module_batch.depth;
+	ret = ncds_device_init(&(module->id), NULL, 1);
+	--module_batch.depth;
+	np_profile_end(prof);
+
+	if (ret != 0) {
+		nc_verb_error("Device initialization of module %s failed.", module->name);
+		ncds_free(module->ds);
+		module->ds = NULL;
+		return (EXIT_FAILURE);
+	}
+
+	if (add) {
+		if (netopeer_options.modules) {
+			netopeer_options.modules->prev = module;
+		}
+		module->next = netopeer_options.modules;
+		netopeer_options.modules = module;
+	}
+
+	return (EXIT_SUCCESS);
+}
+
+/* initialize the modules enabled meanwhile, the ones they enable form the next batch */
+static void module_batch_flush(void) {
+	struct module_pending* pending, *next;
+	int ret, prof;
+
+	while (module_batch.depth == 0 && (pending = module_batch.pending) != NULL) {
+		module_batch.pending = NULL;
+		module_batch.pending_last = &module_batch.pending;
+
+		prof = np_profile_begin("ncds-consolidate", NULL);
+		if ((ret = ncds_consolidate()) != 0) {
+			nc_verb_warning("%s: consolidating libnetconf datastores failed.", __func__);
+		}
+		np_profile_end(prof);
+		module_batch.consolidate = 0;
+
+		for (; pending != NULL; pending = next) {
+			next = pending->next;
+			if (ret != 0 || module_device_init(pending->module, pending->add) != 0) {
+				nc_verb_error("Enabling module %s failed.", pending->module->name);
+				ncds_free(pending->module->ds);
+				pending->module->ds = NULL;
+				if (pending->add) {
+					/* it was not added, nobody else frees it */
+					free(pending->module->name);
+					free(pending->module);
+				}
+			}
+			free(pending);
+		}
+	}
+
+	if (module_batch.depth == 0 && module_batch.consolidate) {
+		if (ncds_consolidate() != 0) {
+			nc_verb_warning("%s: consolidating libnetconf datastores failed.", __func__);
+		}
+		module_batch.consolidate = 0;
+	}
+}
+
+static int module_load(struct np_module* module, int add) {
 	char *config_path = NULL, *repo_path = NULL, *repo_type_str = NULL;
-	int repo_type = -1, main_model_count;
+	int repo_type = -1, main_model_count, ret, prof;
+	struct module_pending* pending;
 	xmlDocPtr module_config;
 	xmlNodePtr node;
 	xmlXPathContextPtr xpath_ctxt;
@@ -226,7 +316,8 @@ int module_enable(struct np_module* module, int add) {
 		nc_verb_error("asprintf() failed (%s:%d).", __FILE__, __LINE__);
 		return(EXIT_FAILURE);
 	}
-	if ((module_config = xmlReadFile(config_path, NULL, XML_PARSE_NOBLANKS|XML_PARSE_NSCLEAN|XML_PARSE_NOWARNING|XML_PARSE_NOERROR)) == NULL) {
+	if ((module_config = np_modcache_take(module->name)) == NULL
+			&& (module_config = xmlReadFile(config_path, NULL, XML_PARSE_NOBLANKS|XML_PARSE_NSCLEAN|XML_PARSE_NOWARNING|XML_PARSE_NOERROR)) == NULL) {
 		nc_verb_error("Reading configuration for %s module failed", module->name);
 		free(config_path);
 		return(EXIT_FAILURE);
@@ -297,10 +388,14 @@ int module_enable(struct np_module* module, int add) {
 			continue;
 		}
 		if (xmlStrcmp(node->name, BAD_CAST "model") == 0) {
+			prof = np_profile_begin("parse-model-cfg", module->name);
 			parse_model_cfg(module, node, -1);
+			np_profile_end(prof);
 		}
 		if (xmlStrcmp(node->name, BAD_CAST "model-main") == 0) {
+			prof = np_profile_begin("parse-model-cfg", module->name);
 			parse_model_cfg(module, node, repo_type);
+			np_profile_end(prof);
 			main_model_count++;
 		}
 	}
@@ -322,38 +417,41 @@ int module_enable(struct np_module* module, int add) {
 	free(repo_path);
 	repo_path = NULL;
 
-	if ((module->id = ncds_init(module->ds)) < 0) {
+	prof = np_profile_begin("ncds-init", module->name);
+	module->id = ncds_init(module->ds);
+	np_profile_end(prof);
+	if (module->id < 0) {
 		goto err_cleanup;
 	}
 
 	xmlXPathFreeContext(xpath_ctxt);
 	xmlFreeDoc(module_config);
 
-	if (ncds_consolidate() != 0) {
-		nc_verb_warning("%s: consolidating libnetconf datastores failed for module %s.", __func__, module->name);
-		return (EXIT_FAILURE);
+	if (module_batch.depth > 0) {
+		if ((pending = malloc(sizeof *pending)) != NULL) {
+			pending->module = module;
+			pending->add = add;
+			pending->next = NULL;
+			*module_batch.pending_last = pending;
+			module_batch.pending_last = &pending->next;
+			return (EXIT_SUCCESS);
+		}
+		nc_verb_warning("%s: memory allocation failed, initializing module %s right away.", __func__, module->name);
 	}
 
-	/* remove datastore locks if any kept */
-	if (server_start) {
-		ncds_break_locks(NULL);
-	}
-	if (ncds_device_init(&(module->id), NULL, 1) != 0) {
-		nc_verb_error("Device initialization of module %s failed.", module->name);
-		ncds_free(module->ds);
-		module->ds = NULL;
+	prof = np_profile_begin("ncds-consolidate", module->name);
+	ret = ncds_consolidate();
+	np_profile_end(prof);
+	if (ret != 0) {
+		nc_verb_warning("%s: consolidating libnetconf datastores failed for module %s.", __func__, module->name);
 		return (EXIT_FAILURE);
 	}
+	module_batch.consolidate = 0;
 
-	if (add) {
-		if (netopeer_options.modules) {
-			netopeer_options.modules->prev = module;
-		}
-		module->next = netopeer_options.modules;
-		netopeer_options.modules = module;
-	}
+	ret = module_device_init(module, add);
+	module_batch_flush();
 
-	return (EXIT_SUCCESS);
+	return (ret);
 
 err_cleanup:
 
@@ -368,11 +466,23 @@ err_cleanup:
 	return (EXIT_FAILURE);
 }
 
+int module_enable(struct np_module* module, int add) {
+	int ret, prof;
+
+	prof = np_profile_begin("module-enable", module->name);
+	ret = module_load(module, add);
+	np_profile_end(prof);
+
+	return (ret);
+}
+
 int module_disable(struct np_module* module, int destroy) {
 	ncds_free(module->ds);
 	module->ds = NULL;
 
-	if (ncds_consolidate() != 0) {
+	if (module_batch.depth > 0) {
+		module_batch.consolidate = 1;
+	} else if (ncds_consolidate() != 0) {
 		nc_verb_warning("%s: consolidating libnetconf datastores failed for module %s.", __func__, module->name);
 	}
 
@@ -401,8 +511,19 @@ int module_disable(struct np_module* module, int destroy) {
  * @return State data as libxml2 xmlDocPtr or NULL in case of error.
  */
 xmlDocPtr netopeer_get_state_data (xmlDocPtr UNUSED(model), xmlDocPtr UNUSED(running), struct nc_err** UNUSED(err)) {
-	/* no state data */
-	return(NULL);
+	xmlDocPtr doc;
+	xmlNodePtr root;
+	xmlNsPtr ns;
+
+	doc = xmlNewDoc(BAD_CAST "1.0");
+	root = xmlNewNode(NULL, BAD_CAST "netopeer");
+	xmlDocSetRootElement(doc, root);
+	ns = xmlNewNs(root, BAD_CAST "urn:cesnet:tmc:netopeer:1.0", NULL);
+	xmlSetNs(root, ns);
+
+	xmlAddChild(root, np_stats_state(ns));
+
+	return doc;
 }
 /*
  * Mapping prefixes with namespaces.
@@ -430,10 +551,17 @@ struct ns_pair netopeer_namespace_mapping[] = {{"n", "urn:cesnet:tmc:netopeer:1.
 int callback_n_netopeer_n_hello_timeout(void** UNUSED(data), XMLDIFF_OP op, xmlNodePtr UNUSED(old_node), xmlNodePtr new_node, struct nc_err** error) {
 	char* content = NULL, *ptr, *msg;
 	uint32_t num;
+	int shorter;
 
 	if (op & XMLDIFF_REM) {
 		/* set default value */
 		nc_hello_timeout(600 * 1000);
+		shorter = (600 < netopeer_options.hello_timeout);
+		netopeer_options.hello_timeout = 600;
+		if (shorter) {
+			/* the armed deadlines could be too late now */
+			np_engine_expire_all();
+		}
 		return EXIT_SUCCESS;
 	}
 
@@ -456,6 +584,12 @@ int callback_n_netopeer_n_hello_timeout(void** UNUSED(data), XMLDIFF_OP op, xmlN
 	}
 
 	nc_hello_timeout(num * 1000);
+	shorter = (num < netopeer_options.hello_timeout);
+	netopeer_options.hello_timeout = num;
+	if (shorter) {
+		/* the armed deadlines could be too late now */
+		np_engine_expire_all();
+	}
 	return EXIT_SUCCESS;
 }
 
@@ -473,9 +607,15 @@ int callback_n_netopeer_n_hello_timeout(void** UNUSED(data), XMLDIFF_OP op, xmlN
 int callback_n_netopeer_n_idle_timeout(void** UNUSED(data), XMLDIFF_OP op, xmlNodePtr UNUSED(old_node), xmlNodePtr new_node, struct nc_err** error) {
 	char* content = NULL, *ptr, *msg;
 	uint32_t num;
+	int shorter;
 
 	if (op & XMLDIFF_REM) {
+		shorter = (3600 < netopeer_options.idle_timeout);
 		netopeer_options.idle_timeout = 3600;
+		if (shorter) {
+			/* the armed deadlines could be too late now */
+			np_engine_expire_all();
+		}
 		return EXIT_SUCCESS;
 	}
 
@@ -497,7 +637,12 @@ int callback_n_netopeer_n_idle_timeout(void** UNUSED(data), XMLDIFF_OP op, xmlNo
 		return EXIT_FAILURE;
 	}
 
+	shorter = (num < netopeer_options.idle_timeout);
 	netopeer_options.idle_timeout = num;
+	if (shorter) {
+		/* the armed deadlines could be too late now */
+		np_engine_expire_all();
+	}
 	return EXIT_SUCCESS;
 }
 
@@ -584,6 +729,289 @@ int callback_n_netopeer_n_response_time(void** UNUSED(data), XMLDIFF_OP op, xmlN
 	return EXIT_SUCCESS;
 }
 
+/**
+ * @brief This callback will be run when node in path /n:netopeer/n:rpc-workers changes
+ *
+ * @param[in] data	Double pointer to void. Its passed to every callback. You can share data using it.
+ * @param[in] op	Observed change in path. XMLDIFF_OP type.
+ * @param[in] node	Modified node. if op == XMLDIFF_REM its copy of node removed.
+ * @param[out] error	If callback fails, it can return libnetconf error structure with a failure description.
+ *
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+/* !DO NOT ALTER FUNCTION SIGNATURE! */
+int callback_n_netopeer_n_rpc_workers(void** UNUSED(data), XMLDIFF_OP op, xmlNodePtr UNUSED(old_node), xmlNodePtr new_node, struct nc_err** error) {
+	char* content = NULL, *ptr, *msg;
+	uint16_t num;
+
+	if (op & XMLDIFF_REM) {
+		netopeer_options.rpc_workers = 4;
+		return np_workers_set_count(netopeer_options.rpc_workers);
+	}
+
+	content = get_node_content(new_node);
+	if (content == NULL) {
+		*error = nc_err_new(NC_ERR_OP_FAILED);
+		nc_verb_error("%s: node content missing", __func__);
+		return EXIT_FAILURE;
+	}
+
+	num = strtol(content, &ptr, 10);
+	if (*ptr != '\0' || num == 0) {
+		*error = nc_err_new(NC_ERR_BAD_ELEM);
+		if (asprintf(&msg, "Could not convert '%s' to a valid number of workers.", content) == 0) {
+			nc_err_set(*error, NC_ERR_PARAM_MSG, msg);
+			nc_err_set(*error, NC_ERR_PARAM_INFO_BADELEM, "/netopeer/rpc-workers");
+			free(msg);
+		}
+		return EXIT_FAILURE;
+	}
+
+	netopeer_options.rpc_workers = num;
+	if (np_workers_set_count(num) != EXIT_SUCCESS) {
+		*error = nc_err_new(NC_ERR_OP_FAILED);
+		nc_err_set(*error, NC_ERR_PARAM_MSG, "Failed to start the RPC workers.");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @brief This callback will be run when node in path /n:netopeer/n:listen-backlog changes
+ *
+ * @param[in] data	Double pointer to void. Its passed to every callback. You can share data using it.
+ * @param[in] op	Observed change in path. XMLDIFF_OP type.
+ * @param[in] node	Modified node. if op == XMLDIFF_REM its copy of node removed.
+ * @param[out] error	If callback fails, it can return libnetconf error structure with a failure description.
+ *
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+/* !DO NOT ALTER FUNCTION SIGNATURE! */
+int callback_n_netopeer_n_listen_backlog(void** UNUSED(data), XMLDIFF_OP op, xmlNodePtr UNUSED(old_node), xmlNodePtr new_node, struct nc_err** error) {
+	char* content = NULL, *ptr, *msg;
+	uint16_t num;
+
+	if (op & XMLDIFF_REM) {
+		num = 128;
+	} else {
+		content = get_node_content(new_node);
+		if (content == NULL) {
+			*error = nc_err_new(NC_ERR_OP_FAILED);
+			nc_verb_error("%s: node content missing", __func__);
+			return EXIT_FAILURE;
+		}
+
+		num = strtol(content, &ptr, 10);
+		if (*ptr != '\0' || num == 0) {
+			*error = nc_err_new(NC_ERR_BAD_ELEM);
+			if (asprintf(&msg, "Could not convert '%s' to a valid listen backlog.", content) == 0) {
+				nc_err_set(*error, NC_ERR_PARAM_MSG, msg);
+				nc_err_set(*error, NC_ERR_PARAM_INFO_BADELEM, "/netopeer/listen-backlog");
+				free(msg);
+			}
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* BINDS LOCK */
+	pthread_mutex_lock(&netopeer_options.binds_lock);
+
+	if (netopeer_options.listen_backlog != num) {
+		netopeer_options.listen_backlog = num;
+		/* listen again with the new backlog */
+		netopeer_options.binds_change_flag = 1;
+	}
+
+	/* BINDS UNLOCK */
+	pthread_mutex_unlock(&netopeer_options.binds_lock);
+
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @brief This callback will be run when node in path /n:netopeer/n:acceptors changes
+ *
+ * @param[in] data	Double pointer to void. Its passed to every callback. You can share data using it.
+ * @param[in] op	Observed change in path. XMLDIFF_OP type.
+ * @param[in] node	Modified node. if op == XMLDIFF_REM its copy of node removed.
+ * @param[out] error	If callback fails, it can return libnetconf error structure with a failure description.
+ *
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+/* !DO NOT ALTER FUNCTION SIGNATURE! */
+int callback_n_netopeer_n_acceptors(void** UNUSED(data), XMLDIFF_OP op, xmlNodePtr UNUSED(old_node), xmlNodePtr new_node, struct nc_err** error) {
+	char* content = NULL, *ptr, *msg;
+	long num;
+
+	if (op & XMLDIFF_REM) {
+		num = 1;
+	} else {
+		content = get_node_content(new_node);
+		if (content == NULL) {
+			*error = nc_err_new(NC_ERR_OP_FAILED);
+			nc_verb_error("%s: node content missing", __func__);
+			return EXIT_FAILURE;
+		}
+
+		num = strtol(content, &ptr, 10);
+		if (*ptr != '\0' || num < 1 || num > 64) {
+			*error = nc_err_new(NC_ERR_BAD_ELEM);
+			if (asprintf(&msg, "Could not convert '%s' to a valid number of acceptors.", content) == 0) {
+				nc_err_set(*error, NC_ERR_PARAM_MSG, msg);
+				nc_err_set(*error, NC_ERR_PARAM_INFO_BADELEM, "/netopeer/acceptors");
+				free(msg);
+			}
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* BINDS LOCK */
+	pthread_mutex_lock(&netopeer_options.binds_lock);
+
+	if (netopeer_options.acceptors != num) {
+		netopeer_options.acceptors = num;
+		/* the acceptors are restarted together with their sockets */
+		netopeer_options.binds_change_flag = 1;
+	}
+
+	/* BINDS UNLOCK */
+	pthread_mutex_unlock(&netopeer_options.binds_lock);
+
+	return EXIT_SUCCESS;
+}
+
+/* parse a rate limit, 0 (no limit) if removed */
+static int rate_limit_set(XMLDIFF_OP op, xmlNodePtr new_node, struct nc_err** error, const char* path, uint16_t* rate) {
+	char* content = NULL, *ptr, *msg;
+	long num;
+
+	if (op & XMLDIFF_REM) {
+		*rate = 0;
+		return EXIT_SUCCESS;
+	}
+
+	content = get_node_content(new_node);
+	if (content == NULL) {
+		*error = nc_err_new(NC_ERR_OP_FAILED);
+		nc_verb_error("%s: node content missing", __func__);
+		return EXIT_FAILURE;
+	}
+
+	num = strtol(content, &ptr, 10);
+	if (*ptr != '\0' || num < 0 || num > UINT16_MAX) {
+		*error = nc_err_new(NC_ERR_BAD_ELEM);
+		if (asprintf(&msg, "Could not convert '%s' to a valid rate.", content) == 0) {
+			nc_err_set(*error, NC_ERR_PARAM_MSG, msg);
+			nc_err_set(*error, NC_ERR_PARAM_INFO_BADELEM, path);
+			free(msg);
+		}
+		return EXIT_FAILURE;
+	}
+
+	*rate = num;
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @brief This callback will be run when node in path /n:netopeer/n:rate-limits/n:connections-per-address changes
+ *
+ * @param[in] data	Double pointer to void. Its passed to every callback. You can share data using it.
+ * @param[in] op	Observed change in path. XMLDIFF_OP type.
+ * @param[in] node	Modified node. if op == XMLDIFF_REM its copy of node removed.
+ * @param[out] error	If callback fails, it can return libnetconf error structure with a failure description.
+ *
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+/* !DO NOT ALTER FUNCTION SIGNATURE! */
+int callback_n_netopeer_n_rate_limits_n_connections_per_address(void** UNUSED(data), XMLDIFF_OP op, xmlNodePtr UNUSED(old_node), xmlNodePtr new_node, struct nc_err** error) {
+	return rate_limit_set(op, new_node, error, "/netopeer/rate-limits/connections-per-address", &netopeer_options.address_conn_rate);
+}
+
+/**
+ * @brief This callback will be run when node in path /n:netopeer/n:rate-limits/n:rpcs-per-user changes
+ *
+ * @param[in] data	Double pointer to void. Its passed to every callback. You can share data using it.
+ * @param[in] op	Observed change in path. XMLDIFF_OP type.
+ * @param[in] node	Modified node. if op == XMLDIFF_REM its copy of node removed.
+ * @param[out] error	If callback fails, it can return libnetconf error structure with a failure description.
+ *
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+/* !DO NOT ALTER FUNCTION SIGNATURE! */
+int callback_n_netopeer_n_rate_limits_n_rpcs_per_user(void** UNUSED(data), XMLDIFF_OP op, xmlNodePtr UNUSED(old_node), xmlNodePtr new_node, struct nc_err** error) {
+	return rate_limit_set(op, new_node, error, "/netopeer/rate-limits/rpcs-per-user", &netopeer_options.user_rpc_rate);
+}
+
+/**
+ * @brief This callback will be run when node in path /n:netopeer/n:rate-limits/n:rpcs-per-session changes
+ *
+ * @param[in] data	Double pointer to void. Its passed to every callback. You can share data using it.
+ * @param[in] op	Observed change in path. XMLDIFF_OP type.
+ * @param[in] node	Modified node. if op == XMLDIFF_REM its copy of node removed.
+ * @param[out] error	If callback fails, it can return libnetconf error structure with a failure description.
+ *
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+/* !DO NOT ALTER FUNCTION SIGNATURE! */
+int callback_n_netopeer_n_rate_limits_n_rpcs_per_session(void** UNUSED(data), XMLDIFF_OP op, xmlNodePtr UNUSED(old_node), xmlNodePtr new_node, struct nc_err** error) {
+	return rate_limit_set(op, new_node, error, "/netopeer/rate-limits/rpcs-per-session", &netopeer_options.session_rpc_rate);
+}
+
+/**
+ * @brief This callback will be run when node in path /n:netopeer/n:rate-limits/n:user-weight changes
+ *
+ * @param[in] data	Double pointer to void. Its passed to every callback. You can share data using it.
+ * @param[in] op	Observed change in path. XMLDIFF_OP type.
+ * @param[in] node	Modified node. if op == XMLDIFF_REM its copy of node removed.
+ * @param[out] error	If callback fails, it can return libnetconf error structure with a failure description.
+ *
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+/* !DO NOT ALTER FUNCTION SIGNATURE! */
+int callback_n_netopeer_n_rate_limits_n_user_weight(void** UNUSED(data), XMLDIFF_OP op, xmlNodePtr old_node, xmlNodePtr new_node, struct nc_err** error) {
+	xmlNodePtr node, child;
+	char* username = NULL, *content = NULL, *ptr, *msg;
+	long weight = 0;
+
+	node = (op & XMLDIFF_REM ? old_node : new_node);
+	for (child = node->children; child != NULL; child = child->next) {
+		if (child->type != XML_ELEMENT_NODE) {
+			continue;
+		}
+		if (xmlStrEqual(child->name, BAD_CAST "username")) {
+			username = get_node_content(child);
+		} else if (xmlStrEqual(child->name, BAD_CAST "weight")) {
+			content = get_node_content(child);
+		}
+	}
+
+	if (username == NULL || (!(op & XMLDIFF_REM) && content == NULL)) {
+		*error = nc_err_new(NC_ERR_OP_FAILED);
+		nc_verb_error("%s: node content missing", __func__);
+		return EXIT_FAILURE;
+	}
+
+	if (!(op & XMLDIFF_REM)) {
+		weight = strtol(content, &ptr, 10);
+		if (*ptr != '\0' || weight < 1 || weight > 100) {
+			*error = nc_err_new(NC_ERR_BAD_ELEM);
+			if (asprintf(&msg, "Could not convert '%s' to a valid weight.", content) == 0) {
+				nc_err_set(*error, NC_ERR_PARAM_MSG, msg);
+				nc_err_set(*error, NC_ERR_PARAM_INFO_BADELEM, "/netopeer/rate-limits/user-weight/weight");
+				free(msg);
+			}
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* the queued RPCs of the user keep the old weight until the user has none */
+	if (np_ratelimit_weight_set(username, weight) != EXIT_SUCCESS) {
+		*error = nc_err_new(NC_ERR_OP_FAILED);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
 /**
  * @brief This callback will be run when node in path /n:netopeer/n:modules/n:module/n:module/n:enabled changes
  *
@@ -663,9 +1091,11 @@ int callback_n_netopeer_n_modules_n_module_n_enabled(void** UNUSED(data), XMLDIF
 */
 struct transapi_data_callbacks netopeer_clbks = {
 #if defined(NP_SSH) && defined(NP_TLS)
-	.callbacks_count = 17,
+	.callbacks_count = 27,
+#elif defined(NP_SSH)
+	.callbacks_count = 18,
 #else
-	.callbacks_count = 11,
+	.callbacks_count = 21,
 #endif
 	.data = NULL,
 	.callbacks = {
@@ -673,6 +1103,13 @@ struct transapi_data_callbacks netopeer_clbks = {
 		{.path = "/n:netopeer/n:idle-timeout", .func = callback_n_netopeer_n_idle_timeout},
 		{.path = "/n:netopeer/n:max-sessions", .func = callback_n_netopeer_n_max_sessions},
 		{.path = "/n:netopeer/n:response-time", .func = callback_n_netopeer_n_response_time},
+		{.path = "/n:netopeer/n:rpc-workers", .func = callback_n_netopeer_n_rpc_workers},
+		{.path = "/n:netopeer/n:listen-backlog", .func = callback_n_netopeer_n_listen_backlog},
+		{.path = "/n:netopeer/n:acceptors", .func = callback_n_netopeer_n_acceptors},
+		{.path = "/n:netopeer/n:rate-limits/n:connections-per-address", .func = callback_n_netopeer_n_rate_limits_n_connections_per_address},
+		{.path = "/n:netopeer/n:rate-limits/n:rpcs-per-user", .func = callback_n_netopeer_n_rate_limits_n_rpcs_per_user},
+		{.path = "/n:netopeer/n:rate-limits/n:rpcs-per-session", .func = callback_n_netopeer_n_rate_limits_n_rpcs_per_session},
+		{.path = "/n:netopeer/n:rate-limits/n:user-weight", .func = callback_n_netopeer_n_rate_limits_n_user_weight},
 #ifdef NP_SSH
 		{.path = "/n:netopeer/n:ssh/n:server-keys/n:rsa-key", .func = callback_n_netopeer_n_ssh_n_server_keys_n_rsa_key},
 		{.path = "/n:netopeer/n:ssh/n:server-keys/n:dsa-key", .func = callback_n_netopeer_n_ssh_n_server_keys_n_dsa_key},
@@ -687,6 +1124,9 @@ struct transapi_data_callbacks netopeer_clbks = {
 		{.path = "/n:netopeer/n:tls/n:trusted-ca-certs/n:trusted-ca-cert", .func = callback_n_netopeer_n_tls_n_trusted_ca_certs_n_trusted_ca_cert},
 		{.path = "/n:netopeer/n:tls/n:trusted-client-certs/n:trusted-client-cert", .func = callback_n_netopeer_n_tls_n_trusted_client_certs_n_trusted_client_cert},
 		{.path = "/n:netopeer/n:tls/n:crl-dir", .func = callback_n_netopeer_n_tls_n_crl_dir},
+		{.path = "/n:netopeer/n:tls/n:session-resumption/n:cache-size", .func = callback_n_netopeer_n_tls_n_session_resumption_n_cache_size},
+		{.path = "/n:netopeer/n:tls/n:session-resumption/n:timeout", .func = callback_n_netopeer_n_tls_n_session_resumption_n_timeout},
+		{.path = "/n:netopeer/n:tls/n:session-resumption/n:tickets", .func = callback_n_netopeer_n_tls_n_session_resumption_n_tickets},
 		{.path = "/n:netopeer/n:tls/n:cert-maps/n:cert-to-name", .func = callback_n_netopeer_n_tls_n_cert_maps_n_cert_to_name},
 #endif
 		{.path = "/n:netopeer/n:modules/n:module/n:enabled", .func = callback_n_netopeer_n_modules_n_module_n_enabled}
@@ -717,7 +1157,7 @@ int netopeer_transapi_init(xmlDocPtr* UNUSED(running)) {
 
 	nc_verb_verbose("Setting the default configuration for the cfgnetopeer module...");
 
-	doc = xmlReadDoc(BAD_CAST "<netopeer xmlns=\"urn:cesnet:tmc:netopeer:1.0\"><hello-timeout>600</hello-timeout><idle-timeout>3600</idle-timeout><max-sessions>8</max-sessions><response-time>50</response-time></netopeer>",
+	doc = xmlReadDoc(BAD_CAST "<netopeer xmlns=\"urn:cesnet:tmc:netopeer:1.0\"><hello-timeout>600</hello-timeout><idle-timeout>3600</idle-timeout><max-sessions>8</max-sessions><response-time>50</response-time><rpc-workers>4</rpc-workers><listen-backlog>128</listen-backlog><acceptors>1</acceptors></netopeer>",
 		NULL, NULL, 0);
 	if (doc == NULL) {
 		nc_verb_error("Unable to parse the default cfgnetopeer configuration.");
@@ -772,6 +1212,42 @@ int netopeer_transapi_init(xmlDocPtr* UNUSED(running)) {
 		return EXIT_FAILURE;
 	}
 
+	if (callback_n_netopeer_n_rpc_workers(NULL, XMLDIFF_ADD, NULL, doc->children->children->next->next->next->next, &error) != EXIT_SUCCESS) {
+		if (error != NULL) {
+			str_err = nc_err_get(error, NC_ERR_PARAM_MSG);
+			if (str_err != NULL) {
+				nc_verb_error(str_err);
+			}
+			nc_err_free(error);
+		}
+		xmlFreeDoc(doc);
+		return EXIT_FAILURE;
+	}
+
+	if (callback_n_netopeer_n_listen_backlog(NULL, XMLDIFF_ADD, NULL, doc->children->children->next->next->next->next->next, &error) != EXIT_SUCCESS) {
+		if (error != NULL) {
+			str_err = nc_err_get(error, NC_ERR_PARAM_MSG);
+			if (str_err != NULL) {
+				nc_verb_error(str_err);
+			}
+			nc_err_free(error);
+		}
+		xmlFreeDoc(doc);
+		return EXIT_FAILURE;
+	}
+
+	if (callback_n_netopeer_n_acceptors(NULL, XMLDIFF_ADD, NULL, doc->children->children->next->next->next->next->next->next, &error) != EXIT_SUCCESS) {
+		if (error != NULL) {
+			str_err = nc_err_get(error, NC_ERR_PARAM_MSG);
+			if (str_err != NULL) {
+				nc_verb_error(str_err);
+			}
+			nc_err_free(error);
+		}
+		xmlFreeDoc(doc);
+		return EXIT_FAILURE;
+	}
+
 	xmlFreeDoc(doc);
 
 #ifdef NP_SSH
@@ -805,9 +1281,13 @@ void netopeer_transapi_close(void) {
 
 	nc_verb_verbose("Netopeer cleanup.");
 
+	/* consolidate only once all of them are gone */
+	++module_batch.depth;
 	while (netopeer_options.modules) {
 		module_disable(netopeer_options.modules, 1);
 	}
+	--module_batch.depth;
+	module_batch_flush();
 }
 
 /**
@@ -902,9 +1382,20 @@ struct transapi_rpc_callbacks netopeer_rpc_clbks = {
 	}
 };
 
+/* libnetconf calls it from ncds_device_init() */
+static int netopeer_transapi_init_profiled(xmlDocPtr* running) {
+	int ret, prof;
+
+	prof = np_profile_begin("transapi-init", NETOPEER_MODULE_NAME);
+	ret = netopeer_transapi_init(running);
+	np_profile_end(prof);
+
+	return ret;
+}
+
 struct transapi netopeer_transapi = {
 	.version = 6,
-	.init = netopeer_transapi_init,
+	.init = netopeer_transapi_init_profiled,
 	.close = netopeer_transapi_close,
 	.get_state = netopeer_get_state_data,
 	.clbks_order = TRANSAPI_CLBCKS_LEAF_TO_ROOT,
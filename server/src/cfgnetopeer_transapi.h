@@ -44,9 +44,16 @@
 
 struct np_options {
 	uint8_t verbose;
+	uint32_t hello_timeout;
 	uint32_t idle_timeout;
 	uint16_t max_sessions;
 	uint16_t response_time;
+	uint16_t rpc_workers;
+	uint16_t listen_backlog;
+	uint8_t acceptors;
+	uint16_t address_conn_rate;
+	uint16_t user_rpc_rate;
+	uint16_t session_rpc_rate;
 
 	struct np_options_ssh* ssh_opts;
 	struct np_options_tls* tls_opts;
@@ -0,0 +1,1017 @@
+/**
+ * @file engine.c
+ * @brief Netopeer server client event engine
+ *
+ * Copyright (C) 2015 CESNET, z.s.p.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of the Company nor the names of its contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * ALTERNATIVELY, provided that this notice is retained in full, this
+ * product may be distributed under the terms of the GNU General Public
+ * License (GPL) version 2 or later, in which case the provisions
+ * of the GPL apply INSTEAD OF those given above.
+ *
+ * This software is provided ``as is, and any express or implied
+ * warranties, including, but not limited to, the implied warranties of
+ * merchantability and fitness for a particular purpose are disclaimed.
+ * In no event shall the company or contributors be liable for any
+ * direct, indirect, incidental, special, exemplary, or consequential
+ * damages (including, but not limited to, procurement of substitute
+ * goods or services; loss of use, data, or profits; or business
+ * interruption) however caused and on any theory of liability, whether
+ * in contract, strict liability, or tort (including negligence or
+ * otherwise) arising in any way out of the use of this software, even
+ * if advised of the possibility of such damage.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "server.h"
+
+static const char rcsid[] __attribute__((used)) ="$Id: "__FILE__": "RCSID" $";
+
+extern struct np_state netopeer_state;
+
+extern pthread_mutex_t callhome_lock;
+
+/*
+ * The engine consists of a single poller thread waiting for events on all
+ * the client sockets and a pool of threads processing the clients. Every
+ * client socket is registered with EPOLLONESHOT, so a client is always
+ * processed by at most one thread and it is re-armed only after the
+ * processing finishes. Only the poller ever frees the clients, after it
+ * has finished processing the events of its last epoll_wait() call, so
+ * no stale event can reference a freed client.
+ *
+ * Client timeouts are kept in a hashed timer wheel, every client has at
+ * most one timer in the slot of its deadline. The timerfd is armed only
+ * for the nearest occupied slot, found using the slot bitmap, so there
+ * are no wake ups without expirations. Activity on a session does not
+ * touch the wheel at all, the transport only records its time and once
+ * the timer expires, it recomputes the real deadline and arms it again.
+ *
+ * The transports never block an engine thread, whatever may block (sending
+ * a long reply to a slow client, for instance) is handed over as a step to
+ * a helper thread. Helpers are created on demand and exit once idle, the
+ * client stays running during its step and its socket is shut down if the
+ * step misses its deadline.
+ */
+struct engine_step {
+	struct client_struct* client;
+	np_engine_step fn;
+	uint64_t deadline;
+	int started;
+	struct engine_step* next;
+};
+
+/* the requests of the transport processing a client, per engine thread */
+static __thread struct {
+	np_engine_step step;
+	uint64_t deadline;
+	int park;
+} engine_round;
+
+/* the step run by the calling helper thread */
+static __thread struct engine_step* helper_step;
+
+static struct {
+	int epfd;
+	int wakefd;
+	int timerfd;
+
+	/* ENGINE LOCK */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct client_struct* queue_head;
+	struct client_struct* queue_tail;
+	struct client_struct* zombies;
+
+	/* ENGINE LOCK */
+	struct client_struct* wheel[ENGINE_TIMER_SLOTS];
+	uint64_t wheel_map[ENGINE_TIMER_SLOTS / 64];	// occupied slots
+	uint64_t wheel_tick;		// first tick (msecs / ENGINE_TIMER_RES) not completely expired yet
+	uint64_t timer_armed;		// msecs the timerfd expires at, 0 if disarmed
+
+	/* ENGINE LOCK */
+	pthread_cond_t helper_cond;
+	struct engine_step* steps;	// queued and running steps
+	unsigned int steps_queued;	// steps not started yet
+	unsigned int helpers;
+	unsigned int helpers_idle;
+
+	/* ENGINE LOCK */
+	pthread_cond_t pause_cond;
+	int paused;
+	unsigned int active;	// clients being processed, run by a helper or set up
+	struct client_struct* paused_clients;
+
+	pthread_t poller;
+	pthread_t* threads;
+	unsigned int thread_count;
+	volatile int stop;
+} engine = {
+	.epfd = -1,
+	.wakefd = -1,
+	.timerfd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.helper_cond = PTHREAD_COND_INITIALIZER,
+	.pause_cond = PTHREAD_COND_INITIALIZER
+};
+
+static void client_free(struct client_struct* client) {
+	switch (client->transport) {
+#ifdef NP_SSH
+	case NC_TRANSPORT_SSH:
+		client_free_ssh((struct client_struct_ssh*)client);
+		break;
+#endif
+#ifdef NP_TLS
+	case NC_TRANSPORT_TLS:
+		client_free_tls((struct client_struct_tls*)client);
+		break;
+#endif
+	default:
+		np_slab_free(NP_SLAB_CLIENT, client);
+		break;
+	}
+}
+
+/* return: 0 - nothing done, >0 - something was processed */
+static int client_process(struct client_struct* client, int expired) {
+	int ret = 0;
+
+	if (client->handshake != NP_HANDSHAKE_DONE) {
+		switch (client->transport) {
+#ifdef NP_SSH
+		case NC_TRANSPORT_SSH:
+			return np_ssh_client_handshake((struct client_struct_ssh*)client, expired);
+#endif
+#ifdef NP_TLS
+		case NC_TRANSPORT_TLS:
+			return np_tls_client_handshake((struct client_struct_tls*)client, expired);
+#endif
+		default:
+			break;
+		}
+	}
+
+	switch (client->transport) {
+#ifdef NP_SSH
+	case NC_TRANSPORT_SSH:
+		ret += np_ssh_client_transport((struct client_struct_ssh*)client, expired);
+		ret += np_ssh_client_netconf_rpc((struct client_struct_ssh*)client);
+		break;
+#endif
+#ifdef NP_TLS
+	case NC_TRANSPORT_TLS:
+		ret += np_tls_client_transport((struct client_struct_tls*)client, expired);
+		ret += np_tls_client_netconf_rpc((struct client_struct_tls*)client);
+		break;
+#endif
+	default:
+		nc_verb_error("%s: internal error (%s:%d)", __func__, __FILE__, __LINE__);
+		client->to_free = 1;
+	}
+
+	return ret;
+}
+
+/* ENGINE LOCK must be held */
+static void engine_enqueue(struct client_struct* client) {
+	client->ev_next = NULL;
+	if (engine.queue_tail != NULL) {
+		engine.queue_tail->ev_next = client;
+	} else {
+		engine.queue_head = client;
+	}
+	engine.queue_tail = client;
+	client->ev_flags |= NP_EV_QUEUED;
+
+	pthread_cond_signal(&engine.cond);
+}
+
+/* ENGINE LOCK must be held */
+static void engine_activate(struct client_struct* client) {
+	if (client->ev_flags & (NP_EV_DEAD | NP_EV_PAUSED)) {
+		/* a paused client is processed on resume, with the timer flag if set */
+		return;
+	}
+
+	if (client->ev_flags & NP_EV_RUNNING) {
+		/* the thread processing it will process it once more */
+		client->ev_flags |= NP_EV_PENDING;
+		return;
+	}
+
+	if (!(client->ev_flags & NP_EV_QUEUED)) {
+		engine_enqueue(client);
+	}
+}
+
+#define WHEEL_SLOT(msec) (((msec) / ENGINE_TIMER_RES) % ENGINE_TIMER_SLOTS)
+
+/* ENGINE LOCK must be held */
+static void wheel_link(struct client_struct* client, uint64_t deadline) {
+	unsigned int slot = WHEEL_SLOT(deadline);
+
+	client->tm_deadline = deadline;
+	client->tm_prev = NULL;
+	client->tm_next = engine.wheel[slot];
+	if (client->tm_next != NULL) {
+		client->tm_next->tm_prev = client;
+	}
+	engine.wheel[slot] = client;
+	engine.wheel_map[slot / 64] |= 1ULL << (slot % 64);
+}
+
+/* ENGINE LOCK must be held */
+static void wheel_unlink(struct client_struct* client) {
+	unsigned int slot = WHEEL_SLOT(client->tm_deadline);
+
+	if (client->tm_prev != NULL) {
+		client->tm_prev->tm_next = client->tm_next;
+	} else {
+		engine.wheel[slot] = client->tm_next;
+	}
+	if (client->tm_next != NULL) {
+		client->tm_next->tm_prev = client->tm_prev;
+	}
+	if (engine.wheel[slot] == NULL) {
+		engine.wheel_map[slot / 64] &= ~(1ULL << (slot % 64));
+	}
+
+	client->tm_deadline = 0;
+	client->tm_next = NULL;
+	client->tm_prev = NULL;
+}
+
+/* ENGINE LOCK must be held, return: number of slots from the tick to the nearest occupied one, ENGINE_TIMER_SLOTS if none */
+static unsigned int wheel_next(uint64_t tick) {
+	unsigned int slot = tick % ENGINE_TIMER_SLOTS, dist, i;
+	uint64_t bits;
+
+	for (dist = 0; dist < ENGINE_TIMER_SLOTS; dist += 64 - i % 64) {
+		i = (slot + dist) % ENGINE_TIMER_SLOTS;
+		bits = engine.wheel_map[i / 64] >> (i % 64);
+		if (bits) {
+			return dist + __builtin_ctzll(bits);
+		}
+	}
+
+	return ENGINE_TIMER_SLOTS;
+}
+
+/* ENGINE LOCK must be held, at - msecs of the expiration, 0 to disarm */
+static void wheel_arm(uint64_t at) {
+	struct itimerspec its;
+
+	if (at == engine.timer_armed) {
+		return;
+	}
+
+	memset(&its, 0, sizeof its);
+	its.it_value.tv_sec = at / 1000;
+	its.it_value.tv_nsec = (at % 1000) * 1000000;
+	if (timerfd_settime(engine.timerfd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+		nc_verb_error("%s: timerfd_settime failed (%s)", __func__, strerror(errno));
+		return;
+	}
+	engine.timer_armed = at;
+}
+
+/* ENGINE LOCK must be held */
+static struct engine_step* step_find(struct client_struct* client) {
+	struct engine_step* step;
+
+	for (step = engine.steps; step != NULL && step->client != client; step = step->next);
+	return step;
+}
+
+/* ENGINE LOCK must be held, the client timer of an offloaded client expired */
+static void step_expire(struct client_struct* client, uint64_t now) {
+	struct engine_step* step = step_find(client);
+
+	if (step == NULL || step->deadline == 0) {
+		/* the timer flag is kept for when the step finishes */
+		return;
+	}
+
+	if (step->deadline > now) {
+		/* it was some earlier transport timeout, keep guarding the step */
+		wheel_link(client, step->deadline);
+		return;
+	}
+
+	nc_verb_warning("A client blocked its session for too long, dropping it.");
+	if (shutdown(client->sock, SHUT_RDWR) == -1) {
+		nc_verb_warning("%s: shutdown failed (%s)", __func__, strerror(errno));
+	}
+}
+
+/* ENGINE LOCK must be held */
+static void wheel_expire(void) {
+	struct client_struct* client, *next;
+	uint64_t now, tick, t, last;
+	unsigned int dist;
+
+	/* the timerfd is one-shot */
+	engine.timer_armed = 0;
+
+	now = np_clock_msec();
+	tick = now / ENGINE_TIMER_RES;
+
+	/* visit only the occupied slots, at most once each */
+	last = (tick - engine.wheel_tick >= ENGINE_TIMER_SLOTS ? engine.wheel_tick + ENGINE_TIMER_SLOTS - 1 : tick);
+	for (t = engine.wheel_tick; t <= last; ++t) {
+		dist = wheel_next(t);
+		if (dist > last - t) {
+			break;
+		}
+		t += dist;
+
+		for (client = engine.wheel[t % ENGINE_TIMER_SLOTS]; client != NULL; client = next) {
+			next = client->tm_next;
+			/* the slot is shared by the deadlines of all the wheel revolutions */
+			if (client->tm_deadline <= now) {
+				wheel_unlink(client);
+				client->ev_flags |= NP_EV_TIMER;
+				if (client->ev_flags & NP_EV_OFFLOADED) {
+					step_expire(client, now);
+				} else {
+					engine_activate(client);
+				}
+			}
+		}
+	}
+
+	/* the current slot may still get new timers, it is visited again next time */
+	engine.wheel_tick = tick;
+
+	dist = wheel_next(tick);
+	wheel_arm(dist == ENGINE_TIMER_SLOTS ? 0 : (tick + dist + 1) * ENGINE_TIMER_RES);
+}
+
+/* ENGINE LOCK must be held */
+static void engine_timer(struct client_struct* client, uint64_t deadline) {
+	uint64_t at;
+
+	if ((client->ev_flags & NP_EV_DEAD) || (client->tm_deadline != 0 && client->tm_deadline <= deadline)) {
+		return;
+	}
+
+	if (client->tm_deadline != 0) {
+		wheel_unlink(client);
+	}
+	/* already passed, expire it with the next processed slot */
+	if (deadline < engine.wheel_tick * ENGINE_TIMER_RES) {
+		deadline = engine.wheel_tick * ENGINE_TIMER_RES;
+	}
+	wheel_link(client, deadline);
+
+	at = (deadline / ENGINE_TIMER_RES + 1) * ENGINE_TIMER_RES;
+	if (engine.timer_armed == 0 || at < engine.timer_armed) {
+		wheel_arm(at);
+	}
+}
+
+/* ENGINE LOCK must be held */
+static void engine_rearm(struct client_struct* client) {
+	struct epoll_event ev;
+
+	ev.events = (client->handshake == NP_HANDSHAKE_WANT_WRITE ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+	ev.data.ptr = client;
+	if (epoll_ctl(engine.epfd, EPOLL_CTL_MOD, client->sock, &ev) == -1) {
+		nc_verb_error("%s: epoll_ctl failed (%s)", __func__, strerror(errno));
+		client->to_free = 1;
+		engine_enqueue(client);
+	}
+}
+
+/* remove the client from everywhere, the poller will free it */
+static void client_release(struct client_struct* client) {
+	uint64_t val = 1;
+
+	/* GLOBAL LOCK */
+	pthread_mutex_lock(&netopeer_state.global_lock);
+	np_client_detach(&netopeer_state.clients, client);
+	/* GLOBAL UNLOCK */
+	pthread_mutex_unlock(&netopeer_state.global_lock);
+
+	/* CALLHOME LOCK */
+	pthread_mutex_lock(&callhome_lock);
+	if (client->callhome != NULL) {
+		/* let the Call Home app know its client is gone */
+		client->callhome->client = NULL;
+		client->callhome = NULL;
+		np_callhome_wake();
+	}
+	/* CALLHOME UNLOCK */
+	pthread_mutex_unlock(&callhome_lock);
+
+	/* ENGINE LOCK */
+	pthread_mutex_lock(&engine.lock);
+	epoll_ctl(engine.epfd, EPOLL_CTL_DEL, client->sock, NULL);
+	if (client->tm_deadline != 0) {
+		wheel_unlink(client);
+	}
+	client->ev_flags = NP_EV_DEAD;
+	client->ev_next = engine.zombies;
+	engine.zombies = client;
+	/* ENGINE UNLOCK */
+	pthread_mutex_unlock(&engine.lock);
+
+	/* the poller frees the zombies, do not let it sleep on them */
+	if (write(engine.wakefd, &val, sizeof val) == -1) {
+		nc_verb_warning("%s: write failed (%s)", __func__, strerror(errno));
+	}
+}
+
+/* ENGINE LOCK must be held */
+static void step_unlink(struct engine_step* step) {
+	struct engine_step** prev;
+
+	for (prev = &engine.steps; *prev != step; prev = &(*prev)->next);
+	*prev = step->next;
+}
+
+/* ENGINE LOCK must be held */
+static void engine_active_done(void) {
+	if (--engine.active == 0) {
+		pthread_cond_broadcast(&engine.pause_cond);
+	}
+}
+
+static void* engine_helper(void* UNUSED(arg)) {
+	struct engine_step* step;
+	struct timespec ts;
+	int ret;
+
+	/* ENGINE LOCK */
+	pthread_mutex_lock(&engine.lock);
+	while (!engine.stop) {
+		for (step = engine.steps; step != NULL && step->started; step = step->next);
+		if (step == NULL) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += ENGINE_HELPER_IDLE;
+			++engine.helpers_idle;
+			ret = pthread_cond_timedwait(&engine.helper_cond, &engine.lock, &ts);
+			--engine.helpers_idle;
+			if (ret == ETIMEDOUT && engine.steps_queued == 0) {
+				break;
+			}
+			continue;
+		}
+
+		step->started = 1;
+		--engine.steps_queued;
+		helper_step = step;
+		/* ENGINE UNLOCK */
+		pthread_mutex_unlock(&engine.lock);
+
+		step->fn(step->client);
+
+		/* ENGINE LOCK */
+		pthread_mutex_lock(&engine.lock);
+		helper_step = NULL;
+		step_unlink(step);
+		/* process it right away, the step may have left some work behind */
+		step->client->ev_flags &= ~(NP_EV_RUNNING | NP_EV_OFFLOADED | NP_EV_PENDING);
+		engine_enqueue(step->client);
+		free(step);
+		engine_active_done();
+	}
+	--engine.helpers;
+	pthread_cond_broadcast(&engine.helper_cond);
+	/* ENGINE UNLOCK */
+	pthread_mutex_unlock(&engine.lock);
+
+#ifdef NP_TLS
+	np_tls_thread_cleanup();
+#endif
+
+	return NULL;
+}
+
+/* return: 0 - a helper got the step, 1 - the step was run by the calling thread */
+static int engine_offload(struct client_struct* client) {
+	struct engine_step* step, *last;
+	pthread_t thread;
+	int ret;
+
+	if ((step = malloc(sizeof *step)) == NULL) {
+		nc_verb_error("%s: memory allocation failed (%s)", __func__, strerror(errno));
+		goto run;
+	}
+	step->client = client;
+	step->fn = engine_round.step;
+	step->deadline = engine_round.deadline;
+	step->started = 0;
+	step->next = NULL;
+
+	/* ENGINE LOCK */
+	pthread_mutex_lock(&engine.lock);
+	if (engine.helpers_idle <= engine.steps_queued) {
+		if ((ret = pthread_create(&thread, NULL, engine_helper, NULL)) != 0) {
+			/* ENGINE UNLOCK */
+			pthread_mutex_unlock(&engine.lock);
+			nc_verb_error("%s: failed to create a thread (%s)", __func__, strerror(ret));
+			free(step);
+			goto run;
+		}
+		pthread_detach(thread);
+		++engine.helpers;
+	}
+
+	for (last = engine.steps; last != NULL && last->next != NULL; last = last->next);
+	if (last != NULL) {
+		last->next = step;
+	} else {
+		engine.steps = step;
+	}
+	++engine.steps_queued;
+	client->ev_flags |= NP_EV_OFFLOADED;
+	if (step->deadline != 0) {
+		engine_timer(client, step->deadline);
+	}
+	pthread_cond_signal(&engine.helper_cond);
+	/* ENGINE UNLOCK */
+	pthread_mutex_unlock(&engine.lock);
+
+	return 0;
+
+run:
+	nc_verb_warning("%s: running a blocking step in an engine thread", __func__);
+	engine_round.step(client);
+
+	/* ENGINE LOCK */
+	pthread_mutex_lock(&engine.lock);
+	client->ev_flags |= NP_EV_PENDING;
+	/* ENGINE UNLOCK */
+	pthread_mutex_unlock(&engine.lock);
+
+	return 1;
+}
+
+static void* engine_thread(void* UNUSED(arg)) {
+	struct client_struct* client;
+	unsigned int rounds;
+	int expired, active = 0;
+
+	/* ENGINE LOCK */
+	pthread_mutex_lock(&engine.lock);
+	while (!engine.stop) {
+		if (active) {
+			/* the previous client was processed */
+			engine_active_done();
+			active = 0;
+		}
+
+		if (engine.queue_head == NULL) {
+			pthread_cond_wait(&engine.cond, &engine.lock);
+			continue;
+		}
+
+		client = engine.queue_head;
+		engine.queue_head = client->ev_next;
+		if (engine.queue_head == NULL) {
+			engine.queue_tail = NULL;
+		}
+		client->ev_next = NULL;
+
+		if (engine.paused) {
+			/* the server state it uses is being reloaded */
+			client->ev_flags = (client->ev_flags & ~NP_EV_QUEUED) | NP_EV_PAUSED;
+			client->ev_next = engine.paused_clients;
+			engine.paused_clients = client;
+			continue;
+		}
+		++engine.active;
+		active = 1;
+
+		expired = client->ev_flags & NP_EV_TIMER;
+		client->ev_flags = (client->ev_flags & ~(NP_EV_QUEUED | NP_EV_TIMER)) | NP_EV_RUNNING;
+		/* ENGINE UNLOCK */
+		pthread_mutex_unlock(&engine.lock);
+
+		/* process the client until there is nothing to do or it must block, but do not starve the others */
+		engine_round.step = NULL;
+		engine_round.park = 0;
+		rounds = 0;
+		while (!client->to_free && client_process(client, expired) && engine_round.step == NULL && ++rounds < ENGINE_CLIENT_ROUNDS) {
+			expired = 0;
+		}
+
+		if (client->to_free && client->rpc_jobs) {
+			/* let the transport dispose of the finished RPC jobs, the workers kick us for the rest */
+			client_process(client, 0);
+			if (client->rpc_jobs) {
+				/* its hung-up socket would stay readable, wait only for the kicks */
+				engine_round.park = 1;
+			}
+		}
+
+		if (client->to_free && !client->rpc_jobs) {
+			client_release(client);
+			/* ENGINE LOCK */
+			pthread_mutex_lock(&engine.lock);
+			continue;
+		}
+
+		if (!client->to_free && engine_round.step != NULL && engine_offload(client) == 0) {
+			/* it keeps running until the helper finishes the step, the helper counts it as active */
+			/* ENGINE LOCK */
+			pthread_mutex_lock(&engine.lock);
+			active = 0;
+			continue;
+		}
+
+		/* ENGINE LOCK */
+		pthread_mutex_lock(&engine.lock);
+		client->ev_flags &= ~NP_EV_RUNNING;
+		if ((client->ev_flags & NP_EV_PENDING) || rounds == ENGINE_CLIENT_ROUNDS) {
+			client->ev_flags &= ~NP_EV_PENDING;
+			engine_enqueue(client);
+		} else if (!engine_round.park) {
+			engine_rearm(client);
+		}
+	}
+	if (active) {
+		engine_active_done();
+	}
+	/* ENGINE UNLOCK */
+	pthread_mutex_unlock(&engine.lock);
+
+#ifdef NP_TLS
+	np_tls_thread_cleanup();
+#endif
+
+	return NULL;
+}
+
+static void engine_free_zombies(void) {
+	struct client_struct* client, *next;
+
+	/* ENGINE LOCK */
+	pthread_mutex_lock(&engine.lock);
+	client = engine.zombies;
+	engine.zombies = NULL;
+	/* ENGINE UNLOCK */
+	pthread_mutex_unlock(&engine.lock);
+
+	for (; client != NULL; client = next) {
+		next = client->ev_next;
+		client_free(client);
+	}
+}
+
+static void* engine_poller(void* UNUSED(arg)) {
+	struct epoll_event events[ENGINE_MAX_EVENTS];
+	uint64_t val;
+	int i, r, expired;
+
+	while (!engine.stop) {
+		r = epoll_wait(engine.epfd, events, ENGINE_MAX_EVENTS, -1);
+		if (r == -1) {
+			if (errno != EINTR) {
+				nc_verb_error("%s: epoll_wait failed (%s)", __func__, strerror(errno));
+			}
+			r = 0;
+		}
+
+		/* ENGINE LOCK */
+		pthread_mutex_lock(&engine.lock);
+		expired = 0;
+		for (i = 0; i < r; ++i) {
+			if (events[i].data.ptr == &engine.timerfd) {
+				if (read(engine.timerfd, &val, sizeof val) == -1 && errno != EAGAIN) {
+					nc_verb_warning("%s: read failed (%s)", __func__, strerror(errno));
+				}
+				expired = 1;
+				continue;
+			}
+			if (events[i].data.ptr == NULL) {
+				/* wake up call */
+				if (read(engine.wakefd, &val, sizeof val) == -1 && errno != EAGAIN) {
+					nc_verb_warning("%s: read failed (%s)", __func__, strerror(errno));
+				}
+				continue;
+			}
+			engine_activate((struct client_struct*)events[i].data.ptr);
+		}
+		if (expired) {
+			wheel_expire();
+		}
+		/* ENGINE UNLOCK */
+		pthread_mutex_unlock(&engine.lock);
+
+		/* all the events of the removed clients were processed, they can be safely freed */
+		engine_free_zombies();
+	}
+
+	return NULL;
+}
+
+int np_engine_add_client(struct client_struct* client) {
+	struct epoll_event ev;
+
+	client->ev_flags = 0;
+	client->ev_next = NULL;
+	client->tm_deadline = 0;
+	client->tm_next = NULL;
+	client->tm_prev = NULL;
+
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = client;
+	if (epoll_ctl(engine.epfd, EPOLL_CTL_ADD, client->sock, &ev) == -1) {
+		nc_verb_error("%s: epoll_ctl failed (%s)", __func__, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	/* the transport handshake must not take forever */
+	np_engine_timer(client, np_clock_msec() + HANDSHAKE_TIMEOUT * 1000);
+
+	/* process it right away, the handshake could have left some data buffered */
+	np_engine_kick(client);
+
+	return EXIT_SUCCESS;
+}
+
+void np_engine_kick(struct client_struct* client) {
+	/* ENGINE LOCK */
+	pthread_mutex_lock(&engine.lock);
+	engine_activate(client);
+	/* ENGINE UNLOCK */
+	pthread_mutex_unlock(&engine.lock);
+}
+
+void np_engine_kick_all(void) {
+	struct client_struct* client;
+
+	/* GLOBAL LOCK */
+	pthread_mutex_lock(&netopeer_state.global_lock);
+	/* ENGINE LOCK */
+	pthread_mutex_lock(&engine.lock);
+	for (client = netopeer_state.clients; client != NULL; client = client->next) {
+		engine_activate(client);
+	}
+	/* ENGINE UNLOCK */
+	pthread_mutex_unlock(&engine.lock);
+	/* GLOBAL UNLOCK */
+	pthread_mutex_unlock(&netopeer_state.global_lock);
+}
+
+void np_engine_timer(struct client_struct* client, uint64_t deadline) {
+	if (deadline == 0) {
+		return;
+	}
+
+	/* ENGINE LOCK */
+	pthread_mutex_lock(&engine.lock);
+	engine_timer(client, deadline);
+	/* ENGINE UNLOCK */
+	pthread_mutex_unlock(&engine.lock);
+}
+
+void np_engine_offload(struct client_struct* UNUSED(client), np_engine_step step, uint64_t deadline) {
+	engine_round.step = step;
+	engine_round.deadline = deadline;
+}
+
+void np_engine_park(struct client_struct* UNUSED(client)) {
+	engine_round.park = 1;
+}
+
+void np_engine_step_deadline(uint64_t deadline) {
+	if (helper_step == NULL) {
+		return;
+	}
+
+	/* ENGINE LOCK */
+	pthread_mutex_lock(&engine.lock);
+	helper_step->deadline = deadline;
+	engine_timer(helper_step->client, deadline);
+	/* ENGINE UNLOCK */
+	pthread_mutex_unlock(&engine.lock);
+}
+
+void np_engine_expire_all(void) {
+	struct client_struct* client;
+
+	/* GLOBAL LOCK */
+	pthread_mutex_lock(&netopeer_state.global_lock);
+	/* ENGINE LOCK */
+	pthread_mutex_lock(&engine.lock);
+	for (client = netopeer_state.clients; client != NULL; client = client->next) {
+		if (client->ev_flags & NP_EV_OFFLOADED) {
+			/* its timer guards the step, the flag is enough */
+			client->ev_flags |= NP_EV_TIMER;
+			continue;
+		}
+		if (client->tm_deadline != 0) {
+			wheel_unlink(client);
+		}
+		if (!(client->ev_flags & NP_EV_DEAD)) {
+			client->ev_flags |= NP_EV_TIMER;
+			engine_activate(client);
+		}
+	}
+	/* ENGINE UNLOCK */
+	pthread_mutex_unlock(&engine.lock);
+	/* GLOBAL UNLOCK */
+	pthread_mutex_unlock(&netopeer_state.global_lock);
+}
+
+void np_engine_pause(void) {
+	/* ENGINE LOCK */
+	pthread_mutex_lock(&engine.lock);
+	engine.paused = 1;
+	while (engine.active > 0) {
+		pthread_cond_wait(&engine.pause_cond, &engine.lock);
+	}
+	/* ENGINE UNLOCK */
+	pthread_mutex_unlock(&engine.lock);
+}
+
+void np_engine_resume(void) {
+	struct client_struct* client;
+
+	/* ENGINE LOCK */
+	pthread_mutex_lock(&engine.lock);
+	engine.paused = 0;
+	while ((client = engine.paused_clients) != NULL) {
+		engine.paused_clients = client->ev_next;
+		client->ev_flags &= ~NP_EV_PAUSED;
+		engine_enqueue(client);
+	}
+	/* ENGINE UNLOCK */
+	pthread_mutex_unlock(&engine.lock);
+}
+
+int np_engine_setup_enter(void) {
+	int ret = 0;
+
+	/* ENGINE LOCK */
+	pthread_mutex_lock(&engine.lock);
+	if (engine.paused) {
+		ret = 1;
+	} else {
+		++engine.active;
+	}
+	/* ENGINE UNLOCK */
+	pthread_mutex_unlock(&engine.lock);
+
+	return ret;
+}
+
+void np_engine_setup_leave(void) {
+	/* ENGINE LOCK */
+	pthread_mutex_lock(&engine.lock);
+	engine_active_done();
+	/* ENGINE UNLOCK */
+	pthread_mutex_unlock(&engine.lock);
+}
+
+static void engine_stop_threads(void) {
+	uint64_t val = 1;
+	unsigned int i;
+
+	/* ENGINE LOCK */
+	pthread_mutex_lock(&engine.lock);
+	engine.stop = 1;
+	pthread_cond_broadcast(&engine.cond);
+	pthread_cond_broadcast(&engine.helper_cond);
+	/* there are no clients left, so no steps, the helpers are exiting */
+	while (engine.helpers) {
+		pthread_cond_wait(&engine.helper_cond, &engine.lock);
+	}
+	/* ENGINE UNLOCK */
+	pthread_mutex_unlock(&engine.lock);
+
+	for (i = 0; i < engine.thread_count; ++i) {
+		pthread_join(engine.threads[i], NULL);
+	}
+	free(engine.threads);
+	engine.threads = NULL;
+	engine.thread_count = 0;
+
+	if (write(engine.wakefd, &val, sizeof val) == -1) {
+		nc_verb_warning("%s: write failed (%s)", __func__, strerror(errno));
+	}
+}
+
+int np_engine_init(void) {
+	struct epoll_event ev;
+	unsigned int count;
+	long cpus;
+	int ret;
+
+	if ((engine.epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		nc_verb_error("%s: epoll_create1 failed (%s)", __func__, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if ((engine.wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		nc_verb_error("%s: eventfd failed (%s)", __func__, strerror(errno));
+		goto fail;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(engine.epfd, EPOLL_CTL_ADD, engine.wakefd, &ev) == -1) {
+		nc_verb_error("%s: epoll_ctl failed (%s)", __func__, strerror(errno));
+		goto fail;
+	}
+	if ((engine.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+		nc_verb_error("%s: timerfd_create failed (%s)", __func__, strerror(errno));
+		goto fail;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = &engine.timerfd;
+	if (epoll_ctl(engine.epfd, EPOLL_CTL_ADD, engine.timerfd, &ev) == -1) {
+		nc_verb_error("%s: epoll_ctl failed (%s)", __func__, strerror(errno));
+		goto fail;
+	}
+	engine.wheel_tick = np_clock_msec() / ENGINE_TIMER_RES;
+	engine.timer_armed = 0;
+
+	count = ENGINE_THREADS;
+	if (count == 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		count = (cpus > 1 ? cpus : 1);
+	}
+
+	engine.stop = 0;
+	engine.threads = calloc(count, sizeof(pthread_t));
+	for (engine.thread_count = 0; engine.thread_count < count; ++engine.thread_count) {
+		if ((ret = pthread_create(&engine.threads[engine.thread_count], NULL, engine_thread, NULL)) != 0) {
+			nc_verb_error("%s: failed to create a thread (%s)", __func__, strerror(ret));
+			break;
+		}
+	}
+	if (engine.thread_count == 0) {
+		goto fail;
+	}
+
+	if ((ret = pthread_create(&engine.poller, NULL, engine_poller, NULL)) != 0) {
+		nc_verb_error("%s: failed to create a thread (%s)", __func__, strerror(ret));
+		engine_stop_threads();
+		goto fail;
+	}
+
+	nc_verb_verbose("Client engine started with %u threads.", engine.thread_count);
+	return EXIT_SUCCESS;
+
+fail:
+	free(engine.threads);
+	engine.threads = NULL;
+	engine.thread_count = 0;
+	if (engine.wakefd != -1) {
+		close(engine.wakefd);
+		engine.wakefd = -1;
+	}
+	if (engine.timerfd != -1) {
+		close(engine.timerfd);
+		engine.timerfd = -1;
+	}
+	close(engine.epfd);
+	engine.epfd = -1;
+	return EXIT_FAILURE;
+}
+
+void np_engine_cleanup(void) {
+	if (engine.epfd == -1) {
+		return;
+	}
+
+	engine_stop_threads();
+	pthread_join(engine.poller, NULL);
+	engine_free_zombies();
+
+	close(engine.wakefd);
+	engine.wakefd = -1;
+	close(engine.timerfd);
+	engine.timerfd = -1;
+	close(engine.epfd);
+	engine.epfd = -1;
+}
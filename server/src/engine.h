@@ -0,0 +1,179 @@
+/**
+ * @file engine.h
+ * @brief Netopeer server client event engine header
+ *
+ * Copyright (C) 2015 CESNET, z.s.p.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of the Company nor the names of its contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * ALTERNATIVELY, provided that this notice is retained in full, this
+ * product may be distributed under the terms of the GNU General Public
+ * License (GPL) version 2 or later, in which case the provisions
+ * of the GPL apply INSTEAD OF those given above.
+ *
+ * This software is provided ``as is, and any express or implied
+ * warranties, including, but not limited to, the implied warranties of
+ * merchantability and fitness for a particular purpose are disclaimed.
+ * In no event shall the company or contributors be liable for any
+ * direct, indirect, incidental, special, exemplary, or consequential
+ * damages (including, but not limited to, procurement of substitute
+ * goods or services; loss of use, data, or profits; or business
+ * interruption) however caused and on any theory of liability, whether
+ * in contract, strict liability, or tort (including negligence or
+ * otherwise) arising in any way out of the use of this software, even
+ * if advised of the possibility of such damage.
+ */
+
+#ifndef _ENGINE_H_
+#define _ENGINE_H_
+
+#include <stdint.h>
+
+struct client_struct;
+
+/* client event flags, protected by the engine lock */
+#define NP_EV_QUEUED 0x01	// waiting in the run queue
+#define NP_EV_RUNNING 0x02	// being processed by an engine thread
+#define NP_EV_PENDING 0x04	// new event arrived during processing
+#define NP_EV_DEAD 0x08		// removed from the engine, waiting to be freed
+#define NP_EV_TIMER 0x10	// the client timer expired
+#define NP_EV_OFFLOADED 0x20	// a blocking step of the client is run by an engine helper
+#define NP_EV_PAUSED 0x40	// waiting for np_engine_resume()
+
+/**
+ * @brief Blocking part of the client processing run by an engine helper thread
+ */
+typedef void (*np_engine_step)(struct client_struct* client);
+
+/**
+ * @brief Start the engine poller and the client processing threads
+ *
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int np_engine_init(void);
+
+/**
+ * @brief Start watching a new client, it must already be in the global clients list
+ *
+ * @param client Client with a fully created session
+ *
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int np_engine_add_client(struct client_struct* client);
+
+/**
+ * @brief Schedule client processing even without any event on its socket
+ *
+ * The caller must make sure the client cannot be freed meanwhile (hold
+ * the GLOBAL LOCK, for instance).
+ *
+ * @param client Client to process
+ */
+void np_engine_kick(struct client_struct* client);
+
+/**
+ * @brief Schedule processing of all the clients
+ */
+void np_engine_kick_all(void);
+
+/**
+ * @brief Make sure the client timer expires no later than at the deadline
+ *
+ * Every client has a single timer, an earlier deadline replaces the armed
+ * one, a later one is ignored. Once the timer expires, the client is processed
+ * with the timer flag, it is no longer armed then and the transport should
+ * check its timeouts and arm the nearest next deadline.
+ *
+ * @param client Client processed by the calling thread, or protected
+ * by the GLOBAL LOCK.
+ * @param deadline Monotonic msecs (np_clock_msec()), 0 does nothing.
+ */
+void np_engine_timer(struct client_struct* client, uint64_t deadline);
+
+/**
+ * @brief Hand the client over to an engine helper thread once the current round ends
+ *
+ * The step may block, the engine threads must not. Until the step returns,
+ * the client is not processed by anyone else, it is processed again right
+ * after. If the step does not finish until the deadline, the client socket
+ * is shut down to unblock it.
+ *
+ * @param client Client processed by the calling engine thread.
+ * @param step Step to run.
+ * @param deadline Monotonic msecs (np_clock_msec()) the step must finish
+ * by, 0 if it limits itself with np_engine_step_deadline().
+ */
+void np_engine_offload(struct client_struct* client, np_engine_step step, uint64_t deadline);
+
+/**
+ * @brief Stop watching the client socket once the current round ends
+ *
+ * A client waiting for something else than its socket would only spin on
+ * any new data. It is processed again once kicked or once its timer expires.
+ *
+ * @param client Client processed by the calling engine thread.
+ */
+void np_engine_park(struct client_struct* client);
+
+/**
+ * @brief Set a new deadline of the step run by the calling engine helper
+ *
+ * A step consisting of many writes can limit each of them instead of
+ * the whole step. Outside of a helper, the call does nothing.
+ *
+ * @param deadline Monotonic msecs (np_clock_msec()).
+ */
+void np_engine_step_deadline(uint64_t deadline);
+
+/**
+ * @brief Expire the timers of all the clients, for instance after a timeout
+ * was shortened
+ */
+void np_engine_expire_all(void);
+
+/**
+ * @brief Stop processing the clients
+ *
+ * The clients use the transport options, the datastores and the capabilities,
+ * which are freed and created again on a soft restart. Once the call returns,
+ * no client is being processed, run by a helper or set up, and the ones to
+ * process wait for np_engine_resume(). A blocking step of a helper can delay
+ * the return by up to its deadline.
+ */
+void np_engine_pause(void);
+
+/**
+ * @brief Process the paused clients again, the server state is ready
+ */
+void np_engine_resume(void);
+
+/**
+ * @brief Start setting up a new client, it uses the transport options
+ *
+ * @return 0 if the client can be set up and np_engine_setup_leave() must be
+ * called afterwards, 1 if the engine is paused and the client must be dropped.
+ */
+int np_engine_setup_enter(void);
+
+/**
+ * @brief The new client setup is finished
+ */
+void np_engine_setup_leave(void);
+
+/**
+ * @brief Stop all the engine threads, there must be no clients left
+ */
+void np_engine_cleanup(void);
+
+#endif /* _ENGINE_H_ */
@@ -0,0 +1,504 @@
+/**
+ * @file logger.c
+ * @brief Netopeer server asynchronous logging
+ *
+ * Copyright (C) 2015 CESNET, z.s.p.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of the Company nor the names of its contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * ALTERNATIVELY, provided that this notice is retained in full, this
+ * product may be distributed under the terms of the GNU General Public
+ * License (GPL) version 2 or later, in which case the provisions
+ * of the GPL apply INSTEAD OF those given above.
+ *
+ * This software is provided ``as is, and any express or implied
+ * warranties, including, but not limited to, the implied warranties of
+ * merchantability and fitness for a particular purpose are disclaimed.
+ * In no event shall the company or contributors be liable for any
+ * direct, indirect, incidental, special, exemplary, or consequential
+ * damages (including, but not limited to, procurement of substitute
+ * goods or services; loss of use, data, or profits; or business
+ * interruption) however caused and on any theory of liability, whether
+ * in contract, strict liability, or tort (including negligence or
+ * otherwise) arising in any way out of the use of this software, even
+ * if advised of the possibility of such damage.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#include "server.h"
+
+static const char rcsid[] __attribute__((used)) ="$Id: "__FILE__": "RCSID" $";
+
+/*
+ * Queued message. Records are 8-byte aligned and never wrap around the end
+ * of the buffer, a record with zero length marks the rest of the buffer as
+ * unused and the next record is at its start.
+ */
+struct log_rec {
+	uint32_t len;						// size of the whole record
+	uint32_t level;
+	struct timespec time;
+	char msg[];
+};
+
+#define LOG_REC_SIZE(msg_size) ((sizeof(struct log_rec) + (msg_size) + 7) & ~(size_t)7)
+
+/*
+ * Buffer of a single thread, it is written only by the thread and read only
+ * by the logging thread so the positions are the only synchronization needed.
+ * The positions only grow, their difference is the number of used bytes.
+ */
+struct log_ring {
+	char buf[LOG_RING_SIZE] __attribute__((aligned(8)));
+	uint64_t head;						// written by the owner
+	unsigned long dropped;				// written by the owner
+	uint64_t tail __attribute__((aligned(64)));	// written by the logging thread
+	uint64_t snap;						// head seen by the current drain
+	unsigned long dropped_reported;
+	pid_t tid;
+	int dead;							// the owner exited
+	int drop;							// the owner exited before the current drain
+	struct log_ring* next;
+};
+
+static struct {
+	volatile int running;
+	volatile int stop;
+	pthread_t thread;
+	pthread_key_t key;
+	int evfd;
+	FILE* file;							// JSON lines sink, NULL for syslog
+	/* LOG LOCK */
+	pthread_mutex_t lock;
+	struct log_ring* rings;
+
+	/* only used by the logging thread */
+	struct {
+		int level;						// -1 if nothing to compare
+		pid_t tid;
+		time_t time;
+		unsigned int repeats;
+		size_t len;
+		char msg[LOG_MSG_MAX];
+	} last;
+} logger = {
+	.evfd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.last = {.level = -1}
+};
+
+static __thread struct log_ring* log_ring;
+
+static int log_priority(int level) {
+	switch (level) {
+	case NC_VERB_ERROR:
+		return LOG_ERR;
+	case NC_VERB_WARNING:
+		return LOG_WARNING;
+	case NC_VERB_VERBOSE:
+		return LOG_INFO;
+	default:
+		return LOG_DEBUG;
+	}
+}
+
+static const char* log_level_name(int level) {
+	switch (level) {
+	case NC_VERB_ERROR:
+		return "error";
+	case NC_VERB_WARNING:
+		return "warning";
+	case NC_VERB_VERBOSE:
+		return "verbose";
+	default:
+		return "debug";
+	}
+}
+
+/* the owner thread exited, the logging thread frees the ring once it is empty */
+static void ring_release(void* arg) {
+	struct log_ring* ring = (struct log_ring*)arg;
+
+	/* messages of the other destructors get a new ring */
+	log_ring = NULL;
+	__atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+/* return: the ring of the calling thread, NULL on error */
+static struct log_ring* ring_get(void) {
+	struct log_ring* ring;
+
+	if (log_ring != NULL) {
+		return log_ring;
+	}
+
+	if (posix_memalign((void**)&ring, 64, sizeof *ring) != 0) {
+		return NULL;
+	}
+	memset(ring, 0, sizeof *ring);
+	ring->tid = syscall(SYS_gettid);
+
+	/* LOG LOCK */
+	pthread_mutex_lock(&logger.lock);
+	ring->next = logger.rings;
+	logger.rings = ring;
+	/* LOG UNLOCK */
+	pthread_mutex_unlock(&logger.lock);
+
+	pthread_setspecific(logger.key, ring);
+	log_ring = ring;
+	return ring;
+}
+
+/* format the message into room bytes at rec, return: size of the record, 0 if it does not fit */
+static size_t rec_fill(struct log_rec* rec, size_t room, NC_VERB_LEVEL level, const char* format, va_list ap) {
+	va_list aq;
+	size_t len;
+	int n;
+
+	if (room < LOG_REC_SIZE(1)) {
+		return 0;
+	}
+
+	va_copy(aq, ap);
+	n = vsnprintf(rec->msg, (room - sizeof *rec < LOG_MSG_MAX ? room - sizeof *rec : LOG_MSG_MAX), format, aq);
+	va_end(aq);
+	if (n < 0) {
+		return 0;
+	}
+
+	/* too long messages are truncated, not dropped */
+	len = (n < LOG_MSG_MAX ? (size_t)n : LOG_MSG_MAX - 1);
+	if (LOG_REC_SIZE(len + 1) > room) {
+		return 0;
+	}
+
+	rec->len = LOG_REC_SIZE(len + 1);
+	rec->level = level;
+	clock_gettime(CLOCK_REALTIME, &rec->time);
+	return rec->len;
+}
+
+static void ring_put(struct log_ring* ring, NC_VERB_LEVEL level, const char* format, va_list ap) {
+	uint64_t head, used;
+	size_t off, end, size, skip = 0;
+	struct log_rec* rec;
+
+	head = ring->head;
+	used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	off = head & (LOG_RING_SIZE - 1);
+	end = LOG_RING_SIZE - off;
+
+	rec = (struct log_rec*)(ring->buf + off);
+	if ((size = rec_fill(rec, (end < LOG_RING_SIZE - used ? end : LOG_RING_SIZE - used), level, format, ap)) == 0) {
+		/* does not fit before the end of the buffer, try its start */
+		if (LOG_RING_SIZE - used > end
+				&& (size = rec_fill((struct log_rec*)ring->buf, LOG_RING_SIZE - used - end, level, format, ap)) != 0) {
+			rec->len = 0;
+			skip = end;
+		} else {
+			/* the logging thread is too slow, the message is lost */
+			__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+
+	__atomic_store_n(&ring->head, head + skip + size, __ATOMIC_RELEASE);
+
+	/* errors are written right away, otherwise only when the buffer is getting full */
+	if (level == NC_VERB_ERROR || (used <= LOG_RING_SIZE / 2 && used + skip + size > LOG_RING_SIZE / 2)) {
+		eventfd_write(logger.evfd, 1);
+	}
+}
+
+/* return: next record of the ring up to the head seen by the drain, NULL if there is none */
+static struct log_rec* ring_peek(struct log_ring* ring) {
+	struct log_rec* rec;
+	size_t off;
+
+	while (ring->tail != ring->snap) {
+		off = ring->tail & (LOG_RING_SIZE - 1);
+		rec = (struct log_rec*)(ring->buf + off);
+		if (rec->len != 0) {
+			return rec;
+		}
+		__atomic_store_n(&ring->tail, ring->tail + (LOG_RING_SIZE - off), __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+static void sink_write(pid_t tid, int level, const struct timespec* time, const char* msg) {
+	char stamp[32];
+	struct tm tm;
+	const char* c;
+
+	if (logger.file == NULL) {
+		syslog(log_priority(level), "%s", msg);
+		return;
+	}
+
+	gmtime_r(&time->tv_sec, &tm);
+	strftime(stamp, sizeof stamp, "%Y-%m-%dT%H:%M:%S", &tm);
+	fprintf(logger.file, "{\"time\":\"%s.%06ldZ\",\"level\":\"%s\",\"thread\":%d,\"message\":\"",
+			stamp, time->tv_nsec / 1000, log_level_name(level), (int)tid);
+	for (c = msg; *c; ++c) {
+		switch (*c) {
+		case '"':
+			fputs("\\\"", logger.file);
+			break;
+		case '\\':
+			fputs("\\\\", logger.file);
+			break;
+		case '\n':
+			fputs("\\n", logger.file);
+			break;
+		case '\t':
+			fputs("\\t", logger.file);
+			break;
+		default:
+			if ((unsigned char)*c < 0x20) {
+				fprintf(logger.file, "\\u%04x", (unsigned char)*c);
+			} else {
+				putc_unlocked(*c, logger.file);
+			}
+			break;
+		}
+	}
+	fputs("\"}\n", logger.file);
+}
+
+/* write how many times the last message was suppressed */
+static void log_repeats_flush(void) {
+	char msg[64];
+	struct timespec now;
+
+	if (logger.last.repeats == 0) {
+		return;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	snprintf(msg, sizeof msg, "last message repeated %u times", logger.last.repeats);
+	sink_write(logger.last.tid, logger.last.level, &now, msg);
+	logger.last.repeats = 0;
+}
+
+/* write a message unless it is the same as the last one written shortly before */
+static void log_write(pid_t tid, int level, const struct timespec* time, const char* msg) {
+	size_t len = strlen(msg);
+
+	if (level == logger.last.level && len == logger.last.len && time->tv_sec - logger.last.time < LOG_DUP_WINDOW
+			&& memcmp(msg, logger.last.msg, len) == 0) {
+		++logger.last.repeats;
+		return;
+	}
+
+	log_repeats_flush();
+	sink_write(tid, level, time, msg);
+
+	logger.last.level = level;
+	logger.last.tid = tid;
+	logger.last.time = time->tv_sec;
+	logger.last.len = len;
+	memcpy(logger.last.msg, msg, len);
+}
+
+/* write all the queued messages ordered by their time */
+static void log_drain(void) {
+	struct log_ring* ring, **rring, *oldest;
+	struct log_rec* rec, *oldest_rec = NULL;
+	unsigned long dropped;
+	char msg[128];
+	struct timespec now;
+
+	/* LOG LOCK */
+	pthread_mutex_lock(&logger.lock);
+
+	for (ring = logger.rings; ring != NULL; ring = ring->next) {
+		/* a ring seen dead holds its last messages already */
+		ring->drop = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+		ring->snap = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	}
+
+	while (1) {
+		oldest = NULL;
+		for (ring = logger.rings; ring != NULL; ring = ring->next) {
+			if ((rec = ring_peek(ring)) != NULL && (oldest == NULL || rec->time.tv_sec < oldest_rec->time.tv_sec
+					|| (rec->time.tv_sec == oldest_rec->time.tv_sec && rec->time.tv_nsec < oldest_rec->time.tv_nsec))) {
+				oldest = ring;
+				oldest_rec = rec;
+			}
+		}
+		if (oldest == NULL) {
+			break;
+		}
+
+		log_write(oldest->tid, oldest_rec->level, &oldest_rec->time, oldest_rec->msg);
+		__atomic_store_n(&oldest->tail, oldest->tail + oldest_rec->len, __ATOMIC_RELEASE);
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	rring = &logger.rings;
+	while ((ring = *rring) != NULL) {
+		dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		if (dropped != ring->dropped_reported) {
+			snprintf(msg, sizeof msg, "%lu log messages of this thread were dropped, the logging could not keep up",
+					dropped - ring->dropped_reported);
+			log_write(ring->tid, NC_VERB_WARNING, &now, msg);
+			ring->dropped_reported = dropped;
+		}
+
+		if (ring->drop) {
+			*rring = ring->next;
+			free(ring);
+		} else {
+			rring = &ring->next;
+		}
+	}
+
+	/* LOG UNLOCK */
+	pthread_mutex_unlock(&logger.lock);
+
+	/* do not keep the count of the last message for too long */
+	if (logger.last.repeats != 0 && now.tv_sec - logger.last.time >= LOG_DUP_WINDOW) {
+		log_repeats_flush();
+		logger.last.level = -1;
+	}
+
+	if (logger.file != NULL) {
+		fflush(logger.file);
+	}
+}
+
+static void* log_thread(void* UNUSED(arg)) {
+	struct pollfd pfd = {.fd = logger.evfd, .events = POLLIN};
+	eventfd_t val;
+
+	while (!logger.stop) {
+		if (poll(&pfd, 1, LOG_DRAIN_INTERVAL) > 0) {
+			eventfd_read(logger.evfd, &val);
+		}
+		log_drain();
+	}
+
+	return NULL;
+}
+
+int np_log_init(const char* path) {
+	int ret;
+
+	if (path != NULL && (logger.file = fopen(path, "ae")) == NULL) {
+		nc_verb_error("%s: failed to open \"%s\" (%s)", __func__, path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if ((logger.evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		nc_verb_error("%s: eventfd failed (%s)", __func__, strerror(errno));
+		goto fail;
+	}
+
+	if ((ret = pthread_key_create(&logger.key, ring_release)) != 0) {
+		nc_verb_error("%s: pthread_key_create() error (%s)", __func__, strerror(ret));
+		goto fail;
+	}
+
+	logger.stop = 0;
+	if ((ret = pthread_create(&logger.thread, NULL, log_thread, NULL)) != 0) {
+		nc_verb_error("%s: pthread_create() error (%s)", __func__, strerror(ret));
+		pthread_key_delete(logger.key);
+		goto fail;
+	}
+
+	__atomic_store_n(&logger.running, 1, __ATOMIC_RELEASE);
+	return EXIT_SUCCESS;
+
+fail:
+	if (logger.evfd != -1) {
+		close(logger.evfd);
+		logger.evfd = -1;
+	}
+	if (logger.file != NULL) {
+		fclose(logger.file);
+		logger.file = NULL;
+	}
+	return EXIT_FAILURE;
+}
+
+void np_log_vprintf(NC_VERB_LEVEL level, const char* format, va_list ap) {
+	struct log_ring* ring;
+
+	if (!__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE) || (ring = ring_get()) == NULL) {
+		vsyslog(log_priority(level), format, ap);
+		return;
+	}
+
+	ring_put(ring, level, format, ap);
+}
+
+void np_log_printf(NC_VERB_LEVEL level, const char* format, ...) {
+	va_list ap;
+
+	va_start(ap, format);
+	np_log_vprintf(level, format, ap);
+	va_end(ap);
+}
+
+void np_log_cleanup(void) {
+	struct log_ring* ring;
+
+	if (!logger.running) {
+		return;
+	}
+
+	/* the messages from now on are written directly */
+	__atomic_store_n(&logger.running, 0, __ATOMIC_RELEASE);
+	logger.stop = 1;
+	eventfd_write(logger.evfd, 1);
+	pthread_join(logger.thread, NULL);
+
+	pthread_key_delete(logger.key);
+	log_drain();
+	log_repeats_flush();
+
+	/* LOG LOCK */
+	pthread_mutex_lock(&logger.lock);
+	while ((ring = logger.rings) != NULL) {
+		logger.rings = ring->next;
+		free(ring);
+	}
+	/* LOG UNLOCK */
+	pthread_mutex_unlock(&logger.lock);
+	log_ring = NULL;
+
+	close(logger.evfd);
+	logger.evfd = -1;
+	if (logger.file != NULL) {
+		fclose(logger.file);
+		logger.file = NULL;
+	}
+}
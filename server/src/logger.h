@@ -0,0 +1,72 @@
+/**
+ * @file logger.h
+ * @brief Netopeer server asynchronous logging
+ *
+ * Copyright (C) 2015 CESNET, z.s.p.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of the Company nor the names of its contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * ALTERNATIVELY, provided that this notice is retained in full, this
+ * product may be distributed under the terms of the GNU General Public
+ * License (GPL) version 2 or later, in which case the provisions
+ * of the GPL apply INSTEAD OF those given above.
+ *
+ * This software is provided ``as is, and any express or implied
+ * warranties, including, but not limited to, the implied warranties of
+ * merchantability and fitness for a particular purpose are disclaimed.
+ * In no event shall the company or contributors be liable for any
+ * direct, indirect, incidental, special, exemplary, or consequential
+ * damages (including, but not limited to, procurement of substitute
+ * goods or services; loss of use, data, or profits; or business
+ * interruption) however caused and on any theory of liability, whether
+ * in contract, strict liability, or tort (including negligence or
+ * otherwise) arising in any way out of the use of this software, even
+ * if advised of the possibility of such damage.
+ */
+
+#ifndef _LOGGER_H_
+#define _LOGGER_H_
+
+#include <stdarg.h>
+#include <libnetconf.h>
+
+/**
+ * @brief Start the logging thread, the messages are only queued from now on
+ *
+ * @param path File to write the messages into as JSON lines, NULL for syslog
+ *
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int np_log_init(const char* path);
+
+/**
+ * @brief Log a message, if the logging thread runs it is only copied into a buffer of the calling thread
+ *
+ * @param level Verbosity level of the message
+ * @param format Format of the message
+ * @param ap Arguments of the format
+ */
+void np_log_vprintf(NC_VERB_LEVEL level, const char* format, va_list ap);
+
+/**
+ * @brief Log a message, see np_log_vprintf()
+ */
+void np_log_printf(NC_VERB_LEVEL level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * @brief Write all the queued messages and stop the logging thread, the messages are written directly then
+ */
+void np_log_cleanup(void);
+
+#endif /* _LOGGER_H_ */
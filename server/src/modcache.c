@@ -0,0 +1,234 @@
+/**
+ * @file modcache.c
+ * @brief Netopeer server module configurations read ahead
+ *
+ * Copyright (C) 2015 CESNET, z.s.p.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of the Company nor the names of its contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * ALTERNATIVELY, provided that this notice is retained in full, this
+ * product may be distributed under the terms of the GNU General Public
+ * License (GPL) version 2 or later, in which case the provisions
+ * of the GPL apply INSTEAD OF those given above.
+ *
+ * This software is provided ``as is, and any express or implied
+ * warranties, including, but not limited to, the implied warranties of
+ * merchantability and fitness for a particular purpose are disclaimed.
+ * In no event shall the company or contributors be liable for any
+ * direct, indirect, incidental, special, exemplary, or consequential
+ * damages (including, but not limited to, procurement of substitute
+ * goods or services; loss of use, data, or profits; or business
+ * interruption) however caused and on any theory of liability, whether
+ * in contract, strict liability, or tort (including negligence or
+ * otherwise) arising in any way out of the use of this software, even
+ * if advised of the possibility of such damage.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <libxml/parser.h>
+
+#include "server.h"
+
+static const char rcsid[] __attribute__((used)) ="$Id: "__FILE__": "RCSID" $";
+
+struct modcache_entry {
+	char* name;
+	char* path;
+	struct stat st;						// of the parsed file
+	xmlDocPtr doc;
+	struct modcache_entry* next;
+};
+
+static struct {
+	/* MODCACHE LOCK */
+	pthread_mutex_t lock;
+	struct modcache_entry* entries;
+
+	/* only while prefetching */
+	struct modcache_entry** work;
+	unsigned int work_count;
+	volatile unsigned int work_next;
+} modcache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static void modcache_entry_free(struct modcache_entry* entry) {
+	xmlFreeDoc(entry->doc);
+	free(entry->name);
+	free(entry->path);
+	free(entry);
+}
+
+static void* modcache_thread(void* UNUSED(arg)) {
+	struct modcache_entry* entry;
+	unsigned int i;
+
+	while ((i = __sync_fetch_and_add(&modcache.work_next, 1)) < modcache.work_count) {
+		entry = modcache.work[i];
+		if (stat(entry->path, &entry->st) == -1) {
+			continue;
+		}
+		/* the same way module_enable() reads it */
+		entry->doc = xmlReadFile(entry->path, NULL, XML_PARSE_NOBLANKS|XML_PARSE_NSCLEAN|XML_PARSE_NOWARNING|XML_PARSE_NOERROR);
+	}
+
+	return NULL;
+}
+
+void np_modcache_prefetch(void) {
+	struct modcache_entry* entry, *entries = NULL;
+	struct dirent* file;
+	pthread_t* threads;
+	unsigned int count = 0, thread_count, i;
+	long cpus;
+	size_t len;
+	DIR* dir;
+	int ret;
+
+	if ((dir = opendir(MODULES_CFG_DIR)) == NULL) {
+		nc_verb_error("%s: unable to read the modules directory \"%s\" (%s)", __func__, MODULES_CFG_DIR, strerror(errno));
+		return;
+	}
+	while ((file = readdir(dir)) != NULL) {
+		if ((len = strlen(file->d_name)) <= 4 || strcmp(file->d_name + len - 4, ".xml") != 0) {
+			continue;
+		}
+		if ((entry = calloc(1, sizeof *entry)) == NULL || (entry->name = strndup(file->d_name, len - 4)) == NULL
+				|| asprintf(&entry->path, "%s/%s", MODULES_CFG_DIR, file->d_name) == -1) {
+			nc_verb_error("%s: memory allocation failed (%s)", __func__, strerror(errno));
+			if (entry != NULL) {
+				entry->path = NULL;
+				modcache_entry_free(entry);
+			}
+			break;
+		}
+		entry->next = entries;
+		entries = entry;
+		++count;
+	}
+	closedir(dir);
+
+	if (count == 0 || (modcache.work = malloc(count * sizeof *modcache.work)) == NULL) {
+		while ((entry = entries) != NULL) {
+			entries = entry->next;
+			modcache_entry_free(entry);
+		}
+		return;
+	}
+	for (i = 0, entry = entries; entry != NULL; entry = entry->next) {
+		modcache.work[i++] = entry;
+	}
+	modcache.work_count = count;
+	modcache.work_next = 0;
+
+	thread_count = MODCACHE_THREADS;
+	if (thread_count == 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		thread_count = (cpus > 1 ? cpus : 1);
+	}
+	if (thread_count > count) {
+		thread_count = count;
+	}
+
+	/* the calling thread parses too, anything the others did not start */
+	if ((threads = calloc(thread_count, sizeof *threads)) != NULL) {
+		for (i = 0; i < thread_count - 1; ++i) {
+			if ((ret = pthread_create(&threads[i], NULL, modcache_thread, NULL)) != 0) {
+				nc_verb_warning("%s: pthread_create() error (%s)", __func__, strerror(ret));
+				break;
+			}
+		}
+		thread_count = i;
+	} else {
+		thread_count = 0;
+	}
+	modcache_thread(NULL);
+	for (i = 0; i < thread_count; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+	free(modcache.work);
+	modcache.work = NULL;
+	modcache.work_count = 0;
+
+	/* MODCACHE LOCK */
+	pthread_mutex_lock(&modcache.lock);
+	while ((entry = entries) != NULL) {
+		entries = entry->next;
+		if (entry->doc == NULL) {
+			/* module_enable() reports it */
+			modcache_entry_free(entry);
+			continue;
+		}
+		entry->next = modcache.entries;
+		modcache.entries = entry;
+	}
+	/* MODCACHE UNLOCK */
+	pthread_mutex_unlock(&modcache.lock);
+}
+
+xmlDocPtr np_modcache_take(const char* name) {
+	struct modcache_entry** iter, *entry = NULL;
+	struct stat st;
+	xmlDocPtr doc;
+
+	/* MODCACHE LOCK */
+	pthread_mutex_lock(&modcache.lock);
+	for (iter = &modcache.entries; *iter != NULL; iter = &(*iter)->next) {
+		if (strcmp((*iter)->name, name) == 0) {
+			entry = *iter;
+			*iter = entry->next;
+			break;
+		}
+	}
+	/* MODCACHE UNLOCK */
+	pthread_mutex_unlock(&modcache.lock);
+
+	if (entry == NULL) {
+		return NULL;
+	}
+
+	doc = entry->doc;
+	entry->doc = NULL;
+	if (stat(entry->path, &st) == -1 || st.st_ino != entry->st.st_ino || st.st_size != entry->st.st_size
+			|| st.st_mtim.tv_sec != entry->st.st_mtim.tv_sec || st.st_mtim.tv_nsec != entry->st.st_mtim.tv_nsec) {
+		xmlFreeDoc(doc);
+		doc = NULL;
+	}
+	modcache_entry_free(entry);
+
+	return doc;
+}
+
+void np_modcache_cleanup(void) {
+	struct modcache_entry* entry;
+
+	/* MODCACHE LOCK */
+	pthread_mutex_lock(&modcache.lock);
+	while ((entry = modcache.entries) != NULL) {
+		modcache.entries = entry->next;
+		modcache_entry_free(entry);
+	}
+	/* MODCACHE UNLOCK */
+	pthread_mutex_unlock(&modcache.lock);
+}
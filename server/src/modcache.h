@@ -0,0 +1,62 @@
+/**
+ * @file modcache.h
+ * @brief Netopeer server module configurations read ahead
+ *
+ * Copyright (C) 2015 CESNET, z.s.p.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of the Company nor the names of its contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * ALTERNATIVELY, provided that this notice is retained in full, this
+ * product may be distributed under the terms of the GNU General Public
+ * License (GPL) version 2 or later, in which case the provisions
+ * of the GPL apply INSTEAD OF those given above.
+ *
+ * This software is provided ``as is, and any express or implied
+ * warranties, including, but not limited to, the implied warranties of
+ * merchantability and fitness for a particular purpose are disclaimed.
+ * In no event shall the company or contributors be liable for any
+ * direct, indirect, incidental, special, exemplary, or consequential
+ * damages (including, but not limited to, procurement of substitute
+ * goods or services; loss of use, data, or profits; or business
+ * interruption) however caused and on any theory of liability, whether
+ * in contract, strict liability, or tort (including negligence or
+ * otherwise) arising in any way out of the use of this software, even
+ * if advised of the possibility of such damage.
+ */
+
+#ifndef _MODCACHE_H_
+#define _MODCACHE_H_
+
+#include <libxml/tree.h>
+
+/**
+ * @brief Parse all the module configurations in MODULES_CFG_DIR by several threads at once
+ */
+void np_modcache_prefetch(void);
+
+/**
+ * @brief Take the parsed configuration of a module
+ *
+ * @param name Name of the module
+ *
+ * @return Configuration to be freed by the caller, NULL if it was not parsed or the file changed since.
+ */
+xmlDocPtr np_modcache_take(const char* name);
+
+/**
+ * @brief Free the configurations nobody took
+ */
+void np_modcache_cleanup(void);
+
+#endif /* _MODCACHE_H_ */
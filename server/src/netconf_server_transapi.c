@@ -55,6 +55,7 @@
 #include <pthread.h>
 #include <sys/poll.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
@@ -325,196 +326,427 @@ static xmlNodePtr find_node(xmlNodePtr parent, xmlChar* name) {
 	return NULL;
 }
 
-static struct client_struct* sock_connect(const char* address, uint16_t port) {
-	struct client_struct* ret;
+/* CALLHOME LOCK, protects the apps with their servers and clients */
+pthread_mutex_t callhome_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * A single thread connects all the Call Home apps. The connects are
+ * non-blocking and every app races its servers, the next one is tried
+ * CALLHOME_CONNECT_DELAY after the previous one unless it connected
+ * meanwhile. The first connected server wins and its client is passed
+ * to the engine right away.
+ */
+static struct {
+	int epfd;
+	int evfd;							// wakes up the connector on an app or client change
+	int running;
+	volatile int stop;
+	pthread_t thread;
+} connector = {
+	.epfd = -1,
+	.evfd = -1
+};
+
+void np_callhome_wake(void) {
+	if (connector.evfd != -1) {
+		eventfd_write(connector.evfd, 1);
+	}
+}
+
+/* CALLHOME LOCK must be held */
+static void ch_server_close(struct ch_server* srv) {
+	if (srv->sock != -1) {
+		epoll_ctl(connector.epfd, EPOLL_CTL_DEL, srv->sock, NULL);
+		close(srv->sock);
+		srv->sock = -1;
+	}
+}
+
+/* CALLHOME LOCK must be held */
+static void ch_app_close_all(struct ch_app* app) {
+	struct ch_server* srv;
+
+	for (srv = app->servers; srv != NULL; srv = srv->next) {
+		ch_server_close(srv);
+	}
+}
+
+/* CALLHOME LOCK must be held, return: 0 connecting, 1 failed */
+static int ch_server_connect(struct ch_server* srv) {
+	struct sockaddr_storage saddr;
+	socklen_t saddr_len;
+	struct epoll_event ev;
 	int is_ipv4;
 
 	struct sockaddr_in* saddr4;
 	struct sockaddr_in6* saddr6;
 
-	ret = calloc(1, sizeof(struct client_struct));
-	ret->sock = -1;
-
-	if (strchr(address, ':') != NULL) {
+	if (strchr(srv->address, ':') != NULL) {
 		is_ipv4 = 0;
 	} else {
 		is_ipv4 = 1;
 	}
 
-	if ((ret->sock = socket((is_ipv4 ? AF_INET : AF_INET6), SOCK_STREAM, IPPROTO_TCP)) == -1) {
+	bzero(&saddr, sizeof saddr);
+	if (is_ipv4) {
+		saddr4 = (struct sockaddr_in*)&saddr;
+		saddr_len = sizeof(struct sockaddr_in);
+
+		saddr4->sin_family = AF_INET;
+		saddr4->sin_port = htons(srv->port);
+
+		if (inet_pton(AF_INET, srv->address, &saddr4->sin_addr) != 1) {
+			nc_verb_error("%s: failed to convert IPv4 address \"%s\"", __func__, srv->address);
+			return 1;
+		}
+	} else {
+		saddr6 = (struct sockaddr_in6*)&saddr;
+		saddr_len = sizeof(struct sockaddr_in6);
+
+		saddr6->sin6_family = AF_INET6;
+		saddr6->sin6_port = htons(srv->port);
+
+		if (inet_pton(AF_INET6, srv->address, &saddr6->sin6_addr) != 1) {
+			nc_verb_error("%s: failed to convert IPv6 address \"%s\"", __func__, srv->address);
+			return 1;
+		}
+	}
+
+	if ((srv->sock = socket((is_ipv4 ? AF_INET : AF_INET6), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP)) == -1) {
 		nc_verb_error("%s: creating socket failed (%s)", __func__, strerror(errno));
-		goto fail;
+		return 1;
 	}
 
-	if (is_ipv4) {
-		saddr4 = (struct sockaddr_in*)&ret->saddr;
+	if (connect(srv->sock, (struct sockaddr*)&saddr, saddr_len) == -1 && errno != EINPROGRESS) {
+		nc_verb_error("Call Home: could not connect to %s:%u (%s)", srv->address, srv->port, strerror(errno));
+		close(srv->sock);
+		srv->sock = -1;
+		return 1;
+	}
 
-		saddr4->sin_family = AF_INET;
-		saddr4->sin_port = htons(port);
+	/* writable once connected or failed, even if connected already */
+	ev.events = EPOLLOUT;
+	ev.data.fd = srv->sock;
+	if (epoll_ctl(connector.epfd, EPOLL_CTL_ADD, srv->sock, &ev) == -1) {
+		nc_verb_error("%s: epoll_ctl failed (%s)", __func__, strerror(errno));
+		close(srv->sock);
+		srv->sock = -1;
+		return 1;
+	}
 
-		if (inet_pton(AF_INET, address, &saddr4->sin_addr) != 1) {
-			nc_verb_error("%s: failed to convert IPv4 address \"%s\"", __func__, address);
-			goto fail;
+	return 0;
+}
+
+/* CALLHOME LOCK must be held, the attempt failed, wait for the next one */
+static void ch_app_retry(struct ch_app* app, uint64_t now) {
+	ch_app_close_all(app);
+
+	if (++app->attempts >= app->rec_count) {
+		/* reconnect-strategy/count-max reached, start with the next server */
+		app->attempts = 0;
+		app->cur_server = (app->cur_server->next != NULL ? app->cur_server->next : app->servers);
+	}
+
+	app->state = CH_APP_WAIT;
+	app->next_time = now + app->rec_interval * 1000ULL;
+}
+
+/* CALLHOME LOCK must be held, the server won the race */
+static void ch_app_connected(struct ch_app* app, struct ch_server* srv, uint64_t now) {
+	struct client_struct* client;
+	struct ch_server* iter;
+	socklen_t saddr_len;
+	int sock;
+
+	/* keep the socket, close the ones still connecting */
+	epoll_ctl(connector.epfd, EPOLL_CTL_DEL, srv->sock, NULL);
+	sock = srv->sock;
+	srv->sock = -1;
+	ch_app_close_all(app);
+
+	nc_verb_verbose("Call Home: connected to %s:%u", srv->address, srv->port);
+
+	if ((client = np_slab_alloc(NP_SLAB_CLIENT)) == NULL) {
+		close(sock);
+		ch_app_retry(app, now);
+		return;
+	}
+	client->sock = sock;
+	saddr_len = sizeof client->saddr;
+	getpeername(sock, (struct sockaddr*)&client->saddr, &saddr_len);
+	client->transport = app->transport;
+	client->callhome = app;
+
+	app->client = client;
+	app->lingered = 0;
+
+	/* the engine clears app->client once the client is gone */
+	if (np_client_setup(client) != 0) {
+		nc_verb_error("Call Home (app %s) client creation failed.", app->name);
+		app->client = NULL;
+		ch_app_retry(app, now);
+		return;
+	}
+
+	for (iter = app->servers; iter != NULL; iter = iter->next) {
+		iter->active = 0;
+	}
+	srv->active = 1;
+
+	app->state = CH_APP_CONNECTED;
+	app->next_time = now + CALLHOME_PERIODIC_LINGER_CHECK * 1000;
+}
+
+/* CALLHOME LOCK must be held, return: monotonic msecs of the next action of the app, 0 for none */
+static uint64_t ch_app_step(struct ch_app* app, uint64_t now) {
+	struct ch_server* srv;
+	int connecting;
+
+	switch (app->state) {
+	case CH_APP_CONNECTED:
+		if (app->client == NULL) {
+			nc_verb_verbose("Call Home (app %s) disconnected.", app->name);
+
+			/* reconnect-strategy/start-with */
+			for (srv = app->servers; srv != NULL && (!app->start_server || !srv->active); srv = srv->next);
+			app->cur_server = (srv != NULL ? srv : app->servers);
+			app->attempts = 0;
+
+			app->state = CH_APP_WAIT;
+			/* the periodic connection reconnects after the set timeout */
+			app->next_time = now + (app->lingered ? app->rep_timeout * 60000ULL : 0);
+			return app->next_time;
 		}
 
-		if (connect(ret->sock, (struct sockaddr*)saddr4, sizeof(struct sockaddr_in)) == -1) {
-			nc_verb_error("Call Home: could not connect to %s:%u (%s)", address, port, strerror(errno));
-			goto fail;
+		if (!app->connection || app->lingered) {
+			/* persistent connection or a disconnect pending */
+			return 0;
 		}
 
-	} else {
-		saddr6 = (struct sockaddr_in6*)&ret->saddr;
+		/* periodic connection */
+		if (now >= app->next_time) {
+			switch (app->client->transport) {
+#ifdef NP_SSH
+			case NC_TRANSPORT_SSH:
+				app->lingered = np_ssh_chapp_linger_check(app);
+				break;
+#endif
+#ifdef NP_TLS
+			case NC_TRANSPORT_TLS:
+				app->lingered = np_tls_chapp_linger_check(app);
+				break;
+#endif
+			default:
+				nc_verb_error("%s: unknown client transport", __func__);
+			}
+			app->next_time = now + CALLHOME_PERIODIC_LINGER_CHECK * 1000;
+		}
+		return (app->lingered ? 0 : app->next_time);
 
-		saddr6->sin6_family = AF_INET6;
-		saddr6->sin6_port = htons(port);
+	case CH_APP_WAIT:
+		if (quit) {
+			/* no new clients when exiting */
+			return 0;
+		}
+		if (now < app->next_time) {
+			return app->next_time;
+		}
 
-		if (inet_pton(AF_INET6, address, &saddr6->sin6_addr) != 1) {
-			nc_verb_error("%s: failed to convert IPv6 address \"%s\"", __func__, address);
-			goto fail;
+		/* a new attempt, start with the current server */
+		app->state = CH_APP_CONNECT;
+		app->race_server = app->cur_server;
+		app->attempt_end = now + CALLHOME_CONNECT_TIMEOUT * 1000;
+		app->next_time = now;
+		/* fallthrough */
+
+	case CH_APP_CONNECT:
+		if (app->race_server != NULL && now >= app->next_time) {
+			srv = app->race_server;
+			ch_server_connect(srv);
+
+			app->race_server = (srv->next != NULL ? srv->next : app->servers);
+			if (app->race_server == app->cur_server) {
+				/* all the servers tried */
+				app->race_server = NULL;
+			}
+			app->next_time = now + CALLHOME_CONNECT_DELAY;
 		}
 
-		if (connect(ret->sock, (struct sockaddr*)saddr6, sizeof(struct sockaddr_in6)) == -1) {
-			nc_verb_error("Call Home: could not connect %s:%u (%s)",address, port, strerror(errno));
-			goto fail;
+		connecting = 0;
+		for (srv = app->servers; srv != NULL; srv = srv->next) {
+			if (srv->sock != -1) {
+				connecting = 1;
+				break;
+			}
+		}
+
+		if (!connecting && app->race_server != NULL) {
+			/* nothing to wait for, try the next server right away */
+			app->next_time = now;
+			return now;
+		}
+		if (!connecting || now >= app->attempt_end) {
+			nc_verb_verbose("Call Home (app %s) could not connect to any server.", app->name);
+			ch_app_retry(app, now);
+			return app->next_time;
 		}
+
+		if (app->race_server != NULL && app->next_time < app->attempt_end) {
+			return app->next_time;
+		}
+		return app->attempt_end;
 	}
 
-	nc_verb_verbose("Call Home: connected to %s:%u", address, port);
-	return ret;
+	return 0;
+}
 
-fail:
-	if (ret->sock != -1) {
-		close(ret->sock);
+/* CALLHOME LOCK must be held */
+static struct ch_server* ch_server_find(int sock, struct ch_app** app) {
+	struct ch_server* srv;
+
+	for (*app = callhome_apps; *app != NULL; *app = (*app)->next) {
+		for (srv = (*app)->servers; srv != NULL; srv = srv->next) {
+			if (srv->sock == sock) {
+				return srv;
+			}
+		}
 	}
-	free(ret);
+
 	return NULL;
 }
 
-pthread_mutex_t callhome_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t callhome_cond = PTHREAD_COND_INITIALIZER;
-volatile struct ch_app* callhome_app = NULL;
-
-/* each app has its own thread */
-__attribute__((noreturn))
-static void* app_loop(void* app_v) {
-	struct ch_app* app = (struct ch_app*)app_v;
-	struct ch_server* cur_server = NULL;
-	struct timespec ts;
-	int i, ret;
-
-	/* TODO sigmask for the thread? */
-
-	nc_verb_verbose("Starting Call Home thread (%s).", app->name);
-
-	nc_session_transport(app->transport);
-
-	for (;;) {
-		pthread_testcancel();
-
-		/* get last connected server if any */
-		for (cur_server = app->servers; cur_server != NULL && cur_server->active == 0; cur_server = cur_server->next);
-		if (cur_server == NULL) {
-			/*
-			 * first-listed start-with's value is set in config or this is the
-			 * first attempt to connect, so use the first listed server spec
-			 */
-			cur_server = app->servers;
+static void* ch_connector_thread(void* UNUSED(arg)) {
+	struct epoll_event events[CALLHOME_MAX_EVENTS];
+	struct sockaddr_storage saddr;
+	socklen_t len;
+	struct ch_app* app;
+	struct ch_server* srv;
+	uint64_t now, next, app_next;
+	eventfd_t val;
+	int i, n, timeout, err;
+
+	nc_verb_verbose("Starting the Call Home connector thread.");
+
+	/* CALLHOME LOCK */
+	pthread_mutex_lock(&callhome_lock);
+	while (!connector.stop) {
+		now = np_clock_msec();
+		next = 0;
+		for (app = callhome_apps; app != NULL; app = app->next) {
+			app_next = ch_app_step(app, now);
+			if (app_next != 0 && (next == 0 || app_next < next)) {
+				next = app_next;
+			}
+		}
+		/* CALLHOME UNLOCK */
+		pthread_mutex_unlock(&callhome_lock);
+
+		if (next == 0) {
+			timeout = -1;
 		} else {
-			/* remove active flag */
-			cur_server->active = 0;
+			timeout = (next > now ? next - now : 0);
+		}
+		n = epoll_wait(connector.epfd, events, CALLHOME_MAX_EVENTS, timeout);
+		if (n == -1 && errno != EINTR) {
+			nc_verb_error("%s: epoll_wait failed (%s)", __func__, strerror(errno));
 		}
 
-		/* try to connect to a server indefinitely */
-		for (;;) {
-			for (i = 0; i < app->rec_count; ++i) {
-				if ((app->client = sock_connect(cur_server->address, cur_server->port)) != NULL) {
-                    app->client->transport = app->transport;
-					break;
-				}
-				sleep(app->rec_interval);
+		/* CALLHOME LOCK */
+		pthread_mutex_lock(&callhome_lock);
+		now = np_clock_msec();
+		for (i = 0; i < n; ++i) {
+			if (events[i].data.fd == connector.evfd) {
+				eventfd_read(connector.evfd, &val);
+				continue;
 			}
 
-			if (app->client != NULL) {
-				break;
+			/* the server could have been removed meanwhile */
+			if ((srv = ch_server_find(events[i].data.fd, &app)) == NULL) {
+				continue;
 			}
 
-			cur_server = cur_server->next;
-			if (cur_server == NULL) {
-				cur_server = app->servers;
+			len = sizeof err;
+			if (getsockopt(srv->sock, SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+				err = errno;
 			}
-		}
-
-		/* publish the new client for the main application loop to create a new session */
-        /* CALLHOME LOCK */
-        pthread_mutex_lock(&callhome_lock);
-        while (callhome_app) {
-            /* someone else is waiting already, let's wait with them */
-            pthread_cond_wait(&callhome_cond, &callhome_lock);
-        }
-        callhome_app = app;
-
-        while (callhome_app) {
-            /* wait for client thread creation */
-            pthread_cond_wait(&callhome_cond, &callhome_lock);
-        }
-
-        /* CALLHOME UNLOCK */
-        pthread_mutex_unlock(&callhome_lock);
-
-        if (!app->client) {
-            nc_verb_error("Call Home (app %s) client creation failed.", app->name);
-            continue;
-        }
-
-		cur_server->active = 1;
-
-		if (app->connection) {
-			/* periodic connection */
-			while (1) {
-				clock_gettime(CLOCK_REALTIME, &ts);
-				ts.tv_sec += CALLHOME_PERIODIC_LINGER_CHECK;
-				ret = pthread_timedjoin_np(app->client->tid, NULL, &ts);
-				if (ret == 0) {
-					break;
-				} else if (ret == ETIMEDOUT) {
-					switch (app->client->transport) {
-#ifdef NP_SSH
-					case NC_TRANSPORT_SSH:
-						i = np_ssh_chapp_linger_check(app);
-						break;
-#endif
-#ifdef NP_TLS
-					case NC_TRANSPORT_TLS:
-						i =  np_tls_chapp_linger_check(app);
-						break;
-#endif
-					default:
-						nc_verb_error("%s: unknown client transport", __func__);
-					}
-					if (i) {
-						break;
-					}
-				} else {
-					nc_verb_error("Call Home (app %s) client thread timed join failed (%s).", app->name, strerror(ret));
-					app->client->to_free = 1;
-					break;
-				}
+			if (err != 0) {
+				nc_verb_verbose("Call Home: could not connect to %s:%u (%s)", srv->address, srv->port, strerror(err));
+				ch_server_close(srv);
+				continue;
 			}
 
-		} else {
-			/* persistent connection */
-			ret = pthread_join(app->client->tid, NULL);
-			if (ret != 0) {
-				nc_verb_error("Call Home (app %s) client thread join failed (%s).", app->name, strerror(ret));
+			len = sizeof saddr;
+			if (getpeername(srv->sock, (struct sockaddr*)&saddr, &len) == -1) {
+				/* a new socket with the same descriptor, still connecting */
+				continue;
 			}
-		}
-		app->client = NULL;
-		nc_verb_verbose("Call Home (app %s) disconnected.", app->name);
 
-		if (quit) {
-			pthread_exit(NULL);
+			ch_app_connected(app, srv, now);
 		}
 	}
+	/* CALLHOME UNLOCK */
+	pthread_mutex_unlock(&callhome_lock);
+
+	return NULL;
+}
+
+static int ch_connector_start(void) {
+	struct epoll_event ev;
+	int ret;
+
+	if (connector.running) {
+		return EXIT_SUCCESS;
+	}
+
+	if ((connector.epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		nc_verb_error("%s: epoll_create1 failed (%s)", __func__, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if ((connector.evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		nc_verb_error("%s: eventfd failed (%s)", __func__, strerror(errno));
+		goto fail;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.fd = connector.evfd;
+	if (epoll_ctl(connector.epfd, EPOLL_CTL_ADD, connector.evfd, &ev) == -1) {
+		nc_verb_error("%s: epoll_ctl failed (%s)", __func__, strerror(errno));
+		goto fail;
+	}
+
+	connector.stop = 0;
+	if ((ret = pthread_create(&connector.thread, NULL, ch_connector_thread, NULL)) != 0) {
+		nc_verb_error("%s: pthread_create() error (%s)", __func__, strerror(ret));
+		goto fail;
+	}
+	connector.running = 1;
+
+	return EXIT_SUCCESS;
+
+fail:
+	if (connector.evfd != -1) {
+		close(connector.evfd);
+		connector.evfd = -1;
+	}
+	close(connector.epfd);
+	connector.epfd = -1;
+	return EXIT_FAILURE;
+}
+
+static void ch_connector_stop(void) {
+	if (!connector.running) {
+		return;
+	}
+
+	connector.stop = 1;
+	np_callhome_wake();
+	pthread_join(connector.thread, NULL);
+	connector.running = 0;
+
+	close(connector.evfd);
+	connector.evfd = -1;
+	close(connector.epfd);
+	connector.epfd = -1;
 }
 
 static int app_create(xmlNodePtr node, struct nc_err** error, NC_TRANSPORT transport) {
@@ -522,7 +754,6 @@ static int app_create(xmlNodePtr node, struct nc_err** error, NC_TRANSPORT trans
 	struct ch_server* srv, *del_srv;
 	xmlNodePtr auxnode, servernode, childnode;
 	xmlChar* auxstr;
-	int ret;
 
 	new = calloc(1, sizeof(struct ch_app));
 	new->transport = transport;
@@ -550,6 +781,7 @@ static int app_create(xmlNodePtr node, struct nc_err** error, NC_TRANSPORT trans
 			srv->next->prev = srv;
 			srv = srv->next;
 		}
+		srv->sock = -1;
 
 		for (childnode = servernode->children; childnode != NULL; childnode = childnode->next) {
 			if (childnode->type != XML_ELEMENT_NODE) {
@@ -632,13 +864,18 @@ static int app_create(xmlNodePtr node, struct nc_err** error, NC_TRANSPORT trans
 		}
 	}
 
-	ret = pthread_create(&(new->thread), NULL, app_loop, new);
-	if (ret) {
-		nc_verb_error("%s: pthread_create() error (%s)", __func__, strerror(ret));
+	if (ch_connector_start() != EXIT_SUCCESS) {
 		goto fail;
 	}
 
+	/* connect right away, starting with the first listed server */
+	new->state = CH_APP_WAIT;
+	new->cur_server = new->servers;
+	new->next_time = 0;
+
 	/* insert the created app structure into the list */
+	/* CALLHOME LOCK */
+	pthread_mutex_lock(&callhome_lock);
 	if (!callhome_apps) {
 		callhome_apps = new;
 		callhome_apps->next = NULL;
@@ -649,6 +886,10 @@ static int app_create(xmlNodePtr node, struct nc_err** error, NC_TRANSPORT trans
 		callhome_apps->prev = new;
 		callhome_apps = new;
 	}
+	/* CALLHOME UNLOCK */
+	pthread_mutex_unlock(&callhome_lock);
+
+	np_callhome_wake();
 
 	return EXIT_SUCCESS;
 
@@ -690,8 +931,8 @@ static int app_rm(const char* name, NC_TRANSPORT transport) {
 		return EXIT_FAILURE;
 	}
 
-	pthread_cancel(app->thread);
-	pthread_join(app->thread, NULL);
+	/* CALLHOME LOCK */
+	pthread_mutex_lock(&callhome_lock);
 
 	if (app->prev) {
 		app->prev->next = app->next;
@@ -704,31 +945,43 @@ static int app_rm(const char* name, NC_TRANSPORT transport) {
 		app->prev->next = NULL;
 	}
 
+	/* the connector does not know about the app anymore */
 	for (srv = app->servers; srv != NULL;) {
 		del_srv = srv;
 		srv = srv->next;
+		ch_server_close(del_srv);
 		free(del_srv->address);
 		free(del_srv);
 	}
 
 	/* a valid client running, mark it for deletion */
-	if (app->client != NULL && !quit) {
-		switch (app->client->transport) {
+	if (app->client != NULL) {
+		app->client->callhome = NULL;
+		if (!quit) {
+			switch (app->client->transport) {
 #ifdef NP_SSH
-		case NC_TRANSPORT_SSH:
-			((struct client_struct_ssh*)app->client)->ssh_chans->to_free = 1;
-			break;
+			case NC_TRANSPORT_SSH:
+				if (((struct client_struct_ssh*)app->client)->ssh_chans != NULL) {
+					((struct client_struct_ssh*)app->client)->ssh_chans->to_free = 1;
+				} else {
+					app->client->to_free = 1;
+				}
+				break;
 #endif
 #ifdef NP_TLS
-		case NC_TRANSPORT_TLS:
-			app->client->to_free = 1;
-			break;
+			case NC_TRANSPORT_TLS:
+				app->client->to_free = 1;
+				break;
 #endif
-		default:
-			nc_verb_error("%s: internal error (%s:%d)", __func__, __FILE__, __LINE__);
-			app->client->to_free = 1;
+			default:
+				nc_verb_error("%s: internal error (%s:%d)", __func__, __FILE__, __LINE__);
+				app->client->to_free = 1;
+			}
+			np_engine_kick(app->client);
 		}
 	}
+	/* CALLHOME UNLOCK */
+	pthread_mutex_unlock(&callhome_lock);
 
 	free(app->name);
 	free(app);
@@ -818,6 +1071,7 @@ void server_transapi_close(void) {
 	while (callhome_apps != NULL) {
 		app_rm(callhome_apps->name, callhome_apps->transport);
 	}
+	ch_connector_stop();
 }
 
 /*
@@ -865,9 +1119,20 @@ struct transapi_rpc_callbacks server_rpc_clbks = {
 	}
 };
 
+/* libnetconf calls it from ncds_device_init() */
+static int server_transapi_init_profiled(xmlDocPtr* running) {
+	int ret, prof;
+
+	prof = np_profile_begin("transapi-init", NCSERVER_MODULE_NAME);
+	ret = server_transapi_init(running);
+	np_profile_end(prof);
+
+	return ret;
+}
+
 struct transapi server_transapi = {
 	.version = 6,
-	.init = server_transapi_init,
+	.init = server_transapi_init_profiled,
 	.close = server_transapi_close,
 	.get_state = server_get_state_data,
 	.clbks_order = TRANSAPI_CLBCKS_LEAF_TO_ROOT,
@@ -48,6 +48,11 @@ struct np_bind_addr {
 	struct np_bind_addr* next;
 };
 
+/* Call Home app connector states */
+#define CH_APP_WAIT 0		/* waiting for the next connection attempt */
+#define CH_APP_CONNECT 1	/* connecting to the servers */
+#define CH_APP_CONNECTED 2	/* the client is running */
+
 struct ch_app {
 	NC_TRANSPORT transport;
 	char* name;
@@ -55,6 +60,7 @@ struct ch_app {
 		char* address;
 		uint16_t port;
 		uint8_t active;
+		int sock;                   /* connect in progress, -1 if none */
 		struct ch_server* next;
 		struct ch_server* prev;
 	} *servers;
@@ -64,12 +70,24 @@ struct ch_app {
 	uint8_t connection;   /* 0 persistent, 1 periodic */
 	uint8_t rep_timeout;        /* connection-type/periodic/timeout-mins */
 	uint8_t rep_linger;         /* connection-type/periodic/linger-secs */
-	pthread_t thread;
+	/* connector state, protected by CALLHOME LOCK */
+	uint8_t state;              /* CH_APP_* */
+	uint8_t lingered;           /* the periodic connection was closed for inactivity */
+	uint8_t attempts;           /* failed attempts starting with cur_server */
+	uint64_t next_time;         /* monotonic msecs of the next connector action */
+	uint64_t attempt_end;       /* monotonic msecs when the current attempt fails */
+	struct ch_server* cur_server;   /* server the attempts start with */
+	struct ch_server* race_server;  /* next server to connect to in this attempt, NULL if none */
 	struct client_struct* client;
 	struct ch_app *next;
 	struct ch_app *prev;
 };
 
+/**
+ * @brief Wake up the Call Home connector, the client of an app is gone
+ */
+void np_callhome_wake(void);
+
 int callback_srv_netconf_srv_call_home_srv_applications_srv_application(XMLDIFF_OP op, xmlNodePtr old_node, xmlNodePtr new_node, struct nc_err** error, NC_TRANSPORT transport);
 
 int callback_srv_netconf_srv_listen_srv_port(XMLDIFF_OP op, xmlNodePtr old_node, xmlNodePtr new_node, struct nc_err** error, NC_TRANSPORT transport);
@@ -0,0 +1,450 @@
+/**
+ * @file notif.c
+ * @brief Netopeer server notification dispatcher
+ *
+ * Copyright (C) 2015 CESNET, z.s.p.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of the Company nor the names of its contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * ALTERNATIVELY, provided that this notice is retained in full, this
+ * product may be distributed under the terms of the GNU General Public
+ * License (GPL) version 2 or later, in which case the provisions
+ * of the GPL apply INSTEAD OF those given above.
+ *
+ * This software is provided ``as is, and any express or implied
+ * warranties, including, but not limited to, the implied warranties of
+ * merchantability and fitness for a particular purpose are disclaimed.
+ * In no event shall the company or contributors be liable for any
+ * direct, indirect, incidental, special, exemplary, or consequential
+ * damages (including, but not limited to, procurement of substitute
+ * goods or services; loss of use, data, or profits; or business
+ * interruption) however caused and on any theory of liability, whether
+ * in contract, strict liability, or tort (including negligence or
+ * otherwise) arising in any way out of the use of this software, even
+ * if advised of the possibility of such damage.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include <libnetconf_xml.h>
+
+#include "server.h"
+
+static const char rcsid[] __attribute__((used)) ="$Id: "__FILE__": "RCSID" $";
+
+/* an event read from a stream, shared by all its subscribers */
+struct notif_event {
+	nc_ntf* ntf;
+	time_t time;
+	size_t len;								// of the content, to tell whether it can be sent without blocking
+	unsigned int refs;						// protected by the dispatcher lock
+};
+
+struct notif_stream;
+
+struct np_subscriber {
+	struct client_struct* client;
+	struct nc_session* session;
+	volatile int* to_free;
+	struct notif_stream* stream;
+	time_t since;							// events older than the subscription are not sent
+
+	/* bounded send queue */
+	struct notif_event* queue[NOTIF_QUEUE_SIZE];
+	unsigned int head;
+	unsigned int count;
+	time_t full_since;						// 0 if the queue is not full
+	int stalled;							// the session is being disconnected
+
+	struct np_subscriber* prev;
+	struct np_subscriber* next;
+};
+
+struct notif_stream {
+	char* name;
+	time_t start;
+	int iterating;							// only the dispatcher thread touches the iterator
+	struct np_subscriber* subs;
+	struct notif_stream* next;
+};
+
+/*
+ * A single thread reads every stream with at least one subscriber and
+ * distributes the events into the send queues of the subscribers. The
+ * notifications are then sent by the engine from the threads processing
+ * the clients. A stream is read only as fast as its slowest subscriber
+ * takes the events, the ones not read yet wait in the stream itself.
+ */
+static struct {
+	/* DISPATCHER LOCK */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int running;
+	int stop;
+	struct notif_stream* streams;
+} dispatcher = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER
+};
+
+/* DISPATCHER LOCK must be held */
+static void notif_event_put(struct notif_event* event) {
+	if (--event->refs == 0) {
+		ncntf_notif_free(event->ntf);
+		free(event);
+	}
+}
+
+/* DISPATCHER LOCK must be held, return: number of the events read */
+static unsigned int notif_stream_read(struct notif_stream* stream, time_t now) {
+	struct notif_event* events[NOTIF_QUEUE_SIZE], *event;
+	struct np_subscriber* sub;
+	unsigned int room, count, i;
+	char* content;
+	time_t event_time;
+
+	/* read only as many events as the slowest subscriber can take */
+	room = NOTIF_QUEUE_SIZE;
+	for (sub = stream->subs; sub != NULL; sub = sub->next) {
+		if (sub->stalled) {
+			continue;
+		}
+
+		if (sub->count < NOTIF_QUEUE_SIZE) {
+			sub->full_since = 0;
+		} else if (sub->full_since == 0) {
+			sub->full_since = now;
+		} else if (now - sub->full_since >= NOTIF_STALL_TIMEOUT) {
+			nc_verb_warning("Session %s does not take its notifications, disconnecting.", nc_session_get_id(sub->session));
+			sub->stalled = 1;
+			*sub->to_free = 1;
+			np_engine_kick(sub->client);
+			continue;
+		}
+
+		if (NOTIF_QUEUE_SIZE - sub->count < room) {
+			room = NOTIF_QUEUE_SIZE - sub->count;
+		}
+	}
+
+	/* the stream is not freed by anyone else, read it unlocked */
+	/* DISPATCHER UNLOCK */
+	pthread_mutex_unlock(&dispatcher.lock);
+
+	count = 0;
+	while (count < room && (content = ncntf_stream_iter_next(stream->name, stream->start, -1, &event_time)) != NULL) {
+		if ((event = calloc(1, sizeof *event)) == NULL || (event->ntf = ncntf_notif_create(event_time, content)) == NULL) {
+			nc_verb_error("%s: failed to create a notification from the stream \"%s\"", __func__, stream->name);
+			free(event);
+			free(content);
+			continue;
+		}
+		event->len = strlen(content);
+		free(content);
+
+		event->time = event_time;
+		events[count++] = event;
+	}
+
+	/* DISPATCHER LOCK */
+	pthread_mutex_lock(&dispatcher.lock);
+
+	for (i = 0; i < count; ++i) {
+		for (sub = stream->subs; sub != NULL; sub = sub->next) {
+			if (sub->stalled || events[i]->time < sub->since || sub->count == NOTIF_QUEUE_SIZE) {
+				continue;
+			}
+
+			sub->queue[(sub->head + sub->count) % NOTIF_QUEUE_SIZE] = events[i];
+			++sub->count;
+			++events[i]->refs;
+		}
+
+		if (events[i]->refs == 0) {
+			ncntf_notif_free(events[i]->ntf);
+			free(events[i]);
+		}
+	}
+
+	if (count > 0) {
+		for (sub = stream->subs; sub != NULL; sub = sub->next) {
+			if (sub->count > 0 && !sub->stalled) {
+				np_engine_kick(sub->client);
+			}
+		}
+	}
+
+	return count;
+}
+
+static void* notif_dispatcher_thread(void* UNUSED(arg)) {
+	struct notif_stream* stream, **stream_p;
+	struct timespec ts;
+	unsigned int read;
+
+	/* DISPATCHER LOCK */
+	pthread_mutex_lock(&dispatcher.lock);
+
+	while (!dispatcher.stop) {
+		read = 0;
+		for (stream_p = &dispatcher.streams; *stream_p != NULL;) {
+			stream = *stream_p;
+
+			if (stream->subs == NULL) {
+				/* the last subscriber left */
+				if (stream->iterating) {
+					ncntf_stream_iter_finish(stream->name);
+				}
+				*stream_p = stream->next;
+				free(stream->name);
+				free(stream);
+				continue;
+			}
+
+			if (!stream->iterating) {
+				ncntf_stream_iter_start(stream->name);
+				stream->iterating = 1;
+			}
+
+			read += notif_stream_read(stream, time(NULL));
+			stream_p = &stream->next;
+		}
+
+		if (read == 0) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += NOTIF_READ_INTERVAL * 1000000L;
+			ts.tv_sec += ts.tv_nsec / 1000000000L;
+			ts.tv_nsec %= 1000000000L;
+			pthread_cond_timedwait(&dispatcher.cond, &dispatcher.lock, &ts);
+		}
+	}
+
+	while ((stream = dispatcher.streams) != NULL) {
+		if (stream->iterating) {
+			ncntf_stream_iter_finish(stream->name);
+		}
+		dispatcher.streams = stream->next;
+		free(stream->name);
+		free(stream);
+	}
+
+	/* DISPATCHER UNLOCK */
+	pthread_mutex_unlock(&dispatcher.lock);
+
+	return NULL;
+}
+
+struct np_subscriber* np_notif_subscribe(struct client_struct* client, struct nc_session* session, volatile int* to_free, const nc_rpc* subscribe_rpc) {
+	struct np_subscriber* sub;
+	struct notif_stream* stream;
+	xmlNodePtr op, node;
+	char* stream_name = NULL;
+	int ret;
+
+	if ((op = ncxml_rpc_get_op_content(subscribe_rpc)) == NULL) {
+		return NULL;
+	}
+
+	for (node = op->children; node != NULL; node = node->next) {
+		if (node->type != XML_ELEMENT_NODE) {
+			continue;
+		}
+
+		if (xmlStrEqual(node->name, BAD_CAST "stream")) {
+			free(stream_name);
+			stream_name = (char*)xmlNodeGetContent(node);
+		} else {
+			/* filter, startTime, stopTime */
+			free(stream_name);
+			xmlFreeNodeList(op);
+			return NULL;
+		}
+	}
+	xmlFreeNodeList(op);
+
+	if ((sub = calloc(1, sizeof *sub)) == NULL) {
+		free(stream_name);
+		return NULL;
+	}
+	sub->client = client;
+	sub->session = session;
+	sub->to_free = to_free;
+	sub->since = time(NULL);
+
+	/* DISPATCHER LOCK */
+	pthread_mutex_lock(&dispatcher.lock);
+
+	for (stream = dispatcher.streams; stream != NULL; stream = stream->next) {
+		if (strcmp(stream->name, (stream_name ? stream_name : "NETCONF")) == 0) {
+			break;
+		}
+	}
+	if (stream == NULL) {
+		if ((stream = calloc(1, sizeof *stream)) == NULL || (stream->name = strdup(stream_name ? stream_name : "NETCONF")) == NULL) {
+			/* DISPATCHER UNLOCK */
+			pthread_mutex_unlock(&dispatcher.lock);
+			free(stream);
+			free(stream_name);
+			free(sub);
+			return NULL;
+		}
+		stream->start = sub->since;
+		stream->next = dispatcher.streams;
+		dispatcher.streams = stream;
+	}
+	free(stream_name);
+
+	sub->stream = stream;
+	sub->next = stream->subs;
+	if (stream->subs != NULL) {
+		stream->subs->prev = sub;
+	}
+	stream->subs = sub;
+
+	if (!dispatcher.running) {
+		dispatcher.stop = 0;
+		if ((ret = pthread_create(&dispatcher.thread, NULL, notif_dispatcher_thread, NULL)) != 0) {
+			nc_verb_error("%s: failed to create the notification dispatcher (%s)", __func__, strerror(ret));
+			stream->subs = sub->next;
+			if (stream->subs != NULL) {
+				stream->subs->prev = NULL;
+			}
+			/* DISPATCHER UNLOCK */
+			pthread_mutex_unlock(&dispatcher.lock);
+			free(sub);
+			return NULL;
+		}
+		dispatcher.running = 1;
+	}
+
+	/* DISPATCHER UNLOCK */
+	pthread_mutex_unlock(&dispatcher.lock);
+
+	return sub;
+}
+
+int np_notif_send(struct np_subscriber* sub, size_t* room) {
+	struct notif_event* event = NULL;
+	int sent = 0;
+
+	/* DISPATCHER LOCK */
+	pthread_mutex_lock(&dispatcher.lock);
+
+	while (sub->count > 0 && !sub->stalled) {
+		event = sub->queue[sub->head];
+		if (room != NULL) {
+			/* the envelope and the framing fit into the spare room */
+			if (event->len + SEND_INLINE_ROOM > *room) {
+				break;
+			}
+			*room -= event->len;
+		}
+		sub->head = (sub->head + 1) % NOTIF_QUEUE_SIZE;
+		--sub->count;
+
+		/* DISPATCHER UNLOCK */
+		pthread_mutex_unlock(&dispatcher.lock);
+
+		if (room == NULL) {
+			/* an engine helper, every notification must be taken by the client in time */
+			np_engine_step_deadline(np_clock_msec() + REPLY_WRITE_TIMEOUT);
+		}
+		nc_session_send_notif(sub->session, event->ntf);
+		sent = 1;
+
+		/* DISPATCHER LOCK */
+		pthread_mutex_lock(&dispatcher.lock);
+
+		notif_event_put(event);
+	}
+
+	if (sent) {
+		/* there is some room for more events now */
+		pthread_cond_signal(&dispatcher.cond);
+	}
+
+	/* DISPATCHER UNLOCK */
+	pthread_mutex_unlock(&dispatcher.lock);
+
+	return sent;
+}
+
+unsigned int np_notif_queue_depth(const struct np_subscriber* sub) {
+	unsigned int count;
+
+	/* DISPATCHER LOCK */
+	pthread_mutex_lock(&dispatcher.lock);
+
+	count = sub->count;
+
+	/* DISPATCHER UNLOCK */
+	pthread_mutex_unlock(&dispatcher.lock);
+
+	return count;
+}
+
+void np_notif_unsubscribe(struct np_subscriber* sub) {
+	if (sub == NULL) {
+		return;
+	}
+
+	/* DISPATCHER LOCK */
+	pthread_mutex_lock(&dispatcher.lock);
+
+	if (sub->prev == NULL) {
+		sub->stream->subs = sub->next;
+	} else {
+		sub->prev->next = sub->next;
+	}
+	if (sub->next != NULL) {
+		sub->next->prev = sub->prev;
+	}
+
+	while (sub->count > 0) {
+		notif_event_put(sub->queue[sub->head]);
+		sub->head = (sub->head + 1) % NOTIF_QUEUE_SIZE;
+		--sub->count;
+	}
+
+	/* DISPATCHER UNLOCK */
+	pthread_mutex_unlock(&dispatcher.lock);
+
+	free(sub);
+}
+
+void np_notif_cleanup(void) {
+	/* DISPATCHER LOCK */
+	pthread_mutex_lock(&dispatcher.lock);
+
+	if (!dispatcher.running) {
+		/* DISPATCHER UNLOCK */
+		pthread_mutex_unlock(&dispatcher.lock);
+		return;
+	}
+	dispatcher.stop = 1;
+	pthread_cond_signal(&dispatcher.cond);
+
+	/* DISPATCHER UNLOCK */
+	pthread_mutex_unlock(&dispatcher.lock);
+
+	pthread_join(dispatcher.thread, NULL);
+	dispatcher.running = 0;
+}
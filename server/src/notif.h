@@ -0,0 +1,99 @@
+/**
+ * @file notif.h
+ * @brief Netopeer server notification dispatcher header
+ *
+ * Copyright (C) 2015 CESNET, z.s.p.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of the Company nor the names of its contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * ALTERNATIVELY, provided that this notice is retained in full, this
+ * product may be distributed under the terms of the GNU General Public
+ * License (GPL) version 2 or later, in which case the provisions
+ * of the GPL apply INSTEAD OF those given above.
+ *
+ * This software is provided ``as is, and any express or implied
+ * warranties, including, but not limited to, the implied warranties of
+ * merchantability and fitness for a particular purpose are disclaimed.
+ * In no event shall the company or contributors be liable for any
+ * direct, indirect, incidental, special, exemplary, or consequential
+ * damages (including, but not limited to, procurement of substitute
+ * goods or services; loss of use, data, or profits; or business
+ * interruption) however caused and on any theory of liability, whether
+ * in contract, strict liability, or tort (including negligence or
+ * otherwise) arising in any way out of the use of this software, even
+ * if advised of the possibility of such damage.
+ */
+
+#ifndef _NOTIF_H_
+#define _NOTIF_H_
+
+#include <stddef.h>
+#include <libnetconf.h>
+
+struct client_struct;
+struct np_subscriber;
+
+/**
+ * @brief Subscribe a session to the shared notification dispatcher
+ *
+ * Only subscriptions to the live events of a stream are handled by the
+ * dispatcher, the ones with a filter, startTime or stopTime must be
+ * processed by ncntf_dispatch_send().
+ *
+ * The client gets kicked whenever there are notifications to send. It
+ * must not be freed until np_notif_unsubscribe() is called.
+ *
+ * @param client Client of the session
+ * @param session Subscribed session
+ * @param to_free Flag to set if the session stops receiving notifications
+ * @param subscribe_rpc Valid create-subscription RPC
+ *
+ * @return Subscriber, NULL if the subscription cannot be handled by the dispatcher.
+ */
+struct np_subscriber* np_notif_subscribe(struct client_struct* client, struct nc_session* session, volatile int* to_free, const nc_rpc* subscribe_rpc);
+
+/**
+ * @brief Send the notifications queued for a subscriber
+ *
+ * @param sub Subscriber
+ * @param room Number of bytes the transport can take without blocking, only
+ * the notifications fitting into it are sent and it is decreased by them. NULL
+ * for an engine helper to send all of them.
+ *
+ * @return 1 if anything was sent, 0 otherwise.
+ */
+int np_notif_send(struct np_subscriber* sub, size_t* room);
+
+/**
+ * @brief Remove a subscriber, must be called before its session is freed
+ *
+ * @param sub Subscriber, can be NULL
+ */
+void np_notif_unsubscribe(struct np_subscriber* sub);
+
+/**
+ * @brief Get the number of notifications waiting in the queue of a subscriber
+ *
+ * @param sub Subscriber
+ *
+ * @return Queue length, it may change at any moment.
+ */
+unsigned int np_notif_queue_depth(const struct np_subscriber* sub);
+
+/**
+ * @brief Stop the dispatcher, there must be no subscribers left
+ */
+void np_notif_cleanup(void);
+
+#endif /* _NOTIF_H_ */
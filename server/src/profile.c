@@ -0,0 +1,291 @@
+/**
+ * @file profile.c
+ * @brief Netopeer server startup and reload profiling
+ *
+ *
+ * Copyright (C) 2015 CESNET, z.s.p.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of the Company nor the names of its contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * ALTERNATIVELY, provided that this notice is retained in full, this
+ * product may be distributed under the terms of the GNU General Public
+ * License (GPL) version 2 or later, in which case the provisions
+ * of the GPL apply INSTEAD OF those given above.
+ *
+ * This software is provided ``as is, and any express or implied
+ * warranties, including, but not limited to, the implied warranties of
+ * merchantability and fitness for a particular purpose are disclaimed.
+ * In no event shall the company or contributors be liable for any
+ * direct, indirect, incidental, special, exemplary, or consequential
+ * damages (including, but not limited to, procurement of substitute
+ * goods or services; loss of use, data, or profits; or business
+ * interruption) however caused and on any theory of liability, whether
+ * in contract, strict liability, or tort (including negligence or
+ * otherwise) arising in any way out of the use of this software, even
+ * if advised of the possibility of such damage.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <libxml/tree.h>
+
+#include "server.h"
+
+static const char rcsid[] __attribute__((used)) ="$Id: "__FILE__": "RCSID" $";
+
+struct profile_phase {
+	const char* name;
+	char* module;
+	unsigned int depth;					// number of the enclosing phases
+	struct timespec wall_start;
+	struct timespec cpu_start;
+	unsigned long long start_usec;		// since the (re)start
+	unsigned long long wall_usec;
+	unsigned long long cpu_usec;		// of the thread running the phase
+	int running;
+};
+
+/*
+ * Only the main thread starts and finishes the phases, the lock
+ * protects them from the state data requests during a soft restart.
+ */
+static struct {
+	char* path;							// NULL when not profiling
+	int soft;
+	unsigned int depth;
+	struct profile_phase* phases;
+	unsigned int count;
+	unsigned int size;
+	pthread_mutex_t lock;
+} profile = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static unsigned long long profile_usec(const struct timespec* start, const struct timespec* end) {
+	return (end->tv_sec - start->tv_sec) * 1000000ULL + end->tv_nsec / 1000 - start->tv_nsec / 1000;
+}
+
+void np_profile_enable(const char* path) {
+	free(profile.path);
+	profile.path = strdup(path);
+}
+
+void np_profile_start(int soft) {
+	unsigned int i;
+
+	if (profile.path == NULL) {
+		return;
+	}
+
+	/* PROFILE LOCK */
+	pthread_mutex_lock(&profile.lock);
+
+	for (i = 0; i < profile.count; ++i) {
+		free(profile.phases[i].module);
+	}
+	profile.count = 0;
+	profile.depth = 0;
+	profile.soft = soft;
+
+	/* PROFILE UNLOCK */
+	pthread_mutex_unlock(&profile.lock);
+
+	/* always the first phase, all the others are nested in it */
+	np_profile_begin("startup", NULL);
+}
+
+int np_profile_begin(const char* name, const char* module) {
+	struct profile_phase* phase;
+	void* new_phases;
+	int ret;
+
+	if (profile.path == NULL) {
+		return -1;
+	}
+
+	/* PROFILE LOCK */
+	pthread_mutex_lock(&profile.lock);
+
+	if (profile.count == profile.size) {
+		if ((new_phases = realloc(profile.phases, (profile.size + 32) * sizeof *profile.phases)) == NULL) {
+			nc_verb_error("%s: memory allocation failed (%s)", __func__, strerror(errno));
+			/* PROFILE UNLOCK */
+			pthread_mutex_unlock(&profile.lock);
+			return -1;
+		}
+		profile.phases = new_phases;
+		profile.size += 32;
+	}
+
+	ret = profile.count++;
+	phase = &profile.phases[ret];
+	phase->name = name;
+	phase->module = (module == NULL ? NULL : strdup(module));
+	phase->depth = profile.depth++;
+	phase->wall_usec = 0;
+	phase->cpu_usec = 0;
+	phase->running = 1;
+	clock_gettime(CLOCK_MONOTONIC, &phase->wall_start);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &phase->cpu_start);
+	phase->start_usec = (ret == 0 ? 0 : profile_usec(&profile.phases[0].wall_start, &phase->wall_start));
+
+	/* PROFILE UNLOCK */
+	pthread_mutex_unlock(&profile.lock);
+
+	return ret;
+}
+
+void np_profile_end(int phase) {
+	struct timespec wall, cpu;
+	struct profile_phase* p;
+
+	if (phase < 0) {
+		return;
+	}
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+	clock_gettime(CLOCK_MONOTONIC, &wall);
+
+	/* PROFILE LOCK */
+	pthread_mutex_lock(&profile.lock);
+
+	/* the phases were forgotten meanwhile */
+	if ((unsigned int)phase < profile.count && profile.phases[phase].running) {
+		p = &profile.phases[phase];
+		p->wall_usec = profile_usec(&p->wall_start, &wall);
+		p->cpu_usec = profile_usec(&p->cpu_start, &cpu);
+		p->running = 0;
+		--profile.depth;
+	}
+
+	/* PROFILE UNLOCK */
+	pthread_mutex_unlock(&profile.lock);
+}
+
+static void profile_json_string(FILE* f, const char* str) {
+	if (str == NULL) {
+		fputs("null", f);
+		return;
+	}
+
+	fputc('"', f);
+	for (; *str; ++str) {
+		if (*str == '"' || *str == '\\') {
+			fputc('\\', f);
+			fputc(*str, f);
+		} else if ((unsigned char)*str < 0x20) {
+			fprintf(f, "\\u%04x", (unsigned char)*str);
+		} else {
+			fputc(*str, f);
+		}
+	}
+	fputc('"', f);
+}
+
+void np_profile_report(void) {
+	struct profile_phase* p;
+	char timestr[32];
+	struct tm tm;
+	time_t now;
+	unsigned int i;
+	FILE* f;
+
+	if (profile.path == NULL || profile.count == 0) {
+		return;
+	}
+
+	np_profile_end(0);
+
+	if ((f = fopen(profile.path, "a")) == NULL) {
+		nc_verb_error("%s: opening \"%s\" failed (%s)", __func__, profile.path, strerror(errno));
+		return;
+	}
+
+	now = time(NULL);
+	strftime(timestr, sizeof timestr, "%Y-%m-%dT%H:%M:%S%z", localtime_r(&now, &tm));
+
+	/* PROFILE LOCK */
+	pthread_mutex_lock(&profile.lock);
+
+	fprintf(f, "{\"time\":\"%s\",\"soft-restart\":%s,\"phases\":[", timestr, profile.soft ? "true" : "false");
+	for (i = 0; i < profile.count; ++i) {
+		p = &profile.phases[i];
+		fprintf(f, "%s{\"phase\":", (i ? "," : ""));
+		profile_json_string(f, p->name);
+		fputs(",\"module\":", f);
+		profile_json_string(f, p->module);
+		fprintf(f, ",\"depth\":%u,\"start-usec\":%llu,\"wall-usec\":%llu,\"cpu-usec\":%llu}",
+				p->depth, p->start_usec, p->wall_usec, p->cpu_usec);
+	}
+	fputs("]}\n", f);
+
+	/* PROFILE UNLOCK */
+	pthread_mutex_unlock(&profile.lock);
+
+	if (fclose(f) != 0) {
+		nc_verb_error("%s: writing \"%s\" failed (%s)", __func__, profile.path, strerror(errno));
+	}
+}
+
+static void profile_add_ulong(xmlNodePtr parent, xmlNsPtr ns, const char* name, unsigned long long value) {
+	char str[24];
+
+	snprintf(str, sizeof str, "%llu", value);
+	xmlNewChild(parent, ns, BAD_CAST name, BAD_CAST str);
+}
+
+xmlNodePtr np_profile_state(xmlNsPtr ns) {
+	xmlNodePtr profile_node, node;
+	struct profile_phase* p;
+	unsigned int i;
+
+	if (profile.path == NULL) {
+		return NULL;
+	}
+
+	profile_node = xmlNewNode(ns, BAD_CAST "startup-profile");
+
+	/* PROFILE LOCK */
+	pthread_mutex_lock(&profile.lock);
+
+	xmlNewChild(profile_node, ns, BAD_CAST "soft-restart", BAD_CAST (profile.soft ? "true" : "false"));
+	for (i = 0; i < profile.count; ++i) {
+		p = &profile.phases[i];
+		if (p->running) {
+			/* still (re)starting */
+			continue;
+		}
+		node = xmlNewChild(profile_node, ns, BAD_CAST "phase", NULL);
+		profile_add_ulong(node, ns, "index", i);
+		xmlNewChild(node, ns, BAD_CAST "name", BAD_CAST p->name);
+		if (p->module != NULL) {
+			xmlNewTextChild(node, ns, BAD_CAST "module", BAD_CAST p->module);
+		}
+		profile_add_ulong(node, ns, "depth", p->depth);
+		profile_add_ulong(node, ns, "start-usec", p->start_usec);
+		profile_add_ulong(node, ns, "wall-usec", p->wall_usec);
+		profile_add_ulong(node, ns, "cpu-usec", p->cpu_usec);
+	}
+
+	/* PROFILE UNLOCK */
+	pthread_mutex_unlock(&profile.lock);
+
+	return profile_node;
+}
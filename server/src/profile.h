@@ -0,0 +1,89 @@
+/**
+ * @file profile.h
+ * @brief Netopeer server startup and reload profiling
+ *
+ *
+ * Copyright (C) 2015 CESNET, z.s.p.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of the Company nor the names of its contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * ALTERNATIVELY, provided that this notice is retained in full, this
+ * product may be distributed under the terms of the GNU General Public
+ * License (GPL) version 2 or later, in which case the provisions
+ * of the GPL apply INSTEAD OF those given above.
+ *
+ * This software is provided ``as is, and any express or implied
+ * warranties, including, but not limited to, the implied warranties of
+ * merchantability and fitness for a particular purpose are disclaimed.
+ * In no event shall the company or contributors be liable for any
+ * direct, indirect, incidental, special, exemplary, or consequential
+ * damages (including, but not limited to, procurement of substitute
+ * goods or services; loss of use, data, or profits; or business
+ * interruption) however caused and on any theory of liability, whether
+ * in contract, strict liability, or tort (including negligence or
+ * otherwise) arising in any way out of the use of this software, even
+ * if advised of the possibility of such damage.
+ */
+
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#include <libxml/tree.h>
+
+/**
+ * @brief Enable the profiling, the phases are recorded only afterwards
+ *
+ * @param path File the reports are appended to as JSON lines
+ */
+void np_profile_enable(const char* path);
+
+/**
+ * @brief Forget the phases of the previous (re)start and start the startup phase
+ *
+ * @param soft Whether it is a soft restart
+ */
+void np_profile_start(int soft);
+
+/**
+ * @brief Start a phase, the phases started meanwhile are nested in it
+ *
+ * @param name Name of the phase
+ * @param module Module or model the phase is for, NULL if none
+ *
+ * @return Phase identifier for np_profile_end(), -1 if not profiling.
+ */
+int np_profile_begin(const char* name, const char* module);
+
+/**
+ * @brief Finish a phase
+ *
+ * @param phase Phase identifier returned by np_profile_begin()
+ */
+void np_profile_end(int phase);
+
+/**
+ * @brief Finish the startup phase and append the report, the phases are kept for the state data
+ */
+void np_profile_report(void);
+
+/**
+ * @brief Build the startup profile state data subtree
+ *
+ * @param ns Namespace of the created nodes
+ *
+ * @return startup-profile node, NULL if not profiling or on error.
+ */
+xmlNodePtr np_profile_state(xmlNsPtr ns);
+
+#endif /* _PROFILE_H_ */
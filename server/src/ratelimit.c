@@ -0,0 +1,321 @@
+/**
+ * @file ratelimit.c
+ * @brief Netopeer server rate limits
+ *
+ * Copyright (C) 2015 CESNET, z.s.p.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of the Company nor the names of its contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * ALTERNATIVELY, provided that this notice is retained in full, this
+ * product may be distributed under the terms of the GNU General Public
+ * License (GPL) version 2 or later, in which case the provisions
+ * of the GPL apply INSTEAD OF those given above.
+ *
+ * This software is provided ``as is, and any express or implied
+ * warranties, including, but not limited to, the implied warranties of
+ * merchantability and fitness for a particular purpose are disclaimed.
+ * In no event shall the company or contributors be liable for any
+ * direct, indirect, incidental, special, exemplary, or consequential
+ * damages (including, but not limited to, procurement of substitute
+ * goods or services; loss of use, data, or profits; or business
+ * interruption) however caused and on any theory of liability, whether
+ * in contract, strict liability, or tort (including negligence or
+ * otherwise) arising in any way out of the use of this software, even
+ * if advised of the possibility of such damage.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "server.h"
+
+static const char rcsid[] __attribute__((used)) ="$Id: "__FILE__": "RCSID" $";
+
+extern struct np_options netopeer_options;
+
+/* kinds of the limited keys */
+#define RATELIMIT_ADDRESS 0
+#define RATELIMIT_USER 1
+#define RATELIMIT_SESSION 2
+#define RATELIMIT_KINDS 3
+
+/*
+ * Token bucket of a single key. A bucket holds at most one second worth of
+ * tokens, the tokens are counted in thousandths so that a rate in tokens
+ * per second refills exactly that many of them every msec. An RPC over the
+ * limit is not rejected right away, it takes a token from the future and
+ * waits until the bucket is not in debt anymore.
+ */
+struct ratelimit_bucket {
+	char* key;
+	int64_t tokens;
+	uint64_t last;						// monotonic msecs of the last refill
+	struct ratelimit_bucket* next;
+};
+
+struct ratelimit_weight {
+	char* username;
+	unsigned int weight;
+	struct ratelimit_weight* next;
+};
+
+static struct {
+	/* RATELIMIT LOCK */
+	pthread_mutex_t lock;
+	struct ratelimit_bucket* buckets[RATELIMIT_KINDS][RATELIMIT_HASH_SIZE];
+	struct ratelimit_weight* weights;
+} ratelimit = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static unsigned int ratelimit_hash(const char* key) {
+	unsigned int hash = 2166136261u;
+
+	for (; *key; ++key) {
+		hash = (hash ^ (unsigned char)*key) * 16777619u;
+	}
+
+	return hash;
+}
+
+/* refill the tokens, return: 1 if the bucket is full */
+static int bucket_refill(struct ratelimit_bucket* bucket, uint16_t rate, uint64_t now) {
+	bucket->tokens += (int64_t)(now - bucket->last) * rate;
+	bucket->last = now;
+	if (bucket->tokens >= rate * 1000LL) {
+		bucket->tokens = rate * 1000LL;
+		return 1;
+	}
+	return 0;
+}
+
+/* RATELIMIT LOCK must be held, return: refilled bucket of the key, NULL on error */
+static struct ratelimit_bucket* bucket_get(int kind, const char* key, uint16_t rate, uint64_t now) {
+	struct ratelimit_bucket** bucket, *found = NULL, *del;
+
+	/* full buckets are the same as new ones, free them on the way */
+	bucket = &ratelimit.buckets[kind][ratelimit_hash(key) & (RATELIMIT_HASH_SIZE-1)];
+	while (*bucket != NULL) {
+		if (found == NULL && strcmp((*bucket)->key, key) == 0) {
+			found = *bucket;
+			bucket_refill(found, rate, now);
+			bucket = &found->next;
+		} else if (bucket_refill(*bucket, rate, now)) {
+			del = *bucket;
+			*bucket = del->next;
+			free(del->key);
+			free(del);
+		} else {
+			bucket = &(*bucket)->next;
+		}
+	}
+
+	if (found == NULL) {
+		if ((found = malloc(sizeof *found)) == NULL || (found->key = strdup(key)) == NULL) {
+			nc_verb_error("%s: memory allocation failed (%s)", __func__, strerror(errno));
+			free(found);
+			return NULL;
+		}
+		found->tokens = rate * 1000LL;
+		found->last = now;
+		found->next = ratelimit.buckets[kind][ratelimit_hash(key) & (RATELIMIT_HASH_SIZE-1)];
+		ratelimit.buckets[kind][ratelimit_hash(key) & (RATELIMIT_HASH_SIZE-1)] = found;
+	}
+
+	return found;
+}
+
+/* return: msecs until the bucket is out of debt after taking a token, -1 if it would take longer than max_delay */
+static int bucket_delay(const struct ratelimit_bucket* bucket, uint16_t rate, unsigned int max_delay) {
+	int64_t tokens = bucket->tokens - 1000;
+
+	if (tokens >= 0) {
+		return 0;
+	}
+	if (-tokens > (int64_t)max_delay * rate) {
+		return -1;
+	}
+	return (-tokens + rate - 1) / rate;
+}
+
+int np_ratelimit_connection(const struct sockaddr_storage* saddr) {
+	struct ratelimit_bucket* bucket;
+	char addr[INET6_ADDRSTRLEN];
+	uint16_t rate = netopeer_options.address_conn_rate;
+	int ret = 0;
+
+	if (rate == 0) {
+		return 0;
+	}
+
+	if (saddr->ss_family == AF_INET) {
+		inet_ntop(AF_INET, &((struct sockaddr_in*)saddr)->sin_addr, addr, sizeof addr);
+	} else if (saddr->ss_family == AF_INET6) {
+		inet_ntop(AF_INET6, &((struct sockaddr_in6*)saddr)->sin6_addr, addr, sizeof addr);
+	} else {
+		/* not a network connection */
+		return 0;
+	}
+
+	/* RATELIMIT LOCK */
+	pthread_mutex_lock(&ratelimit.lock);
+	if ((bucket = bucket_get(RATELIMIT_ADDRESS, addr, rate, np_clock_msec())) != NULL) {
+		if (bucket_delay(bucket, rate, 0) == 0) {
+			bucket->tokens -= 1000;
+		} else {
+			ret = 1;
+		}
+	}
+	/* RATELIMIT UNLOCK */
+	pthread_mutex_unlock(&ratelimit.lock);
+
+	if (ret) {
+		__sync_add_and_fetch(&netopeer_stats.connections_rejected, 1);
+	}
+	return ret;
+}
+
+int np_ratelimit_rpc(const char* username, const char* sid) {
+	struct ratelimit_bucket* user = NULL, *session = NULL;
+	uint16_t user_rate = netopeer_options.user_rpc_rate, session_rate = netopeer_options.session_rpc_rate;
+	uint64_t now;
+	int user_delay = 0, session_delay = 0;
+
+	if ((user_rate == 0 || username == NULL) && (session_rate == 0 || sid == NULL)) {
+		return 0;
+	}
+	now = np_clock_msec();
+
+	/* RATELIMIT LOCK */
+	pthread_mutex_lock(&ratelimit.lock);
+
+	if (user_rate != 0 && username != NULL && (user = bucket_get(RATELIMIT_USER, username, user_rate, now)) != NULL) {
+		user_delay = bucket_delay(user, user_rate, RATELIMIT_MAX_DELAY);
+	}
+	if (session_rate != 0 && sid != NULL && (session = bucket_get(RATELIMIT_SESSION, sid, session_rate, now)) != NULL) {
+		session_delay = bucket_delay(session, session_rate, RATELIMIT_MAX_DELAY);
+	}
+
+	/* the tokens are taken only if the RPC is not rejected by any of the limits */
+	if (user_delay != -1 && session_delay != -1) {
+		if (user != NULL) {
+			user->tokens -= 1000;
+		}
+		if (session != NULL) {
+			session->tokens -= 1000;
+		}
+	}
+
+	/* RATELIMIT UNLOCK */
+	pthread_mutex_unlock(&ratelimit.lock);
+
+	if (user_delay == -1 || session_delay == -1) {
+		__sync_add_and_fetch(&netopeer_stats.rpcs_rejected, 1);
+		return -1;
+	}
+	if (user_delay > 0 || session_delay > 0) {
+		__sync_add_and_fetch(&netopeer_stats.rpcs_delayed, 1);
+	}
+	return (user_delay > session_delay ? user_delay : session_delay);
+}
+
+unsigned int np_ratelimit_weight(const char* username) {
+	struct ratelimit_weight* weight;
+	unsigned int ret = 1;
+
+	if (username == NULL) {
+		return ret;
+	}
+
+	/* RATELIMIT LOCK */
+	pthread_mutex_lock(&ratelimit.lock);
+	for (weight = ratelimit.weights; weight != NULL; weight = weight->next) {
+		if (strcmp(weight->username, username) == 0) {
+			ret = weight->weight;
+			break;
+		}
+	}
+	/* RATELIMIT UNLOCK */
+	pthread_mutex_unlock(&ratelimit.lock);
+
+	return ret;
+}
+
+int np_ratelimit_weight_set(const char* username, unsigned int weight) {
+	struct ratelimit_weight** iter, *del;
+	int ret = EXIT_SUCCESS;
+
+	/* RATELIMIT LOCK */
+	pthread_mutex_lock(&ratelimit.lock);
+
+	for (iter = &ratelimit.weights; *iter != NULL && strcmp((*iter)->username, username) != 0; iter = &(*iter)->next);
+
+	if (weight == 0) {
+		if (*iter != NULL) {
+			del = *iter;
+			*iter = del->next;
+			free(del->username);
+			free(del);
+		}
+	} else if (*iter != NULL) {
+		(*iter)->weight = weight;
+	} else if ((*iter = calloc(1, sizeof **iter)) == NULL || ((*iter)->username = strdup(username)) == NULL) {
+		nc_verb_error("%s: memory allocation failed (%s)", __func__, strerror(errno));
+		free(*iter);
+		*iter = NULL;
+		ret = EXIT_FAILURE;
+	} else {
+		(*iter)->weight = weight;
+	}
+
+	/* RATELIMIT UNLOCK */
+	pthread_mutex_unlock(&ratelimit.lock);
+
+	return ret;
+}
+
+void np_ratelimit_cleanup(void) {
+	struct ratelimit_bucket* bucket;
+	struct ratelimit_weight* weight;
+	int kind, i;
+
+	/* RATELIMIT LOCK */
+	pthread_mutex_lock(&ratelimit.lock);
+
+	for (kind = 0; kind < RATELIMIT_KINDS; ++kind) {
+		for (i = 0; i < RATELIMIT_HASH_SIZE; ++i) {
+			while ((bucket = ratelimit.buckets[kind][i]) != NULL) {
+				ratelimit.buckets[kind][i] = bucket->next;
+				free(bucket->key);
+				free(bucket);
+			}
+		}
+	}
+
+	while ((weight = ratelimit.weights) != NULL) {
+		ratelimit.weights = weight->next;
+		free(weight->username);
+		free(weight);
+	}
+
+	/* RATELIMIT UNLOCK */
+	pthread_mutex_unlock(&ratelimit.lock);
+}
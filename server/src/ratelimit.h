@@ -0,0 +1,87 @@
+/**
+ * @file ratelimit.h
+ * @brief Netopeer server rate limits
+ *
+ * Copyright (C) 2015 CESNET, z.s.p.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of the Company nor the names of its contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * ALTERNATIVELY, provided that this notice is retained in full, this
+ * product may be distributed under the terms of the GNU General Public
+ * License (GPL) version 2 or later, in which case the provisions
+ * of the GPL apply INSTEAD OF those given above.
+ *
+ * This software is provided ``as is, and any express or implied
+ * warranties, including, but not limited to, the implied warranties of
+ * merchantability and fitness for a particular purpose are disclaimed.
+ * In no event shall the company or contributors be liable for any
+ * direct, indirect, incidental, special, exemplary, or consequential
+ * damages (including, but not limited to, procurement of substitute
+ * goods or services; loss of use, data, or profits; or business
+ * interruption) however caused and on any theory of liability, whether
+ * in contract, strict liability, or tort (including negligence or
+ * otherwise) arising in any way out of the use of this software, even
+ * if advised of the possibility of such damage.
+ */
+
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+#include <sys/socket.h>
+
+/**
+ * @brief Take a token of the connection rate limit of the source address
+ *
+ * @param saddr Address of the new client
+ *
+ * @return 0 if the connection may proceed, 1 if it is over the limit.
+ */
+int np_ratelimit_connection(const struct sockaddr_storage* saddr);
+
+/**
+ * @brief Take a token of the RPC rate limits of the user and of the session
+ *
+ * @param username Name of the user, NULL if not known
+ * @param sid NETCONF session ID
+ *
+ * @return Number of msecs the RPC must wait for its turn, -1 if it would
+ * wait longer than RATELIMIT_MAX_DELAY and is to be rejected.
+ */
+int np_ratelimit_rpc(const char* username, const char* sid);
+
+/**
+ * @brief Get the share of the RPC workers of a user
+ *
+ * @param username Name of the user, NULL if not known
+ *
+ * @return Configured weight, 1 for the users without one.
+ */
+unsigned int np_ratelimit_weight(const char* username);
+
+/**
+ * @brief Set the share of the RPC workers of a user
+ *
+ * @param username Name of the user
+ * @param weight Weight of the user, 0 to remove it
+ *
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int np_ratelimit_weight_set(const char* username, unsigned int weight);
+
+/**
+ * @brief Free all the buckets and weights
+ */
+void np_ratelimit_cleanup(void);
+
+#endif /* _RATELIMIT_H_ */
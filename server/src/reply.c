@@ -0,0 +1,276 @@
+/**
+ * @file reply.c
+ * @brief Netopeer server streamed replies
+ *
+ *
+ * Copyright (C) 2015 CESNET, z.s.p.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of the Company nor the names of its contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * ALTERNATIVELY, provided that this notice is retained in full, this
+ * product may be distributed under the terms of the GNU General Public
+ * License (GPL) version 2 or later, in which case the provisions
+ * of the GPL apply INSTEAD OF those given above.
+ *
+ * This software is provided ``as is, and any express or implied
+ * warranties, including, but not limited to, the implied warranties of
+ * merchantability and fitness for a particular purpose are disclaimed.
+ * In no event shall the company or contributors be liable for any
+ * direct, indirect, incidental, special, exemplary, or consequential
+ * damages (including, but not limited to, procurement of substitute
+ * goods or services; loss of use, data, or profits; or business
+ * interruption) however caused and on any theory of liability, whether
+ * in contract, strict liability, or tort (including negligence or
+ * otherwise) arising in any way out of the use of this software, even
+ * if advised of the possibility of such damage.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+#include <libxml/xmlIO.h>
+#include <libnetconf_xml.h>
+
+#include "server.h"
+
+static const char rcsid[] __attribute__((used)) ="$Id: "__FILE__": "RCSID" $";
+
+/* room for the NETCONF 1.1 chunk header before the data and the end of message after it */
+#define REPLY_HEADER_ROOM 24
+#define REPLY_TRAILER_ROOM 8
+
+/*
+ * The reply is serialized into a single chunk buffer that is written
+ * into the transport whenever it fills up, the whole reply string is
+ * never built. The chunk header and the end of message are put around
+ * the data in the same buffer so every chunk is a single write. The data
+ * tree itself is still copied out of the reply by libnetconf, the copy
+ * is released node by node as it is sent.
+ */
+struct reply_stream {
+	np_reply_write write;
+	void* arg;
+	int chunked;						// NETCONF 1.1 chunked framing, end of message delimiter otherwise
+	int failed;							// the transport failed, the session is broken
+	size_t len;							// data in the chunk
+	char buf[REPLY_HEADER_ROOM + REPLY_CHUNK_SIZE + REPLY_TRAILER_ROOM];
+};
+
+static int reply_flush(struct reply_stream* stream, int last) {
+	char header[REPLY_HEADER_ROOM], *start, *end;
+	int len;
+
+	start = stream->buf + REPLY_HEADER_ROOM;
+	end = start + stream->len;
+
+	if (stream->chunked && stream->len > 0) {
+		len = snprintf(header, sizeof header, "\n#%zu\n", stream->len);
+		start -= len;
+		memcpy(start, header, len);
+	}
+	if (last) {
+		len = sprintf(end, "%s", (stream->chunked ? "\n##\n" : "]]>]]>"));
+		end += len;
+	}
+
+	if (end > start && stream->write(stream->arg, start, end - start) != 0) {
+		stream->failed = 1;
+		return -1;
+	}
+	stream->len = 0;
+
+	return 0;
+}
+
+static int reply_output_write(void* context, const char* buffer, int len) {
+	struct reply_stream* stream = context;
+	size_t part;
+	int done;
+
+	for (done = 0; done < len; done += part) {
+		part = REPLY_CHUNK_SIZE - stream->len;
+		if (part > (size_t)(len - done)) {
+			part = len - done;
+		}
+		memcpy(stream->buf + REPLY_HEADER_ROOM + stream->len, buffer + done, part);
+		stream->len += part;
+
+		if (stream->len == REPLY_CHUNK_SIZE && reply_flush(stream, 0)) {
+			return -1;
+		}
+	}
+
+	return len;
+}
+
+static void reply_output_attr(xmlOutputBufferPtr out, const char* value) {
+	const char* entity;
+
+	for (; *value; ++value) {
+		switch (*value) {
+		case '&':
+			entity = "&amp;";
+			break;
+		case '<':
+			entity = "&lt;";
+			break;
+		case '"':
+			entity = "&quot;";
+			break;
+		/* attribute value normalization would turn them into spaces */
+		case '\n':
+			entity = "&#10;";
+			break;
+		case '\r':
+			entity = "&#13;";
+			break;
+		case '\t':
+			entity = "&#9;";
+			break;
+		default:
+			xmlOutputBufferWrite(out, 1, value);
+			continue;
+		}
+		xmlOutputBufferWriteString(out, entity);
+	}
+}
+
+/* the rpc-reply must carry all the attributes of the rpc (RFC 6241 section 4.2), return: 0 - written, 1 - error */
+static int reply_output_rpc_attrs(xmlOutputBufferPtr out, const nc_rpc* rpc) {
+	xmlDocPtr doc;
+	xmlNsPtr ns;
+	xmlAttrPtr attr;
+	xmlChar* value;
+	char* dump;
+
+	/* there is no accessor for the attributes, but the rpc of get and get-config is small */
+	if ((dump = nc_rpc_dump(rpc)) == NULL) {
+		return 1;
+	}
+	doc = xmlReadMemory(dump, strlen(dump), NULL, NULL, XML_PARSE_NONET | XML_PARSE_NOERROR | XML_PARSE_NOWARNING);
+	free(dump);
+	if (doc == NULL || xmlDocGetRootElement(doc) == NULL) {
+		xmlFreeDoc(doc);
+		return 1;
+	}
+
+	/* the namespaces of the prefixed attributes can only be declared on the root */
+	for (ns = xmlDocGetRootElement(doc)->nsDef; ns != NULL; ns = ns->next) {
+		if (ns->prefix == NULL) {
+			continue;
+		}
+		xmlOutputBufferWriteString(out, " xmlns:");
+		xmlOutputBufferWriteString(out, (char*)ns->prefix);
+		xmlOutputBufferWriteString(out, "=\"");
+		reply_output_attr(out, (char*)ns->href);
+		xmlOutputBufferWriteString(out, "\"");
+	}
+
+	for (attr = xmlDocGetRootElement(doc)->properties; attr != NULL; attr = attr->next) {
+		if ((value = xmlNodeGetContent((xmlNodePtr)attr)) == NULL) {
+			continue;
+		}
+		xmlOutputBufferWriteString(out, " ");
+		if (attr->ns != NULL && attr->ns->prefix != NULL) {
+			xmlOutputBufferWriteString(out, (char*)attr->ns->prefix);
+			xmlOutputBufferWriteString(out, ":");
+		}
+		xmlOutputBufferWriteString(out, (char*)attr->name);
+		xmlOutputBufferWriteString(out, "=\"");
+		reply_output_attr(out, (char*)value);
+		xmlOutputBufferWriteString(out, "\"");
+		xmlFree(value);
+	}
+
+	xmlFreeDoc(doc);
+	return 0;
+}
+
+int np_reply_stream(struct nc_session* session, const nc_rpc* rpc, const nc_reply* reply, np_reply_write write, void* arg) {
+	struct reply_stream* stream;
+	xmlOutputBufferPtr out;
+	xmlDocPtr data;
+	xmlNodePtr node;
+	int version, ret;
+
+	if (nc_reply_get_type(reply) != NC_REPLY_DATA || (nc_rpc_get_op(rpc) != NC_OP_GET && nc_rpc_get_op(rpc) != NC_OP_GETCONFIG)) {
+		return 1;
+	}
+
+	/* 0 - NETCONF 1.0, 1 - NETCONF 1.1 */
+	if ((version = nc_session_get_version(session)) < 0) {
+		return 1;
+	}
+
+	if ((stream = malloc(sizeof *stream)) == NULL) {
+		nc_verb_error("%s: memory allocation failed (%s)", __func__, strerror(errno));
+		return 1;
+	}
+	stream->write = write;
+	stream->arg = arg;
+	stream->chunked = version;
+	stream->failed = 0;
+	stream->len = 0;
+
+	if ((data = ncxml_reply_get_data(reply)) == NULL) {
+		/* no data, small enough for libnetconf */
+		free(stream);
+		return 1;
+	}
+
+	if ((out = xmlOutputBufferCreateIO(reply_output_write, NULL, stream, NULL)) == NULL) {
+		nc_verb_error("%s: creating the output buffer failed", __func__);
+		xmlFreeDoc(data);
+		free(stream);
+		return 1;
+	}
+
+	xmlOutputBufferWriteString(out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+			"<rpc-reply xmlns=\"urn:ietf:params:xml:ns:netconf:base:1.0\"");
+	if (reply_output_rpc_attrs(out, rpc) != 0) {
+		/* nothing was written into the transport yet */
+		nc_verb_error("%s: reading the rpc attributes failed", __func__);
+		xmlOutputBufferClose(out);
+		xmlFreeDoc(data);
+		free(stream);
+		return 1;
+	}
+	xmlOutputBufferWriteString(out, "><data>");
+	/* every sent node is freed so the copy shrinks as the reply goes out */
+	while ((node = data->children) != NULL) {
+		xmlNodeDumpOutput(out, data, node, 0, 0, NULL);
+		xmlUnlinkNode(node);
+		xmlFreeNode(node);
+	}
+	xmlOutputBufferWriteString(out, "</data></rpc-reply>");
+
+	/* the rest is written from the buffer into the last chunk */
+	ret = xmlOutputBufferClose(out);
+	xmlFreeDoc(data);
+
+	if (ret < 0 || stream->failed || reply_flush(stream, 1)) {
+		/* a part of the reply may have been sent, the framing is broken */
+		nc_verb_error("%s: sending the reply to session %s failed", __func__, nc_session_get_id(session));
+		free(stream);
+		return -1;
+	}
+
+	free(stream);
+	return 0;
+}
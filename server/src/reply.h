@@ -0,0 +1,74 @@
+/**
+ * @file reply.h
+ * @brief Netopeer server streamed replies
+ *
+ *
+ * Copyright (C) 2015 CESNET, z.s.p.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of the Company nor the names of its contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * ALTERNATIVELY, provided that this notice is retained in full, this
+ * product may be distributed under the terms of the GNU General Public
+ * License (GPL) version 2 or later, in which case the provisions
+ * of the GPL apply INSTEAD OF those given above.
+ *
+ * This software is provided ``as is, and any express or implied
+ * warranties, including, but not limited to, the implied warranties of
+ * merchantability and fitness for a particular purpose are disclaimed.
+ * In no event shall the company or contributors be liable for any
+ * direct, indirect, incidental, special, exemplary, or consequential
+ * damages (including, but not limited to, procurement of substitute
+ * goods or services; loss of use, data, or profits; or business
+ * interruption) however caused and on any theory of liability, whether
+ * in contract, strict liability, or tort (including negligence or
+ * otherwise) arising in any way out of the use of this software, even
+ * if advised of the possibility of such damage.
+ */
+
+#ifndef _REPLY_H_
+#define _REPLY_H_
+
+#include <stddef.h>
+#include <libnetconf.h>
+
+/**
+ * @brief Write a part of a reply into the transport of a session
+ *
+ * The replies are streamed by the engine helpers, the write may block.
+ *
+ * @param arg Transport of the session
+ * @param buf Data to write
+ * @param len Length of the data
+ *
+ * @return 0 when all written, -1 on error.
+ */
+typedef int (*np_reply_write)(void* arg, const char* buf, size_t len);
+
+/**
+ * @brief Send a large reply serialized straight into the transport in chunks
+ *
+ * Only the data replies of get and get-config are streamed, the rest are
+ * left to nc_session_send_reply().
+ *
+ * @param session Session the RPC was received on
+ * @param rpc Replied RPC
+ * @param reply Reply to send
+ * @param write Transport write function
+ * @param arg Argument of \p write
+ *
+ * @return 0 when sent, 1 when not streamed, -1 when the session is broken.
+ */
+int np_reply_stream(struct nc_session* session, const nc_rpc* rpc, const nc_reply* reply, np_reply_write write, void* arg);
+
+#endif /* _REPLY_H_ */
@@ -69,10 +69,6 @@ static const char rcsid[] __attribute__((used)) ="$Id: "__FILE__": "RCSID" $";
 
 extern struct np_options netopeer_options;
 
-extern pthread_mutex_t callhome_lock;
-extern pthread_cond_t callhome_cond;
-extern struct ch_app* callhome_app;
-
 /* one global structure holding all the client information */
 struct np_state netopeer_state = {
 	.global_lock = PTHREAD_MUTEX_INITIALIZER
@@ -83,33 +79,60 @@ volatile int quit = 0, restart_soft = 0, restart_hard = 0;
 
 volatile int server_start = 0;
 
+/*
+ * Server identity shared by all the acceptors. Both the SSH and TLS parts
+ * are reference-counted snapshots, an acceptor takes a reference for the
+ * time of accepting a client. A change is built by a separate thread while
+ * the acceptors keep using the old snapshot, which is then swapped for the
+ * new one and freed once its last user is done.
+ */
+static struct {
+	/* SERVER ID LOCK, protects the current snapshots and the builder state */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int rebuild;
+	int stop;
+	pthread_t builder;
+#ifdef NP_SSH
+	struct np_ssh_id* ssh;
+#endif
+#ifdef NP_TLS
+	SSL_CTX* tls;
+#endif
+} server_id = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER
+};
+
+/* additional acceptor threads, listen_loop() is always the first acceptor */
+static struct {
+	pthread_t* threads;
+	unsigned int count;
+	volatile int stop;
+	/* sockets of the acceptor threads, kept open over a soft restart like the listener ones */
+	struct np_sock* socks;
+	unsigned int sock_count;
+} acceptors;
+
+/* sockets of listen_loop(), kept open over a soft restart */
+static struct {
+	struct np_sock sock;
+	unsigned int acceptor_count;
+} listener = {
+	.sock = {.count = 0},
+	.acceptor_count = 1
+};
+
 void clb_print(NC_VERB_LEVEL level, const char* msg) {
-	switch (level) {
-	case NC_VERB_ERROR:
-		syslog(LOG_ERR, "%s", msg);
-		break;
-	case NC_VERB_WARNING:
-		syslog(LOG_WARNING, "%s", msg);
-		break;
-	case NC_VERB_VERBOSE:
-		syslog(LOG_INFO, "%s", msg);
-		break;
-	case NC_VERB_DEBUG:
-		syslog(LOG_DEBUG, "%s", msg);
-		break;
-	}
+	np_log_printf(level, "%s", msg);
 }
 
 void print_debug(const char* format, ...) {
-#define MAX_DEBUG_LEN 4096
-	char msg[MAX_DEBUG_LEN];
 	va_list ap;
 
 	va_start(ap, format);
-	vsnprintf(msg, MAX_DEBUG_LEN, format, ap);
+	np_log_vprintf(NC_VERB_DEBUG, format, ap);
 	va_end(ap);
-
-	clb_print(NC_VERB_DEBUG, msg);
 }
 
 static void print_version(char* progname) {
@@ -120,15 +143,17 @@ static void print_version(char* progname) {
 }
 
 static void print_usage(char* progname) {
-	fprintf(stdout, "Usage: %s [-dhV] [-v level]\n", progname);
+	fprintf(stdout, "Usage: %s [-dhV] [-l file] [-p file] [-v level]\n", progname);
 	fprintf(stdout, " -d                  daemonize server\n");
 	fprintf(stdout, " -h                  display help\n");
+	fprintf(stdout, " -l file             write the messages into file as JSON lines instead of syslog\n");
+	fprintf(stdout, " -p file             append the startup and reload time profiles into file as JSON lines\n");
 	fprintf(stdout, " -v level            verbose output level\n");
 	fprintf(stdout, " -V                  show program version\n");
 	exit(0);
 }
 
-#define OPTSTRING "dhv:V"
+#define OPTSTRING "dhl:p:v:V"
 
 /*!
  * \brief Signal handler
@@ -162,145 +187,231 @@ void signal_handler(int sig) {
 	}
 }
 
-static void client_append(struct client_struct** root, struct client_struct* clients) {
-	struct client_struct* cur;
-
+/* GLOBAL LOCK must be held, the client session is counted by session_reserve() */
+static void client_append(struct client_struct** root, struct client_struct* client) {
 	if (root == NULL) {
 		return;
 	}
 
-	if (*root == NULL) {
-		*root = clients;
+	client->prev = NULL;
+	client->next = *root;
+	if (*root != NULL) {
+		(*root)->prev = client;
+	}
+	*root = client;
+}
+
+/* GLOBAL LOCK must be held */
+void np_client_detach(struct client_struct** root, struct client_struct* del_client) {
+	if (del_client->prev == NULL && *root != del_client) {
+		nc_verb_error("%s: internal error: client not found (%s:%d)", __func__, __FILE__, __LINE__);
 		return;
 	}
 
-	for (cur = *root; cur->next != NULL; cur = cur->next);
+	if (del_client->prev == NULL) {
+		*root = del_client->next;
+	} else {
+		del_client->prev->next = del_client->next;
+	}
+	if (del_client->next != NULL) {
+		del_client->next->prev = del_client->prev;
+	}
+	del_client->next = NULL;
+	del_client->prev = NULL;
 
-	cur->next = clients;
+	np_session_count_add(-1);
 }
 
-void np_client_detach(struct client_struct** root, struct client_struct* del_client) {
-	struct client_struct* client, *prev_client = NULL;
+void np_session_count_add(int delta) {
+	__sync_add_and_fetch(&netopeer_state.session_count, delta);
+}
 
-	for (client = *root; client != NULL; client = client->next) {
-		if (client == del_client) {
-			break;
+/* return: 0 - a session of a new client counted, 1 - the maximum number of sessions reached */
+static int session_reserve(void) {
+	int count;
+
+	/* the check and the increment must be atomic, the acceptors set up their clients concurrently */
+	do {
+		count = netopeer_state.session_count;
+		if (netopeer_options.max_sessions > 0 && count >= netopeer_options.max_sessions) {
+			return 1;
 		}
-		prev_client = client;
+	} while (!__sync_bool_compare_and_swap(&netopeer_state.session_count, count, count + 1));
+
+	return 0;
+}
+
+static unsigned int sess_index_hash(const char* sid) {
+	unsigned int hash = 2166136261u;
+
+	for (; *sid; ++sid) {
+		hash = (hash ^ (unsigned char)*sid) * 16777619u;
 	}
 
-	if (client == NULL) {
-		nc_verb_error("%s: internal error: client not found (%s:%d)", __func__, __FILE__, __LINE__);
+	return hash;
+}
+
+/* GLOBAL LOCK must be held */
+static void sess_index_grow(void) {
+	struct np_sess_entry** new_index, *entry, *next;
+	unsigned int i, new_size, idx;
+
+	new_size = (netopeer_state.sess_index_size ? netopeer_state.sess_index_size*2 : SESS_INDEX_INIT_SIZE);
+	if ((new_index = calloc(new_size, sizeof *new_index)) == NULL) {
+		/* we can live with longer chains */
 		return;
 	}
 
-	if (prev_client == NULL) {
-		*root = (*root)->next;
-	} else {
-		prev_client->next = client->next;
+	for (i = 0; i < netopeer_state.sess_index_size; ++i) {
+		for (entry = netopeer_state.sess_index[i]; entry != NULL; entry = next) {
+			next = entry->next;
+			idx = sess_index_hash(entry->sid) & (new_size-1);
+			entry->next = new_index[idx];
+			new_index[idx] = entry;
+		}
 	}
+
+	free(netopeer_state.sess_index);
+	netopeer_state.sess_index = new_index;
+	netopeer_state.sess_index_size = new_size;
 }
 
-/* return seconds rounded down */
-unsigned int timeval_diff(struct timeval tv1, struct timeval tv2) {
-	time_t sec;
+int np_sess_index_add(struct nc_session* session, struct client_struct* client, void* data) {
+	struct np_sess_entry* entry;
+	const char* sid;
+	unsigned int idx;
 
-	if (tv1.tv_usec > 1000000) {
-		tv1.tv_sec += tv1.tv_usec / 1000000;
-		tv1.tv_usec = tv1.tv_usec % 1000000;
+	if ((sid = nc_session_get_id(session)) == NULL || (entry = malloc(sizeof *entry)) == NULL) {
+		nc_verb_error("%s: internal error (%s:%d)", __func__, __FILE__, __LINE__);
+		return EXIT_FAILURE;
 	}
+	entry->sid = strdup(sid);
+	entry->client = client;
+	entry->data = data;
+
+	/* GLOBAL LOCK */
+	pthread_mutex_lock(&netopeer_state.global_lock);
 
-	if (tv2.tv_usec > 1000000) {
-		tv2.tv_sec += tv2.tv_usec / 1000000;
-		tv2.tv_usec = tv2.tv_usec % 1000000;
+	if (netopeer_state.sess_index_count >= netopeer_state.sess_index_size) {
+		sess_index_grow();
 	}
+	idx = sess_index_hash(entry->sid) & (netopeer_state.sess_index_size-1);
+	entry->next = netopeer_state.sess_index[idx];
+	netopeer_state.sess_index[idx] = entry;
+	++netopeer_state.sess_index_count;
 
-	sec = (tv1.tv_sec > tv2.tv_sec ? tv1.tv_sec-tv2.tv_sec : tv2.tv_sec-tv1.tv_sec);
-	return sec;
+	/* GLOBAL UNLOCK */
+	pthread_mutex_unlock(&netopeer_state.global_lock);
+
+	return EXIT_SUCCESS;
 }
 
-void* client_notif_thread(void* arg) {
-	struct ntf_thread_config *config = (struct ntf_thread_config*)arg;
+void np_sess_index_del(struct nc_session* session) {
+	struct np_sess_entry** entry, *del_entry;
+	const char* sid;
 
-	ncntf_dispatch_send(config->session, config->subscribe_rpc);
-	nc_rpc_free(config->subscribe_rpc);
-	free(config);
+	if (session == NULL || (sid = nc_session_get_id(session)) == NULL) {
+		return;
+	}
 
-	return NULL;
+	/* GLOBAL LOCK */
+	pthread_mutex_lock(&netopeer_state.global_lock);
+
+	if (netopeer_state.sess_index_size > 0) {
+		for (entry = &netopeer_state.sess_index[sess_index_hash(sid) & (netopeer_state.sess_index_size-1)]; *entry != NULL; entry = &(*entry)->next) {
+			if (strcmp((*entry)->sid, sid) == 0) {
+				del_entry = *entry;
+				*entry = del_entry->next;
+				--netopeer_state.sess_index_count;
+				free(del_entry->sid);
+				free(del_entry);
+				break;
+			}
+		}
+	}
+
+	/* GLOBAL UNLOCK */
+	pthread_mutex_unlock(&netopeer_state.global_lock);
 }
 
-void* client_main_thread(void* arg) {
-	struct client_struct* client = (struct client_struct*)arg;
-	int skip_sleep;
+/* GLOBAL LOCK must be held */
+struct np_sess_entry* np_sess_index_find(const char* sid) {
+	struct np_sess_entry* entry;
 
-	do {
-		skip_sleep = 0;
+	if (sid == NULL || netopeer_state.sess_index_size == 0) {
+		return NULL;
+	}
 
-		switch (client->transport) {
-#ifdef NP_SSH
-		case NC_TRANSPORT_SSH:
-			skip_sleep += np_ssh_client_transport((struct client_struct_ssh*)client);
-			skip_sleep += np_ssh_client_netconf_rpc((struct client_struct_ssh*)client);
-			break;
-#endif
-#ifdef NP_TLS
-		case NC_TRANSPORT_TLS:
-			skip_sleep += np_tls_client_transport((struct client_struct_tls*)client);
-			skip_sleep += np_tls_client_netconf_rpc((struct client_struct_tls*)client);
-			break;
-#endif
-		default:
-			nc_verb_error("%s: internal error (%s:%d)", __func__, __FILE__, __LINE__);
+	for (entry = netopeer_state.sess_index[sess_index_hash(sid) & (netopeer_state.sess_index_size-1)]; entry != NULL; entry = entry->next) {
+		if (strcmp(entry->sid, sid) == 0) {
+			return entry;
 		}
+	}
 
-		if (!skip_sleep) {
-			/* we did not do anything productive, so let the thread sleep */
-			usleep(netopeer_options.response_time*1000);
-		}
-	} while (!client->to_free);
+	return NULL;
+}
 
-	/* GLOBAL LOCK */
-	pthread_mutex_lock(&netopeer_state.global_lock);
+uint64_t np_timespec_msec(const struct timespec* ts) {
+	return ts->tv_sec * 1000ULL + ts->tv_nsec / 1000000;
+}
 
-	np_client_detach(&netopeer_state.clients, client);
+/* return: milliseconds of the monotonic clock, wall-clock changes do not affect it */
+uint64_t np_clock_msec(void) {
+	struct timespec ts;
 
-	/* GLOBAL UNLOCK */
-	pthread_mutex_unlock(&netopeer_state.global_lock);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return np_timespec_msec(&ts);
+}
 
-	switch (client->transport) {
-#ifdef NP_SSH
-	case NC_TRANSPORT_SSH:
-		client_free_ssh((struct client_struct_ssh*)client);
-		break;
-#endif
-#ifdef NP_TLS
-	case NC_TRANSPORT_TLS:
-		client_free_tls((struct client_struct_tls*)client);
-		break;
-#endif
-	default:
-		free(client);
-		break;
+/* return: number of bytes of the server hello, roughly */
+size_t np_hello_len(void) {
+	struct nc_cpblts* caps;
+	const char* cap;
+	size_t len;
+
+	/* the envelope with the session ID */
+	len = 256;
+
+	caps = nc_session_get_cpblts_default();
+	nc_cpblts_iter_start(caps);
+	while ((cap = nc_cpblts_iter_next(caps)) != NULL) {
+		len += strlen(cap) + 32;
 	}
+	nc_cpblts_free(caps);
 
-#ifdef NP_TLS
-	np_tls_thread_cleanup();
-#endif
+	return len;
+}
 
-	pthread_detach(pthread_self());
+void* client_notif_thread(void* arg) {
+	struct ntf_thread_config *config = (struct ntf_thread_config*)arg;
+
+	ncntf_dispatch_send(config->session, config->subscribe_rpc);
+	nc_rpc_free(config->subscribe_rpc);
+	np_slab_free(NP_SLAB_NOTIF, config);
 
 	return NULL;
 }
 
 static void sock_cleanup(struct np_sock* npsock) {
 	unsigned int i;
+	struct client_struct* client;
 
 	if (npsock == NULL) {
 		return;
 	}
 
+	/* drop the connections we did not get to */
+	while (npsock->pending != NULL) {
+		client = npsock->pending;
+		npsock->pending = client->next;
+		close(client->sock);
+		np_slab_free(NP_SLAB_CLIENT, client);
+	}
+
 	for (i = 0; i < npsock->count; ++i) {
-		close(npsock->pollsock[i].fd);
+		if (npsock->pollsock[i].fd != -1) {
+			close(npsock->pollsock[i].fd);
+		}
 	}
 	free(npsock->pollsock);
 	npsock->pollsock = NULL;
@@ -309,11 +420,45 @@ static void sock_cleanup(struct np_sock* npsock) {
 	npsock->count = 0;
 }
 
-static void sock_listen(const struct np_bind_addr* addrs, struct np_sock* npsock) {
+/* return: listening socket of the old set bound to the same address taken over, -1 if there is none */
+static int sock_take(struct np_sock* old, NC_TRANSPORT transport, const struct sockaddr_storage* saddr, socklen_t saddr_len) {
+	struct sockaddr_storage bound;
+	socklen_t bound_len;
+	unsigned int i;
+	int fd;
+
+	for (i = 0; i < old->count; ++i) {
+		if (old->pollsock[i].fd == -1 || old->transport[i] != transport) {
+			continue;
+		}
+
+		bound_len = sizeof bound;
+		if (getsockname(old->pollsock[i].fd, (struct sockaddr*)&bound, &bound_len) == -1) {
+			continue;
+		}
+		if (bound_len == saddr_len && memcmp(&bound, saddr, saddr_len) == 0) {
+			fd = old->pollsock[i].fd;
+			old->pollsock[i].fd = -1;
+			return fd;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * The sockets already listening on any of the addresses are kept,
+ * so that the clients connecting meanwhile wait in the backlog
+ * instead of being refused.
+ */
+static void sock_listen(const struct np_bind_addr* addrs, struct np_sock* npsock, int backlog, int reuseport) {
 	const int optVal = 1;
 	const socklen_t optLen = sizeof(optVal);
+	int flags, fd;
 	char is_ipv4;
 	struct sockaddr_storage saddr;
+	socklen_t saddr_len;
+	struct np_sock old;
 
 	struct sockaddr_in* saddr4;
 	struct sockaddr_in6* saddr6;
@@ -322,8 +467,15 @@ static void sock_listen(const struct np_bind_addr* addrs, struct np_sock* npsock
 		return;
 	}
 
-	if (npsock->count > 0) {
-		sock_cleanup(npsock);
+	/* the connections already accepted are not affected */
+	old = *npsock;
+	bzero(npsock, sizeof *npsock);
+	npsock->reuseport = reuseport;
+	npsock->pending = old.pending;
+	old.pending = NULL;
+	if (old.reuseport != reuseport) {
+		/* the socket option must be the same when binding */
+		sock_cleanup(&old);
 	}
 
 	/*
@@ -346,25 +498,10 @@ static void sock_listen(const struct np_bind_addr* addrs, struct np_sock* npsock
 			is_ipv4 = 0;
 		}
 
-		npsock->pollsock[npsock->count-1].fd = socket((is_ipv4 ? AF_INET : AF_INET6), SOCK_STREAM, 0);
-		if (npsock->pollsock[npsock->count-1].fd == -1) {
-			nc_verb_error("%s: could not create socket (%s)", __func__, strerror(errno));
-			continue;
-		}
-
-		if (setsockopt(npsock->pollsock[npsock->count-1].fd, SOL_SOCKET, SO_REUSEADDR, (void*) &optVal, optLen) != 0) {
-			nc_verb_error("%s: could not set socket SO_REUSEADDR option (%s)", __func__, strerror(errno));
-			continue;
-		}
-
-		if (fcntl(npsock->pollsock[npsock->count-1].fd, F_SETFD, FD_CLOEXEC) != 0) {
-			nc_verb_error("%s: fcntl failed (%s)", __func__, strerror(errno));
-			continue;
-		}
-
 		bzero(&saddr, sizeof(struct sockaddr_storage));
 		if (is_ipv4) {
 			saddr4 = (struct sockaddr_in*)&saddr;
+			saddr_len = sizeof(struct sockaddr_in);
 
 			saddr4->sin_family = AF_INET;
 			saddr4->sin_port = htons(addrs->port);
@@ -373,14 +510,9 @@ static void sock_listen(const struct np_bind_addr* addrs, struct np_sock* npsock
 				nc_verb_error("%s: failed to convert IPv4 address \"%s\"", __func__, addrs->addr);
 				continue;
 			}
-
-			if (bind(npsock->pollsock[npsock->count-1].fd, (struct sockaddr*)saddr4, sizeof(struct sockaddr_in)) == -1) {
-				nc_verb_error("%s: could not bind \"%s\" port %d (%s)", __func__, addrs->addr, addrs->port, strerror(errno));
-				continue;
-			}
-
 		} else {
 			saddr6 = (struct sockaddr_in6*)&saddr;
+			saddr_len = sizeof(struct sockaddr_in6);
 
 			saddr6->sin6_family = AF_INET6;
 			saddr6->sin6_port = htons(addrs->port);
@@ -389,14 +521,47 @@ static void sock_listen(const struct np_bind_addr* addrs, struct np_sock* npsock
 				nc_verb_error("%s: failed to convert IPv6 address \"%s\"", __func__, addrs->addr);
 				continue;
 			}
+		}
+
+		if ((fd = sock_take(&old, addrs->transport, &saddr, saddr_len)) != -1) {
+			npsock->pollsock[npsock->count-1].fd = fd;
+		} else {
+			npsock->pollsock[npsock->count-1].fd = socket((is_ipv4 ? AF_INET : AF_INET6), SOCK_STREAM, 0);
+			if (npsock->pollsock[npsock->count-1].fd == -1) {
+				nc_verb_error("%s: could not create socket (%s)", __func__, strerror(errno));
+				continue;
+			}
+
+			if (setsockopt(npsock->pollsock[npsock->count-1].fd, SOL_SOCKET, SO_REUSEADDR, (void*) &optVal, optLen) != 0) {
+				nc_verb_error("%s: could not set socket SO_REUSEADDR option (%s)", __func__, strerror(errno));
+				continue;
+			}
+
+			/* every acceptor listens on its own socket bound to the same address */
+			if (reuseport && setsockopt(npsock->pollsock[npsock->count-1].fd, SOL_SOCKET, SO_REUSEPORT, (void*) &optVal, optLen) != 0) {
+				nc_verb_error("%s: could not set socket SO_REUSEPORT option (%s)", __func__, strerror(errno));
+				continue;
+			}
 
-			if (bind(npsock->pollsock[npsock->count-1].fd, (struct sockaddr*)saddr6, sizeof(struct sockaddr_in6)) == -1) {
+			if (fcntl(npsock->pollsock[npsock->count-1].fd, F_SETFD, FD_CLOEXEC) != 0) {
+				nc_verb_error("%s: fcntl failed (%s)", __func__, strerror(errno));
+				continue;
+			}
+
+			/* so that the pending connections can be drained */
+			if (((flags = fcntl(npsock->pollsock[npsock->count-1].fd, F_GETFL)) == -1) || (fcntl(npsock->pollsock[npsock->count-1].fd, F_SETFL, flags | O_NONBLOCK) == -1)) {
+				nc_verb_error("%s: fcntl failed (%s)", __func__, strerror(errno));
+				continue;
+			}
+
+			if (bind(npsock->pollsock[npsock->count-1].fd, (struct sockaddr*)&saddr, saddr_len) == -1) {
 				nc_verb_error("%s: could not bind \"%s\" port %d (%s)", __func__, addrs->addr, addrs->port, strerror(errno));
 				continue;
 			}
 		}
 
-		if (listen(npsock->pollsock[npsock->count-1].fd, 5) == -1) {
+		/* on a kept socket only the backlog is changed */
+		if (listen(npsock->pollsock[npsock->count-1].fd, backlog) == -1) {
 			nc_verb_error("%s: unable to start listening on \"%s\" port %d (%s)", __func__, addrs->addr, addrs->port, strerror(errno));
 			continue;
 		}
@@ -411,294 +576,546 @@ static void sock_listen(const struct np_bind_addr* addrs, struct np_sock* npsock
 
 	/* the last pollsock is not valid */
 	--npsock->count;
+
+	/* stop listening on the addresses no longer configured */
+	sock_cleanup(&old);
 }
 
-/* always returns only a single new connection */
-static struct client_struct* sock_accept(const struct np_sock* npsock) {
+/* accepts all the pending connections on a wakeup, but returns them one by one */
+static struct client_struct* sock_accept(struct np_sock* npsock) {
 	int r, flags;
 	unsigned int i;
 	socklen_t client_saddr_len;
-	struct client_struct* ret;
+	struct client_struct* ret, **last;
 
 	if (npsock == NULL) {
 		return NULL;
 	}
 
-	/* poll for a new connection */
-	errno = 0;
-	r = poll(npsock->pollsock, npsock->count, netopeer_options.response_time);
-	if (r == 0 || (r == -1 && errno == EINTR)) {
-		/* we either timeouted or going to exit or restart */
-		return NULL;
-	}
-	if (r == -1) {
-		nc_verb_error("%s: poll failed (%s)", __func__, strerror(errno));
-		return NULL;
-	}
-
-	ret = calloc(1, sizeof(struct client_struct));
-	client_saddr_len = sizeof(struct sockaddr_storage);
+	if (npsock->pending == NULL) {
+		/* poll for new connections */
+		errno = 0;
+		r = poll(npsock->pollsock, npsock->count, netopeer_options.response_time);
+		if (r == 0 || (r == -1 && errno == EINTR)) {
+			/* we either timeouted or going to exit or restart */
+			return NULL;
+		}
+		if (r == -1) {
+			nc_verb_error("%s: poll failed (%s)", __func__, strerror(errno));
+			return NULL;
+		}
 
-	/* accept the first polled connection */
-	for (i = 0; i < npsock->count; ++i) {
-		if (npsock->pollsock[i].revents & POLLIN) {
-			ret->sock = accept(npsock->pollsock[i].fd, (struct sockaddr*)&ret->saddr, &client_saddr_len);
-			if (ret->sock == -1) {
-				nc_verb_error("%s: accept failed (%s)", __func__, strerror(errno));
-				free(ret);
-				return NULL;
-			}
-			/* make the socket non-blocking */
-			if (((flags = fcntl(ret->sock, F_GETFL)) == -1) || (fcntl(ret->sock, F_SETFL, flags | O_NONBLOCK) == -1)) {
-				nc_verb_error("%s: fcntl failed (%s)", __func__, strerror(errno));
-				close(ret->sock);
-				free(ret);
-				return NULL;
+		/* drain every polled socket */
+		last = &npsock->pending;
+		for (i = 0; i < npsock->count; ++i) {
+			if (!(npsock->pollsock[i].revents & POLLIN)) {
+				continue;
 			}
-			ret->transport = npsock->transport[i];
 			npsock->pollsock[i].revents = 0;
-			break;
+
+			while (1) {
+				if ((ret = np_slab_alloc(NP_SLAB_CLIENT)) == NULL) {
+					break;
+				}
+				client_saddr_len = sizeof(struct sockaddr_storage);
+
+				ret->sock = accept(npsock->pollsock[i].fd, (struct sockaddr*)&ret->saddr, &client_saddr_len);
+				if (ret->sock == -1) {
+					if (errno != EAGAIN && errno != EWOULDBLOCK) {
+						nc_verb_error("%s: accept failed (%s)", __func__, strerror(errno));
+					}
+					np_slab_free(NP_SLAB_CLIENT, ret);
+					break;
+				}
+				/* make the socket non-blocking */
+				if (((flags = fcntl(ret->sock, F_GETFL)) == -1) || (fcntl(ret->sock, F_SETFL, flags | O_NONBLOCK) == -1)) {
+					nc_verb_error("%s: fcntl failed (%s)", __func__, strerror(errno));
+					close(ret->sock);
+					np_slab_free(NP_SLAB_CLIENT, ret);
+					continue;
+				}
+				ret->transport = npsock->transport[i];
+
+				*last = ret;
+				last = &ret->next;
+			}
 		}
 	}
 
+	ret = npsock->pending;
+	if (ret != NULL) {
+		npsock->pending = ret->next;
+		ret->next = NULL;
+	}
+
 	return ret;
 }
 
-static void clear_broadcast_callhome_client(int fail) {
-    /* CALLHOME LOCK */
-    pthread_mutex_lock(&callhome_lock);
-    if (callhome_app) {
-        if (fail) {
-            callhome_app->client = NULL;
-        }
-        callhome_app = NULL;
-        pthread_cond_broadcast(&callhome_cond);
-    }
-    /* CALLHOME UNLOCK */
-    pthread_mutex_unlock(&callhome_lock);
+static void client_drop(struct client_struct* client) {
+	client->to_free = 1;
+	switch (client->transport) {
+#ifdef NP_SSH
+	case NC_TRANSPORT_SSH:
+		client_free_ssh((struct client_struct_ssh*)client);
+		break;
+#endif
+#ifdef NP_TLS
+	case NC_TRANSPORT_TLS:
+		client_free_tls((struct client_struct_tls*)client);
+		break;
+#endif
+	default:
+		np_slab_free(NP_SLAB_CLIENT, client);
+		nc_verb_error("%s: internal error (%s:%d)", __func__, __FILE__, __LINE__);
+	}
 }
 
-void listen_loop(int do_init) {
-	struct client_struct* new_client;
-	struct np_sock npsock = {.count = 0};
-	pthread_t client_tid;
-	int ret;
+/* only the builder thread (or listen_loop() while there is none) replaces the snapshots */
+static void server_id_build(void) {
 #ifdef NP_SSH
-	ssh_bind sshbind = NULL;
+	struct np_ssh_id* ssh_new, *ssh_old;
 #endif
 #ifdef NP_TLS
-	SSL_CTX* tlsctx = NULL;
+	SSL_CTX* tls_new, *tls_old;
 #endif
 
-	/* Init */
-	if (do_init) {
 #ifdef NP_SSH
-		np_ssh_init();
+	if (netopeer_options.ssh_opts->server_key_change_flag || server_id.ssh == NULL) {
+		/* keep the old identity if the new one cannot be created */
+		if ((ssh_new = np_ssh_server_id_new()) != NULL) {
+			/* SERVER ID LOCK */
+			pthread_mutex_lock(&server_id.lock);
+			ssh_old = server_id.ssh;
+			server_id.ssh = ssh_new;
+			/* SERVER ID UNLOCK */
+			pthread_mutex_unlock(&server_id.lock);
+
+			np_ssh_server_id_put(ssh_old);
+		}
+	}
 #endif
 #ifdef NP_TLS
-		np_tls_init();
-#endif
+	if (netopeer_options.tls_opts->tls_ctx_change_flag || server_id.tls == NULL) {
+		if ((tls_new = np_tls_server_id_new()) != NULL) {
+			/* SERVER ID LOCK */
+			pthread_mutex_lock(&server_id.lock);
+			tls_old = server_id.tls;
+			server_id.tls = tls_new;
+			/* SERVER ID UNLOCK */
+			pthread_mutex_unlock(&server_id.lock);
+
+			/* the connections created from it hold their own references */
+			SSL_CTX_free(tls_old);
+		}
 	}
+#endif
+}
 
-	/* Main accept loop */
-	do {
-		new_client = NULL;
+static void* server_id_thread(void* UNUSED(arg)) {
+	/* SERVER ID LOCK */
+	pthread_mutex_lock(&server_id.lock);
+	while (!server_id.stop) {
+		if (!server_id.rebuild) {
+			pthread_cond_wait(&server_id.cond, &server_id.lock);
+			continue;
+		}
 
-		/* Binds change check */
-		if (netopeer_options.binds_change_flag) {
-			/* BINDS LOCK */
-			pthread_mutex_lock(&netopeer_options.binds_lock);
+		/* SERVER ID UNLOCK */
+		pthread_mutex_unlock(&server_id.lock);
 
-			sock_cleanup(&npsock);
-			sock_listen(netopeer_options.binds, &npsock);
+		server_id_build();
 
-			netopeer_options.binds_change_flag = 0;
-			/* BINDS UNLOCK */
-			pthread_mutex_unlock(&netopeer_options.binds_lock);
+		/* SERVER ID LOCK */
+		pthread_mutex_lock(&server_id.lock);
+		server_id.rebuild = 0;
+	}
+	/* SERVER ID UNLOCK */
+	pthread_mutex_unlock(&server_id.lock);
 
-			if (npsock.count == 0) {
-				nc_verb_warning("Server is not listening on any address!");
-			}
-		}
+#ifdef NP_TLS
+	np_tls_thread_cleanup();
+#endif
+
+	return NULL;
+}
+
+/* let the builder thread create a new identity if any of the server keys or certificates changed */
+static void server_id_check(void) {
+	int changed = 0;
 
 #ifdef NP_SSH
-		sshbind = np_ssh_server_id_check(sshbind);
+	changed |= netopeer_options.ssh_opts->server_key_change_flag;
 #endif
 #ifdef NP_TLS
-		tlsctx = np_tls_server_id_check(tlsctx);
+	changed |= netopeer_options.tls_opts->tls_ctx_change_flag;
 #endif
+	if (!changed) {
+		return;
+	}
 
-		/* Callhome client check */
-        /* CALLHOME LOCK */
-        pthread_mutex_lock(&callhome_lock);
-		if (callhome_app) {
-			new_client = callhome_app->client;
-		}
-		/* CALLHOME UNLOCK */
-        pthread_mutex_unlock(&callhome_lock);
+	/* SERVER ID LOCK */
+	pthread_mutex_lock(&server_id.lock);
+	if (!server_id.rebuild) {
+		server_id.rebuild = 1;
+		pthread_cond_signal(&server_id.cond);
+	}
+	/* SERVER ID UNLOCK */
+	pthread_mutex_unlock(&server_id.lock);
+}
 
-		/* Listen client check */
-		if (new_client == NULL) {
-			new_client = sock_accept(&npsock);
-		}
+static void server_id_start(void) {
+	int ret;
 
-		/* New client full structure creation */
-		if (new_client != NULL) {
+	/* the first identity must be ready before accepting anyone */
+	server_id_build();
+
+	server_id.stop = 0;
+	server_id.rebuild = 0;
+	if ((ret = pthread_create(&server_id.builder, NULL, server_id_thread, NULL)) != 0) {
+		nc_verb_error("%s: failed to create a thread (%s)", __func__, strerror(ret));
+		server_id.stop = 1;
+	}
+}
+
+static void server_id_stop(void) {
+	if (!server_id.stop) {
+		/* SERVER ID LOCK */
+		pthread_mutex_lock(&server_id.lock);
+		server_id.stop = 1;
+		pthread_cond_signal(&server_id.cond);
+		/* SERVER ID UNLOCK */
+		pthread_mutex_unlock(&server_id.lock);
 
-			/* Maximum number of sessions check */
-			if (netopeer_options.max_sessions > 0) {
-				ret = 0;
-				/* GLOBAL LOCK */
-				pthread_mutex_lock(&netopeer_state.global_lock);
+		pthread_join(server_id.builder, NULL);
+	}
+
+	/* SERVER ID LOCK */
+	pthread_mutex_lock(&server_id.lock);
 #ifdef NP_SSH
-				ret += np_ssh_session_count();
+	np_ssh_server_id_put(server_id.ssh);
+	server_id.ssh = NULL;
 #endif
 #ifdef NP_TLS
-				ret += np_tls_session_count();
+	SSL_CTX_free(server_id.tls);
+	server_id.tls = NULL;
 #endif
-				/* GLOBAL UNLOCK */
-				pthread_mutex_unlock(&netopeer_state.global_lock);
+	/* SERVER ID UNLOCK */
+	pthread_mutex_unlock(&server_id.lock);
+}
 
-				if (ret >= netopeer_options.max_sessions) {
-					nc_verb_error("Maximum number of sessions reached, droppping the new client.");
-					new_client->to_free = 1;
-					switch (new_client->transport) {
+/* return: 0 - client added, 1 - client dropped on error or over the connection rate limit, 2 - client dropped because of max-sessions */
+int np_client_setup(struct client_struct* new_client) {
 #ifdef NP_SSH
-					case NC_TRANSPORT_SSH:
-						client_free_ssh((struct client_struct_ssh*)new_client);
-						break;
+	struct np_ssh_id* ssh_id;
 #endif
 #ifdef NP_TLS
-					case NC_TRANSPORT_TLS:
-						client_free_tls((struct client_struct_tls*)new_client);
-						break;
+	SSL_CTX* tls_id;
 #endif
-					default:
-						free(new_client);
-						nc_verb_error("%s: internal error (%s:%d)", __func__, __FILE__, __LINE__);
-					}
+	int ret;
 
-					clear_broadcast_callhome_client(1);
+	/* refuse a flooding address before spending any handshake on it */
+	if (np_ratelimit_connection(&new_client->saddr) != 0) {
+		nc_verb_verbose("Connection rate limit of the client address exceeded, dropping the new client.");
+		client_drop(new_client);
+		return 1;
+	}
 
-					/* sleep to prevent clients from immediate connection retry */
-					usleep(netopeer_options.response_time*1000);
-					continue;
-				}
-			}
+	/* Maximum number of sessions check */
+	if (session_reserve()) {
+		nc_verb_error("Maximum number of sessions reached, droppping the new client.");
+		client_drop(new_client);
+		return 2;
+	}
 
-			switch (new_client->transport) {
+	/* the server state is being reloaded */
+	if (np_engine_setup_enter() != 0) {
+		nc_verb_verbose("Server is restarting, dropping the new client.");
+		np_session_count_add(-1);
+		client_drop(new_client);
+		return 1;
+	}
+
+	switch (new_client->transport) {
 #ifdef NP_SSH
-			case NC_TRANSPORT_SSH:
-				ret = np_ssh_create_client((struct client_struct_ssh*)new_client, sshbind);
-				if (ret != 0) {
-					new_client->to_free = 1;
-					client_free_ssh((struct client_struct_ssh*)new_client);
-				}
-				break;
+	case NC_TRANSPORT_SSH:
+		/* SERVER ID LOCK */
+		pthread_mutex_lock(&server_id.lock);
+		if ((ssh_id = server_id.ssh) != NULL) {
+			__sync_add_and_fetch(&ssh_id->refs, 1);
+		}
+		/* SERVER ID UNLOCK */
+		pthread_mutex_unlock(&server_id.lock);
+
+		if (ssh_id == NULL) {
+			nc_verb_error("No SSH server identity, dropping the new client.");
+			ret = 1;
+		} else {
+			ret = np_ssh_create_client((struct client_struct_ssh*)new_client, ssh_id->sshbind);
+			np_ssh_server_id_put(ssh_id);
+		}
+		if (ret != 0) {
+			new_client->to_free = 1;
+			client_free_ssh((struct client_struct_ssh*)new_client);
+		}
+		break;
 #endif
 #ifdef NP_TLS
-			case NC_TRANSPORT_TLS:
-				ret = np_tls_create_client((struct client_struct_tls*)new_client, tlsctx);
-				if (ret != 0) {
-					new_client->to_free = 1;
-					client_free_tls((struct client_struct_tls*)new_client);
-				}
-				break;
+	case NC_TRANSPORT_TLS:
+		/* SERVER ID LOCK */
+		pthread_mutex_lock(&server_id.lock);
+		if ((tls_id = server_id.tls) != NULL) {
+			np_tls_server_id_ref(tls_id);
+		}
+		/* SERVER ID UNLOCK */
+		pthread_mutex_unlock(&server_id.lock);
+
+		if (tls_id == NULL) {
+			nc_verb_error("No TLS server identity, dropping the new client.");
+			ret = 1;
+		} else {
+			ret = np_tls_create_client((struct client_struct_tls*)new_client, tls_id);
+			SSL_CTX_free(tls_id);
+		}
+		if (ret != 0) {
+			new_client->to_free = 1;
+			client_free_tls((struct client_struct_tls*)new_client);
+		}
+		break;
 #endif
-			default:
-				nc_verb_error("Client with an unknown transport protocol, dropping it.");
-				free(new_client);
-				ret = 1;
-			}
+	default:
+		nc_verb_error("Client with an unknown transport protocol, dropping it.");
+		np_slab_free(NP_SLAB_CLIENT, new_client);
+		ret = 1;
+	}
+	np_engine_setup_leave();
 
-			/* client is not valid, some error occured */
-			if (ret != 0) {
-                clear_broadcast_callhome_client(1);
-				continue;
-			}
+	/* client is not valid, some error occured */
+	if (ret != 0) {
+		np_session_count_add(-1);
+		return 1;
+	}
 
-			/* add the client into the global clients structure */
-			/* GLOBAL LOCK */
-			pthread_mutex_lock(&netopeer_state.global_lock);
-			client_append(&netopeer_state.clients, new_client);
-			/* GLOBAL UNLOCK */
-			pthread_mutex_unlock(&netopeer_state.global_lock);
+	/* add the client into the global clients structure */
+	/* GLOBAL LOCK */
+	pthread_mutex_lock(&netopeer_state.global_lock);
+	client_append(&netopeer_state.clients, new_client);
+	/* GLOBAL UNLOCK */
+	pthread_mutex_unlock(&netopeer_state.global_lock);
+
+	/* let the engine take care of the client */
+	if (np_engine_add_client(new_client) != EXIT_SUCCESS) {
+		/* GLOBAL LOCK */
+		pthread_mutex_lock(&netopeer_state.global_lock);
+		np_client_detach(&netopeer_state.clients, new_client);
+		/* GLOBAL UNLOCK */
+		pthread_mutex_unlock(&netopeer_state.global_lock);
+
+		client_drop(new_client);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void* acceptor_thread(void* arg) {
+	struct np_sock* npsock = (struct np_sock*)arg;
+	struct client_struct* new_client;
+
+	/* the sockets still listening on the configured addresses are kept */
+	/* BINDS LOCK */
+	pthread_mutex_lock(&netopeer_options.binds_lock);
+	sock_listen(netopeer_options.binds, npsock, netopeer_options.listen_backlog, 1);
+	/* BINDS UNLOCK */
+	pthread_mutex_unlock(&netopeer_options.binds_lock);
+
+	while (!acceptors.stop && !quit && !restart_soft) {
+		if ((new_client = sock_accept(npsock)) == NULL) {
+			continue;
+		}
+		if (np_client_setup(new_client) == 2 && npsock->pending == NULL) {
+			/* sleep to prevent clients from immediate connection retry */
+			usleep(netopeer_options.response_time*1000);
+		}
+	}
+
+	/* the connections queued meanwhile are accepted once restarted */
+	return NULL;
+}
+
+static void acceptors_stop(void) {
+	unsigned int i;
+
+	acceptors.stop = 1;
+	for (i = 0; i < acceptors.count; ++i) {
+		pthread_join(acceptors.threads[i], NULL);
+	}
+	free(acceptors.threads);
+	acceptors.threads = NULL;
+	acceptors.count = 0;
+	acceptors.stop = 0;
+}
+
+static void acceptors_cleanup(void) {
+	unsigned int i;
+
+	for (i = 0; i < acceptors.sock_count; ++i) {
+		sock_cleanup(&acceptors.socks[i]);
+	}
+	free(acceptors.socks);
+	acceptors.socks = NULL;
+	acceptors.sock_count = 0;
+}
 
-			/* start the client thread */
-			if ((ret = pthread_create((pthread_t*)&new_client->tid, NULL, client_main_thread, (void*)new_client)) != 0) {
-				nc_verb_error("%s: failed to create a thread (%s)", __func__, strerror(ret));
+/* the threads must be stopped */
+static void acceptors_start(unsigned int count) {
+	struct np_sock* socks;
+	int ret;
 
-				/* GLOBAL LOCK */
-				pthread_mutex_lock(&netopeer_state.global_lock);
-				np_client_detach(&netopeer_state.clients, new_client);
-				/* GLOBAL UNLOCK */
-				pthread_mutex_unlock(&netopeer_state.global_lock);
+	if (count < acceptors.sock_count) {
+		/* fewer acceptors, their queued connections are reset */
+		while (acceptors.sock_count > count) {
+			sock_cleanup(&acceptors.socks[--acceptors.sock_count]);
+		}
+	} else if (count > acceptors.sock_count) {
+		if ((socks = realloc(acceptors.socks, count * sizeof *socks)) == NULL) {
+			nc_verb_error("%s: memory allocation failed (%s)", __func__, strerror(errno));
+			count = acceptors.sock_count;
+		} else {
+			memset(socks + acceptors.sock_count, 0, (count - acceptors.sock_count) * sizeof *socks);
+			acceptors.socks = socks;
+			acceptors.sock_count = count;
+		}
+	}
 
-				new_client->tid = 0;
-				new_client->to_free = 1;
-				switch (new_client->transport) {
+	if (count == 0) {
+		return;
+	}
+
+	if ((acceptors.threads = malloc(count * sizeof *acceptors.threads)) == NULL) {
+		nc_verb_error("%s: memory allocation failed (%s)", __func__, strerror(errno));
+		count = 0;
+	}
+	for (acceptors.count = 0; acceptors.count < count; ++acceptors.count) {
+		if ((ret = pthread_create(&acceptors.threads[acceptors.count], NULL, acceptor_thread, &acceptors.socks[acceptors.count])) != 0) {
+			nc_verb_error("%s: failed to create an acceptor thread (%s)", __func__, strerror(ret));
+			break;
+		}
+	}
+	/* no one would accept the connections queued on the sockets of the missing acceptors */
+	while (acceptors.sock_count > acceptors.count) {
+		sock_cleanup(&acceptors.socks[--acceptors.sock_count]);
+	}
+}
+
+void listen_loop(int do_init) {
+	struct client_struct* new_client;
+	int ret, prof, report = 1;
+
+	/* Init */
+	if (do_init) {
+		if (np_engine_init()) {
+			nc_verb_error("Failed to start the client engine.");
+			return;
+		}
 #ifdef NP_SSH
-				case NC_TRANSPORT_SSH:
-					client_free_ssh((struct client_struct_ssh*)new_client);
-					break;
+		np_ssh_init();
 #endif
 #ifdef NP_TLS
-				case NC_TRANSPORT_TLS:
-					client_free_tls((struct client_struct_tls*)new_client);
-					break;
+		np_tls_init();
 #endif
-				default:
-					free(new_client);
-					break;
-				}
+	}
 
-				clear_broadcast_callhome_client(1);
-				continue;
+	server_id_start();
+
+	if (!netopeer_options.binds_change_flag) {
+		/* the same addresses after a soft restart, only the other acceptors were stopped */
+		acceptors_start(listener.acceptor_count-1);
+	}
+
+	/* Main accept loop */
+	do {
+		/* Binds change check */
+		if (netopeer_options.binds_change_flag) {
+			/* the other acceptors listen on the same addresses, restart them */
+			acceptors_stop();
+
+			/* BINDS LOCK */
+			pthread_mutex_lock(&netopeer_options.binds_lock);
+
+			listener.acceptor_count = (netopeer_options.acceptors > 1 ? netopeer_options.acceptors : 1);
+			prof = np_profile_begin("listen", NULL);
+			sock_listen(netopeer_options.binds, &listener.sock, netopeer_options.listen_backlog, (listener.acceptor_count > 1));
+			np_profile_end(prof);
+
+			netopeer_options.binds_change_flag = 0;
+			/* BINDS UNLOCK */
+			pthread_mutex_unlock(&netopeer_options.binds_lock);
+
+			if (listener.sock.count == 0) {
+				nc_verb_warning("Server is not listening on any address!");
 			}
 
-			/* Signal app loops if needed */
-			clear_broadcast_callhome_client(0);
+			acceptors_start(listener.acceptor_count-1);
+		}
+
+		if (report) {
+			/* the (re)start is finished with the listening sockets */
+			np_profile_report();
+			report = 0;
+		}
+
+		/* a changed server identity is built meanwhile, the old one is used until then */
+		server_id_check();
+
+		/* Listen client check, the Call Home clients are set up by their connector */
+		new_client = sock_accept(&listener.sock);
+
+		/* New client full structure creation */
+		if (new_client != NULL) {
+			ret = np_client_setup(new_client);
+
+			if (ret == 2 && listener.sock.pending == NULL) {
+				/* sleep to prevent clients from immediate connection retry */
+				usleep(netopeer_options.response_time*1000);
+			}
 		}
 
 	} while (!quit && !restart_soft);
 
 	/* Cleanup */
-	sock_cleanup(&npsock);
-#ifdef NP_SSH
-	ssh_bind_free(sshbind);
-#endif
-#ifdef NP_TLS
-	SSL_CTX_free(tlsctx);
-#endif
+	acceptors_stop();
+	server_id_stop();
+
 	if (!restart_soft) {
+		sock_cleanup(&listener.sock);
+		acceptors_cleanup();
+
 		/* wait for all the clients to exit nicely themselves */
+		np_engine_kick_all();
 		while (1) {
 			/* GLOBAL LOCK */
 			pthread_mutex_lock(&netopeer_state.global_lock);
-
-			if (netopeer_state.clients == NULL) {
-				/* GLOBAL UNLOCK */
-				pthread_mutex_unlock(&netopeer_state.global_lock);
-
-				break;
-			}
-
-			client_tid = netopeer_state.clients->tid;
-
+			ret = (netopeer_state.clients == NULL);
 			/* GLOBAL UNLOCK */
 			pthread_mutex_unlock(&netopeer_state.global_lock);
 
-			ret = pthread_join(client_tid, NULL);
-			if (ret == EINVAL) {
-				/* Call Home app is already waiting for it, let it handle it */
-				usleep(10000);
-				continue;
-			}
-			if (ret != 0) {
-				nc_verb_error("Failed to join client thread (%s).", strerror(ret));
+			if (ret) {
+				break;
 			}
+			usleep(10000);
 		}
 
+		np_workers_cleanup();
+		np_notif_cleanup();
+		np_ratelimit_cleanup();
+		np_engine_cleanup();
+
+		/* all the sessions are gone by now */
+		free(netopeer_state.sess_index);
+		netopeer_state.sess_index = NULL;
+		netopeer_state.sess_index_size = 0;
+		netopeer_state.sess_index_count = 0;
+
 #ifdef NP_SSH
 		np_ssh_cleanup();
 #endif
@@ -712,9 +1129,9 @@ int main(int argc, char** argv) {
 	struct sigaction action;
 	sigset_t block_mask;
 
-	char *aux_string = NULL, path[PATH_MAX+1];
+	char *aux_string = NULL, *log_path = NULL, path[PATH_MAX+1];
 	int next_option;
-	int daemonize = 0, len;
+	int daemonize = 0, len, prof;
 	int listen_init = 1;
 	struct np_module* netopeer_module = NULL, *server_module = NULL;
 
@@ -736,6 +1153,12 @@ int main(int argc, char** argv) {
 		case 'h':
 			print_usage(argv[0]);
 			break;
+		case 'l':
+			log_path = optarg;
+			break;
+		case 'p':
+			np_profile_enable(optarg);
+			break;
 		case 'v':
 			netopeer_options.verbose = atoi(optarg);
 			break;
@@ -778,6 +1201,12 @@ int main(int argc, char** argv) {
 		openlog("netopeer-server", LOG_PID|LOG_PERROR, LOG_DAEMON);
 	}
 
+	/* from now on the messages are only queued by the calling threads */
+	if (np_log_init(log_path)) {
+		return EXIT_FAILURE;
+	}
+	atexit(np_log_cleanup);
+
 	/* make sure we were executed by root */
 	if (geteuid() != 0) {
 		nc_verb_error("Failed to start, must have root privileges.");
@@ -791,15 +1220,24 @@ int main(int argc, char** argv) {
 	 */
 	LIBXML_TEST_VERSION
 
+	np_profile_start(0);
+
 	/* initialize library including internal datastores and maybee something more */
+	prof = np_profile_begin("nc-init", NULL);
 	if (nc_init(NC_INIT_ALL | NC_INIT_MULTILAYER) < 0) {
 		nc_verb_error("Library initialization failed.");
 		return EXIT_FAILURE;
 	}
+	np_profile_end(prof);
 
 	server_start = 1;
 
 restart:
+	/* the configurations of all the modules are parsed at once, module_enable() takes them */
+	prof = np_profile_begin("modcache-prefetch", NULL);
+	np_modcache_prefetch();
+	np_profile_end(prof);
+
 	/* start NETCONF server module */
 	if ((server_module = calloc(1, sizeof(struct np_module))) == NULL) {
 		nc_verb_error("Creating necessary NETCONF server plugin failed!");
@@ -829,11 +1267,31 @@ restart:
 		return EXIT_FAILURE;
 	}
 
+	/* the modules not enabled */
+	np_modcache_cleanup();
+
 	server_start = 0;
 	nc_verb_verbose("Netopeer server successfully initialized.");
 
+	if (!listen_init) {
+		/* the RPCs received during the soft restart are applied on the new datastores */
+		np_workers_resume();
+		/* the server state exists again, process the clients */
+		np_engine_resume();
+	}
+
 	listen_loop(listen_init);
 
+	if (restart_soft) {
+		/*
+		 * The sessions and the listening sockets are kept,
+		 * only the datastores cannot be used until reloaded.
+		 */
+		np_workers_pause();
+		/* the clients would use the server state freed with the modules */
+		np_engine_pause();
+	}
+
 	/* unload Netopeer module -> unload all modules */
 	module_disable(server_module, 1);
 	module_disable(netopeer_module, 1);
@@ -843,12 +1301,14 @@ restart:
 	if (!restart_soft) {
 		/* close libnetconf only when shutting down or hard restarting the server */
 		nc_close();
+		np_slab_cleanup();
 	}
 
 	if (restart_soft) {
 		nc_verb_verbose("Server is going to soft restart.");
 		restart_soft = 0;
 		listen_init = 0;
+		np_profile_start(1);
 		goto restart;
 	} else if (restart_hard) {
 		nc_verb_verbose("Server is going to hard restart.");
@@ -856,6 +1316,7 @@ restart:
 		if (len > 0) {
 			path[len] = 0;
 			xmlCleanupParser();
+			np_log_cleanup();
 			execv(path, argv);
 		}
 		nc_verb_error("Failed to get the path to self.");
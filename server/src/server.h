@@ -40,26 +40,60 @@
 #define _SERVER_H_
 
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <libnetconf.h>
 
 #include "netconf_server_transapi.h"
 #include "cfgnetopeer_transapi.h"
+#include "engine.h"
+#include "workers.h"
+#include "notif.h"
+#include "stats.h"
+#include "ratelimit.h"
+#include "logger.h"
+#include "slab.h"
+#include "modcache.h"
+#include "profile.h"
+#include "reply.h"
 
 #include "config.h"
 
+/* transport handshake (SSH key exchange, TLS handshake) states */
+#define NP_HANDSHAKE_DONE 0
+#define NP_HANDSHAKE_WANT_READ 1
+#define NP_HANDSHAKE_WANT_WRITE 2
+
 /* for each client */
 struct client_struct {
 	NC_TRANSPORT transport;
 
 	int sock;
 	struct sockaddr_storage saddr;
-	volatile pthread_t tid;
 	char* username;
 	volatile int to_free;
 	struct client_struct* next;
+	struct client_struct* prev;
+
+	int ev_flags;						// NP_EV_* flags, protected by the engine lock
+	struct client_struct* ev_next;		// engine queue linking
+	struct ch_app* callhome;			// Call Home app owning the client, protected by CALLHOME LOCK
+	int rpc_jobs;						// RPC jobs submitted to the workers and not freed yet
+	int handshake;						// NP_HANDSHAKE_* state of the transport handshake
+	uint64_t tm_deadline;				// monotonic msecs of the engine timer expiration, 0 if not armed
+	struct client_struct* tm_next;		// engine timer wheel slot linking
+	struct client_struct* tm_prev;
+
+	char __padding[(((((CLIENT_STRUCT_MAX_SIZE) - 5*sizeof(int)) - sizeof(struct sockaddr_storage)) - 7*sizeof(void*)) - sizeof(uint64_t)) - sizeof(NC_TRANSPORT)];
+};
 
-	char __padding[((((CLIENT_STRUCT_MAX_SIZE) - 2*sizeof(int)) - sizeof(struct sockaddr_storage)) - 3*sizeof(void*)) - sizeof(NC_TRANSPORT)];
+/* session-id index entry */
+struct np_sess_entry {
+	char* sid;
+	struct client_struct* client;
+	void* data;							// transport-specific session structure (SSH channel)
+	struct np_sess_entry* next;
 };
 
 /* one global structure */
@@ -67,6 +101,13 @@ struct np_state {
 	/* locked when adding/removing clients */
 	pthread_mutex_t global_lock;
 	struct client_struct* clients;
+	struct np_sess_entry** sess_index;	// session-id hash index
+	unsigned int sess_index_size;
+	unsigned int sess_index_count;
+
+	/* clients without any NETCONF session yet count as one soon-to-be session, atomic */
+	volatile int session_count;
+
 	struct np_state_tls* tls_state;
 };
 
@@ -79,12 +120,28 @@ struct np_sock {
 	struct pollfd* pollsock;
 	NC_TRANSPORT* transport;
 	unsigned int count;
+	int reuseport;						// SO_REUSEPORT set on the sockets
+	struct client_struct* pending;		// accepted connections not yet returned
 };
 
-unsigned int timeval_diff(struct timeval tv1, struct timeval tv2);
+uint64_t np_timespec_msec(const struct timespec* ts);
+
+uint64_t np_clock_msec(void);
+
+size_t np_hello_len(void);
 
 void* client_notif_thread(void* arg);
 
+int np_client_setup(struct client_struct* new_client);
+
 void np_client_detach(struct client_struct** root, struct client_struct* del_client);
 
+void np_session_count_add(int delta);
+
+int np_sess_index_add(struct nc_session* session, struct client_struct* client, void* data);
+
+void np_sess_index_del(struct nc_session* session);
+
+struct np_sess_entry* np_sess_index_find(const char* sid);
+
 #endif /* _SERVER_H_ */
\ No newline at end of file
@@ -0,0 +1,351 @@
+/**
+ * @file slab.c
+ * @brief Netopeer server object caches
+ *
+ * Copyright (C) 2015 CESNET, z.s.p.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of the Company nor the names of its contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * ALTERNATIVELY, provided that this notice is retained in full, this
+ * product may be distributed under the terms of the GNU General Public
+ * License (GPL) version 2 or later, in which case the provisions
+ * of the GPL apply INSTEAD OF those given above.
+ *
+ * This software is provided ``as is, and any express or implied
+ * warranties, including, but not limited to, the implied warranties of
+ * merchantability and fitness for a particular purpose are disclaimed.
+ * In no event shall the company or contributors be liable for any
+ * direct, indirect, incidental, special, exemplary, or consequential
+ * damages (including, but not limited to, procurement of substitute
+ * goods or services; loss of use, data, or profits; or business
+ * interruption) however caused and on any theory of liability, whether
+ * in contract, strict liability, or tort (including negligence or
+ * otherwise) arising in any way out of the use of this software, even
+ * if advised of the possibility of such damage.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "server.h"
+
+static const char rcsid[] __attribute__((used)) ="$Id: "__FILE__": "RCSID" $";
+
+/*
+ * Every thread keeps 2 magazines of free objects of each type, it allocates
+ * from and frees into the loaded one and swaps it with the previous one when
+ * the loaded one gets empty or full. Only when both of them are, a magazine
+ * is exchanged with the shared depot, so a thread goes there at most once
+ * per SLAB_MAGAZINE_SIZE operations. Objects are never returned to the system
+ * until np_slab_cleanup(), the caches keep the peak number of them.
+ */
+struct slab_mag {
+	unsigned int count;
+	void* objs[SLAB_MAGAZINE_SIZE];
+	struct slab_mag* next;
+};
+
+struct slab_chunk {
+	struct slab_chunk* next;
+	char objs[] __attribute__((aligned(16)));
+};
+
+struct slab_local {
+	struct slab_mag* loaded;
+	struct slab_mag* previous;
+	unsigned long allocs;				// folded into the cache on a depot exchange
+	unsigned long frees;
+};
+
+struct slab_cache {
+	const char* name;
+	size_t size;
+
+	/* SLAB LOCK */
+	pthread_mutex_t lock;
+	struct slab_mag* full;				// magazines with some objects
+	struct slab_mag* empty;
+	struct slab_chunk* chunks;
+	char* fresh;						// objects of the last chunk not used yet
+	unsigned int fresh_count;
+	unsigned long objects;
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long transfers;
+};
+
+#define SLAB_OBJ_SIZE(size) (((size) + 15) & ~(size_t)15)
+
+static struct slab_cache slab_caches[NP_SLAB_TYPES] = {
+	{.name = "client", .size = SLAB_OBJ_SIZE(sizeof(struct client_struct)), .lock = PTHREAD_MUTEX_INITIALIZER},
+#ifdef NP_SSH
+	{.name = "ssh-channel", .size = SLAB_OBJ_SIZE(sizeof(struct chan_struct)), .lock = PTHREAD_MUTEX_INITIALIZER},
+#else
+	{.name = "ssh-channel", .size = 16, .lock = PTHREAD_MUTEX_INITIALIZER},
+#endif
+	{.name = "notification-thread", .size = SLAB_OBJ_SIZE(sizeof(struct ntf_thread_config)), .lock = PTHREAD_MUTEX_INITIALIZER}
+};
+
+static pthread_key_t slab_key;
+static pthread_once_t slab_key_once = PTHREAD_ONCE_INIT;
+
+static __thread struct slab_local slab_local[NP_SLAB_TYPES];
+static __thread int slab_local_set;
+
+/* SLAB LOCK must be held */
+static void slab_fold(struct slab_cache* cache, struct slab_local* local) {
+	cache->allocs += local->allocs;
+	cache->frees += local->frees;
+	local->allocs = 0;
+	local->frees = 0;
+}
+
+/* SLAB LOCK must be held */
+static void slab_depot_put(struct slab_cache* cache, struct slab_mag* mag) {
+	if (mag == NULL) {
+		return;
+	}
+
+	if (mag->count == 0) {
+		mag->next = cache->empty;
+		cache->empty = mag;
+	} else {
+		mag->next = cache->full;
+		cache->full = mag;
+	}
+}
+
+/* the thread exited, give its magazines to the other threads */
+static void slab_release(void* UNUSED(arg)) {
+	struct slab_cache* cache;
+	int i;
+
+	for (i = 0; i < NP_SLAB_TYPES; ++i) {
+		cache = &slab_caches[i];
+
+		/* SLAB LOCK */
+		pthread_mutex_lock(&cache->lock);
+		slab_depot_put(cache, slab_local[i].loaded);
+		slab_depot_put(cache, slab_local[i].previous);
+		slab_fold(cache, &slab_local[i]);
+		/* SLAB UNLOCK */
+		pthread_mutex_unlock(&cache->lock);
+
+		slab_local[i].loaded = NULL;
+		slab_local[i].previous = NULL;
+	}
+	slab_local_set = 0;
+}
+
+static void slab_key_create(void) {
+	pthread_key_create(&slab_key, slab_release);
+}
+
+/* return: the magazines of the calling thread */
+static struct slab_local* slab_local_get(int type) {
+	if (!slab_local_set) {
+		/* just to get the magazines back when the thread exits */
+		pthread_once(&slab_key_once, slab_key_create);
+		pthread_setspecific(slab_key, slab_local);
+		slab_local_set = 1;
+	}
+
+	return &slab_local[type];
+}
+
+/* SLAB LOCK must be held, return: a magazine filled with new objects, NULL on error */
+static struct slab_mag* slab_grow(struct slab_cache* cache) {
+	struct slab_mag* mag;
+	struct slab_chunk* chunk;
+	unsigned int count;
+
+	if ((mag = cache->empty) != NULL) {
+		cache->empty = mag->next;
+	} else if ((mag = malloc(sizeof *mag)) == NULL) {
+		return NULL;
+	}
+	mag->count = 0;
+
+	while (mag->count < SLAB_MAGAZINE_SIZE) {
+		if (cache->fresh_count == 0) {
+			count = (SLAB_CHUNK_SIZE - sizeof *chunk) / cache->size;
+			if (count == 0) {
+				count = 1;
+			}
+			if ((chunk = malloc(sizeof *chunk + count * cache->size)) == NULL) {
+				break;
+			}
+			chunk->next = cache->chunks;
+			cache->chunks = chunk;
+			cache->fresh = chunk->objs;
+			cache->fresh_count = count;
+			cache->objects += count;
+		}
+
+		mag->objs[mag->count++] = cache->fresh;
+		cache->fresh += cache->size;
+		--cache->fresh_count;
+	}
+
+	if (mag->count == 0) {
+		mag->next = cache->empty;
+		cache->empty = mag;
+		return NULL;
+	}
+	return mag;
+}
+
+void* np_slab_alloc(int type) {
+	struct slab_cache* cache = &slab_caches[type];
+	struct slab_local* local = slab_local_get(type);
+	struct slab_mag* mag;
+	void* obj;
+
+	if (local->loaded == NULL || local->loaded->count == 0) {
+		if (local->previous != NULL && local->previous->count != 0) {
+			mag = local->loaded;
+			local->loaded = local->previous;
+			local->previous = mag;
+		} else {
+			/* SLAB LOCK */
+			pthread_mutex_lock(&cache->lock);
+			if ((mag = cache->full) != NULL) {
+				cache->full = mag->next;
+			} else {
+				mag = slab_grow(cache);
+			}
+			if (mag != NULL) {
+				/* keep the empty one for the frees */
+				slab_depot_put(cache, local->previous);
+				local->previous = local->loaded;
+				local->loaded = mag;
+				++cache->transfers;
+			}
+			slab_fold(cache, local);
+			/* SLAB UNLOCK */
+			pthread_mutex_unlock(&cache->lock);
+
+			if (mag == NULL) {
+				nc_verb_error("%s: memory allocation failed", __func__);
+				return NULL;
+			}
+		}
+	}
+
+	obj = local->loaded->objs[--local->loaded->count];
+	++local->allocs;
+	memset(obj, 0, cache->size);
+	return obj;
+}
+
+void np_slab_free(int type, void* obj) {
+	struct slab_cache* cache = &slab_caches[type];
+	struct slab_local* local;
+	struct slab_mag* mag;
+
+	if (obj == NULL) {
+		return;
+	}
+
+	local = slab_local_get(type);
+	if (local->loaded == NULL || local->loaded->count == SLAB_MAGAZINE_SIZE) {
+		if (local->previous != NULL && local->previous->count != SLAB_MAGAZINE_SIZE) {
+			mag = local->loaded;
+			local->loaded = local->previous;
+			local->previous = mag;
+		} else {
+			/* SLAB LOCK */
+			pthread_mutex_lock(&cache->lock);
+			if ((mag = cache->empty) != NULL) {
+				cache->empty = mag->next;
+			} else if ((mag = malloc(sizeof *mag)) == NULL) {
+				/* the object cannot be cached, it stays allocated until the cleanup */
+				++cache->frees;
+				/* SLAB UNLOCK */
+				pthread_mutex_unlock(&cache->lock);
+				nc_verb_error("%s: memory allocation failed", __func__);
+				return;
+			}
+			mag->count = 0;
+			/* keep the full one for the allocations */
+			slab_depot_put(cache, local->previous);
+			local->previous = local->loaded;
+			local->loaded = mag;
+			++cache->transfers;
+			slab_fold(cache, local);
+			/* SLAB UNLOCK */
+			pthread_mutex_unlock(&cache->lock);
+		}
+	}
+
+	local->loaded->objs[local->loaded->count++] = obj;
+	++local->frees;
+}
+
+void np_slab_stats(int type, struct np_slab_stats* stats) {
+	struct slab_cache* cache = &slab_caches[type];
+
+	/* SLAB LOCK */
+	pthread_mutex_lock(&cache->lock);
+	stats->name = cache->name;
+	stats->object_size = cache->size;
+	stats->objects = cache->objects;
+	stats->in_use = (cache->allocs > cache->frees ? cache->allocs - cache->frees : 0);
+	stats->allocations = cache->allocs;
+	stats->depot_transfers = cache->transfers;
+	/* SLAB UNLOCK */
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void np_slab_cleanup(void) {
+	struct slab_cache* cache;
+	struct slab_mag* mag;
+	struct slab_chunk* chunk;
+	int i;
+
+	/* the magazines of the calling thread go to the depot to be freed with the rest */
+	if (slab_local_set) {
+		pthread_setspecific(slab_key, NULL);
+		slab_release(NULL);
+	}
+
+	for (i = 0; i < NP_SLAB_TYPES; ++i) {
+		cache = &slab_caches[i];
+
+		/* SLAB LOCK */
+		pthread_mutex_lock(&cache->lock);
+		while ((mag = cache->full) != NULL) {
+			cache->full = mag->next;
+			free(mag);
+		}
+		while ((mag = cache->empty) != NULL) {
+			cache->empty = mag->next;
+			free(mag);
+		}
+		while ((chunk = cache->chunks) != NULL) {
+			cache->chunks = chunk->next;
+			free(chunk);
+		}
+		cache->fresh = NULL;
+		cache->fresh_count = 0;
+		cache->objects = 0;
+		cache->allocs = 0;
+		cache->frees = 0;
+		/* SLAB UNLOCK */
+		pthread_mutex_unlock(&cache->lock);
+	}
+}
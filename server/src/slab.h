@@ -0,0 +1,87 @@
+/**
+ * @file slab.h
+ * @brief Netopeer server object caches
+ *
+ * Copyright (C) 2015 CESNET, z.s.p.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of the Company nor the names of its contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * ALTERNATIVELY, provided that this notice is retained in full, this
+ * product may be distributed under the terms of the GNU General Public
+ * License (GPL) version 2 or later, in which case the provisions
+ * of the GPL apply INSTEAD OF those given above.
+ *
+ * This software is provided ``as is, and any express or implied
+ * warranties, including, but not limited to, the implied warranties of
+ * merchantability and fitness for a particular purpose are disclaimed.
+ * In no event shall the company or contributors be liable for any
+ * direct, indirect, incidental, special, exemplary, or consequential
+ * damages (including, but not limited to, procurement of substitute
+ * goods or services; loss of use, data, or profits; or business
+ * interruption) however caused and on any theory of liability, whether
+ * in contract, strict liability, or tort (including negligence or
+ * otherwise) arising in any way out of the use of this software, even
+ * if advised of the possibility of such damage.
+ */
+
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+/* cached object types */
+#define NP_SLAB_CLIENT 0				// client_struct of any transport
+#define NP_SLAB_CHANNEL 1				// chan_struct of an SSH client
+#define NP_SLAB_NOTIF 2					// ntf_thread_config of a subscription
+#define NP_SLAB_TYPES 3
+
+/* statistics of a single object type */
+struct np_slab_stats {
+	const char* name;
+	unsigned long object_size;
+	unsigned long objects;				// allocated from the system
+	unsigned long in_use;				// may lag behind by the objects cached in the threads
+	unsigned long allocations;
+	unsigned long depot_transfers;		// magazines exchanged with the shared depot
+};
+
+/**
+ * @brief Allocate a zeroed object from the cache of the calling thread
+ *
+ * @param type NP_SLAB_* type of the object
+ *
+ * @return New object, NULL on error.
+ */
+void* np_slab_alloc(int type);
+
+/**
+ * @brief Return an object into the cache of the calling thread
+ *
+ * @param type NP_SLAB_* type of the object
+ * @param obj Object allocated by np_slab_alloc(), can be NULL
+ */
+void np_slab_free(int type, void* obj);
+
+/**
+ * @brief Get the statistics of an object type
+ *
+ * @param type NP_SLAB_* type of the object
+ * @param stats Filled statistics
+ */
+void np_slab_stats(int type, struct np_slab_stats* stats);
+
+/**
+ * @brief Free all the cached memory, no object may be used anymore
+ */
+void np_slab_cleanup(void);
+
+#endif /* _SLAB_H_ */
@@ -43,8 +43,14 @@
  */
 
 #define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <libxml/tree.h>
 #include <libnetconf_xml.h>
 #include <libxml/xpath.h>
@@ -82,6 +88,240 @@ extern struct np_options netopeer_options;
 
 char* get_node_content(const xmlNodePtr node);
 
+/* parsed client authorized key */
+struct auth_key_entry {
+	unsigned char* hash;
+	size_t hash_len;
+	ssh_key key;
+	char* username;
+	struct auth_key_entry* next;
+};
+
+/*
+ * The client_auth_keys are parsed by a watcher thread into a table
+ * indexed by the key fingerprints, so the authentication needs no file
+ * access. The thread rebuilds the table whenever the configured keys
+ * change or inotify reports a change in the directories of the key files.
+ */
+static struct {
+	/* protected by CLIENT KEYS LOCK */
+	struct auth_key_entry** buckets;
+	unsigned int size;
+
+	pthread_t watcher;
+	int running;
+	volatile int stop;
+	int wake_fd;
+} auth_keys;
+
+static unsigned int auth_key_bucket(const unsigned char* hash, size_t hash_len, unsigned int size) {
+	unsigned int idx = 0;
+	size_t i;
+
+	/* the hash is uniform enough on its own */
+	for (i = 0; i < hash_len && i < sizeof idx; ++i) {
+		idx = (idx << 8) | hash[i];
+	}
+
+	return idx & (size-1);
+}
+
+static void auth_key_index_free(struct auth_key_entry** buckets, unsigned int size) {
+	struct auth_key_entry* entry, *next;
+	unsigned int i;
+
+	for (i = 0; i < size; ++i) {
+		for (entry = buckets[i]; entry != NULL; entry = next) {
+			next = entry->next;
+			ssh_clean_pubkey_hash(&entry->hash);
+			ssh_key_free(entry->key);
+			free(entry->username);
+			free(entry);
+		}
+	}
+	free(buckets);
+}
+
+/* return: inotify fd watching the directories of all the keys */
+static int auth_key_index_rebuild(void) {
+	struct np_auth_key* auth_key;
+	struct auth_key_entry** buckets, **old_buckets, *entry;
+	unsigned int count, size, old_size, i, idx;
+	char** paths, **usernames, *dir;
+	int inotify_fd;
+
+	/* copy the configured keys */
+	/* CLIENT KEYS LOCK */
+	pthread_mutex_lock(&netopeer_options.ssh_opts->client_keys_lock);
+
+	for (count = 0, auth_key = netopeer_options.ssh_opts->client_auth_keys; auth_key != NULL; auth_key = auth_key->next, ++count);
+	paths = malloc(count * sizeof *paths);
+	usernames = malloc(count * sizeof *usernames);
+	for (i = 0, auth_key = netopeer_options.ssh_opts->client_auth_keys; auth_key != NULL; auth_key = auth_key->next, ++i) {
+		paths[i] = strdup(auth_key->path);
+		usernames[i] = strdup(auth_key->username);
+	}
+
+	/* CLIENT KEYS UNLOCK */
+	pthread_mutex_unlock(&netopeer_options.ssh_opts->client_keys_lock);
+
+	if ((inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+		nc_verb_error("%s: inotify_init1 failed (%s)", __func__, strerror(errno));
+	}
+
+	for (size = 16; size < 2*count; size *= 2);
+	buckets = calloc(size, sizeof *buckets);
+
+	/* parse them without holding the lock */
+	for (i = 0; i < count; ++i) {
+		if (inotify_fd != -1) {
+			dir = strdup(paths[i]);
+			if (strrchr(dir, '/') != NULL) {
+				*strrchr(dir, '/') = '\0';
+			}
+			if (inotify_add_watch(inotify_fd, (dir[0] ? dir : "/"), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ATTRIB) == -1) {
+				nc_verb_warning("%s: cannot watch \"%s\" for changes (%s)", __func__, dir, strerror(errno));
+			}
+			free(dir);
+		}
+
+		entry = calloc(1, sizeof *entry);
+		if (ssh_pki_import_pubkey_file(paths[i], &entry->key) != SSH_OK) {
+			nc_verb_verbose("%s: failed to import the public key \"%s\"", __func__, paths[i]);
+			free(entry);
+		} else if (ssh_get_publickey_hash(entry->key, SSH_PUBLICKEY_HASH_SHA1, &entry->hash, &entry->hash_len) != 0) {
+			nc_verb_verbose("%s: failed to get the fingerprint of the public key \"%s\"", __func__, paths[i]);
+			ssh_key_free(entry->key);
+			free(entry);
+		} else {
+			entry->username = usernames[i];
+			usernames[i] = NULL;
+			idx = auth_key_bucket(entry->hash, entry->hash_len, size);
+			entry->next = buckets[idx];
+			buckets[idx] = entry;
+		}
+
+		free(paths[i]);
+		free(usernames[i]);
+	}
+	free(paths);
+	free(usernames);
+
+	/* CLIENT KEYS LOCK */
+	pthread_mutex_lock(&netopeer_options.ssh_opts->client_keys_lock);
+
+	old_buckets = auth_keys.buckets;
+	old_size = auth_keys.size;
+	auth_keys.buckets = buckets;
+	auth_keys.size = size;
+
+	/* CLIENT KEYS UNLOCK */
+	pthread_mutex_unlock(&netopeer_options.ssh_opts->client_keys_lock);
+
+	auth_key_index_free(old_buckets, old_size);
+
+	return inotify_fd;
+}
+
+static void* auth_key_watcher_thread(void* UNUSED(arg)) {
+	struct pollfd fds[2];
+	char buf[4096];
+	int inotify_fd;
+
+	while (!auth_keys.stop) {
+		inotify_fd = auth_key_index_rebuild();
+
+		fds[0].fd = auth_keys.wake_fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = inotify_fd;
+		fds[1].events = POLLIN;
+
+		while (!auth_keys.stop && poll(fds, 2, -1) == -1 && errno == EINTR);
+
+		/* several changes at once trigger a single rebuild */
+		usleep(AUTH_KEYS_SETTLE_TIME * 1000);
+		while (read(auth_keys.wake_fd, buf, sizeof(uint64_t)) > 0);
+		if (inotify_fd != -1) {
+			while (read(inotify_fd, buf, sizeof buf) > 0);
+			close(inotify_fd);
+		}
+	}
+
+	return NULL;
+}
+
+/* wake the watcher thread to rebuild the key index */
+static void auth_keys_changed(void) {
+	uint64_t one = 1;
+
+	if (auth_keys.running && write(auth_keys.wake_fd, &one, sizeof one) == -1) {
+		nc_verb_error("%s: write failed (%s)", __func__, strerror(errno));
+	}
+}
+
+static int auth_keys_start(void) {
+	int ret;
+
+	auth_keys.stop = 0;
+	if ((auth_keys.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		nc_verb_error("%s: eventfd failed (%s)", __func__, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if ((ret = pthread_create(&auth_keys.watcher, NULL, auth_key_watcher_thread, NULL)) != 0) {
+		nc_verb_error("%s: failed to create the key watcher thread (%s)", __func__, strerror(ret));
+		close(auth_keys.wake_fd);
+		return EXIT_FAILURE;
+	}
+	auth_keys.running = 1;
+
+	return EXIT_SUCCESS;
+}
+
+static void auth_keys_stop(void) {
+	if (auth_keys.running) {
+		auth_keys.stop = 1;
+		auth_keys_changed();
+		pthread_join(auth_keys.watcher, NULL);
+		close(auth_keys.wake_fd);
+		auth_keys.running = 0;
+	}
+
+	auth_key_index_free(auth_keys.buckets, auth_keys.size);
+	auth_keys.buckets = NULL;
+	auth_keys.size = 0;
+}
+
+char* np_ssh_auth_key_username(ssh_key key) {
+	struct auth_key_entry* entry;
+	unsigned char* hash;
+	size_t hash_len;
+	char* username = NULL;
+
+	if (ssh_get_publickey_hash(key, SSH_PUBLICKEY_HASH_SHA1, &hash, &hash_len) != 0) {
+		return NULL;
+	}
+
+	/* CLIENT KEYS LOCK */
+	pthread_mutex_lock(&netopeer_options.ssh_opts->client_keys_lock);
+
+	if (auth_keys.size > 0) {
+		for (entry = auth_keys.buckets[auth_key_bucket(hash, hash_len, auth_keys.size)]; entry != NULL; entry = entry->next) {
+			if (entry->hash_len == hash_len && memcmp(entry->hash, hash, hash_len) == 0
+					&& ssh_key_cmp(key, entry->key, SSH_KEY_CMP_PUBLIC) == 0) {
+				username = strdup(entry->username);
+				break;
+			}
+		}
+	}
+
+	/* CLIENT KEYS UNLOCK */
+	pthread_mutex_unlock(&netopeer_options.ssh_opts->client_keys_lock);
+
+	ssh_clean_pubkey_hash(&hash);
+	return username;
+}
+
 /*
 * CONFIGURATION callbacks
 * Here follows set of callback functions run every time some change in associated part of running datastore occurs.
@@ -260,6 +500,7 @@ int callback_n_netopeer_n_ssh_n_client_auth_keys_n_client_auth_key(void** UNUSED
 		pthread_mutex_unlock(&netopeer_options.ssh_opts->client_keys_lock);
 	}
 
+	auth_keys_changed();
 
 	return EXIT_SUCCESS;
 }
@@ -353,9 +594,15 @@ int callback_n_netopeer_n_ssh_n_auth_attempts(void** UNUSED(data), XMLDIFF_OP op
 int callback_n_netopeer_n_ssh_n_auth_timeout(void** UNUSED(data), XMLDIFF_OP op, xmlNodePtr UNUSED(old_node), xmlNodePtr new_node, struct nc_err** error) {
 	char* content = NULL, *ptr, *msg;
 	uint16_t num;
+	int shorter;
 
 	if (op & XMLDIFF_REM) {
+		shorter = (10 < netopeer_options.ssh_opts->auth_timeout);
 		netopeer_options.ssh_opts->auth_timeout = 10;
+		if (shorter) {
+			/* the armed deadlines could be too late now */
+			np_engine_expire_all();
+		}
 		return EXIT_SUCCESS;
 	}
 
@@ -376,7 +623,12 @@ int callback_n_netopeer_n_ssh_n_auth_timeout(void** UNUSED(data), XMLDIFF_OP op,
 		return EXIT_FAILURE;
 	}
 
+	shorter = (num < netopeer_options.ssh_opts->auth_timeout);
 	netopeer_options.ssh_opts->auth_timeout = num;
+	if (shorter) {
+		/* the armed deadlines could be too late now */
+		np_engine_expire_all();
+	}
 	return EXIT_SUCCESS;
 }
 
@@ -389,6 +641,9 @@ int netopeer_transapi_init_ssh(void) {
 
 	netopeer_options.ssh_opts = calloc(1, sizeof(struct np_options_ssh));
 	pthread_mutex_init(&netopeer_options.ssh_opts->client_keys_lock, NULL);
+	if (auth_keys_start() != EXIT_SUCCESS) {
+		return EXIT_FAILURE;
+	}
 
 	doc = xmlReadDoc(BAD_CAST "<netopeer xmlns=\"urn:cesnet:tmc:netopeer:1.0\"><ssh><server-keys><rsa-key>/etc/ssh/ssh_host_rsa_key</rsa-key></server-keys><password-auth-enabled>true</password-auth-enabled><auth-attempts>3</auth-attempts><auth-timeout>10</auth-timeout></ssh></netopeer>",
 		NULL, NULL, 0);
@@ -457,6 +712,8 @@ void netopeer_transapi_close_ssh(void) {
 
 	nc_verb_verbose("Netopeer SSH cleanup.");
 
+	auth_keys_stop();
+
 	free(netopeer_options.ssh_opts->rsa_key);
 	free(netopeer_options.ssh_opts->dsa_key);
 	for (key = netopeer_options.ssh_opts->client_auth_keys; key != NULL;) {
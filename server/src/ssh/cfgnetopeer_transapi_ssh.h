@@ -71,4 +71,13 @@ int callback_n_netopeer_n_ssh_n_auth_timeout(void** UNUSED(data), XMLDIFF_OP op,
 
 void netopeer_transapi_close_ssh(void);
 
+/**
+ * @brief Find the user authorized to use a public key
+ *
+ * @param key Presented public key
+ *
+ * @return Username (to be freed), NULL if the key is not authorized.
+ */
+char* np_ssh_auth_key_username(ssh_key key);
+
 #endif /* _CFGNETOPEER_TRANSAPI_SSH_H_ */
\ No newline at end of file
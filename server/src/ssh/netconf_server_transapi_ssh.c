@@ -146,15 +146,19 @@ int callback_srv_netconf_srv_ssh_srv_call_home_srv_applications_srv_application(
 	return callback_srv_netconf_srv_call_home_srv_applications_srv_application(op, old_node, new_node, error, NC_TRANSPORT_SSH);
 }
 
+/* CALLHOME LOCK must be held */
 int np_ssh_chapp_linger_check(struct ch_app* app) {
-	struct timeval cur_time;
+	struct client_struct_ssh* client = (struct client_struct_ssh*)app->client;
 
-	gettimeofday(&cur_time, NULL);
-	if (timeval_diff(cur_time, ((struct client_struct_ssh*)app->client)->ssh_chans->last_rpc_time) >= app->rep_linger) {
-		/* no data flow for too long, disconnect the client, wait for the set timeout and reconnect */
+	if (client->ssh_chans == NULL) {
+		return 0;
+	}
+
+	if (np_clock_msec() - client->ssh_chans->last_rpc_time >= app->rep_linger * 1000ULL) {
+		/* no data flow for too long, disconnect the client */
 		nc_verb_verbose("Call Home (app %s) did not communicate for too long, disconnecting.", app->name);
-		((struct client_struct_ssh*)app->client)->ssh_chans->to_free = 1;
-		sleep(app->rep_timeout*60);
+		client->ssh_chans->to_free = 1;
+		np_engine_kick(app->client);
 		return 1;
 	}
 
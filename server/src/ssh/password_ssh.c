@@ -0,0 +1,630 @@
+/**
+ * @file password_ssh.c
+ * @brief Netopeer server SSH password checks
+ *
+ * Copyright (C) 2015 CESNET, z.s.p.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of the Company nor the names of its contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * ALTERNATIVELY, provided that this notice is retained in full, this
+ * product may be distributed under the terms of the GNU General Public
+ * License (GPL) version 2 or later, in which case the provisions
+ * of the GPL apply INSTEAD OF those given above.
+ *
+ * This software is provided ``as is, and any express or implied
+ * warranties, including, but not limited to, the implied warranties of
+ * merchantability and fitness for a particular purpose are disclaimed.
+ * In no event shall the company or contributors be liable for any
+ * direct, indirect, incidental, special, exemplary, or consequential
+ * damages (including, but not limited to, procurement of substitute
+ * goods or services; loss of use, data, or profits; or business
+ * interruption) however caused and on any theory of liability, whether
+ * in contract, strict liability, or tort (including negligence or
+ * otherwise) arising in any way out of the use of this software, even
+ * if advised of the possibility of such damage.
+ */
+
+#define _GNU_SOURCE
+
+#include <crypt.h>
+#include <errno.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <shadow.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../server.h"
+#include "password_ssh.h"
+
+static const char rcsid[] __attribute__((used)) ="$Id: "__FILE__": "RCSID" $";
+
+#define PASSWD_FILE "/etc/passwd"
+#define SHADOW_FILE "/etc/shadow"
+
+/* user of the local files snapshot */
+struct pw_user {
+	char* name;
+	char* hash;							// NULL if the shadow entry is missing
+	struct pw_user* next;
+};
+
+/*
+ * Successful check. The password is remembered only as its cheap hash with
+ * a random salt of this process, so it still cannot be read from the memory.
+ */
+struct pw_verdict {
+	char* name;
+	char* hash;							// password hash of the user checked against
+	char* digest;
+	time_t expires;
+	struct pw_verdict* next;
+};
+
+struct pw_job {
+	char* username;
+	char* password;
+	char* hash;							// looked up by the hashing thread
+	struct client_struct* client;		// NULL once the check is abandoned
+	int result;							// -1 until a hashing thread is done
+	struct pw_job* next;
+};
+
+static struct {
+	/* PASSWORD LOCK */
+	pthread_mutex_t lock;
+	pthread_cond_t job_cond;
+	struct pw_job* jobs;
+	struct pw_job** jobs_last;
+	unsigned int queued;
+	pthread_t* threads;
+	unsigned int thread_count;
+	int stop;
+	char digest_salt[40];
+
+	/* reloaded only when the files change */
+	struct stat passwd_st;
+	struct stat shadow_st;
+	struct pw_user* users[SSH_PASSWORD_BUCKETS];
+
+	struct pw_verdict* verdicts[SSH_PASSWORD_BUCKETS];
+} pw = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.job_cond = PTHREAD_COND_INITIALIZER,
+	.jobs_last = &pw.jobs
+};
+
+static unsigned int pw_hash(const char* key) {
+	unsigned int hash = 2166136261u;
+
+	for (; *key; ++key) {
+		hash = (hash ^ (unsigned char)*key) * 16777619u;
+	}
+
+	return hash & (SSH_PASSWORD_BUCKETS - 1);
+}
+
+/* PASSWORD LOCK must be held */
+static void pw_users_free(void) {
+	struct pw_user* user;
+	int i;
+
+	for (i = 0; i < SSH_PASSWORD_BUCKETS; ++i) {
+		while ((user = pw.users[i]) != NULL) {
+			pw.users[i] = user->next;
+			free(user->name);
+			free(user->hash);
+			free(user);
+		}
+	}
+}
+
+/* PASSWORD LOCK must be held */
+static struct pw_user* pw_user_find(const char* username) {
+	struct pw_user* user;
+
+	for (user = pw.users[pw_hash(username)]; user != NULL; user = user->next) {
+		if (strcmp(user->name, username) == 0) {
+			break;
+		}
+	}
+
+	return user;
+}
+
+static int pw_file_changed(const char* path, struct stat* old) {
+	struct stat st;
+
+	if (stat(path, &st) == -1) {
+		memset(&st, 0, sizeof st);
+	}
+	if (st.st_ino == old->st_ino && st.st_size == old->st_size && st.st_mtim.tv_sec == old->st_mtim.tv_sec
+			&& st.st_mtim.tv_nsec == old->st_mtim.tv_nsec) {
+		return 0;
+	}
+
+	*old = st;
+	return 1;
+}
+
+/* PASSWORD LOCK must be held, parse the local files again if any of them changed */
+static void pw_users_refresh(void) {
+	struct passwd pwd, *pwdp;
+	struct spwd spwd, *spwdp;
+	struct pw_user* user;
+	char buf[4096];
+	FILE* file;
+	int passwd_changed, shadow_changed;
+
+	passwd_changed = pw_file_changed(PASSWD_FILE, &pw.passwd_st);
+	shadow_changed = pw_file_changed(SHADOW_FILE, &pw.shadow_st);
+	if (!passwd_changed && !shadow_changed) {
+		return;
+	}
+
+	pw_users_free();
+
+	if ((file = fopen(PASSWD_FILE, "re")) == NULL) {
+		nc_verb_error("%s: failed to open \"%s\" (%s)", __func__, PASSWD_FILE, strerror(errno));
+		return;
+	}
+	while (fgetpwent_r(file, &pwd, buf, sizeof buf, &pwdp) == 0) {
+		if (pw_user_find(pwd.pw_name) != NULL) {
+			continue;
+		}
+		if ((user = calloc(1, sizeof *user)) == NULL || (user->name = strdup(pwd.pw_name)) == NULL) {
+			free(user);
+			break;
+		}
+		if (strcmp(pwd.pw_passwd, "x") != 0) {
+			user->hash = strdup(pwd.pw_passwd);
+		}
+		user->next = pw.users[pw_hash(user->name)];
+		pw.users[pw_hash(user->name)] = user;
+	}
+	fclose(file);
+
+	if ((file = fopen(SHADOW_FILE, "re")) == NULL) {
+		nc_verb_error("%s: failed to open \"%s\" (%s)", __func__, SHADOW_FILE, strerror(errno));
+		return;
+	}
+	while (fgetspent_r(file, &spwd, buf, sizeof buf, &spwdp) == 0) {
+		if ((user = pw_user_find(spwd.sp_namp)) != NULL && user->hash == NULL && spwd.sp_pwdp != NULL) {
+			user->hash = strdup(spwd.sp_pwdp);
+		}
+	}
+	memset(buf, 0, sizeof buf);
+	fclose(file);
+}
+
+/* users not in the local files are looked up through all the NSS sources, return: password hash, NULL on error */
+static char* pw_hash_nss(const char* username) {
+	struct passwd pwd, *pwdp;
+	struct spwd spwd, *spwdp;
+	char buf[4096];
+	char* pass_hash = NULL;
+
+	if (getpwnam_r(username, &pwd, buf, sizeof buf, &pwdp) != 0 || pwdp == NULL) {
+		nc_verb_verbose("User '%s' not found locally.", username);
+		return NULL;
+	}
+
+	if (strcmp(pwd.pw_passwd, "x") == 0) {
+		if (getspnam_r(username, &spwd, buf, sizeof buf, &spwdp) != 0 || spwdp == NULL) {
+			nc_verb_verbose("Failed to retrieve the shadow entry for '%s'.", username);
+			return NULL;
+		}
+		pass_hash = strdup(spwd.sp_pwdp);
+	} else {
+		pass_hash = strdup(pwd.pw_passwd);
+	}
+	memset(buf, 0, sizeof buf);
+
+	return pass_hash;
+}
+
+/* return: password hash of the user usable for the check, NULL if there is none */
+static char* pw_hash_get(const char* username) {
+	struct pw_user* user;
+	char* pass_hash = NULL;
+
+	/* PASSWORD LOCK */
+	pthread_mutex_lock(&pw.lock);
+	pw_users_refresh();
+	if ((user = pw_user_find(username)) != NULL && user->hash != NULL) {
+		pass_hash = strdup(user->hash);
+	}
+	/* PASSWORD UNLOCK */
+	pthread_mutex_unlock(&pw.lock);
+
+	if (pass_hash == NULL && (pass_hash = pw_hash_nss(username)) == NULL) {
+		return NULL;
+	}
+
+	/* check the hash structure for special meaning */
+	if (strcmp(pass_hash, "*") == 0 || strcmp(pass_hash, "!") == 0) {
+		nc_verb_verbose("User '%s' is not allowed to authenticate using a password.", username);
+		free(pass_hash);
+		return NULL;
+	}
+	if (strcmp(pass_hash, "*NP*") == 0) {
+		nc_verb_verbose("Retrieving password for '%s' from a NIS+ server not supported.", username);
+		free(pass_hash);
+		return NULL;
+	}
+
+	return pass_hash;
+}
+
+/* PASSWORD LOCK must be held */
+static void pw_verdict_free(struct pw_verdict* verdict) {
+	free(verdict->name);
+	free(verdict->hash);
+	free(verdict->digest);
+	free(verdict);
+}
+
+/* PASSWORD LOCK must be held, return: 1 if the same password of the user was checked recently */
+static int pw_verdict_match(const struct pw_job* job, const char* digest) {
+	struct pw_verdict* verdict;
+
+	for (verdict = pw.verdicts[pw_hash(job->username)]; verdict != NULL; verdict = verdict->next) {
+		if (strcmp(verdict->name, job->username) == 0) {
+			return (verdict->expires > time(NULL) && strcmp(verdict->hash, job->hash) == 0
+					&& strcmp(verdict->digest, digest) == 0);
+		}
+	}
+
+	return 0;
+}
+
+/* PASSWORD LOCK must be held, the digest is consumed */
+static void pw_verdict_add(const struct pw_job* job, char* digest) {
+	struct pw_verdict** verdict, *del;
+	time_t now = time(NULL);
+
+	/* replace the previous verdict of the user, forget the expired ones on the way */
+	verdict = &pw.verdicts[pw_hash(job->username)];
+	while (*verdict != NULL) {
+		if ((*verdict)->expires <= now || strcmp((*verdict)->name, job->username) == 0) {
+			del = *verdict;
+			*verdict = del->next;
+			pw_verdict_free(del);
+		} else {
+			verdict = &(*verdict)->next;
+		}
+	}
+
+	if ((del = calloc(1, sizeof *del)) == NULL || (del->name = strdup(job->username)) == NULL
+			|| (del->hash = strdup(job->hash)) == NULL) {
+		if (del != NULL) {
+			del->digest = digest;
+			pw_verdict_free(del);
+		} else {
+			free(digest);
+		}
+		return;
+	}
+	del->digest = digest;
+	del->expires = now + SSH_PASSWORD_VERDICT_TTL;
+	del->next = pw.verdicts[pw_hash(job->username)];
+	pw.verdicts[pw_hash(job->username)] = del;
+}
+
+/* return: 0 - password correct, 1 - password wrong */
+static int pw_verify(const struct pw_job* job, struct crypt_data* data) {
+	char* new_pass_hash, *digest = NULL;
+	int ret;
+
+	/* the cheap hash is compared first, the configured one may take long */
+	if ((new_pass_hash = crypt_r(job->password, pw.digest_salt, data)) != NULL && (digest = strdup(new_pass_hash)) != NULL) {
+		/* PASSWORD LOCK */
+		pthread_mutex_lock(&pw.lock);
+		ret = pw_verdict_match(job, digest);
+		/* PASSWORD UNLOCK */
+		pthread_mutex_unlock(&pw.lock);
+
+		if (ret) {
+			free(digest);
+			return 0;
+		}
+	}
+
+	new_pass_hash = crypt_r(job->password, job->hash, data);
+	if (new_pass_hash == NULL) {
+		nc_verb_error("%s: crypt() failed (setting \"%s\").", __func__, job->hash);
+		free(digest);
+		return 1;
+	}
+	if (strcmp(new_pass_hash, job->hash) != 0) {
+		free(digest);
+		return 1;
+	}
+
+	if (digest != NULL) {
+		/* PASSWORD LOCK */
+		pthread_mutex_lock(&pw.lock);
+		pw_verdict_add(job, digest);
+		/* PASSWORD UNLOCK */
+		pthread_mutex_unlock(&pw.lock);
+	}
+	return 0;
+}
+
+/* return: 0 - password correct, 1 - password wrong */
+static int pw_check(struct pw_job* job, struct crypt_data* data) {
+	if ((job->hash = pw_hash_get(job->username)) == NULL) {
+		return 1;
+	}
+
+	if (strcmp(job->hash, "") == 0) {
+		if (strcmp(job->password, "") == 0) {
+			nc_verb_verbose("User authentication successful with an empty password!");
+			return 0;
+		}
+		/* the user did now know he does not need any password,
+		 * (which should not be used) so deny authentication */
+		return 1;
+	}
+
+	return (data != NULL ? pw_verify(job, data) : 1);
+}
+
+static void pw_job_free(struct pw_job* job) {
+	if (job->password != NULL) {
+		memset(job->password, 0, strlen(job->password));
+		free(job->password);
+	}
+	free(job->username);
+	free(job->hash);
+	free(job);
+}
+
+static void* pw_thread(void* UNUSED(arg)) {
+	struct crypt_data* data;
+	struct pw_job* job;
+	int result;
+
+	/* it is too big for the stack */
+	data = calloc(1, sizeof *data);
+
+	/* PASSWORD LOCK */
+	pthread_mutex_lock(&pw.lock);
+
+	while (1) {
+		while (!pw.stop && pw.jobs == NULL) {
+			pthread_cond_wait(&pw.job_cond, &pw.lock);
+		}
+		if (pw.stop) {
+			break;
+		}
+
+		job = pw.jobs;
+		if ((pw.jobs = job->next) == NULL) {
+			pw.jobs_last = &pw.jobs;
+		}
+		--pw.queued;
+
+		if (job->client == NULL) {
+			/* abandoned while queued */
+			pw_job_free(job);
+			continue;
+		}
+
+		/* PASSWORD UNLOCK */
+		pthread_mutex_unlock(&pw.lock);
+
+		result = pw_check(job, data);
+
+		/* PASSWORD LOCK */
+		pthread_mutex_lock(&pw.lock);
+
+		job->result = result;
+		if (job->client == NULL) {
+			pw_job_free(job);
+		} else {
+			/* the client cannot be freed without abandoning the check first */
+			np_engine_kick(job->client);
+		}
+	}
+
+	/* PASSWORD UNLOCK */
+	pthread_mutex_unlock(&pw.lock);
+
+	free(data);
+	return NULL;
+}
+
+/* PASSWORD LOCK must be held, return: 0 on success, -1 on error */
+static int pw_threads_start(void) {
+	static const char b64[] = "./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+	unsigned char rnd[16];
+	unsigned int count, i;
+	long cpus;
+	FILE* file;
+	int ret;
+
+	/* the salt of the remembered passwords is new for every process */
+	if ((file = fopen("/dev/urandom", "re")) == NULL || fread(rnd, 1, sizeof rnd, file) != sizeof rnd) {
+		nc_verb_error("%s: failed to read \"/dev/urandom\" (%s)", __func__, strerror(errno));
+		if (file != NULL) {
+			fclose(file);
+		}
+		return -1;
+	}
+	fclose(file);
+	strcpy(pw.digest_salt, "$5$rounds=1000$");
+	for (i = 0; i < sizeof rnd; ++i) {
+		pw.digest_salt[15 + i] = b64[rnd[i] & 63];
+	}
+	pw.digest_salt[15 + sizeof rnd] = '$';
+	pw.digest_salt[16 + sizeof rnd] = '\0';
+
+	count = SSH_PASSWORD_THREADS;
+	if (count == 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		count = (cpus > 1 ? cpus / 2 : 1);
+	}
+
+	if ((pw.threads = calloc(count, sizeof *pw.threads)) == NULL) {
+		nc_verb_error("%s: memory allocation failed (%s)", __func__, strerror(errno));
+		return -1;
+	}
+
+	pw.stop = 0;
+	for (pw.thread_count = 0; pw.thread_count < count; ++pw.thread_count) {
+		if ((ret = pthread_create(&pw.threads[pw.thread_count], NULL, pw_thread, NULL)) != 0) {
+			nc_verb_error("%s: pthread_create() error (%s)", __func__, strerror(ret));
+			break;
+		}
+	}
+
+	if (pw.thread_count == 0) {
+		free(pw.threads);
+		pw.threads = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+struct pw_job* np_ssh_password_check(const char* username, const char* password, struct client_struct* client) {
+	struct pw_job* job;
+
+	if ((job = calloc(1, sizeof *job)) == NULL || (job->username = strdup(username)) == NULL
+			|| (job->password = strdup(password)) == NULL) {
+		nc_verb_error("%s: memory allocation failed (%s)", __func__, strerror(errno));
+		if (job != NULL) {
+			pw_job_free(job);
+		}
+		return NULL;
+	}
+	job->client = client;
+	job->result = -1;
+
+	/* PASSWORD LOCK */
+	pthread_mutex_lock(&pw.lock);
+
+	if (pw.thread_count == 0 && pw_threads_start() != 0) {
+		/* PASSWORD UNLOCK */
+		pthread_mutex_unlock(&pw.lock);
+		pw_job_free(job);
+		return NULL;
+	}
+
+	/* a burst of attempts must not take all the CPUs */
+	if (pw.queued >= SSH_PASSWORD_QUEUE) {
+		/* PASSWORD UNLOCK */
+		pthread_mutex_unlock(&pw.lock);
+		nc_verb_warning("Too many SSH password checks in progress, refusing the one of user '%s'.", username);
+		pw_job_free(job);
+		return NULL;
+	}
+
+	*pw.jobs_last = job;
+	pw.jobs_last = &job->next;
+	++pw.queued;
+	pthread_cond_signal(&pw.job_cond);
+
+	/* PASSWORD UNLOCK */
+	pthread_mutex_unlock(&pw.lock);
+
+	return job;
+}
+
+int np_ssh_password_result(struct pw_job* job) {
+	int ret;
+
+	/* PASSWORD LOCK */
+	pthread_mutex_lock(&pw.lock);
+	ret = job->result;
+	/* PASSWORD UNLOCK */
+	pthread_mutex_unlock(&pw.lock);
+
+	if (ret == -1) {
+		return 2;
+	}
+
+	/* the hashing thread is done with it */
+	pw_job_free(job);
+	return ret;
+}
+
+void np_ssh_password_cancel(struct pw_job* job) {
+	if (job == NULL) {
+		return;
+	}
+
+	/* PASSWORD LOCK */
+	pthread_mutex_lock(&pw.lock);
+	if (job->result == -1) {
+		/* the hashing thread frees it */
+		job->client = NULL;
+		job = NULL;
+	}
+	/* PASSWORD UNLOCK */
+	pthread_mutex_unlock(&pw.lock);
+
+	if (job != NULL) {
+		pw_job_free(job);
+	}
+}
+
+void np_ssh_password_cleanup(void) {
+	struct pw_verdict* verdict;
+	struct pw_job* job;
+	unsigned int i;
+
+	/* PASSWORD LOCK */
+	pthread_mutex_lock(&pw.lock);
+	pw.stop = 1;
+	pthread_cond_broadcast(&pw.job_cond);
+	/* PASSWORD UNLOCK */
+	pthread_mutex_unlock(&pw.lock);
+
+	/* all the clients are gone, nobody waits for a check */
+	for (i = 0; i < pw.thread_count; ++i) {
+		pthread_join(pw.threads[i], NULL);
+	}
+	free(pw.threads);
+	pw.threads = NULL;
+	pw.thread_count = 0;
+
+	/* PASSWORD LOCK */
+	pthread_mutex_lock(&pw.lock);
+
+	/* the abandoned checks nobody got to */
+	while ((job = pw.jobs) != NULL) {
+		pw.jobs = job->next;
+		pw_job_free(job);
+	}
+	pw.jobs_last = &pw.jobs;
+	pw.queued = 0;
+
+	pw_users_free();
+	memset(&pw.passwd_st, 0, sizeof pw.passwd_st);
+	memset(&pw.shadow_st, 0, sizeof pw.shadow_st);
+	for (i = 0; i < SSH_PASSWORD_BUCKETS; ++i) {
+		while ((verdict = pw.verdicts[i]) != NULL) {
+			pw.verdicts[i] = verdict->next;
+			pw_verdict_free(verdict);
+		}
+	}
+
+	/* PASSWORD UNLOCK */
+	pthread_mutex_unlock(&pw.lock);
+}
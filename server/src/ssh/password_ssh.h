@@ -0,0 +1,80 @@
+/**
+ * @file password_ssh.h
+ * @brief Netopeer server SSH password checks
+ *
+ * Copyright (C) 2015 CESNET, z.s.p.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of the Company nor the names of its contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * ALTERNATIVELY, provided that this notice is retained in full, this
+ * product may be distributed under the terms of the GNU General Public
+ * License (GPL) version 2 or later, in which case the provisions
+ * of the GPL apply INSTEAD OF those given above.
+ *
+ * This software is provided ``as is, and any express or implied
+ * warranties, including, but not limited to, the implied warranties of
+ * merchantability and fitness for a particular purpose are disclaimed.
+ * In no event shall the company or contributors be liable for any
+ * direct, indirect, incidental, special, exemplary, or consequential
+ * damages (including, but not limited to, procurement of substitute
+ * goods or services; loss of use, data, or profits; or business
+ * interruption) however caused and on any theory of liability, whether
+ * in contract, strict liability, or tort (including negligence or
+ * otherwise) arising in any way out of the use of this software, even
+ * if advised of the possibility of such damage.
+ */
+
+#ifndef _PASSWORD_SSH_H_
+#define _PASSWORD_SSH_H_
+
+struct client_struct;
+struct pw_job;
+
+/**
+ * @brief Start checking the password of a user, the check is done by a bounded pool of threads
+ *
+ * The client is kicked once the check is done, np_ssh_password_result() then
+ * returns its result.
+ *
+ * @param username Name of the user
+ * @param password Password in clear text
+ * @param client Client to kick, np_ssh_password_result() or np_ssh_password_cancel()
+ * must be called before it is freed
+ *
+ * @return Check in progress, NULL if there are too many checks in progress
+ */
+struct pw_job* np_ssh_password_check(const char* username, const char* password, struct client_struct* client);
+
+/**
+ * @brief Get the result of a password check, a finished check is freed
+ *
+ * @param job Check in progress
+ *
+ * @return 0 if the password is correct, 1 if it is not, 2 if the check has not finished yet
+ */
+int np_ssh_password_result(struct pw_job* job);
+
+/**
+ * @brief Abandon a password check, the client is not kicked anymore
+ *
+ * @param job Check in progress, can be NULL
+ */
+void np_ssh_password_cancel(struct pw_job* job);
+
+/**
+ * @brief Stop the hashing threads and forget the users and the remembered passwords
+ */
+void np_ssh_password_cleanup(void);
+
+#endif /* _PASSWORD_SSH_H_ */
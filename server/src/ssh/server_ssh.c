@@ -54,14 +54,13 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <unistd.h>
-#include <shadow.h>
-#include <pwd.h>
 
 #include <libssh/libssh.h>
 #include <libssh/callbacks.h>
 #include <libssh/server.h>
 
 #include "../server.h"
+#include "password_ssh.h"
 
 static const char rcsid[] __attribute__((used)) ="$Id: "__FILE__": "RCSID" $";
 
@@ -74,6 +73,8 @@ extern struct np_options netopeer_options;
 static inline void _chan_free(struct client_struct_ssh* client, struct chan_struct* chan) {
 	if (chan->nc_sess != NULL) {
 		nc_verb_error("%s: internal error: freeing a channel with an opened NC session", __func__);
+		np_sess_index_del(chan->nc_sess);
+		np_notif_unsubscribe(chan->notif_sub);
 		nc_session_free(chan->nc_sess);
 	}
 
@@ -87,6 +88,11 @@ void client_free_ssh(struct client_struct_ssh* client) {
 		nc_verb_error("%s: internal error: freeing a client with some channels", __func__);
 	}
 
+	np_ssh_password_cancel(client->auth_job);
+	if (client->auth_msg != NULL) {
+		ssh_message_free(client->auth_msg);
+	}
+
 	if (client->ssh_sess != NULL) {
 		/* !! frees all the associated channels as well !! (if any left) */
 		ssh_free(client->ssh_sess);
@@ -98,23 +104,7 @@ void client_free_ssh(struct client_struct_ssh* client) {
 	}*/
 
 	free(client->username);
-	free(client);
-}
-
-static struct client_struct_ssh* client_find_by_sshsession(struct client_struct* root, ssh_session sshsession) {
-	struct client_struct_ssh* client;
-
-	if (sshsession == NULL) {
-		return NULL;
-	}
-
-	for (client = (struct client_struct_ssh*)root; client != NULL; client = (struct client_struct_ssh*)client->next) {
-		if (client->transport == NC_TRANSPORT_SSH && client->ssh_sess == sshsession) {
-			break;
-		}
-	}
-
-	return client;
+	np_slab_free(NP_SLAB_CLIENT, client);
 }
 
 static struct chan_struct* client_find_channel_by_sshchan(struct client_struct_ssh* client, ssh_channel sshchannel) {
@@ -148,33 +138,40 @@ static struct chan_struct* client_free_channel(struct client_struct_ssh* client,
 	if (prev_chan == NULL) {
 		_chan_free(client, cur_chan);
 		client->ssh_chans = cur_chan->next;
-		free(cur_chan);
+		np_slab_free(NP_SLAB_CHANNEL, cur_chan);
+		if (client->ssh_chans != NULL) {
+			/* the last channel keeps counting as the client itself */
+			np_session_count_add(-1);
+		}
 		return client->ssh_chans;
 	}
 
 	prev_chan->next = cur_chan->next;
 	_chan_free(client, cur_chan);
-	free(cur_chan);
+	np_slab_free(NP_SLAB_CHANNEL, cur_chan);
+	np_session_count_add(-1);
 	return prev_chan;
 }
 
 static struct chan_struct* client_find_channel_by_sid(struct client_struct_ssh* client, const char* sid) {
+	struct np_sess_entry* entry;
 	struct chan_struct* chan = NULL;
 
 	if (client == NULL || sid == NULL) {
 		return NULL;
 	}
 
-	for (chan = client->ssh_chans; chan != NULL; chan = chan->next) {
-		if (chan->nc_sess == NULL) {
-			continue;
-		}
+	/* GLOBAL LOCK */
+	pthread_mutex_lock(&netopeer_state.global_lock);
 
-		if (strcmp(sid, nc_session_get_id(chan->nc_sess)) == 0) {
-			break;
-		}
+	entry = np_sess_index_find(sid);
+	if (entry != NULL && entry->client == (struct client_struct*)client) {
+		chan = entry->data;
 	}
 
+	/* GLOBAL UNLOCK */
+	pthread_mutex_unlock(&netopeer_state.global_lock);
+
 	return chan;
 }
 
@@ -201,7 +198,8 @@ static int create_netconf_session(struct client_struct_ssh* client, struct chan_
 
 	/* new session was created */
 	nc_verb_verbose("New server session for '%s' with ID %s", client->username, nc_session_get_id(channel->nc_sess));
-	gettimeofday((struct timeval*)&channel->last_rpc_time, NULL);
+	channel->last_rpc_time = np_clock_msec();
+	np_sess_index_add(channel->nc_sess, (struct client_struct*)client, channel);
 
 	return EXIT_SUCCESS;
 }
@@ -221,156 +219,67 @@ static int sshcb_channel_subsystem(struct client_struct_ssh* client, struct chan
 	return 0;
 }
 
-static char* auth_password_get_pwd_hash(const char* username) {
-	struct passwd* pwd;
-	struct spwd* spwd;
-	char* pass_hash = NULL;
-
-	pwd = getpwnam(username);
-	if (pwd == NULL) {
-		nc_verb_verbose("User '%s' not found locally.", username);
-		return NULL;
-	}
-
-	if (strcmp(pwd->pw_passwd, "x") == 0) {
-		spwd = getspnam(username);
-		if (spwd == NULL) {
-			nc_verb_verbose("Failed to retrieve the shadow entry for '%s'.", username);
-			return NULL;
-		}
-
-		pass_hash = spwd->sp_pwdp;
-	} else {
-		pass_hash = pwd->pw_passwd;
-	}
-
-	if (pass_hash == NULL) {
-		nc_verb_error("%s: no password could be retrieved for '%s'", __func__, username);
-		return NULL;
+/* answer a password or keyboard-interactive auth message, ret: 0 - password correct, 1 - password wrong, -1 - not checked */
+static void sshcb_auth_verdict(struct client_struct_ssh* client, ssh_message msg, int ret) {
+	if (ret == 0) {
+		nc_verb_verbose("User '%s' authenticated.", client->username);
+		ssh_message_auth_reply_success(msg, 0);
+		client->authenticated = 1;
+		return;
 	}
 
-	/* check the hash structure for special meaning */
-	if (strcmp(pass_hash, "*") == 0 || strcmp(pass_hash, "!") == 0) {
-		nc_verb_verbose("User '%s' is not allowed to authenticate using a password.", username);
-		return NULL;
+	/* the server being too busy is not the client's failed attempt */
+	if (ret == 1) {
+		client->auth_attempts++;
+		np_stats_auth_failure(NC_TRANSPORT_SSH);
+		nc_verb_verbose("Failed user '%s' authentication attempt (#%d).", client->username, client->auth_attempts);
 	}
-	if (strcmp(pass_hash, "*NP*") == 0) {
-		nc_verb_verbose("Retrieving password for '%s' from a NIS+ server not supported.", username);
-		return NULL;
-	}
-
-	return pass_hash;
+	ssh_message_reply_default(msg);
 }
 
-static int auth_password_compare_pwd(const char* pass_hash, const char* pass_clear) {
-	char* new_pass_hash;
-
-	if (strcmp(pass_hash, "") == 0) {
-		if (strcmp(pass_clear, "") == 0) {
-			nc_verb_verbose("User authentication successful with an empty password!");
-			return 0;
-		} else {
-			/* the user did now know he does not need any password,
-			 * (which should not be used) so deny authentication */
-			return 1;
-		}
+/* return: 0 - answered, 2 - the message is kept until the password check finishes */
+static int sshcb_auth_check(struct client_struct_ssh* client, ssh_message msg, const char* password) {
+	if (password == NULL) {
+		sshcb_auth_verdict(client, msg, 1);
+		return 0;
 	}
 
-	new_pass_hash = crypt(pass_clear, pass_hash);
-	if (!new_pass_hash) {
-		nc_verb_error("%s: crypt() failed (setting \"%s\").", __func__, pass_hash);
-		return 1;
+	/* hashing takes long, the engine thread does not wait for it */
+	if ((client->auth_job = np_ssh_password_check(client->username, password, (struct client_struct*)client)) == NULL) {
+		sshcb_auth_verdict(client, msg, -1);
+		return 0;
 	}
-	return strcmp(new_pass_hash, pass_hash);
+	client->auth_msg = msg;
+	return 2;
 }
 
-static void sshcb_auth_password(struct client_struct_ssh* client, ssh_message msg) {
-	char* pass_hash;
-
-	pass_hash = auth_password_get_pwd_hash(client->username);
-	if (pass_hash != NULL && auth_password_compare_pwd(pass_hash, ssh_message_auth_password(msg)) == 0) {
-		nc_verb_verbose("User '%s' authenticated.", client->username);
-		ssh_message_auth_reply_success(msg, 0);
-		client->authenticated = 1;
-		return;
-	}
-
-	client->auth_attempts++;
-	nc_verb_verbose("Failed user '%s' authentication attempt (#%d).", client->username, client->auth_attempts);
-	ssh_message_reply_default(msg);
+/* return: 0 - answered, 2 - the message is kept until the password check finishes */
+static int sshcb_auth_password(struct client_struct_ssh* client, ssh_message msg) {
+	return sshcb_auth_check(client, msg, ssh_message_auth_password(msg));
 }
 
-static void sshcb_auth_kbdint(struct client_struct_ssh* client, ssh_message msg) {
-	char* pass_hash;
-
+/* return: 0 - answered, 2 - the message is kept until the password check finishes */
+static int sshcb_auth_kbdint(struct client_struct_ssh* client, ssh_message msg) {
 	if (!ssh_message_auth_kbdint_is_response(msg)) {
 		const char* prompts[] = {"Password: "};
 		char echo[] = {0};
 
 		ssh_message_auth_interactive_request(msg, "Interactive SSH Authentication", "Type your password", 1, prompts, echo);
-	} else {
-		if (ssh_userauth_kbdint_getnanswers(client->ssh_sess) != 1) {
-			ssh_message_reply_default(msg);
-			return;
-		}
-		pass_hash = auth_password_get_pwd_hash(client->username);
-		if (pass_hash == NULL) {
-			ssh_message_reply_default(msg);
-			return;
-		}
-		if (auth_password_compare_pwd(pass_hash, ssh_userauth_kbdint_getanswer(client->ssh_sess, 0)) == 0) {
-			nc_verb_verbose("User '%s' authenticated.", client->username);
-			client->authenticated = 1;
-			ssh_message_auth_reply_success(msg, 0);
-		} else {
-			client->auth_attempts++;
-			nc_verb_verbose("Failed user '%s' authentication attempt (#%d).", client->username, client->auth_attempts);
-			ssh_message_reply_default(msg);
-		}
-	}
-}
-
-static char* auth_pubkey_compare_key(ssh_key key) {
-	struct np_auth_key* auth_key;
-	ssh_key pub_key;
-	char* username = NULL;
-
-	/* CLIENT KEYS LOCK */
-	pthread_mutex_lock(&netopeer_options.ssh_opts->client_keys_lock);
-
-	for (auth_key = netopeer_options.ssh_opts->client_auth_keys; auth_key != NULL; auth_key = auth_key->next) {
-		if (ssh_pki_import_pubkey_file(auth_key->path, &pub_key) != SSH_OK) {
-			if (eaccess(auth_key->path, R_OK) != 0) {
-				nc_verb_verbose("%s: failed to import the public key \"%s\" (%s)", __func__, auth_key->path, strerror(errno));
-			} else {
-				nc_verb_verbose("%s: failed to import the public key \"%s\": %s", __func__, auth_key->path, ssh_get_error(pub_key));
-			}
-			continue;
-		}
-
-		if (ssh_key_cmp(key, pub_key, SSH_KEY_CMP_PUBLIC) == 0) {
-			ssh_key_free(pub_key);
-			break;
-		}
-
-		ssh_key_free(pub_key);
+		return 0;
 	}
 
-	if (auth_key != NULL) {
-		username = strdup(auth_key->username);
+	if (ssh_userauth_kbdint_getnanswers(client->ssh_sess) != 1) {
+		ssh_message_reply_default(msg);
+		return 0;
 	}
-
-	/* CLIENT KEYS UNLOCK */
-	pthread_mutex_unlock(&netopeer_options.ssh_opts->client_keys_lock);
-
-	return username;
+	return sshcb_auth_check(client, msg, ssh_userauth_kbdint_getanswer(client->ssh_sess, 0));
 }
 
 static void sshcb_auth_pubkey(struct client_struct_ssh* client, ssh_message msg) {
 	char* username;
 	int signature_state;
 
-	if ((username = auth_pubkey_compare_key(ssh_message_auth_pubkey(msg))) == NULL) {
+	if ((username = np_ssh_auth_key_username(ssh_message_auth_pubkey(msg))) == NULL) {
 		nc_verb_verbose("User '%s' tried to use an unknown (unauthorized) public key.", client->username);
 		goto fail;
 	} else if (strcmp(client->username, username) != 0) {
@@ -396,127 +305,499 @@ static void sshcb_auth_pubkey(struct client_struct_ssh* client, ssh_message msg)
 fail:
 	free(username);
 	client->auth_attempts++;
+	np_stats_auth_failure(NC_TRANSPORT_SSH);
 	nc_verb_verbose("Failed user '%s' authentication attempt (#%d).", client->username, client->auth_attempts);
 	ssh_message_reply_default(msg);
 }
 
-/* return 0 - OK, -1 error */
-static int sshcb_channel_open(struct client_struct_ssh* client, ssh_channel channel) {
-	struct chan_struct* cur_chan;
+/* only peeks into the data until the whole hello, always with the 1.0 framing, is there, libnetconf reads it afterwards */
+static int sshcb_channel_data(ssh_session UNUSED(session), ssh_channel UNUSED(channel), void* data, uint32_t len, int is_stderr, void* userdata) {
+	struct chan_struct* chan = userdata;
+
+	if (!chan->hello_ready && !is_stderr && memmem(data, len, "]]>]]>", 6) != NULL) {
+		chan->hello_ready = 1;
+	}
+
+	/* nothing consumed */
+	return 0;
+}
+
+/* return: 0 - channel opened, -1 - the request was refused */
+static int sshcb_channel_open(struct client_struct_ssh* client, ssh_message msg) {
+	struct chan_struct* cur_chan, *new_chan;
+
+	/* the client must not be left with a channel the server does not know about */
+	if ((new_chan = np_slab_alloc(NP_SLAB_CHANNEL)) == NULL) {
+		ssh_message_reply_default(msg);
+		return -1;
+	}
+	if ((new_chan->ssh_chan = ssh_message_channel_request_open_reply_accept(msg)) == NULL) {
+		np_slab_free(NP_SLAB_CHANNEL, new_chan);
+		ssh_message_reply_default(msg);
+		return -1;
+	}
+	ssh_callbacks_init(&new_chan->callbacks);
+	new_chan->callbacks.userdata = new_chan;
+	new_chan->callbacks.channel_data_function = sshcb_channel_data;
+	ssh_set_channel_callbacks(new_chan->ssh_chan, &new_chan->callbacks);
 
 	/* GLOBAL LOCK */
 	pthread_mutex_lock(&netopeer_state.global_lock);
 
 	if (client->ssh_chans == NULL) {
-		client->ssh_chans = calloc(1, sizeof(struct chan_struct));
-		cur_chan = client->ssh_chans;
+		client->ssh_chans = new_chan;
 	} else {
 		for (cur_chan = client->ssh_chans; cur_chan->next != NULL; cur_chan = cur_chan->next);
-		cur_chan->next = calloc(1, sizeof(struct chan_struct));
-		cur_chan = cur_chan->next;
+		cur_chan->next = new_chan;
+		/* the first channel was already counted as the client itself */
+		np_session_count_add(1);
 	}
-	cur_chan->ssh_chan = channel;
+	cur_chan = new_chan;
 
 	/* GLOBAL UNLOCK */
 	pthread_mutex_unlock(&netopeer_state.global_lock);
 
-	gettimeofday((struct timeval*)&cur_chan->last_rpc_time, NULL);
+	cur_chan->last_rpc_time = np_clock_msec();
+	np_engine_timer((struct client_struct*)client, cur_chan->last_rpc_time + netopeer_options.hello_timeout * 1000ULL);
 
 	return 0;
 }
 
 int np_ssh_kill_session(const char* sid, struct client_struct_ssh* cur_client) {
-	struct client_struct_ssh* kill_client;
-	struct chan_struct* kill_chan = NULL;
+	struct np_sess_entry* entry;
 
 	if (sid == NULL) {
 		return 1;
 	}
 
-	/* find the requested session (channel) */
-	for (kill_client = (struct client_struct_ssh*)netopeer_state.clients; kill_client != NULL; kill_client = (struct client_struct_ssh*)kill_client->next) {
-		if (kill_client->transport != NC_TRANSPORT_SSH || kill_client == cur_client) {
-			continue;
-		}
-
-		kill_chan = client_find_channel_by_sid(kill_client, sid);
-		if (kill_chan != NULL) {
-			break;
-		}
-	}
+	/* GLOBAL LOCK */
+	pthread_mutex_lock(&netopeer_state.global_lock);
 
-	if (kill_chan == NULL) {
+	/* find the requested session (channel) */
+	entry = np_sess_index_find(sid);
+	if (entry == NULL || entry->client->transport != NC_TRANSPORT_SSH || entry->client == (struct client_struct*)cur_client) {
+		/* GLOBAL UNLOCK */
+		pthread_mutex_unlock(&netopeer_state.global_lock);
 		return 1;
 	}
 
-	kill_chan->to_free = 1;
+	((struct chan_struct*)entry->data)->to_free = 1;
+	np_engine_kick(entry->client);
+
+	/* GLOBAL UNLOCK */
+	pthread_mutex_unlock(&netopeer_state.global_lock);
 	return 0;
 }
 
-/* return: 0 - nothing happened (sleep), 1 - something happened (skip sleep) */
-int np_ssh_client_netconf_rpc(struct client_struct_ssh* client) {
-	nc_rpc* rpc = NULL;
-	nc_reply* rpc_reply = NULL;
-	NC_MSG_TYPE rpc_type;
-	xmlNodePtr op;
-	int closing = 0, skip_sleep = 0;
-	struct nc_err* err;
-	struct chan_struct* chan;
+/* return: 0 - processed, 1 - not processed (default reply), 2 - kept by the client */
+static int sshcb_msg(struct client_struct_ssh* client, ssh_message msg) {
+	const char* str_type, *str_subtype = NULL, *username;
+	int subtype, type;
+	struct chan_struct* channel = NULL;
 
-	if (client->to_free) {
-		return 1;
-	}
+	type = ssh_message_type(msg);
+	subtype = ssh_message_subtype(msg);
 
-	for (chan = client->ssh_chans; chan != NULL; chan = chan->next) {
-		if (chan->to_free) {
-			++skip_sleep;
-			continue;
+	switch (type) {
+	case SSH_REQUEST_AUTH:
+		str_type = "request-auth";
+		switch (subtype) {
+		case SSH_AUTH_METHOD_NONE:
+			str_subtype = "none";
+			break;
+		case SSH_AUTH_METHOD_PASSWORD:
+			str_subtype = "password";
+			break;
+		case SSH_AUTH_METHOD_PUBLICKEY:
+			str_subtype = "publickey";
+			break;
+		case SSH_AUTH_METHOD_HOSTBASED:
+			str_subtype = "hostbased";
+			break;
+		case SSH_AUTH_METHOD_INTERACTIVE:
+			str_subtype = "interactive";
+			break;
+		case SSH_AUTH_METHOD_GSSAPI_MIC:
+			str_subtype = "gssapi-mic";
+			break;
+		default:
+			str_subtype = "unknown";
+			break;
 		}
+		break;
 
-		/* block this client until the hello is received */
-		if (chan->nc_sess == NULL) {
-			if (!chan->netconf_subsystem) {
-				continue;
-			}
-			if (create_netconf_session(client, chan)) {
-				continue;
-			}
+	case SSH_REQUEST_CHANNEL_OPEN:
+		str_type = "request-channel-open";
+		switch (subtype) {
+		case SSH_CHANNEL_SESSION:
+			str_subtype = "session";
+			break;
+		case SSH_CHANNEL_DIRECT_TCPIP:
+			str_subtype = "direct-tcpip";
+			break;
+		case SSH_CHANNEL_FORWARDED_TCPIP:
+			str_subtype = "forwarded-tcpip";
+			break;
+		case (int)SSH_CHANNEL_X11:
+			str_subtype = "channel-x11";
+			break;
+		case SSH_CHANNEL_UNKNOWN:
+			/* fallthrough */
+		default:
+			str_subtype = "unknown";
+			break;
 		}
+		break;
 
-		/* receive a new RPC */
-		rpc_type = nc_session_recv_rpc(chan->nc_sess, 0, &rpc);
-		if (rpc_type == NC_MSG_WOULDBLOCK || rpc_type == NC_MSG_NONE) {
-			/* no RPC, or processed internally */
-			continue;
+	case SSH_REQUEST_CHANNEL:
+		str_type = "request-channel";
+		switch (subtype) {
+		case SSH_CHANNEL_REQUEST_PTY:
+			str_subtype = "pty";
+			break;
+		case SSH_CHANNEL_REQUEST_EXEC:
+			str_subtype = "exec";
+			break;
+		case SSH_CHANNEL_REQUEST_SHELL:
+			str_subtype = "shell";
+			break;
+		case SSH_CHANNEL_REQUEST_ENV:
+			str_subtype = "env";
+			break;
+		case SSH_CHANNEL_REQUEST_SUBSYSTEM:
+			str_subtype = "subsystem";
+			break;
+		case SSH_CHANNEL_REQUEST_WINDOW_CHANGE:
+			str_subtype = "window-change";
+			break;
+		case SSH_CHANNEL_REQUEST_X11:
+			str_subtype = "x11";
+			break;
+		case SSH_CHANNEL_REQUEST_UNKNOWN:
+			/* fallthrough */
+		default:
+			str_subtype = "unknown";
+			break;
 		}
+		break;
 
-		gettimeofday((struct timeval*)&chan->last_rpc_time, NULL);
+	case SSH_REQUEST_SERVICE:
+		str_type = "request-service";
+		str_subtype = ssh_message_service_service(msg);
+		break;
 
-		if (rpc_type == NC_MSG_UNKNOWN) {
-			if (nc_session_get_status(chan->nc_sess) != NC_SESSION_STATUS_WORKING) {
-				/* something really bad happened, and communication is not possible anymore */
-				nc_verb_error("%s: failed to receive client's message (nc session not working)", __func__);
-				chan->to_free = 1;
-			}
-			/* ignore */
-			continue;
+	case SSH_REQUEST_GLOBAL:
+		str_type = "request-global";
+		switch (subtype) {
+		case SSH_GLOBAL_REQUEST_TCPIP_FORWARD:
+			str_subtype = "tcpip-forward";
+			break;
+		case SSH_GLOBAL_REQUEST_CANCEL_TCPIP_FORWARD:
+			str_subtype = "cancel-tcpip-forward";
+			break;
+		case SSH_GLOBAL_REQUEST_UNKNOWN:
+			/* fallthrough */
+		default:
+			str_subtype = "unknown";
+			break;
 		}
+		break;
 
-		if (rpc_type != NC_MSG_RPC) {
-			/* NC_MSG_HELLO, NC_MSG_REPLY, NC_MSG_NOTIFICATION */
-			nc_verb_warning("%s: received a %s RPC from session %s, ignoring", __func__,
-							(rpc_type == NC_MSG_HELLO ? "hello" : (rpc_type == NC_MSG_REPLY ? "reply" : "notification")),
-							nc_session_get_id(chan->nc_sess));
-			++skip_sleep;
-			continue;
-		}
+	default:
+		str_type = "unknown";
+		str_subtype = "unknown";
+		break;
+	}
+
+	nc_verb_verbose("Received an SSH message \"%s\" of subtype \"%s\".", str_type, str_subtype);
+
+	if (type == SSH_REQUEST_CHANNEL) {
+		if ((channel = client_find_channel_by_sshchan(client, ssh_message_channel_request_channel(msg))) == NULL) {
+			nc_verb_error("%s: internal error (%s:%d)", __func__, __FILE__, __LINE__);
+			return 1;
+		}
+	}
+
+	/*
+	 * process known messages
+	 */
+	if (type == SSH_REQUEST_AUTH) {
+		if (client->authenticated) {
+			nc_verb_warning("User '%s' authenticated, but requested another authentication.", client->username);
+			ssh_message_reply_default(msg);
+			return 0;
+		}
+
+		if (client->auth_attempts >= netopeer_options.ssh_opts->auth_attempts) {
+			/* too many failed attempts */
+			ssh_message_reply_default(msg);
+			return 0;
+		}
+
+		/* save the username, do not let the client change it */
+		username = ssh_message_auth_user(msg);
+		if (client->username == NULL) {
+			if (username == NULL) {
+				nc_verb_error("Denying an auth request without a username.");
+				return 1;
+			}
+
+			client->username = strdup(username);
+		} else if (username != NULL) {
+			if (strcmp(username, client->username) != 0) {
+				nc_verb_error("User '%s' changed its username to '%s', disconnecting.", client->username, username);
+				client->to_free = 1;
+				return 1;
+			}
+		}
+
+		if (subtype == SSH_AUTH_METHOD_NONE) {
+			/* libssh will return the supported auth methods */
+			return 1;
+		} else if (subtype == SSH_AUTH_METHOD_PASSWORD) {
+			return sshcb_auth_password(client, msg);
+		} else if (subtype == SSH_AUTH_METHOD_PUBLICKEY) {
+			sshcb_auth_pubkey(client, msg);
+			return 0;
+		} else if (subtype == SSH_AUTH_METHOD_INTERACTIVE) {
+			return sshcb_auth_kbdint(client, msg);
+		}
+	} else if (client->authenticated) {
+		if (type == SSH_REQUEST_CHANNEL_OPEN && subtype == (int)SSH_CHANNEL_SESSION) {
+			sshcb_channel_open(client, msg);
+			return 0;
+		} else if (type == SSH_REQUEST_CHANNEL && subtype == (int)SSH_CHANNEL_REQUEST_SUBSYSTEM) {
+			if (sshcb_channel_subsystem(client, channel, ssh_message_channel_request_subsystem(msg)) == 0) {
+				ssh_message_channel_request_reply_success(msg);
+			} else {
+				ssh_message_reply_default(msg);
+			}
+			return 0;
+		}
+	}
+
+	/* we did not process it */
+	return 1;
+}
+
+/* return: number of the messages processed, -1 if the session failed */
+static int ssh_client_messages(struct client_struct_ssh* client) {
+	ssh_message msg;
+	int count = 0;
+
+	/* in order, nothing more until the password check in progress finishes */
+	while (client->auth_job == NULL && !client->to_free) {
+		if ((msg = ssh_message_get(client->ssh_sess)) == NULL) {
+			return (ssh_get_error_code(client->ssh_sess) == SSH_FATAL ? -1 : count);
+		}
+		++count;
+
+		switch (sshcb_msg(client, msg)) {
+		case 1:
+			ssh_message_reply_default(msg);
+			/* fallthrough */
+		case 0:
+			ssh_message_free(msg);
+			break;
+		default:
+			/* answered once the check finishes */
+			break;
+		}
+	}
+
+	return count;
+}
+
+/* only in an engine helper with a blocking session, the engine drops the client if a chunk is not taken in time */
+static int ssh_reply_write(void* arg, const char* buf, size_t len) {
+	ssh_channel ssh_chan = arg;
+
+	np_engine_step_deadline(np_clock_msec() + REPLY_WRITE_TIMEOUT);
+	if (ssh_channel_write(ssh_chan, buf, len) != (int)len) {
+		nc_verb_error("%s: failed to write into SSH channel (%s)", __func__, ssh_get_error(ssh_channel_get_session(ssh_chan)));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* send the reply of the finished job of the channel */
+static void ssh_reply_send(struct chan_struct* chan) {
+	struct np_rpc_job* job = chan->rpc_job;
+	int ret;
+
+	/* large data replies are written into the channel as they are serialized */
+	ret = np_reply_stream(chan->nc_sess, job->rpc, job->reply, ssh_reply_write, chan->ssh_chan);
+	if (ret == 1) {
+		nc_session_send_reply(chan->nc_sess, job->rpc, job->reply);
+	} else if (ret == -1) {
+		chan->to_free = 1;
+	}
+	if (nc_rpc_get_op(job->rpc) == NC_OP_CLOSESESSION) {
+		chan->to_free = 1;
+	}
+	np_stats_hist_add(&netopeer_stats.rpc_latency, &job->recv_time);
+	np_rpc_job_free(job);
+	chan->rpc_job = NULL;
+	chan->last_rpc_time = np_clock_msec();
+}
+
+/* the engine helper steps, they run with the session blocking and nobody else processes the client meanwhile */
+static void ssh_step_reply(struct client_struct* arg) {
+	struct client_struct_ssh* client = (struct client_struct_ssh*)arg;
+
+	ssh_set_blocking(client->ssh_sess, 1);
+	ssh_reply_send(client->step_chan);
+	ssh_set_blocking(client->ssh_sess, 0);
+}
+
+static void ssh_step_notif(struct client_struct* arg) {
+	struct client_struct_ssh* client = (struct client_struct_ssh*)arg;
+
+	ssh_set_blocking(client->ssh_sess, 1);
+	np_notif_send(client->step_chan->notif_sub, NULL);
+	ssh_set_blocking(client->ssh_sess, 0);
+}
+
+static void ssh_step_hello(struct client_struct* arg) {
+	struct client_struct_ssh* client = (struct client_struct_ssh*)arg;
+
+	ssh_set_blocking(client->ssh_sess, 1);
+	create_netconf_session(client, client->step_chan);
+	ssh_set_blocking(client->ssh_sess, 0);
+}
+
+/* return: 0 - the reply was sent, 1 - an engine helper sends it */
+static int ssh_chan_reply(struct client_struct_ssh* client, struct chan_struct* chan) {
+	NC_REPLY_TYPE type = nc_reply_get_type(chan->rpc_job->reply);
+
+	/* only a short reply fitting into the channel window cannot block */
+	if ((type == NC_REPLY_OK || type == NC_REPLY_ERROR) && ssh_channel_window_size(chan->ssh_chan) >= SEND_INLINE_ROOM) {
+		ssh_reply_send(chan);
+		return 0;
+	}
+
+	client->step_chan = chan;
+	np_engine_offload((struct client_struct*)client, ssh_step_reply, np_clock_msec() + REPLY_WRITE_TIMEOUT);
+	return 1;
+}
+
+/* return: 0 - nothing happened (sleep), 1 - something happened (skip sleep) */
+int np_ssh_client_netconf_rpc(struct client_struct_ssh* client) {
+	nc_rpc* rpc = NULL;
+	nc_reply* rpc_reply = NULL;
+	NC_MSG_TYPE rpc_type;
+	xmlNodePtr op;
+	int skip_sleep = 0, ret, delay;
+	struct nc_err* err;
+	struct chan_struct* chan;
+	struct timespec recv_time;
+	size_t room;
+
+	if (client->to_free) {
+		return 1;
+	}
+
+	for (chan = client->ssh_chans; chan != NULL; chan = chan->next) {
+		if (chan->to_free) {
+			++skip_sleep;
+			continue;
+		}
+
+		/* send the reply of the RPC processed by a worker */
+		if (chan->rpc_job != NULL) {
+			if (!np_rpc_job_done(chan->rpc_job)) {
+				/* keep the order of the replies, do not receive anything meanwhile */
+				continue;
+			}
+
+			if (ssh_chan_reply(client, chan)) {
+				/* nothing else until an engine helper sends it */
+				return skip_sleep + 1;
+			}
+			++skip_sleep;
+
+			if (chan->to_free) {
+				continue;
+			}
+		}
+
+		/* send the queued notifications, the ones not fitting into the window by an engine helper */
+		if (chan->notif_sub != NULL) {
+			room = ssh_channel_window_size(chan->ssh_chan);
+			if (np_notif_send(chan->notif_sub, &room)) {
+				++skip_sleep;
+			}
+			if (np_notif_queue_depth(chan->notif_sub) > 0) {
+				client->step_chan = chan;
+				np_engine_offload((struct client_struct*)client, ssh_step_notif, np_clock_msec() + REPLY_WRITE_TIMEOUT);
+				return skip_sleep + 1;
+			}
+		}
+
+		/* accepting the session reads the hello, only once it has all arrived */
+		if (chan->nc_sess == NULL) {
+			if (!chan->netconf_subsystem) {
+				continue;
+			}
+			ret = ssh_channel_poll(chan->ssh_chan, 0);
+			if (ret == SSH_ERROR || ret == SSH_EOF) {
+				nc_verb_error("%s: channel closed before the hello was received", __func__);
+				chan->to_free = 1;
+				++skip_sleep;
+				continue;
+			}
+			if (!chan->hello_ready) {
+				continue;
+			}
+			if (ssh_channel_window_size(chan->ssh_chan) < np_hello_len() + SEND_INLINE_ROOM) {
+				/* our hello does not fit into the window */
+				client->step_chan = chan;
+				np_engine_offload((struct client_struct*)client, ssh_step_hello, chan->last_rpc_time + netopeer_options.hello_timeout * 1000ULL);
+				return skip_sleep + 1;
+			}
+			++skip_sleep;
+			if (create_netconf_session(client, chan)) {
+				continue;
+			}
+		}
+
+		/* receive a new RPC */
+		rpc_type = nc_session_recv_rpc(chan->nc_sess, 0, &rpc);
+		if (rpc_type == NC_MSG_WOULDBLOCK || rpc_type == NC_MSG_NONE) {
+			/* no RPC, or processed internally */
+			continue;
+		}
+
+		chan->last_rpc_time = np_clock_msec();
+
+		if (rpc_type == NC_MSG_UNKNOWN) {
+			if (nc_session_get_status(chan->nc_sess) != NC_SESSION_STATUS_WORKING) {
+				/* something really bad happened, and communication is not possible anymore */
+				nc_verb_error("%s: failed to receive client's message (nc session not working)", __func__);
+				chan->to_free = 1;
+			}
+			/* ignore */
+			continue;
+		}
+
+		if (rpc_type != NC_MSG_RPC) {
+			/* NC_MSG_HELLO, NC_MSG_REPLY, NC_MSG_NOTIFICATION */
+			nc_verb_warning("%s: received a %s RPC from session %s, ignoring", __func__,
+							(rpc_type == NC_MSG_HELLO ? "hello" : (rpc_type == NC_MSG_REPLY ? "reply" : "notification")),
+							nc_session_get_id(chan->nc_sess));
+			++skip_sleep;
+			continue;
+		}
 
 		++skip_sleep;
+		clock_gettime(CLOCK_MONOTONIC, &recv_time);
+		np_stats_rpc(rpc);
 
 		/* process the new RPC */
 		switch (nc_rpc_get_op(rpc)) {
 		case NC_OP_CLOSESESSION:
-			closing = 1;
+			/* the channel is closed once the reply is sent */
 			rpc_reply = nc_reply_ok();
 			break;
 
@@ -541,7 +822,6 @@ int np_ssh_client_netconf_rpc(struct client_struct_ssh* client) {
 
 			/* block-local variables */
 			char* sid;
-			int ret;
 
 			sid = (char*)xmlNodeGetContent(op->children);
 			xmlFreeNodeList(op);
@@ -581,7 +861,7 @@ int np_ssh_client_netconf_rpc(struct client_struct_ssh* client) {
 			}
 
 			/* check if notifications are allowed on this session */
-			if (nc_session_notif_allowed(chan->nc_sess) == 0) {
+			if (chan->notif_sub != NULL || nc_session_notif_allowed(chan->nc_sess) == 0) {
 				nc_verb_error("%s: notification subscription is not allowed on the session %s", __func__, nc_session_get_id(chan->nc_sess));
 				err = nc_err_new(NC_ERR_OP_FAILED);
 				nc_err_set(err, NC_ERR_PARAM_TYPE, "protocol");
@@ -596,10 +876,15 @@ int np_ssh_client_netconf_rpc(struct client_struct_ssh* client) {
 				break;
 			}
 
+			/* live events of a stream are served by the shared dispatcher */
+			if ((chan->notif_sub = np_notif_subscribe((struct client_struct*)client, chan->nc_sess, &chan->to_free, rpc)) != NULL) {
+				break;
+			}
+
 			pthread_t thread;
 			struct ntf_thread_config* ntf_config;
 
-			if ((ntf_config = malloc(sizeof(struct ntf_thread_config))) == NULL) {
+			if ((ntf_config = np_slab_alloc(NP_SLAB_NOTIF)) == NULL) {
 				nc_verb_error("%s: memory allocation failed", __func__);
 				err = nc_err_new(NC_ERR_OP_FAILED);
 				nc_err_set(err, NC_ERR_PARAM_MSG, "Memory allocation failed.");
@@ -612,6 +897,8 @@ int np_ssh_client_netconf_rpc(struct client_struct_ssh* client) {
 
 			/* perform notification sending */
 			if ((pthread_create(&thread, NULL, client_notif_thread, ntf_config)) != 0) {
+				nc_rpc_free(ntf_config->subscribe_rpc);
+				np_slab_free(NP_SLAB_NOTIF, ntf_config);
 				nc_reply_free(rpc_reply);
 				err = nc_err_new(NC_ERR_OP_FAILED);
 				nc_err_set(err, NC_ERR_PARAM_MSG, "Creating thread for sending Notifications failed.");
@@ -623,39 +910,49 @@ int np_ssh_client_netconf_rpc(struct client_struct_ssh* client) {
 			break;
 
 		default:
-			if ((rpc_reply = ncds_apply_rpc2all(chan->nc_sess, rpc, NULL)) == NULL) {
-				err = nc_err_new(NC_ERR_OP_FAILED);
-				nc_err_set(err, NC_ERR_PARAM_MSG, "For unknown reason no reply was returned by the library.");
-				rpc_reply = nc_reply_error(err);
-			} else if (rpc_reply == NCDS_RPC_NOT_APPLICABLE) {
-				err = nc_err_new(NC_ERR_OP_FAILED);
-				nc_err_set(err, NC_ERR_PARAM_MSG, "There is no device/data that could be affected.");
-				nc_reply_free(rpc_reply);
+			if ((delay = np_ratelimit_rpc(client->username, nc_session_get_id(chan->nc_sess))) == -1) {
+				err = nc_err_new(NC_ERR_RES_DENIED);
+				nc_err_set(err, NC_ERR_PARAM_MSG, "RPC rate limit exceeded, try again later.");
 				rpc_reply = nc_reply_error(err);
+				break;
 			}
 
+			/* a worker applies it, the reply is sent once it is done */
+			if ((chan->rpc_job = np_workers_submit((struct client_struct*)client, chan->nc_sess, rpc, delay)) != NULL) {
+				continue;
+			}
+
+			err = nc_err_new(NC_ERR_OP_FAILED);
+			nc_err_set(err, NC_ERR_PARAM_MSG, "Failed to queue the RPC for processing.");
+			rpc_reply = nc_reply_error(err);
 			break;
 		}
 
-		/* send reply */
-		nc_session_send_reply(chan->nc_sess, rpc, rpc_reply);
-		nc_reply_free(rpc_reply);
-		nc_rpc_free(rpc);
-
-		if (closing) {
+		/* replied right away, it is sent the same way as the replies of the workers */
+		if ((chan->rpc_job = np_rpc_job_reply((struct client_struct*)client, chan->nc_sess, rpc, rpc_reply, &recv_time)) == NULL) {
+			nc_reply_free(rpc_reply);
+			nc_rpc_free(rpc);
 			chan->to_free = 1;
-			closing = 0;
+			continue;
+		}
+		if (ssh_chan_reply(client, chan)) {
+			return skip_sleep;
 		}
 	}
 
+	/* reading the channels may have queued some new messages, there is no event for them */
+	if (ssh_client_messages(client) > 0) {
+		++skip_sleep;
+	}
+
 	return skip_sleep;
 }
 
 /* return: 0 - nothing happened (sleep), 1 - something happened (skip sleep) */
-int np_ssh_client_transport(struct client_struct_ssh* client) {
+int np_ssh_client_transport(struct client_struct_ssh* client, int expired) {
 	struct chan_struct* chan;
-	struct timeval cur_time;
-	int skip_sleep = 0;
+	uint64_t now = 0, deadline = 0, chan_deadline;
+	int skip_sleep = 0, ret;
 
 	/* special corner case */
 	if (quit && client->ssh_chans == NULL) {
@@ -667,11 +964,17 @@ int np_ssh_client_transport(struct client_struct_ssh* client) {
 		return 1;
 	}
 
-	gettimeofday(&cur_time, NULL);
+	/* timeouts are checked only when the client timer expires */
+	if (expired) {
+		now = np_clock_msec();
+	}
 
 	/* check the client for authentication timeout and failed attempts */
 	if (!client->authenticated) {
-		if (timeval_diff(cur_time, client->conn_time) >= netopeer_options.ssh_opts->auth_timeout) {
+		if (expired) {
+			deadline = np_timespec_msec(&client->conn_time) + netopeer_options.ssh_opts->auth_timeout * 1000;
+		}
+		if (expired && now >= deadline) {
 			if (client->username == NULL) {
 				nc_verb_warning("Failed to authenticate for too long, dropping a client.");
 			} else {
@@ -707,7 +1010,21 @@ int np_ssh_client_transport(struct client_struct_ssh* client) {
 		}
 	}
 
-	if (ssh_execute_message_callbacks(client->ssh_sess) != SSH_OK) {
+	/* the hashing thread kicks us once the password check finishes */
+	if (client->auth_job != NULL) {
+		if ((ret = np_ssh_password_result(client->auth_job)) == 2) {
+			/* any data would have to wait anyway */
+			np_engine_park((struct client_struct*)client);
+		} else {
+			client->auth_job = NULL;
+			sshcb_auth_verdict(client, client->auth_msg, ret);
+			ssh_message_free(client->auth_msg);
+			client->auth_msg = NULL;
+			skip_sleep = 1;
+		}
+	}
+
+	if ((ret = ssh_client_messages(client)) == -1) {
 		if (client->username == NULL) {
 			nc_verb_error("Failed to receive new messages (%s), dropping a client.", ssh_get_error(client->ssh_sess));
 		} else {
@@ -722,9 +1039,8 @@ int np_ssh_client_transport(struct client_struct_ssh* client) {
 			client->to_free = 1;
 		}
 	}
-	if (client->new_ssh_msg) {
+	if (ret > 0) {
 		skip_sleep = 1;
-		client->new_ssh_msg = 0;
 	}
 
 	/* check every channel of the client for removal and timeout */
@@ -732,9 +1048,21 @@ int np_ssh_client_transport(struct client_struct_ssh* client) {
 		if (chan->to_free || quit) {
 			chan->to_free = 1;
 
+			if (chan->rpc_job != NULL) {
+				if (!np_rpc_job_done(chan->rpc_job)) {
+					/* the worker will kick us once it finishes */
+					continue;
+				}
+				np_rpc_job_free(chan->rpc_job);
+				chan->rpc_job = NULL;
+			}
+
 			/* don't sleep, we may have been asked to quit */
 			skip_sleep = 1;
 			nc_verb_verbose("Freeing session for '%s'", client->username);
+			np_sess_index_del(chan->nc_sess);
+			np_notif_unsubscribe(chan->notif_sub);
+			chan->notif_sub = NULL;
 			nc_session_free(chan->nc_sess);
 			chan->nc_sess = NULL;
 
@@ -747,221 +1075,40 @@ int np_ssh_client_transport(struct client_struct_ssh* client) {
 			}
 		}
 
-		/* check the channel for idle timeout */
-		if (timeval_diff(cur_time, chan->last_rpc_time) >= netopeer_options.idle_timeout) {
-			/* check for active event subscriptions, in that case we can never disconnect an idle session */
-			if (chan->nc_sess == NULL || !ncntf_session_get_active_subscription(chan->nc_sess)) {
-				nc_verb_warning("Session of client '%s' did not send/receive an RPC for too long, disconnecting.", client->username);
-				chan->to_free = 1;
-			}
-		}
-	}
-
-	return skip_sleep;
-}
-
-int sshcb_msg(ssh_session session, ssh_message msg, void* UNUSED(data)) {
-	const char* str_type, *str_subtype = NULL, *username;
-	int subtype, type;
-	struct client_struct_ssh* client;
-	struct chan_struct* channel = NULL;
-
-	type = ssh_message_type(msg);
-	subtype = ssh_message_subtype(msg);
-
-	switch (type) {
-	case SSH_REQUEST_AUTH:
-		str_type = "request-auth";
-		switch (subtype) {
-		case SSH_AUTH_METHOD_NONE:
-			str_subtype = "none";
-			break;
-		case SSH_AUTH_METHOD_PASSWORD:
-			str_subtype = "password";
-			break;
-		case SSH_AUTH_METHOD_PUBLICKEY:
-			str_subtype = "publickey";
-			break;
-		case SSH_AUTH_METHOD_HOSTBASED:
-			str_subtype = "hostbased";
-			break;
-		case SSH_AUTH_METHOD_INTERACTIVE:
-			str_subtype = "interactive";
-			break;
-		case SSH_AUTH_METHOD_GSSAPI_MIC:
-			str_subtype = "gssapi-mic";
-			break;
-		default:
-			str_subtype = "unknown";
-			break;
-		}
-		break;
-
-	case SSH_REQUEST_CHANNEL_OPEN:
-		str_type = "request-channel-open";
-		switch (subtype) {
-		case SSH_CHANNEL_SESSION:
-			str_subtype = "session";
-			break;
-		case SSH_CHANNEL_DIRECT_TCPIP:
-			str_subtype = "direct-tcpip";
-			break;
-		case SSH_CHANNEL_FORWARDED_TCPIP:
-			str_subtype = "forwarded-tcpip";
-			break;
-		case (int)SSH_CHANNEL_X11:
-			str_subtype = "channel-x11";
-			break;
-		case SSH_CHANNEL_UNKNOWN:
-			/* fallthrough */
-		default:
-			str_subtype = "unknown";
-			break;
-		}
-		break;
-
-	case SSH_REQUEST_CHANNEL:
-		str_type = "request-channel";
-		switch (subtype) {
-		case SSH_CHANNEL_REQUEST_PTY:
-			str_subtype = "pty";
-			break;
-		case SSH_CHANNEL_REQUEST_EXEC:
-			str_subtype = "exec";
-			break;
-		case SSH_CHANNEL_REQUEST_SHELL:
-			str_subtype = "shell";
-			break;
-		case SSH_CHANNEL_REQUEST_ENV:
-			str_subtype = "env";
-			break;
-		case SSH_CHANNEL_REQUEST_SUBSYSTEM:
-			str_subtype = "subsystem";
-			break;
-		case SSH_CHANNEL_REQUEST_WINDOW_CHANGE:
-			str_subtype = "window-change";
-			break;
-		case SSH_CHANNEL_REQUEST_X11:
-			str_subtype = "x11";
-			break;
-		case SSH_CHANNEL_REQUEST_UNKNOWN:
-			/* fallthrough */
-		default:
-			str_subtype = "unknown";
-			break;
-		}
-		break;
-
-	case SSH_REQUEST_SERVICE:
-		str_type = "request-service";
-		str_subtype = ssh_message_service_service(msg);
-		break;
-
-	case SSH_REQUEST_GLOBAL:
-		str_type = "request-global";
-		switch (subtype) {
-		case SSH_GLOBAL_REQUEST_TCPIP_FORWARD:
-			str_subtype = "tcpip-forward";
-			break;
-		case SSH_GLOBAL_REQUEST_CANCEL_TCPIP_FORWARD:
-			str_subtype = "cancel-tcpip-forward";
-			break;
-		case SSH_GLOBAL_REQUEST_UNKNOWN:
-			/* fallthrough */
-		default:
-			str_subtype = "unknown";
-			break;
-		}
-		break;
-
-	default:
-		str_type = "unknown";
-		str_subtype = "unknown";
-		break;
-	}
-
-	nc_verb_verbose("Received an SSH message \"%s\" of subtype \"%s\".", str_type, str_subtype);
-
-	if ((client = client_find_by_sshsession(netopeer_state.clients, session)) == NULL) {
-		nc_verb_error("%s: internal error (%s:%d)", __func__, __FILE__, __LINE__);
-		return 1;
-	}
-
-	client->new_ssh_msg = 1;
-
-	if (type == SSH_REQUEST_CHANNEL) {
-		if ((channel = client_find_channel_by_sshchan(client, ssh_message_channel_request_channel(msg))) == NULL) {
-			nc_verb_error("%s: internal error (%s:%d)", __func__, __FILE__, __LINE__);
-			return 1;
-		}
-	}
-
-	/*
-	 * process known messages
-	 */
-	if (type == SSH_REQUEST_AUTH) {
-		if (client->authenticated) {
-			nc_verb_warning("User '%s' authenticated, but requested another authentication.", client->username);
-			ssh_message_reply_default(msg);
-			return 0;
-		}
-
-		if (client->auth_attempts >= netopeer_options.ssh_opts->auth_attempts) {
-			/* too many failed attempts */
-			ssh_message_reply_default(msg);
-			return 0;
+		if (!expired) {
+			continue;
 		}
 
-		/* save the username, do not let the client change it */
-		username = ssh_message_auth_user(msg);
-		if (client->username == NULL) {
-			if (username == NULL) {
-				nc_verb_error("Denying an auth request without a username.");
-				return 1;
+		if (chan->nc_sess == NULL) {
+			/* check the channel for hello timeout, the last RPC time is its opening time until then */
+			chan_deadline = chan->last_rpc_time + netopeer_options.hello_timeout * 1000ULL;
+			if (now >= chan_deadline) {
+				nc_verb_warning("Client '%s' did not send the hello for too long, closing its channel.", client->username);
+				chan->to_free = 1;
+				skip_sleep = 1;
+				continue;
 			}
-
-			client->username = strdup(username);
-		} else if (username != NULL) {
-			if (strcmp(username, client->username) != 0) {
-				nc_verb_error("User '%s' changed its username to '%s', disconnecting.", client->username, username);
-				client->to_free = 1;
-				return 1;
+		} else {
+			/* check the channel for idle timeout */
+			chan_deadline = chan->last_rpc_time + netopeer_options.idle_timeout * 1000ULL;
+			if (now >= chan_deadline) {
+				/* check for active event subscriptions, in that case we can never disconnect an idle session */
+				if (chan->notif_sub == NULL && !ncntf_session_get_active_subscription(chan->nc_sess)) {
+					nc_verb_warning("Session of client '%s' did not send/receive an RPC for too long, disconnecting.", client->username);
+					chan->to_free = 1;
+					skip_sleep = 1;
+					continue;
+				}
+				chan_deadline = now + netopeer_options.idle_timeout * 1000ULL;
 			}
 		}
-
-		if (subtype == SSH_AUTH_METHOD_NONE) {
-			/* libssh will return the supported auth methods */
-			return 1;
-		} else if (subtype == SSH_AUTH_METHOD_PASSWORD) {
-			sshcb_auth_password(client, msg);
-			return 0;
-		} else if (subtype == SSH_AUTH_METHOD_PUBLICKEY) {
-			sshcb_auth_pubkey(client, msg);
-			return 0;
-		} else if (subtype == SSH_AUTH_METHOD_INTERACTIVE) {
-			sshcb_auth_kbdint(client, msg);
-			return 0;
-		}
-	} else if (client->authenticated) {
-		if (type == SSH_REQUEST_CHANNEL_OPEN && subtype == (int)SSH_CHANNEL_SESSION) {
-			ssh_channel chan;
-			if ((chan = ssh_message_channel_request_open_reply_accept(msg)) == NULL) {
-				ssh_message_reply_default(msg);
-			}
-			sshcb_channel_open(client, chan);
-			return 0;
-		} else if (type == SSH_REQUEST_CHANNEL && subtype == (int)SSH_CHANNEL_REQUEST_SUBSYSTEM) {
-			if (sshcb_channel_subsystem(client, channel, ssh_message_channel_request_subsystem(msg)) == 0) {
-				ssh_message_channel_request_reply_success(msg);
-			} else {
-				ssh_message_reply_default(msg);
-			}
-			return 0;
+		if (deadline == 0 || chan_deadline < deadline) {
+			deadline = chan_deadline;
 		}
 	}
 
-	/* we did not process it */
-	return 1;
+	np_engine_timer((struct client_struct*)client, deadline);
+	return skip_sleep;
 }
 
 void sshcb_log(int priority, const char* UNUSED(function), const char* buffer, void* UNUSED(userdata)) {
@@ -987,62 +1134,53 @@ void np_ssh_init(void) {
 	ssh_set_log_callback(sshcb_log);
 }
 
-ssh_bind np_ssh_server_id_check(ssh_bind sshbind) {
-	ssh_bind ret;
+struct np_ssh_id* np_ssh_server_id_new(void) {
+	struct np_ssh_id* ret;
 
-	/* Check server keys for a change */
-	if (netopeer_options.ssh_opts->server_key_change_flag || sshbind == NULL) {
-		ssh_bind_free(sshbind);
-		if ((ret = ssh_bind_new()) == NULL) {
-			nc_verb_error("%s: failed to create SSH bind", __func__);
-			return NULL;
-		}
+	/* changes made from now on are picked up by the next identity */
+	netopeer_options.ssh_opts->server_key_change_flag = 0;
 
-		if (netopeer_options.ssh_opts->rsa_key != NULL) {
-			ssh_bind_options_set(ret, SSH_BIND_OPTIONS_RSAKEY, netopeer_options.ssh_opts->rsa_key);
-		}
-		if (netopeer_options.ssh_opts->dsa_key != NULL) {
-			ssh_bind_options_set(ret, SSH_BIND_OPTIONS_DSAKEY, netopeer_options.ssh_opts->dsa_key);
-		}
+	if ((ret = malloc(sizeof *ret)) == NULL) {
+		nc_verb_error("%s: memory allocation failed (%s)", __func__, strerror(errno));
+		return NULL;
+	}
+	ret->refs = 1;
 
-		ssh_bind_options_set(ret, SSH_BIND_OPTIONS_LOG_VERBOSITY, &netopeer_options.verbose);
+	if ((ret->sshbind = ssh_bind_new()) == NULL) {
+		nc_verb_error("%s: failed to create SSH bind", __func__);
+		free(ret);
+		return NULL;
+	}
 
-		netopeer_options.ssh_opts->server_key_change_flag = 0;
-	} else {
-		ret = sshbind;
+	if (netopeer_options.ssh_opts->rsa_key != NULL) {
+		ssh_bind_options_set(ret->sshbind, SSH_BIND_OPTIONS_RSAKEY, netopeer_options.ssh_opts->rsa_key);
+	}
+	if (netopeer_options.ssh_opts->dsa_key != NULL) {
+		ssh_bind_options_set(ret->sshbind, SSH_BIND_OPTIONS_DSAKEY, netopeer_options.ssh_opts->dsa_key);
 	}
 
+	ssh_bind_options_set(ret->sshbind, SSH_BIND_OPTIONS_LOG_VERBOSITY, &netopeer_options.verbose);
+
 	return ret;
 }
 
-int np_ssh_session_count(void) {
-	struct client_struct_ssh* client;
-	struct chan_struct* chan;
-	int count = 0;
-
-	for (client = (struct client_struct_ssh*)netopeer_state.clients; client != NULL; client = (struct client_struct_ssh*)client->next) {
-		if (client->transport != NC_TRANSPORT_SSH) {
-			continue;
-		}
-
-		if (client->ssh_chans == NULL) {
-			/* count this client as one soon-to-be valid session */
-			++count;
-		}
-		for (chan = client->ssh_chans; chan != NULL; chan = chan->next) {
-			/* count every channel, we rather include some invalid ones than
-			 * exclude some soon-to-be valid, which could cause more sessions
-			 * to be allowed than max_sessions
-			 */
-			++count;
-		}
+void np_ssh_server_id_put(struct np_ssh_id* id) {
+	if (id == NULL || __sync_sub_and_fetch(&id->refs, 1) > 0) {
+		return;
 	}
 
-	return count;
+	ssh_bind_free(id->sshbind);
+	free(id);
 }
 
 int np_ssh_create_client(struct client_struct_ssh* new_client, ssh_bind sshbind) {
-	int ret;
+	int flags;
+
+	/* Call Home sockets are still blocking */
+	if (((flags = fcntl(new_client->sock, F_GETFL)) == -1) || (fcntl(new_client->sock, F_SETFL, flags | O_NONBLOCK) == -1)) {
+		nc_verb_error("%s: fcntl failed (%s)", __func__, strerror(errno));
+		return 1;
+	}
 
 	new_client->ssh_sess = ssh_new();
 	if (new_client->ssh_sess == NULL) {
@@ -1056,28 +1194,54 @@ int np_ssh_create_client(struct client_struct_ssh* new_client, ssh_bind sshbind)
 		ssh_set_auth_methods(new_client->ssh_sess, SSH_AUTH_METHOD_PUBLICKEY | SSH_AUTH_METHOD_INTERACTIVE);
 	}
 
-	ssh_set_message_callback(new_client->ssh_sess, sshcb_msg, NULL);
-
 	if (ssh_bind_accept_fd(sshbind, new_client->ssh_sess, new_client->sock) == SSH_ERROR) {
 		nc_verb_error("%s: SSH failed to accept a new connection: %s", __func__, ssh_get_error(sshbind));
 		return 1;
 	}
 
-	gettimeofday((struct timeval*)&new_client->conn_time, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &new_client->conn_time);
 
-	while ((ret = ssh_handle_key_exchange(new_client->ssh_sess)) == SSH_AGAIN) {
-		usleep(READ_SLEEP * 2);
-	}
-	if (ret != SSH_OK) {
-		nc_verb_error("%s: SSH key exchange error (%s:%d): %s", __func__, __FILE__, __LINE__, ssh_get_error(new_client->ssh_sess));
+	/* the key exchange is performed by the engine whenever the socket is ready */
+	ssh_set_blocking(new_client->ssh_sess, 0);
+	new_client->handshake = NP_HANDSHAKE_WANT_READ;
+
+	return 0;
+}
+
+/* return: 0 - nothing happened or still in progress, 1 - key exchange finished */
+int np_ssh_client_handshake(struct client_struct_ssh* client, int expired) {
+	uint64_t conn_msec;
+	int ret;
+
+	conn_msec = np_timespec_msec(&client->conn_time);
+
+	ret = ssh_handle_key_exchange(client->ssh_sess);
+	if (ret == SSH_OK) {
+		np_stats_hist_add(&netopeer_stats.ssh_handshake, &client->conn_time);
+		client->handshake = NP_HANDSHAKE_DONE;
+		np_engine_timer((struct client_struct*)client, conn_msec + netopeer_options.ssh_opts->auth_timeout * 1000);
 		return 1;
 	}
 
-	ssh_set_blocking(new_client->ssh_sess, 0);
+	if (ret != SSH_AGAIN) {
+		nc_verb_error("%s: SSH key exchange error (%s:%d): %s", __func__, __FILE__, __LINE__, ssh_get_error(client->ssh_sess));
+		client->to_free = 1;
+		return 0;
+	}
+
+	if (expired) {
+		if (np_clock_msec() >= conn_msec + HANDSHAKE_TIMEOUT * 1000) {
+			nc_verb_warning("SSH key exchange took too long, dropping a client.");
+			client->to_free = 1;
+		} else {
+			np_engine_timer((struct client_struct*)client, conn_msec + HANDSHAKE_TIMEOUT * 1000);
+		}
+	}
 
 	return 0;
 }
 
 void np_ssh_cleanup(void) {
-	/* nothing to do here, libssh finalize is called by libnetconf */
+	/* libssh finalize is called by libnetconf */
+	np_ssh_password_cleanup();
 }
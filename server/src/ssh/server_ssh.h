@@ -48,8 +48,12 @@ struct chan_struct {
 	ssh_channel ssh_chan;
 	int netconf_subsystem;
 	struct nc_session* nc_sess;
-	volatile struct timeval last_rpc_time;	// timestamp of the last RPC either in or out
+	struct np_rpc_job* rpc_job;			// RPC being processed by a worker
+	struct np_subscriber* notif_sub;	// subscription served by the notification dispatcher
+	volatile uint64_t last_rpc_time;	// monotonic msecs of the last RPC either in or out
 	volatile int to_free;		// is this channel valid?
+	struct ssh_channel_callbacks_struct callbacks;
+	int hello_ready;			// the whole client hello is buffered
 	struct chan_struct* next;
 };
 
@@ -59,17 +63,34 @@ struct client_struct_ssh {
 
 	int sock;
 	struct sockaddr_storage saddr;
-	pthread_t tid;
 	char* username;
 	volatile int to_free;
 	struct client_struct* next;
-
-	volatile struct timeval conn_time;	// timestamp of the new connection
+	struct client_struct* prev;
+
+	int ev_flags;
+	struct client_struct* ev_next;
+	struct ch_app* callhome;
+	int rpc_jobs;
+	int handshake;
+	uint64_t tm_deadline;
+	struct client_struct* tm_next;
+	struct client_struct* tm_prev;
+
+	struct timespec conn_time;			// monotonic timestamp of the new connection
 	int auth_attempts;					// number of failed auth attempts
 	int authenticated;
 	struct chan_struct* ssh_chans;
 	ssh_session ssh_sess;
-	int new_ssh_msg;
+	ssh_message auth_msg;				// answered once the password check finishes
+	struct pw_job* auth_job;			// password check in progress
+	struct chan_struct* step_chan;		// channel of the step run by an engine helper
+};
+
+/* SSH server identity snapshot, the acceptors hold a reference while accepting a client */
+struct np_ssh_id {
+	volatile int refs;
+	ssh_bind sshbind;
 };
 
 struct ncsess_thread_config {
@@ -79,18 +100,20 @@ struct ncsess_thread_config {
 
 int np_ssh_client_netconf_rpc(struct client_struct_ssh* client);
 
-int np_ssh_client_transport(struct client_struct_ssh* client);
+int np_ssh_client_transport(struct client_struct_ssh* client, int expired);
 
 void np_ssh_init(void);
 
-ssh_bind np_ssh_server_id_check(ssh_bind sshbind);
+struct np_ssh_id* np_ssh_server_id_new(void);
 
-int np_ssh_session_count(void);
+void np_ssh_server_id_put(struct np_ssh_id* id);
 
 int np_ssh_kill_session(const char* sid, struct client_struct_ssh* cur_client);
 
 int np_ssh_create_client(struct client_struct_ssh* new_client, ssh_bind sshbind);
 
+int np_ssh_client_handshake(struct client_struct_ssh* client, int expired);
+
 void np_ssh_cleanup(void);
 
 void client_free_ssh(struct client_struct_ssh* client);
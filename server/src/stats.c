@@ -0,0 +1,282 @@
+/**
+ * @file stats.c
+ * @brief Netopeer server performance counters
+ *
+ * Copyright (C) 2015 CESNET, z.s.p.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of the Company nor the names of its contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * ALTERNATIVELY, provided that this notice is retained in full, this
+ * product may be distributed under the terms of the GNU General Public
+ * License (GPL) version 2 or later, in which case the provisions
+ * of the GPL apply INSTEAD OF those given above.
+ *
+ * This software is provided ``as is, and any express or implied
+ * warranties, including, but not limited to, the implied warranties of
+ * merchantability and fitness for a particular purpose are disclaimed.
+ * In no event shall the company or contributors be liable for any
+ * direct, indirect, incidental, special, exemplary, or consequential
+ * damages (including, but not limited to, procurement of substitute
+ * goods or services; loss of use, data, or profits; or business
+ * interruption) however caused and on any theory of liability, whether
+ * in contract, strict liability, or tort (including negligence or
+ * otherwise) arising in any way out of the use of this software, even
+ * if advised of the possibility of such damage.
+ */
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+
+#include <libnetconf_xml.h>
+
+#include "server.h"
+
+static const char rcsid[] __attribute__((used)) ="$Id: "__FILE__": "RCSID" $";
+
+extern struct np_state netopeer_state;
+
+/*
+ * The counters are only ever incremented with atomic operations, so neither
+ * the sessions nor the workers need any lock to update them. Reading them
+ * for the state data is not synchronized with the updates, every value is
+ * consistent on its own.
+ */
+struct np_stats netopeer_stats;
+
+static const struct {
+	NC_OP op;
+	const char* name;
+} rpc_ops[NP_STATS_RPC_OPS] = {
+	{NC_OP_UNKNOWN, "other"},
+	{NC_OP_GETCONFIG, "get-config"},
+	{NC_OP_GET, "get"},
+	{NC_OP_EDITCONFIG, "edit-config"},
+	{NC_OP_COPYCONFIG, "copy-config"},
+	{NC_OP_DELETECONFIG, "delete-config"},
+	{NC_OP_LOCK, "lock"},
+	{NC_OP_UNLOCK, "unlock"},
+	{NC_OP_CLOSESESSION, "close-session"},
+	{NC_OP_KILLSESSION, "kill-session"},
+	{NC_OP_CREATESUBSCRIPTION, "create-subscription"},
+	{NC_OP_GETSCHEMA, "get-schema"},
+	{NC_OP_COMMIT, "commit"},
+	{NC_OP_DISCARDCHANGES, "discard-changes"},
+	{NC_OP_VALIDATE, "validate"}
+};
+
+void np_stats_rpc(const nc_rpc* rpc) {
+	NC_OP op;
+	int i;
+
+	op = nc_rpc_get_op(rpc);
+	for (i = NP_STATS_RPC_OPS-1; i > 0 && rpc_ops[i].op != op; --i);
+
+	__sync_add_and_fetch(&netopeer_stats.rpcs[i], 1);
+}
+
+void np_stats_hist_add(struct np_stats_hist* hist, const struct timespec* since) {
+	struct timespec now;
+	unsigned long long usec;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usec = (now.tv_sec - since->tv_sec) * 1000000LL + (now.tv_nsec - since->tv_nsec) / 1000;
+
+	for (i = 0; i < NP_STATS_HIST_BUCKETS-1 && usec >= (16ULL << i); ++i);
+
+	__sync_add_and_fetch(&hist->buckets[i], 1);
+	__sync_add_and_fetch(&hist->total_usec, usec);
+	__sync_add_and_fetch(&hist->count, 1);
+}
+
+void np_stats_auth_failure(NC_TRANSPORT transport) {
+	if (transport == NC_TRANSPORT_TLS) {
+		__sync_add_and_fetch(&netopeer_stats.tls_auth_failures, 1);
+	} else {
+		__sync_add_and_fetch(&netopeer_stats.ssh_auth_failures, 1);
+	}
+}
+
+static xmlNodePtr stats_add_ulong(xmlNodePtr parent, xmlNsPtr ns, const char* name, unsigned long long value) {
+	char buf[24];
+
+	snprintf(buf, sizeof buf, "%llu", value);
+	return xmlNewChild(parent, ns, BAD_CAST name, BAD_CAST buf);
+}
+
+static void stats_add_hist(xmlNodePtr parent, xmlNsPtr ns, const char* name, const struct np_stats_hist* hist) {
+	xmlNodePtr node, bucket;
+	int i;
+
+	node = xmlNewChild(parent, ns, BAD_CAST name, NULL);
+	stats_add_ulong(node, ns, "count", hist->count);
+	stats_add_ulong(node, ns, "total-usec", hist->total_usec);
+	for (i = 0; i < NP_STATS_HIST_BUCKETS; ++i) {
+		if (hist->buckets[i] == 0) {
+			continue;
+		}
+		bucket = xmlNewChild(node, ns, BAD_CAST "bucket", NULL);
+		if (i < NP_STATS_HIST_BUCKETS-1) {
+			stats_add_ulong(bucket, ns, "below-usec", 16ULL << i);
+		} else {
+			xmlNewChild(bucket, ns, BAD_CAST "below-usec", BAD_CAST "infinity");
+		}
+		stats_add_ulong(bucket, ns, "count", hist->buckets[i]);
+	}
+}
+
+/* bytes of the client connection, both directions, as counted by the kernel */
+static void stats_add_bytes(xmlNodePtr parent, xmlNsPtr ns, int sock) {
+	struct tcp_info info;
+	socklen_t len = sizeof info;
+
+	memset(&info, 0, sizeof info);
+	if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) != 0
+			|| len < offsetof(struct tcp_info, tcpi_bytes_received) + sizeof info.tcpi_bytes_received) {
+		/* unix socket or an old kernel */
+		return;
+	}
+
+	stats_add_ulong(parent, ns, "in-bytes", info.tcpi_bytes_received);
+	stats_add_ulong(parent, ns, "out-bytes", info.tcpi_bytes_acked);
+}
+
+/* GLOBAL LOCK must be held */
+/* counts: sessions per transport, SSH and TLS */
+static void stats_add_session(xmlNodePtr parent, xmlNsPtr ns, struct np_sess_entry* entry, unsigned long counts[2]) {
+	struct np_subscriber* notif_sub = NULL;
+	xmlNodePtr node;
+
+	node = xmlNewChild(parent, ns, BAD_CAST "session", NULL);
+	xmlNewChild(node, ns, BAD_CAST "session-id", BAD_CAST entry->sid);
+
+	switch (entry->client->transport) {
+#ifdef NP_SSH
+	case NC_TRANSPORT_SSH:
+		xmlNewChild(node, ns, BAD_CAST "transport", BAD_CAST "ssh");
+		notif_sub = ((struct chan_struct*)entry->data)->notif_sub;
+		++counts[0];
+		break;
+#endif
+#ifdef NP_TLS
+	case NC_TRANSPORT_TLS:
+		xmlNewChild(node, ns, BAD_CAST "transport", BAD_CAST "tls");
+		notif_sub = ((struct client_struct_tls*)entry->client)->notif_sub;
+		++counts[1];
+		break;
+#endif
+	default:
+		break;
+	}
+
+	if (entry->client->username != NULL) {
+		xmlNewChild(node, ns, BAD_CAST "username", BAD_CAST entry->client->username);
+	}
+	stats_add_bytes(node, ns, entry->client->sock);
+	if (notif_sub != NULL) {
+		stats_add_ulong(node, ns, "notification-queue", np_notif_queue_depth(notif_sub));
+	}
+}
+
+xmlNodePtr np_stats_state(xmlNsPtr ns) {
+	xmlNodePtr stats, node, sessions, rpc;
+	struct np_sess_entry* entry;
+	struct np_slab_stats slab;
+	unsigned long counts[2] = {0, 0};
+	unsigned int i;
+
+	stats = xmlNewNode(ns, BAD_CAST "statistics");
+
+	sessions = xmlNewChild(stats, ns, BAD_CAST "sessions", NULL);
+
+	/* GLOBAL LOCK */
+	pthread_mutex_lock(&netopeer_state.global_lock);
+
+	/* the index entries are removed before the sessions are freed */
+	for (i = 0; i < netopeer_state.sess_index_size; ++i) {
+		for (entry = netopeer_state.sess_index[i]; entry != NULL; entry = entry->next) {
+			stats_add_session(sessions, ns, entry, counts);
+		}
+	}
+
+	/* GLOBAL UNLOCK */
+	pthread_mutex_unlock(&netopeer_state.global_lock);
+
+#ifdef NP_SSH
+	stats_add_ulong(sessions, ns, "ssh", counts[0]);
+#endif
+#ifdef NP_TLS
+	stats_add_ulong(sessions, ns, "tls", counts[1]);
+#endif
+
+	node = xmlNewChild(stats, ns, BAD_CAST "rpcs", NULL);
+	for (i = 0; i < NP_STATS_RPC_OPS; ++i) {
+		if (netopeer_stats.rpcs[i] == 0) {
+			continue;
+		}
+		rpc = xmlNewChild(node, ns, BAD_CAST "rpc", NULL);
+		xmlNewChild(rpc, ns, BAD_CAST "operation", BAD_CAST rpc_ops[i].name);
+		stats_add_ulong(rpc, ns, "count", netopeer_stats.rpcs[i]);
+	}
+	stats_add_hist(stats, ns, "rpc-latency", &netopeer_stats.rpc_latency);
+
+	node = xmlNewChild(stats, ns, BAD_CAST "handshakes", NULL);
+#ifdef NP_SSH
+	stats_add_hist(node, ns, "ssh", &netopeer_stats.ssh_handshake);
+#endif
+#ifdef NP_TLS
+	stats_add_hist(node, ns, "tls", &netopeer_stats.tls_handshake);
+	if (netopeer_state.tls_state != NULL) {
+		stats_add_ulong(node->last, ns, "full", netopeer_state.tls_state->full_handshakes);
+		stats_add_ulong(node->last, ns, "resumed", netopeer_state.tls_state->resumed_handshakes);
+	}
+#endif
+
+	node = xmlNewChild(stats, ns, BAD_CAST "auth-failures", NULL);
+#ifdef NP_SSH
+	stats_add_ulong(node, ns, "ssh", netopeer_stats.ssh_auth_failures);
+#endif
+#ifdef NP_TLS
+	stats_add_ulong(node, ns, "tls", netopeer_stats.tls_auth_failures);
+#endif
+
+	node = xmlNewChild(stats, ns, BAD_CAST "rate-limits", NULL);
+	stats_add_ulong(node, ns, "connections-rejected", netopeer_stats.connections_rejected);
+	stats_add_ulong(node, ns, "rpcs-rejected", netopeer_stats.rpcs_rejected);
+	stats_add_ulong(node, ns, "rpcs-delayed", netopeer_stats.rpcs_delayed);
+	stats_add_ulong(node, ns, "rpcs-queued", np_workers_queued());
+
+	for (i = 0; i < NP_SLAB_TYPES; ++i) {
+		np_slab_stats(i, &slab);
+		node = xmlNewChild(stats, ns, BAD_CAST "object-cache", NULL);
+		xmlNewChild(node, ns, BAD_CAST "type", BAD_CAST slab.name);
+		stats_add_ulong(node, ns, "object-size", slab.object_size);
+		stats_add_ulong(node, ns, "objects", slab.objects);
+		stats_add_ulong(node, ns, "in-use", slab.in_use);
+		stats_add_ulong(node, ns, "allocations", slab.allocations);
+		stats_add_ulong(node, ns, "depot-transfers", slab.depot_transfers);
+	}
+
+	if ((node = np_profile_state(ns)) != NULL) {
+		xmlAddChild(stats, node);
+	}
+
+	return stats;
+}
@@ -0,0 +1,104 @@
+/**
+ * @file stats.h
+ * @brief Netopeer server performance counters
+ *
+ * Copyright (C) 2015 CESNET, z.s.p.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of the Company nor the names of its contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * ALTERNATIVELY, provided that this notice is retained in full, this
+ * product may be distributed under the terms of the GNU General Public
+ * License (GPL) version 2 or later, in which case the provisions
+ * of the GPL apply INSTEAD OF those given above.
+ *
+ * This software is provided ``as is, and any express or implied
+ * warranties, including, but not limited to, the implied warranties of
+ * merchantability and fitness for a particular purpose are disclaimed.
+ * In no event shall the company or contributors be liable for any
+ * direct, indirect, incidental, special, exemplary, or consequential
+ * damages (including, but not limited to, procurement of substitute
+ * goods or services; loss of use, data, or profits; or business
+ * interruption) however caused and on any theory of liability, whether
+ * in contract, strict liability, or tort (including negligence or
+ * otherwise) arising in any way out of the use of this software, even
+ * if advised of the possibility of such damage.
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <time.h>
+#include <libnetconf.h>
+#include <libxml/tree.h>
+
+/* counted RPC operations, all the non-base ones are counted together */
+#define NP_STATS_RPC_OPS 15
+
+/* histogram buckets, the first one is below 16 usec and every next one doubles */
+#define NP_STATS_HIST_BUCKETS 20
+
+/* duration histogram, all the members are updated atomically */
+struct np_stats_hist {
+	volatile unsigned long count;
+	volatile unsigned long long total_usec;
+	volatile unsigned long buckets[NP_STATS_HIST_BUCKETS];
+};
+
+/* server-wide counters, all the members are updated atomically */
+struct np_stats {
+	volatile unsigned long rpcs[NP_STATS_RPC_OPS];
+	struct np_stats_hist rpc_latency;		// RPC received -> reply sent
+	struct np_stats_hist ssh_handshake;		// connection accepted -> key exchange finished
+	struct np_stats_hist tls_handshake;		// connection accepted -> handshake finished
+	volatile unsigned long ssh_auth_failures;
+	volatile unsigned long tls_auth_failures;
+	volatile unsigned long connections_rejected;	// over the connection rate limit of the address
+	volatile unsigned long rpcs_rejected;			// over the RPC rate limits for too long
+	volatile unsigned long rpcs_delayed;			// waited for the RPC rate limits
+};
+
+extern struct np_stats netopeer_stats;
+
+/**
+ * @brief Count a received RPC
+ *
+ * @param rpc Received RPC
+ */
+void np_stats_rpc(const nc_rpc* rpc);
+
+/**
+ * @brief Add the time elapsed since a timestamp into a histogram
+ *
+ * @param hist Histogram to update
+ * @param since Start of the measured interval
+ */
+void np_stats_hist_add(struct np_stats_hist* hist, const struct timespec* since);
+
+/**
+ * @brief Count a failed authentication
+ *
+ * @param transport Transport of the client
+ */
+void np_stats_auth_failure(NC_TRANSPORT transport);
+
+/**
+ * @brief Build the statistics state data subtree
+ *
+ * @param ns Namespace of the created nodes
+ *
+ * @return statistics node, NULL on error.
+ */
+xmlNodePtr np_stats_state(xmlNsPtr ns);
+
+#endif /* _STATS_H_ */
@@ -43,13 +43,20 @@
  */
 
 #define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
 #include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <sys/stat.h>
 #include <libxml/tree.h>
 #include <libnetconf_xml.h>
 #include <libxml/xpath.h>
 #include <libxml/xpathInternals.h>
 #include <string.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
 
 #include "../server.h"
 
@@ -82,26 +89,68 @@ extern struct np_options netopeer_options;
 
 char* get_node_content(const xmlNodePtr node);
 
+/* TLS_CTX LOCK must be held, the cert is decoded once and client certs are indexed by their public keys */
+static void trusted_cert_load(struct np_trusted_cert* tr_cert) {
+	struct np_trusted_cert** bucket;
+	unsigned int digest_len;
+
+	if ((tr_cert->x509 = np_tls_base64der_to_cert(tr_cert->cert)) == NULL) {
+		nc_verb_error("Loading a trusted certificate failed (%s).", ERR_reason_error_string(ERR_get_error()));
+		return;
+	}
+
+	if (!tr_cert->client_cert) {
+		return;
+	}
+	if (X509_pubkey_digest(tr_cert->x509, EVP_sha256(), tr_cert->pubkey_digest, &digest_len) != 1) {
+		nc_verb_error("%s: public key digest failed (%s)", __func__, ERR_reason_error_string(ERR_get_error()));
+		return;
+	}
+
+	bucket = &netopeer_options.tls_opts->client_cert_index[NP_TRUSTED_CERT_BUCKET(tr_cert->pubkey_digest)];
+	tr_cert->index_next = *bucket;
+	*bucket = tr_cert;
+}
+
+/* TLS_CTX LOCK must be held */
+static void trusted_cert_unload(struct np_trusted_cert* tr_cert) {
+	struct np_trusted_cert** bucket;
+
+	if (tr_cert->client_cert && tr_cert->x509 != NULL) {
+		bucket = &netopeer_options.tls_opts->client_cert_index[NP_TRUSTED_CERT_BUCKET(tr_cert->pubkey_digest)];
+		for (; *bucket != NULL; bucket = &(*bucket)->index_next) {
+			if (*bucket == tr_cert) {
+				*bucket = tr_cert->index_next;
+				break;
+			}
+		}
+	}
+
+	X509_free(tr_cert->x509);
+	tr_cert->x509 = NULL;
+}
+
 static void add_trusted_cert(struct np_trusted_cert** root, const char* cert, uint8_t client_cert) {
-	struct np_trusted_cert* tr_cert;
+	struct np_trusted_cert* tr_cert, *new_cert;
 
 	if (root == NULL || cert == NULL) {
 		return;
 	}
 
+	new_cert = calloc(1, sizeof(struct np_trusted_cert));
+	new_cert->cert = strdup(cert);
+	new_cert->client_cert = client_cert;
+	trusted_cert_load(new_cert);
+
 	if (*root == NULL) {
-		*root = calloc(1, sizeof(struct np_trusted_cert));
-		(*root)->cert = strdup(cert);
-		(*root)->client_cert = client_cert;
+		*root = new_cert;
 		return;
 	}
 
 	for (tr_cert = *root; tr_cert->next != NULL; tr_cert = tr_cert->next);
 
-	tr_cert->next = calloc(1, sizeof(struct np_trusted_cert));
-	tr_cert->next->cert = strdup(cert);
-	tr_cert->next->client_cert = client_cert;
-	tr_cert->next->prev = tr_cert;
+	tr_cert->next = new_cert;
+	new_cert->prev = tr_cert;
 }
 
 static int del_trusted_cert(struct np_trusted_cert** root, const char* cert, uint8_t client_cert) {
@@ -135,6 +184,7 @@ static int del_trusted_cert(struct np_trusted_cert** root, const char* cert, uin
 		}
 		tr_cert->prev->next = tr_cert->next;
 	}
+	trusted_cert_unload(tr_cert);
 	free(tr_cert->cert);
 	free(tr_cert);
 
@@ -231,6 +281,394 @@ static int del_ctn_item(struct np_ctn_item** root, uint32_t id, const char* fing
 	return 0;
 }
 
+static unsigned int crl_serial_hash(const ASN1_INTEGER* serial) {
+	unsigned int hash = 2166136261u;
+	int i;
+
+	for (i = 0; i < serial->length; ++i) {
+		hash = (hash ^ serial->data[i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+static void crl_store_free(struct np_crl_store* store) {
+	struct np_crl_entry* entry, *next;
+	unsigned int i;
+
+	for (i = 0; i < store->file_count; ++i) {
+		free(store->files[i].name);
+	}
+	free(store->files);
+	for (entry = store->crls; entry != NULL; entry = next) {
+		next = entry->next;
+		EVP_PKEY_free(entry->signer);
+		free(entry->serials);
+		X509_CRL_free(entry->crl);
+		free(entry);
+	}
+	free(store);
+}
+
+static void crl_store_add(struct np_crl_store* store, X509_CRL* crl) {
+	struct np_crl_entry* entry;
+	STACK_OF(X509_REVOKED)* revoked;
+	ASN1_INTEGER* serial;
+	unsigned int idx;
+	int i, n;
+
+	entry = calloc(1, sizeof *entry);
+	entry->crl = crl;
+	entry->issuer_hash = X509_NAME_hash(X509_CRL_get_issuer(crl));
+
+	revoked = X509_CRL_get_REVOKED(crl);
+	n = sk_X509_REVOKED_num(revoked);
+	for (entry->serials_size = 8; entry->serials_size < 2*(unsigned int)n; entry->serials_size *= 2);
+	entry->serials = calloc(entry->serials_size, sizeof *entry->serials);
+	for (i = 0; i < n; ++i) {
+		serial = sk_X509_REVOKED_value(revoked, i)->serialNumber;
+		for (idx = crl_serial_hash(serial) & (entry->serials_size-1); entry->serials[idx] != NULL; idx = (idx+1) & (entry->serials_size-1)) {
+			if (ASN1_INTEGER_cmp(entry->serials[idx], serial) == 0) {
+				break;
+			}
+		}
+		entry->serials[idx] = serial;
+	}
+
+	entry->next = store->crls;
+	store->crls = entry;
+}
+
+/* return: 1 - the file is one the OpenSSL hash_dir lookup would load, "<issuer hash>.r<n>" */
+static int crl_file_name(const char* name) {
+	unsigned long hash;
+	unsigned int n;
+	int len;
+
+	return (sscanf(name, "%8lx.r%u%n", &hash, &n, &len) == 2 && name[len] == '\0');
+}
+
+/* return: 0 - the file is the one loaded, 1 - it was changed, replaced or added since */
+static int crl_file_changed(const struct np_crl_store* store, const char* name, const struct stat* st) {
+	unsigned int i;
+
+	for (i = 0; i < store->file_count; ++i) {
+		if (strcmp(store->files[i].name, name) == 0) {
+			return (store->files[i].dev != st->st_dev || store->files[i].ino != st->st_ino || store->files[i].size != st->st_size
+					|| store->files[i].mtime.tv_sec != st->st_mtim.tv_sec || store->files[i].mtime.tv_nsec != st->st_mtim.tv_nsec);
+		}
+	}
+
+	return 1;
+}
+
+static struct np_crl_store* crl_store_load(const char* crl_dir) {
+	struct np_crl_store* store;
+	struct np_crl_file* files;
+	struct stat st;
+	DIR* dir;
+	struct dirent* file;
+	X509_CRL* crl;
+	FILE* f;
+	char* path;
+
+	store = calloc(1, sizeof *store);
+	store->refs = 1;
+
+	if ((dir = opendir(crl_dir)) == NULL) {
+		nc_verb_error("%s: unable to read the CRL directory \"%s\" (%s)", __func__, crl_dir, strerror(errno));
+		return store;
+	}
+
+	while ((file = readdir(dir)) != NULL) {
+		if (!crl_file_name(file->d_name)) {
+			continue;
+		}
+
+		if (asprintf(&path, "%s/%s", crl_dir, file->d_name) == -1) {
+			nc_verb_error("%s: asprintf failed (%s:%d)", __func__, __FILE__, __LINE__);
+			continue;
+		}
+		/* the same stat() crl_store_outdated() compares, stamped before reading so a concurrent rewrite is noticed */
+		if (stat(path, &st) == -1) {
+			free(path);
+			continue;
+		}
+		if ((files = realloc(store->files, (store->file_count+1) * sizeof *store->files)) == NULL) {
+			nc_verb_error("%s: memory allocation failed (%s)", __func__, strerror(errno));
+			free(path);
+			continue;
+		}
+		store->files = files;
+		files[store->file_count].name = strdup(file->d_name);
+		files[store->file_count].dev = st.st_dev;
+		files[store->file_count].ino = st.st_ino;
+		files[store->file_count].size = st.st_size;
+		files[store->file_count].mtime = st.st_mtim;
+		++store->file_count;
+
+		if ((f = fopen(path, "r")) == NULL) {
+			nc_verb_warning("%s: unable to open the CRL \"%s\" (%s)", __func__, path, strerror(errno));
+			free(path);
+			continue;
+		}
+		while ((crl = PEM_read_X509_CRL(f, NULL, NULL, NULL)) != NULL) {
+			crl_store_add(store, crl);
+		}
+		/* the end of the file is reported as an error */
+		ERR_clear_error();
+		fclose(f);
+		free(path);
+	}
+	closedir(dir);
+
+	return store;
+}
+
+/* return: 0 - store is up-to-date, 1 - store must be reloaded */
+static int crl_store_outdated(const struct np_crl_store* store, const char* crl_dir) {
+	const struct np_crl_entry* entry;
+	ASN1_TIME* next_update;
+	struct stat st;
+	DIR* dir;
+	struct dirent* file;
+	unsigned int count = 0;
+	char* path;
+	int ret = 0;
+
+	/* the directory mtime misses files rewritten in place, compare every file */
+	if ((dir = opendir(crl_dir)) == NULL) {
+		return (store->file_count != 0);
+	}
+	while (!ret && (file = readdir(dir)) != NULL) {
+		if (!crl_file_name(file->d_name)) {
+			continue;
+		}
+
+		if (asprintf(&path, "%s/%s", crl_dir, file->d_name) == -1) {
+			nc_verb_error("%s: asprintf failed (%s:%d)", __func__, __FILE__, __LINE__);
+			continue;
+		}
+		if (stat(path, &st) == 0) {
+			ret = crl_file_changed(store, file->d_name, &st);
+			++count;
+		}
+		free(path);
+	}
+	closedir(dir);
+
+	/* a file was changed, added or removed */
+	if (ret || count != store->file_count) {
+		return 1;
+	}
+
+	for (entry = store->crls; entry != NULL; entry = entry->next) {
+		next_update = X509_CRL_get_nextUpdate(entry->crl);
+		if (next_update != NULL && X509_cmp_current_time(next_update) < 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+struct np_crl_store* np_crl_store_get(void) {
+	struct np_crl_store* store = NULL, *old_store = NULL;
+	time_t now = time(NULL);
+
+	/* CRL_DIR LOCK */
+	pthread_mutex_lock(&netopeer_options.tls_opts->crl_dir_lock);
+
+	if (netopeer_options.tls_opts->crl_dir != NULL) {
+		if (netopeer_options.tls_opts->crl_store == NULL || (now - netopeer_options.tls_opts->crl_checked >= CRL_CHECK_INTERVAL
+				&& crl_store_outdated(netopeer_options.tls_opts->crl_store, netopeer_options.tls_opts->crl_dir))) {
+			old_store = netopeer_options.tls_opts->crl_store;
+			netopeer_options.tls_opts->crl_store = crl_store_load(netopeer_options.tls_opts->crl_dir);
+			netopeer_options.tls_opts->crl_checked = now;
+		} else if (now - netopeer_options.tls_opts->crl_checked >= CRL_CHECK_INTERVAL) {
+			netopeer_options.tls_opts->crl_checked = now;
+		}
+
+		store = netopeer_options.tls_opts->crl_store;
+		__sync_add_and_fetch(&store->refs, 1);
+	}
+
+	/* CRL_DIR UNLOCK */
+	pthread_mutex_unlock(&netopeer_options.tls_opts->crl_dir_lock);
+
+	if (old_store != NULL) {
+		/* resumed sessions skip the verification, do not let them outlive a revocation */
+		np_tls_session_flush();
+	}
+	np_crl_store_release(old_store);
+	return store;
+}
+
+void np_crl_store_release(struct np_crl_store* store) {
+	if (store == NULL || __sync_sub_and_fetch(&store->refs, 1) > 0) {
+		return;
+	}
+
+	crl_store_free(store);
+}
+
+struct np_crl_entry* np_crl_store_find(const struct np_crl_store* store, X509_NAME* issuer) {
+	struct np_crl_entry* entry;
+	unsigned long hash = X509_NAME_hash(issuer);
+
+	for (entry = store->crls; entry != NULL; entry = entry->next) {
+		if (entry->issuer_hash == hash && X509_NAME_cmp(X509_CRL_get_issuer(entry->crl), issuer) == 0) {
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+int np_crl_entry_verify(struct np_crl_entry* entry, EVP_PKEY* pubkey) {
+	EVP_PKEY* signer = entry->signer;
+
+	if (pubkey == NULL) {
+		return 0;
+	}
+
+	if (signer != NULL && EVP_PKEY_cmp(signer, pubkey) == 1) {
+		EVP_PKEY_free(pubkey);
+		return 1;
+	}
+
+	if (X509_CRL_verify(entry->crl, pubkey) <= 0) {
+		EVP_PKEY_free(pubkey);
+		return 0;
+	}
+
+	/* remember the key, the first verification wins */
+	if (!__sync_bool_compare_and_swap(&entry->signer, NULL, pubkey)) {
+		EVP_PKEY_free(pubkey);
+	}
+	return 1;
+}
+
+int np_crl_entry_revoked(const struct np_crl_entry* entry, ASN1_INTEGER* serial) {
+	unsigned int idx;
+
+	for (idx = crl_serial_hash(serial) & (entry->serials_size-1); entry->serials[idx] != NULL; idx = (idx+1) & (entry->serials_size-1)) {
+		if (ASN1_INTEGER_cmp(entry->serials[idx], serial) == 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+unsigned int np_ctn_index_bucket(const struct np_ctn_index* index, uint8_t alg, const unsigned char* digest, unsigned int digest_len) {
+	unsigned int hash = alg, i;
+
+	/* the digest is uniform enough on its own */
+	for (i = 0; i < digest_len && i < sizeof hash; ++i) {
+		hash = (hash << 8) ^ digest[i];
+	}
+
+	return hash & (index->size-1);
+}
+
+/* return: 0 - parsed, 1 - invalid fingerprint */
+static int ctn_fingerprint_parse(const char* fingerprint, struct np_ctn_index_item* item) {
+	unsigned int octet;
+	int len;
+
+	if (sscanf(fingerprint, "%2x%n", &octet, &len) != 1 || len != 2 || octet < CTN_DIGEST_MD5 || octet > CTN_DIGEST_SHA512) {
+		return 1;
+	}
+	item->alg = octet;
+
+	for (fingerprint += 2; *fingerprint != '\0'; fingerprint += 3) {
+		if (fingerprint[0] != ':' || item->digest_len == EVP_MAX_MD_SIZE
+				|| sscanf(fingerprint+1, "%2x%n", &octet, &len) != 1 || len != 2) {
+			return 1;
+		}
+		item->digest[item->digest_len++] = octet;
+	}
+
+	return (item->digest_len == 0);
+}
+
+/* CTN_MAP LOCK must be held */
+static struct np_ctn_index* ctn_index_build(const struct np_ctn_item* ctn_map) {
+	const struct np_ctn_item* ctn;
+	struct np_ctn_index* index;
+	struct np_ctn_index_item* item;
+	unsigned int count, idx;
+
+	if (ctn_map == NULL) {
+		return NULL;
+	}
+
+	for (count = 0, ctn = ctn_map; ctn != NULL; ctn = ctn->next, ++count);
+
+	index = calloc(1, sizeof *index);
+	index->refs = 1;
+	for (index->size = 16; index->size < 2*count; index->size *= 2);
+	index->buckets = calloc(index->size, sizeof *index->buckets);
+
+	for (ctn = ctn_map; ctn != NULL; ctn = ctn->next) {
+		item = calloc(1, sizeof *item);
+		if (ctn_fingerprint_parse(ctn->fingerprint, item) != 0) {
+			nc_verb_warning("%s: unknown fingerprint algorithm used (%s), skipping", __func__, ctn->fingerprint);
+			free(item);
+			continue;
+		}
+		item->id = ctn->id;
+		item->map_type = ctn->map_type;
+		if (ctn->name != NULL) {
+			item->name = strdup(ctn->name);
+		}
+
+		idx = np_ctn_index_bucket(index, item->alg, item->digest, item->digest_len);
+		item->next = index->buckets[idx];
+		index->buckets[idx] = item;
+		index->algs |= (1 << item->alg);
+	}
+
+	return index;
+}
+
+struct np_ctn_index* np_ctn_index_get(void) {
+	struct np_ctn_index* index;
+
+	/* CTN_MAP LOCK */
+	pthread_mutex_lock(&netopeer_options.tls_opts->ctn_map_lock);
+
+	index = netopeer_options.tls_opts->ctn_index;
+	if (index != NULL) {
+		__sync_add_and_fetch(&index->refs, 1);
+	}
+
+	/* CTN_MAP UNLOCK */
+	pthread_mutex_unlock(&netopeer_options.tls_opts->ctn_map_lock);
+
+	return index;
+}
+
+void np_ctn_index_release(struct np_ctn_index* index) {
+	struct np_ctn_index_item* item, *next;
+	unsigned int i;
+
+	if (index == NULL || __sync_sub_and_fetch(&index->refs, 1) > 0) {
+		return;
+	}
+
+	for (i = 0; i < index->size; ++i) {
+		for (item = index->buckets[i]; item != NULL; item = next) {
+			next = item->next;
+			free(item->name);
+			free(item);
+		}
+	}
+	free(index->buckets);
+	free(index);
+}
+
 static CTN_MAP_TYPE ctn_type_parse(const char* str) {
 	if (strcmp(str, "specified") == 0) {
 		return CTN_MAP_TYPE_SPECIFIED;
@@ -381,6 +819,9 @@ int callback_n_netopeer_n_tls_n_trusted_ca_certs_n_trusted_ca_cert(void** UNUSED
 
 		/* TLS_CTX UNLOCK */
 		pthread_mutex_unlock(&netopeer_options.tls_opts->tls_ctx_lock);
+
+		/* sessions of clients no longer trusted must not be resumed */
+		np_tls_session_flush();
 	}
 
 	if (op & (XMLDIFF_MOD | XMLDIFF_ADD)) {
@@ -435,6 +876,9 @@ int callback_n_netopeer_n_tls_n_trusted_client_certs_n_trusted_client_cert(void*
 
 		/* TLS_CTX UNLOCK */
 		pthread_mutex_unlock(&netopeer_options.tls_opts->tls_ctx_lock);
+
+		/* sessions of clients no longer trusted must not be resumed */
+		np_tls_session_flush();
 	}
 
 	if (op & (XMLDIFF_MOD | XMLDIFF_ADD)) {
@@ -470,6 +914,7 @@ int callback_n_netopeer_n_tls_n_trusted_client_certs_n_trusted_client_cert(void*
 /* !DO NOT ALTER FUNCTION SIGNATURE! */
 int callback_n_netopeer_n_tls_n_crl_dir(void** UNUSED(data), XMLDIFF_OP op, xmlNodePtr UNUSED(old_node), xmlNodePtr new_node, struct nc_err** error) {
 	char* content = NULL;
+	struct np_crl_store* store;
 
 	if (op & (XMLDIFF_MOD | XMLDIFF_ADD)) {
 		content = get_node_content(new_node);
@@ -488,10 +933,151 @@ int callback_n_netopeer_n_tls_n_crl_dir(void** UNUSED(data), XMLDIFF_OP op, xmlN
 	if (op & (XMLDIFF_MOD | XMLDIFF_ADD)) {
 		netopeer_options.tls_opts->crl_dir = strdup(content);
 	}
+	/* the CRLs are loaded from the new directory on the next verification */
+	store = netopeer_options.tls_opts->crl_store;
+	netopeer_options.tls_opts->crl_store = NULL;
 
 	/* CRL_DIR UNLOCK */
 	pthread_mutex_unlock(&netopeer_options.tls_opts->crl_dir_lock);
 
+	np_crl_store_release(store);
+	np_tls_session_flush();
+
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @brief This callback will be run when node in path /n:netopeer/n:tls/n:session-resumption/n:cache-size changes
+ *
+ * @param[in] data	Double pointer to void. Its passed to every callback. You can share data using it.
+ * @param[in] op	Observed change in path. XMLDIFF_OP type.
+ * @param[in] node	Modified node. if op == XMLDIFF_REM its copy of node removed.
+ * @param[out] error	If callback fails, it can return libnetconf error structure with a failure description.
+ *
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+/* !DO NOT ALTER FUNCTION SIGNATURE! */
+int callback_n_netopeer_n_tls_n_session_resumption_n_cache_size(void** UNUSED(data), XMLDIFF_OP op, xmlNodePtr UNUSED(old_node), xmlNodePtr new_node, struct nc_err** error) {
+	char* content = NULL, *ptr, *msg;
+	unsigned long num;
+
+	if (op & XMLDIFF_REM) {
+		num = 1024;
+	} else {
+		content = get_node_content(new_node);
+		if (content == NULL) {
+			*error = nc_err_new(NC_ERR_OP_FAILED);
+			nc_verb_error("%s: node content missing", __func__);
+			return EXIT_FAILURE;
+		}
+
+		num = strtoul(content, &ptr, 10);
+		if (*ptr != '\0' || num > UINT32_MAX) {
+			*error = nc_err_new(NC_ERR_BAD_ELEM);
+			if (asprintf(&msg, "Could not convert '%s' to a valid session cache size.", content) == 0) {
+				nc_err_set(*error, NC_ERR_PARAM_MSG, msg);
+				nc_err_set(*error, NC_ERR_PARAM_INFO_BADELEM, "/netopeer/tls/session-resumption/cache-size");
+				free(msg);
+			}
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* TLS_CTX LOCK */
+	pthread_mutex_lock(&netopeer_options.tls_opts->tls_ctx_lock);
+
+	netopeer_options.tls_opts->session_cache_size = num;
+	netopeer_options.tls_opts->tls_ctx_change_flag = 1;
+
+	/* TLS_CTX UNLOCK */
+	pthread_mutex_unlock(&netopeer_options.tls_opts->tls_ctx_lock);
+
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @brief This callback will be run when node in path /n:netopeer/n:tls/n:session-resumption/n:timeout changes
+ *
+ * @param[in] data	Double pointer to void. Its passed to every callback. You can share data using it.
+ * @param[in] op	Observed change in path. XMLDIFF_OP type.
+ * @param[in] node	Modified node. if op == XMLDIFF_REM its copy of node removed.
+ * @param[out] error	If callback fails, it can return libnetconf error structure with a failure description.
+ *
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+/* !DO NOT ALTER FUNCTION SIGNATURE! */
+int callback_n_netopeer_n_tls_n_session_resumption_n_timeout(void** UNUSED(data), XMLDIFF_OP op, xmlNodePtr UNUSED(old_node), xmlNodePtr new_node, struct nc_err** error) {
+	char* content = NULL, *ptr, *msg;
+	unsigned long num;
+
+	if (op & XMLDIFF_REM) {
+		num = 300;
+	} else {
+		content = get_node_content(new_node);
+		if (content == NULL) {
+			*error = nc_err_new(NC_ERR_OP_FAILED);
+			nc_verb_error("%s: node content missing", __func__);
+			return EXIT_FAILURE;
+		}
+
+		num = strtoul(content, &ptr, 10);
+		if (*ptr != '\0' || num < 1 || num > UINT32_MAX) {
+			*error = nc_err_new(NC_ERR_BAD_ELEM);
+			if (asprintf(&msg, "Could not convert '%s' to a valid session timeout.", content) == 0) {
+				nc_err_set(*error, NC_ERR_PARAM_MSG, msg);
+				nc_err_set(*error, NC_ERR_PARAM_INFO_BADELEM, "/netopeer/tls/session-resumption/timeout");
+				free(msg);
+			}
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* TLS_CTX LOCK */
+	pthread_mutex_lock(&netopeer_options.tls_opts->tls_ctx_lock);
+
+	netopeer_options.tls_opts->session_timeout = num;
+	netopeer_options.tls_opts->tls_ctx_change_flag = 1;
+
+	/* TLS_CTX UNLOCK */
+	pthread_mutex_unlock(&netopeer_options.tls_opts->tls_ctx_lock);
+
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @brief This callback will be run when node in path /n:netopeer/n:tls/n:session-resumption/n:tickets changes
+ *
+ * @param[in] data	Double pointer to void. Its passed to every callback. You can share data using it.
+ * @param[in] op	Observed change in path. XMLDIFF_OP type.
+ * @param[in] node	Modified node. if op == XMLDIFF_REM its copy of node removed.
+ * @param[out] error	If callback fails, it can return libnetconf error structure with a failure description.
+ *
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+/* !DO NOT ALTER FUNCTION SIGNATURE! */
+int callback_n_netopeer_n_tls_n_session_resumption_n_tickets(void** UNUSED(data), XMLDIFF_OP op, xmlNodePtr UNUSED(old_node), xmlNodePtr new_node, struct nc_err** error) {
+	char* content = NULL;
+	uint8_t enabled = 1;
+
+	if (op & (XMLDIFF_MOD | XMLDIFF_ADD)) {
+		content = get_node_content(new_node);
+		if (content == NULL) {
+			*error = nc_err_new(NC_ERR_OP_FAILED);
+			nc_verb_error("%s: node content missing", __func__);
+			return EXIT_FAILURE;
+		}
+		enabled = (strcmp(content, "false") != 0);
+	}
+
+	/* TLS_CTX LOCK */
+	pthread_mutex_lock(&netopeer_options.tls_opts->tls_ctx_lock);
+
+	netopeer_options.tls_opts->session_tickets = enabled;
+	netopeer_options.tls_opts->tls_ctx_change_flag = 1;
+
+	/* TLS_CTX UNLOCK */
+	pthread_mutex_unlock(&netopeer_options.tls_opts->tls_ctx_lock);
+
 	return EXIT_SUCCESS;
 }
 
@@ -509,6 +1095,7 @@ int callback_n_netopeer_n_tls_n_crl_dir(void** UNUSED(data), XMLDIFF_OP op, xmlN
 int callback_n_netopeer_n_tls_n_cert_maps_n_cert_to_name(void** UNUSED(data), XMLDIFF_OP op, xmlNodePtr old_node, xmlNodePtr new_node, struct nc_err** error) {
 	char* id = NULL, *fingerprint = NULL, *map_type = NULL, *name = NULL, *ptr, *msg;
 	xmlNodePtr child;
+	struct np_ctn_index* old_index;
 
 callback_restart:
 	for (child = (op & (XMLDIFF_MOD | XMLDIFF_REM) ? old_node->children : new_node->children); child != NULL; child = child->next) {
@@ -569,9 +1156,18 @@ callback_restart:
 		add_ctn_item(&netopeer_options.tls_opts->ctn_map, atoi(id), fingerprint, ctn_type_parse(map_type), name);
 	}
 
+	/* publish a new snapshot, the handshakes in progress keep using the old one */
+	old_index = netopeer_options.tls_opts->ctn_index;
+	netopeer_options.tls_opts->ctn_index = ctn_index_build(netopeer_options.tls_opts->ctn_map);
+
 	/* CTN_MAP UNLOCK */
 	pthread_mutex_unlock(&netopeer_options.tls_opts->ctn_map_lock);
 
+	np_ctn_index_release(old_index);
+
+	/* the usernames of the resumable sessions may have changed */
+	np_tls_session_flush();
+
 	return EXIT_SUCCESS;
 }
 
@@ -590,6 +1186,10 @@ int netopeer_transapi_init_tls(void) {
 	pthread_mutex_init(&netopeer_options.tls_opts->tls_ctx_lock, NULL);
 	pthread_mutex_init(&netopeer_options.tls_opts->crl_dir_lock, NULL);
 	pthread_mutex_init(&netopeer_options.tls_opts->ctn_map_lock, NULL);
+	netopeer_options.tls_opts->client_cert_index = calloc(TLS_TRUSTED_CERT_BUCKETS, sizeof *netopeer_options.tls_opts->client_cert_index);
+	netopeer_options.tls_opts->session_cache_size = 1024;
+	netopeer_options.tls_opts->session_timeout = 300;
+	netopeer_options.tls_opts->session_tickets = 1;
 
 	return EXIT_SUCCESS;
 }
@@ -608,10 +1208,13 @@ void netopeer_transapi_close_tls(void) {
 	for (cert = netopeer_options.tls_opts->trusted_certs; cert != NULL;) {
 		del_cert = cert;
 		cert = cert->next;
+		X509_free(del_cert->x509);
 		free(del_cert->cert);
 		free(del_cert);
 	}
+	free(netopeer_options.tls_opts->client_cert_index);
 	free(netopeer_options.tls_opts->crl_dir);
+	np_crl_store_release(netopeer_options.tls_opts->crl_store);
 	for (item = netopeer_options.tls_opts->ctn_map; item != NULL;) {
 		del_item = item;
 		item = item->next;
@@ -619,6 +1222,7 @@ void netopeer_transapi_close_tls(void) {
 		free(del_item->name);
 		free(del_item);
 	}
+	np_ctn_index_release(netopeer_options.tls_opts->ctn_index);
 
 	pthread_mutex_destroy(&netopeer_options.tls_opts->tls_ctx_lock);
 	pthread_mutex_destroy(&netopeer_options.tls_opts->crl_dir_lock);
@@ -48,21 +48,78 @@ typedef enum {
 	CTN_MAP_TYPE_COMMON_NAME
 } CTN_MAP_TYPE;
 
+/* fingerprint algorithms, the first octet of a cert-to-name fingerprint */
+#define CTN_DIGEST_MD5 1
+#define CTN_DIGEST_SHA1 2
+#define CTN_DIGEST_SHA224 3
+#define CTN_DIGEST_SHA256 4
+#define CTN_DIGEST_SHA384 5
+#define CTN_DIGEST_SHA512 6
+
+/* bucket of a trusted client certificate public key digest */
+#define NP_TRUSTED_CERT_BUCKET(digest) (((digest)[0] | ((digest)[1] << 8)) & (TLS_TRUSTED_CERT_BUCKETS - 1))
+
+/* read-only snapshot of the CRLs loaded from crl_dir */
+struct np_crl_store {
+	volatile int refs;
+	unsigned int file_count;
+	struct np_crl_file {		/* stat() of every loaded file, the symlinks followed */
+		char* name;
+		dev_t dev;
+		ino_t ino;
+		off_t size;
+		struct timespec mtime;
+	} *files;
+	struct np_crl_entry {
+		unsigned long issuer_hash;
+		X509_CRL* crl;
+		EVP_PKEY* signer;		/* key the CRL signature was already verified with */
+		unsigned int serials_size;
+		ASN1_INTEGER** serials;		/* open-addressed set of the revoked serial numbers */
+		struct np_crl_entry* next;
+	} *crls;
+};
+
+/* read-only snapshot of the cert-to-name map indexed by the raw fingerprint digests */
+struct np_ctn_index {
+	volatile int refs;
+	uint8_t algs;				/* bitmask (1 << CTN_DIGEST_*) of the algorithms used in the map */
+	unsigned int size;
+	struct np_ctn_index_item {
+		uint32_t id;
+		uint8_t alg;
+		unsigned int digest_len;
+		unsigned char digest[EVP_MAX_MD_SIZE];
+		CTN_MAP_TYPE map_type;
+		char* name;
+		struct np_ctn_index_item* next;
+	} **buckets;
+};
+
 struct np_options_tls {
 	pthread_mutex_t tls_ctx_lock;
 	uint8_t tls_ctx_change_flag;
 	char* server_cert;		/* All certificates are stored in base64-encoded DER format */
 	char* server_key;
 	uint8_t server_key_type;	/* 1 - RSA, 0 - DSA */
+	uint32_t session_cache_size;
+	uint32_t session_timeout;
+	uint8_t session_tickets;
 	struct np_trusted_cert {	/* Must contain the server certificate CA chain certificates! */
 		char* cert;
+		X509* x509;			/* decoded cert, NULL if it is not valid */
+		unsigned char pubkey_digest[SHA256_DIGEST_LENGTH];	/* client certs only */
 		uint8_t client_cert;
 		struct np_trusted_cert* next;
 		struct np_trusted_cert* prev;
+		struct np_trusted_cert* index_next;
 	} *trusted_certs;
+	struct np_trusted_cert** client_cert_index;	/* TLS_TRUSTED_CERT_BUCKETS buckets, by the SHA-256 of the public key */
 
 	pthread_mutex_t crl_dir_lock;
 	char* crl_dir;
+	struct np_crl_store* crl_store;	/* loaded on demand, refreshed on crl_dir changes */
+	time_t crl_checked;
 
 	pthread_mutex_t ctn_map_lock;
 	struct np_ctn_item {
@@ -73,6 +130,7 @@ struct np_options_tls {
 		struct np_ctn_item* next;
 		struct np_ctn_item* prev;
 	} *ctn_map;
+	struct np_ctn_index* ctn_index;	/* rebuilt on every ctn_map change */
 };
 
 int netopeer_transapi_init_tls(void);
@@ -87,8 +145,67 @@ int callback_n_netopeer_n_tls_n_trusted_client_certs_n_trusted_client_cert(void*
 
 int callback_n_netopeer_n_tls_n_crl_dir(void** UNUSED(data), XMLDIFF_OP op, xmlNodePtr UNUSED(old_node), xmlNodePtr new_node, struct nc_err** error);
 
+int callback_n_netopeer_n_tls_n_session_resumption_n_cache_size(void** UNUSED(data), XMLDIFF_OP op, xmlNodePtr UNUSED(old_node), xmlNodePtr new_node, struct nc_err** error);
+
+int callback_n_netopeer_n_tls_n_session_resumption_n_timeout(void** UNUSED(data), XMLDIFF_OP op, xmlNodePtr UNUSED(old_node), xmlNodePtr new_node, struct nc_err** error);
+
+int callback_n_netopeer_n_tls_n_session_resumption_n_tickets(void** UNUSED(data), XMLDIFF_OP op, xmlNodePtr UNUSED(old_node), xmlNodePtr new_node, struct nc_err** error);
+
 int callback_n_netopeer_n_tls_n_cert_maps_n_cert_to_name(void** UNUSED(data), XMLDIFF_OP op, xmlNodePtr old_node, xmlNodePtr new_node, struct nc_err** error);
 
 void netopeer_transapi_close_tls(void);
 
+/**
+ * @brief Get the current CRL store snapshot, reload it if the CRL directory changed or a CRL expired
+ *
+ * @return Store to be released by np_crl_store_release(), NULL if no CRL directory is set.
+ */
+struct np_crl_store* np_crl_store_get(void);
+
+/**
+ * @brief Release a CRL store snapshot
+ *
+ * @param store Store returned by np_crl_store_get(), can be NULL
+ */
+void np_crl_store_release(struct np_crl_store* store);
+
+/**
+ * @brief Find a CRL issued by the specified name
+ */
+struct np_crl_entry* np_crl_store_find(const struct np_crl_store* store, X509_NAME* issuer);
+
+/**
+ * @brief Verify the signature of a CRL, successful verifications are remembered
+ *
+ * @param entry CRL entry
+ * @param pubkey Public key of the CRL issuer, it is consumed
+ *
+ * @return 1 on success, 0 on invalid signature
+ */
+int np_crl_entry_verify(struct np_crl_entry* entry, EVP_PKEY* pubkey);
+
+/**
+ * @brief Check whether a serial number is revoked by a CRL
+ */
+int np_crl_entry_revoked(const struct np_crl_entry* entry, ASN1_INTEGER* serial);
+
+/**
+ * @brief Get the current cert-to-name index snapshot
+ *
+ * @return Index to be released by np_ctn_index_release(), NULL if the map is empty.
+ */
+struct np_ctn_index* np_ctn_index_get(void);
+
+/**
+ * @brief Release a cert-to-name index snapshot
+ *
+ * @param index Index returned by np_ctn_index_get(), can be NULL
+ */
+void np_ctn_index_release(struct np_ctn_index* index);
+
+/**
+ * @brief Get the bucket of a fingerprint digest in a cert-to-name index
+ */
+unsigned int np_ctn_index_bucket(const struct np_ctn_index* index, uint8_t alg, const unsigned char* digest, unsigned int digest_len);
+
 #endif /* _CFGNETOPEER_TRANSAPI_TLS_H_ */
\ No newline at end of file
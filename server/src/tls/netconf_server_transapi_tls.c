@@ -130,16 +130,14 @@ int callback_srv_netconf_srv_tls_srv_call_home_srv_applications_srv_application(
 	return callback_srv_netconf_srv_call_home_srv_applications_srv_application(op, old_node, new_node, error, NC_TRANSPORT_TLS);
 }
 
+/* CALLHOME LOCK must be held */
 int np_tls_chapp_linger_check(struct ch_app* app) {
-	struct timeval cur_time;
+	if (np_clock_msec() - ((struct client_struct_tls*)app->client)->last_rpc_time >= app->rep_linger * 1000ULL) {
 
-	gettimeofday(&cur_time, NULL);
-	if (timeval_diff(cur_time, ((struct client_struct_tls*)app->client)->last_rpc_time) >= app->rep_linger) {
-
-		/* no data flow for too long, disconnect the client, wait for the set timeout and reconnect */
+		/* no data flow for too long, disconnect the client */
 		nc_verb_verbose("Call Home (app %s) did not communicate for too long, disconnecting.", app->name);
 		app->client->to_free = 1;
-		sleep(app->rep_timeout*60);
+		np_engine_kick(app->client);
 		return 1;
 	}
 
@@ -48,12 +48,14 @@
 #include <string.h>
 #include <pthread.h>
 #include <sys/poll.h>
+#include <sys/ioctl.h>
 #include <sys/time.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <unistd.h>
+#include <linux/sockios.h>
 #include <shadow.h>
 #include <pwd.h>
 
@@ -61,6 +63,8 @@
 #include <openssl/evp.h>
 #include <openssl/err.h>
 #include <openssl/x509v3.h>
+#include <openssl/rand.h>
+#include <openssl/hmac.h>
 
 #include "../server.h"
 
@@ -77,6 +81,9 @@ void client_free_tls(struct client_struct_tls* client) {
 	}
 	if (client->nc_sess != NULL) {
 		nc_verb_error("%s: internal error: freeing a client with an opened NC session", __func__);
+		np_sess_index_del(client->nc_sess);
+		np_notif_unsubscribe(client->notif_sub);
+		client->notif_sub = NULL;
 		nc_session_free(client->nc_sess);
 	}
 
@@ -90,7 +97,7 @@ void client_free_tls(struct client_struct_tls* client) {
 	free(client->username);
 	X509_free(client->cert);
 
-	free(client);
+	np_slab_free(NP_SLAB_CLIENT, client);
 }
 
 static char* asn1time_to_str(ASN1_TIME *t) {
@@ -119,18 +126,8 @@ static char* asn1time_to_str(ASN1_TIME *t) {
 	return cp;
 }
 
-static void digest_to_str(const unsigned char* digest, unsigned int dig_len, char** str) {
-	unsigned int i;
-
-	*str = malloc(dig_len*3);
-	for (i = 0; i < dig_len-1; ++i) {
-		sprintf((*str)+(i*3), "%02x:", digest[i]);
-	}
-	sprintf((*str)+(i*3), "%02x", digest[i]);
-}
-
 /* return NULL - SSL error can be retrieved */
-static X509* base64der_to_cert(const char* in) {
+X509* np_tls_base64der_to_cert(const char* in) {
 	X509* out;
 	char* buf;
 	BIO* bio;
@@ -304,203 +301,98 @@ static int tls_ctn_get_username_from_cert(X509* client_cert, CTN_MAP_TYPE map_ty
 	return 0;
 }
 
+static const EVP_MD* ctn_digest_md(uint8_t alg) {
+	switch (alg) {
+	case CTN_DIGEST_MD5:
+		return EVP_md5();
+	case CTN_DIGEST_SHA1:
+		return EVP_sha1();
+	case CTN_DIGEST_SHA224:
+		return EVP_sha224();
+	case CTN_DIGEST_SHA256:
+		return EVP_sha256();
+	case CTN_DIGEST_SHA384:
+		return EVP_sha384();
+	case CTN_DIGEST_SHA512:
+		return EVP_sha512();
+	}
+
+	return NULL;
+}
+
 /* return: 0 - result assigned, 1 - result unchanged (no match or some error occured) */
 static int tls_cert_to_name(X509* cert, CTN_MAP_TYPE* map_type, char** name) {
-	char* digest_md5 = NULL, *digest_sha1 = NULL, *digest_sha224 = NULL;
-	char* digest_sha256 = NULL, *digest_sha384 = NULL, *digest_sha512 = NULL;
-	struct np_ctn_item* ctn;
-	unsigned char* buf = malloc(64);
-	unsigned int buf_len = 64;
+	struct np_ctn_index* index;
+	struct np_ctn_index_item* item, *match = NULL;
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_len;
+	uint8_t alg;
 
 	if (cert == NULL || map_type == NULL || name == NULL) {
-		free(buf);
 		return 1;
 	}
 
-	/* CTN_MAP LOCK */
-	pthread_mutex_lock(&netopeer_options.tls_opts->ctn_map_lock);
-
-	for (ctn = netopeer_options.tls_opts->ctn_map; ctn != NULL; ctn = ctn->next) {
-		/* MD5 */
-		if (strncmp(ctn->fingerprint, "01", 2) == 0) {
-			if (digest_md5 == NULL) {
-				if (X509_digest(cert, EVP_md5(), buf, &buf_len) != 1) {
-					nc_verb_error("%s: calculating MD5 digest: %s", __func__, ERR_reason_error_string(ERR_get_error()));
-					goto fail;
-				}
-				digest_to_str(buf, buf_len, &digest_md5);
-			}
-
-			if (strcasecmp(ctn->fingerprint+3, digest_md5) == 0) {
-				/* we got ourselves a winner! */
-				nc_verb_verbose("Cert verify CTN: entry with a matching fingerprint found");
-				*map_type = ctn->map_type;
-				if (ctn->map_type == CTN_MAP_TYPE_SPECIFIED) {
-					*name = strdup(ctn->name);
-				}
-				break;
-			}
-
-		/* SHA-1 */
-		} else if (strncmp(ctn->fingerprint, "02", 2) == 0) {
-			if (digest_sha1 == NULL) {
-				if (X509_digest(cert, EVP_sha1(), buf, &buf_len) != 1) {
-					nc_verb_error("%s: calculating SHA-1 digest: %s", __func__, ERR_reason_error_string(ERR_get_error()));
-					goto fail;
-				}
-				digest_to_str(buf, buf_len, &digest_sha1);
-			}
-
-			if (strcasecmp(ctn->fingerprint+3, digest_sha1) == 0) {
-				/* we got ourselves a winner! */
-				nc_verb_verbose("Cert verify CTN: entry with a matching fingerprint found");
-				*map_type = ctn->map_type;
-				if (ctn->map_type == CTN_MAP_TYPE_SPECIFIED) {
-					*name = strdup(ctn->name);
-				}
-				break;
-			}
-
-		/* SHA-224 */
-		} else if (strncmp(ctn->fingerprint, "03", 2) == 0) {
-			if (digest_sha224 == NULL) {
-				if (X509_digest(cert, EVP_sha224(), buf, &buf_len) != 1) {
-					nc_verb_error("%s: calculating SHA-224 digest: %s", __func__, ERR_reason_error_string(ERR_get_error()));
-					goto fail;
-				}
-				digest_to_str(buf, buf_len, &digest_sha224);
-			}
-
-			if (strcasecmp(ctn->fingerprint+3, digest_sha224) == 0) {
-				/* we got ourselves a winner! */
-				nc_verb_verbose("Cert verify CTN: entry with a matching fingerprint found");
-				*map_type = ctn->map_type;
-				if (ctn->map_type == CTN_MAP_TYPE_SPECIFIED) {
-					*name = strdup(ctn->name);
-				}
-				break;
-			}
-
-		/* SHA-256 */
-		} else if (strncmp(ctn->fingerprint, "04", 2) == 0) {
-			if (digest_sha256 == NULL) {
-				if (X509_digest(cert, EVP_sha256(), buf, &buf_len) != 1) {
-					nc_verb_error("%s: calculating SHA-256 digest: %s", __func__, ERR_reason_error_string(ERR_get_error()));
-					goto fail;
-				}
-				digest_to_str(buf, buf_len, &digest_sha256);
-			}
-
-			if (strcasecmp(ctn->fingerprint+3, digest_sha256) == 0) {
-				/* we got ourselves a winner! */
-				nc_verb_verbose("Cert verify CTN: entry with a matching fingerprint found");
-				*map_type = ctn->map_type;
-				if (ctn->map_type == CTN_MAP_TYPE_SPECIFIED) {
-					*name = strdup(ctn->name);
-				}
-				break;
-			}
-
-		/* SHA-384 */
-		} else if (strncmp(ctn->fingerprint, "05", 2) == 0) {
-			if (digest_sha384 == NULL) {
-				if (X509_digest(cert, EVP_sha384(), buf, &buf_len) != 1) {
-					nc_verb_error("%s: calculating SHA-384 digest: %s", __func__, ERR_reason_error_string(ERR_get_error()));
-					goto fail;
-				}
-				digest_to_str(buf, buf_len, &digest_sha384);
-			}
+	if ((index = np_ctn_index_get()) == NULL) {
+		return 1;
+	}
 
-			if (strcasecmp(ctn->fingerprint+3, digest_sha384) == 0) {
-				/* we got ourselves a winner! */
-				nc_verb_verbose("Cert verify CTN: entry with a matching fingerprint found");
-				*map_type = ctn->map_type;
-				if (ctn->map_type == CTN_MAP_TYPE_SPECIFIED) {
-					*name = strdup(ctn->name);
-				}
-				break;
-			}
+	/* compute only the digests used in the map, the entry with the lowest id wins */
+	for (alg = CTN_DIGEST_MD5; alg <= CTN_DIGEST_SHA512; ++alg) {
+		if (!(index->algs & (1 << alg))) {
+			continue;
+		}
 
-		/* SHA-512 */
-		} else if (strncmp(ctn->fingerprint, "06", 2) == 0) {
-			if (digest_sha512 == NULL) {
-				if (X509_digest(cert, EVP_sha512(), buf, &buf_len) != 1) {
-					nc_verb_error("%s: calculating SHA-512 digest: %s", __func__, ERR_reason_error_string(ERR_get_error()));
-					goto fail;
-				}
-				digest_to_str(buf, buf_len, &digest_sha512);
-			}
+		if (X509_digest(cert, ctn_digest_md(alg), digest, &digest_len) != 1) {
+			nc_verb_error("%s: calculating %s digest: %s", __func__, OBJ_nid2sn(EVP_MD_type(ctn_digest_md(alg))), ERR_reason_error_string(ERR_get_error()));
+			np_ctn_index_release(index);
+			return 1;
+		}
 
-			if (strcasecmp(ctn->fingerprint+3, digest_sha512) == 0) {
-				/* we got ourselves a winner! */
-				nc_verb_verbose("Cert verify CTN: entry with a matching fingerprint found");
-				*map_type = ctn->map_type;
-				if (ctn->map_type == CTN_MAP_TYPE_SPECIFIED) {
-					*name = strdup(ctn->name);
-				}
-				break;
+		for (item = index->buckets[np_ctn_index_bucket(index, alg, digest, digest_len)]; item != NULL; item = item->next) {
+			if (item->alg == alg && item->digest_len == digest_len && memcmp(item->digest, digest, digest_len) == 0
+					&& (match == NULL || item->id < match->id)) {
+				match = item;
 			}
-
-		/* unknown */
-		} else {
-			nc_verb_warning("%s: unknown fingerprint algorithm used (%s), skipping", __func__, ctn->fingerprint);
 		}
 	}
 
-	if (ctn == NULL) {
-		goto fail;
+	if (match == NULL) {
+		np_ctn_index_release(index);
+		return 1;
 	}
 
-	/* CTN_MAP UNLOCK */
-	pthread_mutex_unlock(&netopeer_options.tls_opts->ctn_map_lock);
+	/* we got ourselves a winner! */
+	nc_verb_verbose("Cert verify CTN: entry with a matching fingerprint found");
+	*map_type = match->map_type;
+	if (match->map_type == CTN_MAP_TYPE_SPECIFIED) {
+		*name = strdup(match->name);
+	}
 
-	free(digest_md5);
-	free(digest_sha1);
-	free(digest_sha224);
-	free(digest_sha256);
-	free(digest_sha384);
-	free(digest_sha512);
-	free(buf);
+	np_ctn_index_release(index);
 	return 0;
-
-fail:
-	/* CTN_MAP UNLOCK */
-	pthread_mutex_unlock(&netopeer_options.tls_opts->ctn_map_lock);
-
-	free(digest_md5);
-	free(digest_sha1);
-	free(digest_sha224);
-	free(digest_sha256);
-	free(digest_sha384);
-	free(digest_sha512);
-	free(buf);
-	return 1;
 }
 
-static int tls_verify_callback(int preverify_ok, X509_STORE_CTX* x509_ctx) {
-	X509_STORE *store;
-	X509_LOOKUP *lookup;
-	X509_STORE_CTX store_ctx;
-	X509_OBJECT obj;
+static int tls_verify_cert(int preverify_ok, X509_STORE_CTX* x509_ctx) {
 	X509_NAME* subject;
 	X509_NAME* issuer;
 	X509* cert;
-	X509_CRL* crl;
-	X509_REVOKED* revoked;
 	STACK_OF(X509)* cert_chain_stack;
-	EVP_PKEY* pubkey;
 	SSL* cur_tls;
 	struct client_struct_tls* new_client;
-	struct np_trusted_cert* trusted_cert;
+	struct np_trusted_cert* trusted_cert = NULL;
+	struct np_crl_store* crl_store;
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	unsigned int digest_len;
+	struct np_crl_entry* crl_entry;
 	long serial;
-	int i, n, rc, depth;
+	int depth;
 	char* cp;
 	CTN_MAP_TYPE map_type = 0;
 	ASN1_TIME* last_update = NULL, *next_update = NULL;
 
 	/* get the new client structure */
 	cur_tls = X509_STORE_CTX_get_ex_data(x509_ctx, SSL_get_ex_data_X509_STORE_CTX_idx());
-	new_client = (struct client_struct_tls*)SSL_get_ex_data(cur_tls, netopeer_state.tls_state->last_tls_idx);
+	new_client = (struct client_struct_tls*)SSL_get_ex_data(cur_tls, netopeer_state.tls_state->tls_client_idx);
 	if (new_client == NULL) {
 		nc_verb_error("%s: internal error (%s:%d)", __func__, __FILE__, __LINE__);
 		return 0;
@@ -518,29 +410,22 @@ static int tls_verify_callback(int preverify_ok, X509_STORE_CTX* x509_ctx) {
 
 	/* standard certificate verification failed, so a local client cert must match to continue */
 	if (!preverify_ok) {
-		/* TLS_CTX LOCK */
-		pthread_mutex_lock(&netopeer_options.tls_opts->tls_ctx_lock);
-
-		for (trusted_cert = netopeer_options.tls_opts->trusted_certs; trusted_cert != NULL; trusted_cert = trusted_cert->next) {
-			if (!trusted_cert->client_cert) {
-				continue;
-			}
-			cert = base64der_to_cert(trusted_cert->cert);
-			if (cert == NULL) {
-				nc_verb_error("%s: loading a trusted client certificate failed (%s).", __func__, ERR_reason_error_string(ERR_get_error()));
-				continue;
+		if (X509_pubkey_digest(new_client->cert, EVP_sha256(), digest, &digest_len) == 1) {
+			/* TLS_CTX LOCK */
+			pthread_mutex_lock(&netopeer_options.tls_opts->tls_ctx_lock);
+
+			trusted_cert = netopeer_options.tls_opts->client_cert_index[NP_TRUSTED_CERT_BUCKET(digest)];
+			for (; trusted_cert != NULL; trusted_cert = trusted_cert->index_next) {
+				if (memcmp(trusted_cert->pubkey_digest, digest, SHA256_DIGEST_LENGTH) == 0
+						&& cert_pubkey_match(new_client->cert, trusted_cert->x509)) {
+					break;
+				}
 			}
 
-			if (cert_pubkey_match(new_client->cert, cert)) {
-				X509_free(cert);
-				break;
-			}
-			X509_free(cert);
+			/* TLS_CTX UNLOCK */
+			pthread_mutex_unlock(&netopeer_options.tls_opts->tls_ctx_lock);
 		}
 
-		/* TLS_CTX UNLOCK */
-		pthread_mutex_unlock(&netopeer_options.tls_opts->tls_ctx_lock);
-
 		if (trusted_cert == NULL) {
 			nc_verb_error("Cert verify: fail (%s).", X509_verify_cert_error_string(X509_STORE_CTX_get_error(x509_ctx)));
 			return 0;
@@ -569,45 +454,17 @@ static int tls_verify_callback(int preverify_ok, X509_STORE_CTX* x509_ctx) {
 	OPENSSL_free(cp);
 
 	/* check for revocation if set */
-	/* CRL_DIR LOCK */
-	pthread_mutex_lock(&netopeer_options.tls_opts->crl_dir_lock);
-
-	if (netopeer_options.tls_opts->crl_dir != NULL) {
-		store = X509_STORE_new();
-		lookup = X509_STORE_add_lookup(store, X509_LOOKUP_hash_dir());
-		if (lookup == NULL) {
-			nc_verb_error("%s: failed to add lookup method", __func__);
-			X509_STORE_free(store);
-			/* CRL_DIR UNLOCK */
-			pthread_mutex_unlock(&netopeer_options.tls_opts->crl_dir_lock);
-			return 0;
-		}
-
-		i = X509_LOOKUP_add_dir(lookup, netopeer_options.tls_opts->crl_dir, X509_FILETYPE_PEM);
-
-		/* CRL_DIR UNLOCK */
-		pthread_mutex_unlock(&netopeer_options.tls_opts->crl_dir_lock);
-
-		if (i == 0) {
-			nc_verb_error("%s: failed to add revocation lookup directory", __func__);
-			X509_STORE_free(store);
-			return 0;
-		}
-
+	if ((crl_store = np_crl_store_get()) != NULL) {
 		/* try to retrieve a CRL corresponding to the _subject_ of
 		* the current certificate in order to verify it's integrity */
-		memset((char*)&obj, 0, sizeof(obj));
-		X509_STORE_CTX_init(&store_ctx, store, NULL, NULL);
-		rc = X509_STORE_get_by_subject(&store_ctx, X509_LU_CRL, subject, &obj);
-		X509_STORE_CTX_cleanup(&store_ctx);
-		crl = obj.data.crl;
-		if (rc > 0 && crl) {
+		crl_entry = np_crl_store_find(crl_store, subject);
+		if (crl_entry != NULL) {
 			cp = X509_NAME_oneline(subject, NULL, 0);
 			nc_verb_verbose("Cert verify CRL: issuer: %s", cp);
 			OPENSSL_free(cp);
 
-			last_update = X509_CRL_get_lastUpdate(crl);
-			next_update = X509_CRL_get_nextUpdate(crl);
+			last_update = X509_CRL_get_lastUpdate(crl_entry->crl);
+			next_update = X509_CRL_get_nextUpdate(crl_entry->crl);
 			cp = asn1time_to_str(last_update);
 			nc_verb_verbose("Cert verify CRL: last update: %s", cp);
 			free(cp);
@@ -616,68 +473,42 @@ static int tls_verify_callback(int preverify_ok, X509_STORE_CTX* x509_ctx) {
 			free(cp);
 
 			/* verify the signature on this CRL */
-			pubkey = X509_get_pubkey(cert);
-			if (X509_CRL_verify(crl, pubkey) <= 0) {
+			if (!np_crl_entry_verify(crl_entry, X509_get_pubkey(cert))) {
 				nc_verb_error("Cert verify CRL: invalid signature.");
 				X509_STORE_CTX_set_error(x509_ctx, X509_V_ERR_CRL_SIGNATURE_FAILURE);
-				X509_OBJECT_free_contents(&obj);
-				if (pubkey) {
-					EVP_PKEY_free(pubkey);
-				}
-				X509_STORE_free(store);
+				np_crl_store_release(crl_store);
 				return 0;
 			}
-			if (pubkey) {
-				EVP_PKEY_free(pubkey);
-			}
 
 			/* check date of CRL to make sure it's not expired */
 			if (next_update == NULL) {
 				nc_verb_error("Cert verify CRL: invalid nextUpdate field.");
 				X509_STORE_CTX_set_error(x509_ctx, X509_V_ERR_ERROR_IN_CRL_NEXT_UPDATE_FIELD);
-				X509_OBJECT_free_contents(&obj);
-				X509_STORE_free(store);
+				np_crl_store_release(crl_store);
 				return 0;
 			}
 			if (X509_cmp_current_time(next_update) < 0) {
 				nc_verb_error("Cert verify CRL: expired - revoking all certificates.");
 				X509_STORE_CTX_set_error(x509_ctx, X509_V_ERR_CRL_HAS_EXPIRED);
-				X509_OBJECT_free_contents(&obj);
-				X509_STORE_free(store);
+				np_crl_store_release(crl_store);
 				return 0;
 			}
-			X509_OBJECT_free_contents(&obj);
 		}
 
 		/* try to retrieve a CRL corresponding to the _issuer_ of
 		* the current certificate in order to check for revocation */
-		memset((char*)&obj, 0, sizeof(obj));
-		X509_STORE_CTX_init(&store_ctx, store, NULL, NULL);
-		rc = X509_STORE_get_by_subject(&store_ctx, X509_LU_CRL, issuer, &obj);
-		X509_STORE_CTX_cleanup(&store_ctx);
-		crl = obj.data.crl;
-		if (rc > 0 && crl) {
-			/* check if the current certificate is revoked by this CRL */
-			n = sk_X509_REVOKED_num(X509_CRL_get_REVOKED(crl));
-			for (i = 0; i < n; i++) {
-				revoked = sk_X509_REVOKED_value(X509_CRL_get_REVOKED(crl), i);
-				if (ASN1_INTEGER_cmp(revoked->serialNumber, X509_get_serialNumber(cert)) == 0) {
-					serial = ASN1_INTEGER_get(revoked->serialNumber);
-					cp = X509_NAME_oneline(issuer, NULL, 0);
-					nc_verb_error("Cert verify CRL: certificate with serial %ld (0x%lX) revoked per CRL from issuer %s", serial, serial, cp);
-					OPENSSL_free(cp);
-					X509_STORE_CTX_set_error(x509_ctx, X509_V_ERR_CERT_REVOKED);
-					X509_OBJECT_free_contents(&obj);
-					X509_STORE_free(store);
-					return 0;
-				}
-			}
-			X509_OBJECT_free_contents(&obj);
+		crl_entry = np_crl_store_find(crl_store, issuer);
+		if (crl_entry != NULL && np_crl_entry_revoked(crl_entry, X509_get_serialNumber(cert))) {
+			serial = ASN1_INTEGER_get(X509_get_serialNumber(cert));
+			cp = X509_NAME_oneline(issuer, NULL, 0);
+			nc_verb_error("Cert verify CRL: certificate with serial %ld (0x%lX) revoked per CRL from issuer %s", serial, serial, cp);
+			OPENSSL_free(cp);
+			X509_STORE_CTX_set_error(x509_ctx, X509_V_ERR_CERT_REVOKED);
+			np_crl_store_release(crl_store);
+			return 0;
 		}
-		X509_STORE_free(store);
+		np_crl_store_release(crl_store);
 	}
-	/* CRL_DIR UNLOCK */
-	pthread_mutex_unlock(&netopeer_options.tls_opts->crl_dir_lock);
 
 	/* cert-to-name already successful */
 	if (new_client->username != NULL) {
@@ -710,6 +541,16 @@ fail:
 	return 0;
 }
 
+static int tls_verify_callback(int preverify_ok, X509_STORE_CTX* x509_ctx) {
+	int ret;
+
+	if ((ret = tls_verify_cert(preverify_ok, x509_ctx)) == 0) {
+		np_stats_auth_failure(NC_TRANSPORT_TLS);
+	}
+
+	return ret;
+}
+
 static int create_netconf_session(struct client_struct_tls* client) {
 	struct nc_cpblts* caps = NULL;
 
@@ -731,52 +572,241 @@ static int create_netconf_session(struct client_struct_tls* client) {
 	}
 
 	nc_verb_verbose("New server session for '%s' with ID %s", client->username, nc_session_get_id(client->nc_sess));
-	gettimeofday((struct timeval*)&client->last_rpc_time, NULL);
+	client->last_rpc_time = np_clock_msec();
+	np_sess_index_add(client->nc_sess, (struct client_struct*)client, NULL);
 
 	return EXIT_SUCCESS;
 }
 
 int np_tls_kill_session(const char* sid, struct client_struct_tls* cur_client) {
-	struct client_struct_tls* kill_client;
+	struct np_sess_entry* entry;
 
 	if (sid == NULL) {
 		return 1;
 	}
 
-	for (kill_client = (struct client_struct_tls*)netopeer_state.clients; kill_client != NULL; kill_client = (struct client_struct_tls*)kill_client->next) {
-		if (kill_client->transport != NC_TRANSPORT_TLS || kill_client == cur_client) {
-			continue;
-		}
-
-		if (strcmp(sid, nc_session_get_id(kill_client->nc_sess)) == 0) {
-			break;
-		}
-	}
+	/* GLOBAL LOCK */
+	pthread_mutex_lock(&netopeer_state.global_lock);
 
-	if (kill_client == NULL) {
+	entry = np_sess_index_find(sid);
+	if (entry == NULL || entry->client->transport != NC_TRANSPORT_TLS || entry->client == (struct client_struct*)cur_client) {
+		/* GLOBAL UNLOCK */
+		pthread_mutex_unlock(&netopeer_state.global_lock);
 		return 1;
 	}
 
-	kill_client->to_free = 1;
+	entry->client->to_free = 1;
+	np_engine_kick(entry->client);
+
+	/* GLOBAL UNLOCK */
+	pthread_mutex_unlock(&netopeer_state.global_lock);
 
 	return 0;
 }
 
+/* only in an engine helper with a blocking socket, the engine drops the client if a chunk is not taken in time */
+static int tls_reply_write(void* arg, const char* buf, size_t len) {
+	SSL* tls = arg;
+
+	np_engine_step_deadline(np_clock_msec() + REPLY_WRITE_TIMEOUT);
+	if (SSL_write(tls, buf, len) != (int)len) {
+		nc_verb_error("%s: failed to write into TLS (%s)", __func__, ERR_reason_error_string(ERR_get_error()));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* return: number of bytes the socket can take without blocking, roughly */
+static size_t tls_send_room(struct client_struct_tls* client) {
+	int sndbuf, queued;
+	socklen_t len = sizeof sndbuf;
+
+	if (getsockopt(client->sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) == -1 || ioctl(client->sock, SIOCOUTQ, &queued) == -1) {
+		nc_verb_warning("%s: failed to get the socket send queue (%s)", __func__, strerror(errno));
+		return 0;
+	}
+
+	/* half of the buffer is the kernel overhead */
+	sndbuf /= 2;
+	return (queued < sndbuf ? (size_t)(sndbuf - queued) : 0);
+}
+
+static void tls_set_blocking(struct client_struct_tls* client, int blocking) {
+	int flags;
+
+	if (((flags = fcntl(client->sock, F_GETFL)) == -1) || (fcntl(client->sock, F_SETFL, (blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK)) == -1)) {
+		nc_verb_error("%s: fcntl failed (%s)", __func__, strerror(errno));
+	}
+}
+
+/* send the reply of the finished job */
+static void tls_reply_send(struct client_struct_tls* client) {
+	struct np_rpc_job* job = client->rpc_job;
+	int ret;
+
+	/* large data replies are written into the stream as they are serialized */
+	ret = np_reply_stream(client->nc_sess, job->rpc, job->reply, tls_reply_write, client->tls);
+	if (ret == 1) {
+		nc_session_send_reply(client->nc_sess, job->rpc, job->reply);
+	} else if (ret == -1) {
+		client->to_free = 1;
+	}
+	np_stats_hist_add(&netopeer_stats.rpc_latency, &job->recv_time);
+	client->last_rpc_time = np_clock_msec();
+
+	/* so that we do not free the client before this reply gets sent */
+	if (nc_rpc_get_op(job->rpc) == NC_OP_CLOSESESSION) {
+		nc_verb_verbose("Freeing session for '%s'", client->username);
+		np_sess_index_del(client->nc_sess);
+		np_notif_unsubscribe(client->notif_sub);
+		client->notif_sub = NULL;
+		nc_session_free(client->nc_sess);
+		client->nc_sess = NULL;
+		client->to_free = 1;
+	}
+
+	np_rpc_job_free(job);
+	client->rpc_job = NULL;
+}
+
+/* the engine helper steps, they run with the socket blocking and nobody else processes the client meanwhile */
+static void tls_step_reply(struct client_struct* arg) {
+	struct client_struct_tls* client = (struct client_struct_tls*)arg;
+
+	tls_set_blocking(client, 1);
+	tls_reply_send(client);
+	tls_set_blocking(client, 0);
+}
+
+static void tls_step_notif(struct client_struct* arg) {
+	struct client_struct_tls* client = (struct client_struct_tls*)arg;
+
+	tls_set_blocking(client, 1);
+	np_notif_send(client->notif_sub, NULL);
+	tls_set_blocking(client, 0);
+}
+
+static void tls_step_hello(struct client_struct* arg) {
+	struct client_struct_tls* client = (struct client_struct_tls*)arg;
+
+	tls_set_blocking(client, 1);
+	create_netconf_session(client);
+	tls_set_blocking(client, 0);
+}
+
+/* return: 1 - the whole hello is buffered, 0 - not yet, 2 - it spans more records, -1 - the connection failed */
+static int tls_hello_ready(struct client_struct_tls* client) {
+	char buf[16384];
+	int ret;
+
+	/* only the current record can be peeked into */
+	if ((ret = SSL_peek(client->tls, buf, sizeof buf)) > 0) {
+		/* the hello always uses the 1.0 framing */
+		return (memmem(buf, ret, "]]>]]>", 6) != NULL ? 1 : 2);
+	}
+
+	switch (SSL_get_error(client->tls, ret)) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/* return: 0 - the reply was sent, 1 - an engine helper sends it */
+static int tls_client_reply(struct client_struct_tls* client) {
+	NC_REPLY_TYPE type = nc_reply_get_type(client->rpc_job->reply);
+
+	/* only a short reply fitting into the socket buffer cannot block */
+	if ((type == NC_REPLY_OK || type == NC_REPLY_ERROR) && tls_send_room(client) >= SEND_INLINE_ROOM) {
+		tls_reply_send(client);
+		return 0;
+	}
+
+	np_engine_offload((struct client_struct*)client, tls_step_reply, np_clock_msec() + REPLY_WRITE_TIMEOUT);
+	return 1;
+}
+
 /* return: 0 - nothing happened (sleep), 1 - something happened (skip sleep) */
 int np_tls_client_netconf_rpc(struct client_struct_tls* client) {
 	nc_rpc* rpc = NULL;
 	nc_reply* rpc_reply = NULL;
 	NC_MSG_TYPE rpc_type;
 	xmlNodePtr op;
-	int closing = 0, skip_sleep = 0;
+	int skip_sleep = 0, delay;
 	struct nc_err* err;
+	struct timespec recv_time;
+	size_t room;
+
+	/* send the reply of the RPC processed by a worker */
+	if (client->rpc_job != NULL) {
+		if (!np_rpc_job_done(client->rpc_job)) {
+			/* keep the order of the replies, do not receive anything meanwhile, the worker kicks us once it finishes */
+			np_engine_park((struct client_struct*)client);
+			return 0;
+		}
+
+		if (!client->to_free) {
+			if (tls_client_reply(client)) {
+				/* nothing else until an engine helper sends it */
+				return 1;
+			}
+		} else {
+			if (quit && client->nc_sess != NULL) {
+				nc_verb_verbose("Freeing session for '%s'", client->username);
+				np_sess_index_del(client->nc_sess);
+				np_notif_unsubscribe(client->notif_sub);
+				client->notif_sub = NULL;
+				nc_session_free(client->nc_sess);
+				client->nc_sess = NULL;
+			}
+			np_rpc_job_free(client->rpc_job);
+			client->rpc_job = NULL;
+		}
+		++skip_sleep;
+	}
 
 	if (client->to_free) {
 		return 1;
 	}
 
-	if (client->nc_sess == NULL && create_netconf_session(client)) {
-		return 1;
+	/* send the queued notifications, the ones not fitting into the socket buffer by an engine helper */
+	if (client->notif_sub != NULL) {
+		room = tls_send_room(client);
+		if (np_notif_send(client->notif_sub, &room)) {
+			++skip_sleep;
+		}
+		if (np_notif_queue_depth(client->notif_sub) > 0) {
+			np_engine_offload((struct client_struct*)client, tls_step_notif, np_clock_msec() + REPLY_WRITE_TIMEOUT);
+			return 1;
+		}
+	}
+
+	/* accepting the session reads the hello, only once it has all arrived */
+	if (client->nc_sess == NULL) {
+		switch (tls_hello_ready(client)) {
+		case 0:
+			return skip_sleep;
+		case -1:
+			nc_verb_error("%s: connection closed before the hello was received", __func__);
+			client->to_free = 1;
+			return 1;
+		case 1:
+			if (tls_send_room(client) >= np_hello_len() + SEND_INLINE_ROOM) {
+				if (create_netconf_session(client)) {
+					return 1;
+				}
+				++skip_sleep;
+				break;
+			}
+			/* fallthrough */
+		default:
+			/* the rest of it may take a while or our hello does not fit */
+			np_engine_offload((struct client_struct*)client, tls_step_hello, client->last_rpc_time + netopeer_options.hello_timeout * 1000ULL);
+			return 1;
+		}
 	}
 
 	/* receive a new RPC */
@@ -786,7 +816,7 @@ int np_tls_client_netconf_rpc(struct client_struct_tls* client) {
 		return skip_sleep;
 	}
 
-	gettimeofday((struct timeval*)&client->last_rpc_time, NULL);
+	client->last_rpc_time = np_clock_msec();
 
 	if (rpc_type == NC_MSG_UNKNOWN) {
 		if (nc_session_get_status(client->nc_sess) != NC_SESSION_STATUS_WORKING) {
@@ -807,11 +837,13 @@ int np_tls_client_netconf_rpc(struct client_struct_tls* client) {
 	}
 
 	++skip_sleep;
+	clock_gettime(CLOCK_MONOTONIC, &recv_time);
+	np_stats_rpc(rpc);
 
 	/* process the new RPC */
 	switch (nc_rpc_get_op(rpc)) {
 	case NC_OP_CLOSESESSION:
-		closing = 1;
+		/* the session is freed once the reply is sent */
 		rpc_reply = nc_reply_ok();
 		break;
 
@@ -876,7 +908,7 @@ int np_tls_client_netconf_rpc(struct client_struct_tls* client) {
 		}
 
 		/* check if notifications are allowed on this session */
-		if (nc_session_notif_allowed(client->nc_sess) == 0) {
+		if (client->notif_sub != NULL || nc_session_notif_allowed(client->nc_sess) == 0) {
 			nc_verb_error("%s: notification subscription is not allowed on the session %s", __func__, nc_session_get_id(client->nc_sess));
 			err = nc_err_new(NC_ERR_OP_FAILED);
 			nc_err_set(err, NC_ERR_PARAM_TYPE, "protocol");
@@ -891,10 +923,15 @@ int np_tls_client_netconf_rpc(struct client_struct_tls* client) {
 			break;
 		}
 
+		/* live events of a stream are served by the shared dispatcher */
+		if ((client->notif_sub = np_notif_subscribe((struct client_struct*)client, client->nc_sess, &client->to_free, rpc)) != NULL) {
+			break;
+		}
+
 		pthread_t thread;
 		struct ntf_thread_config* ntf_config;
 
-		if ((ntf_config = malloc(sizeof(struct ntf_thread_config))) == NULL) {
+		if ((ntf_config = np_slab_alloc(NP_SLAB_NOTIF)) == NULL) {
 			nc_verb_error("%s: memory allocation failed", __func__);
 			err = nc_err_new(NC_ERR_OP_FAILED);
 			nc_err_set(err, NC_ERR_PARAM_MSG, "Memory allocation failed.");
@@ -907,6 +944,8 @@ int np_tls_client_netconf_rpc(struct client_struct_tls* client) {
 
 		/* perform notification sending */
 		if ((pthread_create(&thread, NULL, client_notif_thread, ntf_config)) != 0) {
+			nc_rpc_free(ntf_config->subscribe_rpc);
+			np_slab_free(NP_SLAB_NOTIF, ntf_config);
 			nc_reply_free(rpc_reply);
 			err = nc_err_new(NC_ERR_OP_FAILED);
 			nc_err_set(err, NC_ERR_PARAM_MSG, "Creating thread for sending Notifications failed.");
@@ -918,69 +957,86 @@ int np_tls_client_netconf_rpc(struct client_struct_tls* client) {
 		break;
 
 	default:
-		if ((rpc_reply = ncds_apply_rpc2all(client->nc_sess, rpc, NULL)) == NULL) {
-			err = nc_err_new(NC_ERR_OP_FAILED);
-			nc_err_set(err, NC_ERR_PARAM_MSG, "For unknown reason no reply was returned by the library.");
-			rpc_reply = nc_reply_error(err);
-		} else if (rpc_reply == NCDS_RPC_NOT_APPLICABLE) {
-			err = nc_err_new(NC_ERR_OP_FAILED);
-			nc_err_set(err, NC_ERR_PARAM_MSG, "There is no device/data that could be affected.");
-			nc_reply_free(rpc_reply);
+		if ((delay = np_ratelimit_rpc(client->username, nc_session_get_id(client->nc_sess))) == -1) {
+			err = nc_err_new(NC_ERR_RES_DENIED);
+			nc_err_set(err, NC_ERR_PARAM_MSG, "RPC rate limit exceeded, try again later.");
 			rpc_reply = nc_reply_error(err);
+			break;
 		}
 
+		/* a worker applies it, the reply is sent once it is done */
+		if ((client->rpc_job = np_workers_submit((struct client_struct*)client, client->nc_sess, rpc, delay)) != NULL) {
+			return skip_sleep;
+		}
+
+		err = nc_err_new(NC_ERR_OP_FAILED);
+		nc_err_set(err, NC_ERR_PARAM_MSG, "Failed to queue the RPC for processing.");
+		rpc_reply = nc_reply_error(err);
 		break;
 	}
 
-	/* send reply */
-	nc_session_send_reply(client->nc_sess, rpc, rpc_reply);
-	nc_reply_free(rpc_reply);
-	nc_rpc_free(rpc);
-
-	/* so that we do not free the client before
-	 * this reply gets sent
-	 */
-	if (closing) {
-		nc_verb_verbose("Freeing session for '%s'", client->username);
-		nc_session_free(client->nc_sess);
-		client->nc_sess = NULL;
+	/* replied right away, it is sent the same way as the replies of the workers */
+	if ((client->rpc_job = np_rpc_job_reply((struct client_struct*)client, client->nc_sess, rpc, rpc_reply, &recv_time)) == NULL) {
+		nc_reply_free(rpc_reply);
+		nc_rpc_free(rpc);
 		client->to_free = 1;
+		return 1;
 	}
+	tls_client_reply(client);
 
 	return skip_sleep;
 }
 
 /* return: 0 - nothing happened (sleep), 1 - something happened (skip sleep) */
-int np_tls_client_transport(struct client_struct_tls* client) {
-	struct timeval cur_time;
-	int skip_sleep = 0;
+int np_tls_client_transport(struct client_struct_tls* client, int expired) {
+	uint64_t now, deadline;
 
 	if (quit) {
-		if (client->nc_sess != NULL) {
+		/* a session with an RPC being processed is freed after the worker finishes */
+		if (client->nc_sess != NULL && client->rpc_job == NULL) {
 			nc_verb_verbose("Freeing session for '%s'", client->username);
+			np_sess_index_del(client->nc_sess);
+			np_notif_unsubscribe(client->notif_sub);
+			client->notif_sub = NULL;
 			nc_session_free(client->nc_sess);
 			client->nc_sess = NULL;
 		}
 		client->to_free = 1;
 	}
 
-	if (client->to_free || client->nc_sess == NULL) {
+	if (client->to_free) {
 		return 1;
 	}
 
-	gettimeofday(&cur_time, NULL);
+	/* check the session for idle timeout, only when the client timer expires */
+	if (expired) {
+		now = np_clock_msec();
+		if (client->nc_sess == NULL) {
+			/* the last RPC time is the end of the handshake until the hello */
+			deadline = client->last_rpc_time + netopeer_options.hello_timeout * 1000ULL;
+			if (now >= deadline) {
+				nc_verb_warning("Client '%s' did not send the hello for too long, disconnecting.", client->username);
+				client->to_free = 1;
+				return 1;
+			}
+			np_engine_timer((struct client_struct*)client, deadline);
+			return 0;
+		}
 
-	/* check the session for idle timeout */
-	if (timeval_diff(cur_time, client->last_rpc_time) >= netopeer_options.idle_timeout) {
-		/* check for active event subscriptions, in that case we can never disconnect an idle session */
-		if (client->nc_sess == NULL || !ncntf_session_get_active_subscription(client->nc_sess)) {
-			nc_verb_warning("Session of client '%s' did not send/receive an RPC for too long, disconnecting.", client->username);
-			client->to_free = 1;
-			++skip_sleep;
+		deadline = client->last_rpc_time + netopeer_options.idle_timeout * 1000ULL;
+		if (now >= deadline) {
+			/* check for active event subscriptions, in that case we can never disconnect an idle session */
+			if (client->notif_sub == NULL && !ncntf_session_get_active_subscription(client->nc_sess)) {
+				nc_verb_warning("Session of client '%s' did not send/receive an RPC for too long, disconnecting.", client->username);
+				client->to_free = 1;
+				return 1;
+			}
+			deadline = now + netopeer_options.idle_timeout * 1000ULL;
 		}
+		np_engine_timer((struct client_struct*)client, deadline);
 	}
 
-	return skip_sleep;
+	return 0;
 }
 
 void np_tls_thread_cleanup(void) {
@@ -1031,92 +1087,450 @@ void np_tls_init(void) {
 
 	netopeer_state.tls_state = calloc(1, sizeof(struct np_state_tls));
 	tls_thread_setup();
+
+	/* index of the client structure in the TLS-specific data, for the verify callback */
+	netopeer_state.tls_state->tls_client_idx = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+
+	pthread_mutex_init(&netopeer_state.tls_state->session_lock, NULL);
+	netopeer_state.tls_state->sessions = calloc(TLS_SESSION_BUCKETS, sizeof *netopeer_state.tls_state->sessions);
+	netopeer_state.tls_state->peers = calloc(TLS_SESSION_BUCKETS, sizeof *netopeer_state.tls_state->peers);
 }
 
-SSL_CTX* np_tls_server_id_check(SSL_CTX* tlsctx) {
-	SSL_CTX* ret;
-	X509* cert;
-	EVP_PKEY* key;
-	X509_STORE* trusted_store;
-	struct np_trusted_cert* trusted_cert;
+static unsigned int tls_session_bucket(const unsigned char* id, unsigned int id_len) {
+	unsigned int hash = 2166136261u, i;
+
+	for (i = 0; i < id_len; ++i) {
+		hash = (hash ^ id[i]) * 16777619u;
+	}
+
+	return hash % TLS_SESSION_BUCKETS;
+}
+
+/* SESSION LOCK must be held */
+static void tls_session_unlink(struct np_tls_session* session) {
+	struct np_tls_session** bucket;
+
+	for (bucket = &netopeer_state.tls_state->sessions[tls_session_bucket(session->id, session->id_len)]; *bucket != session; bucket = &(*bucket)->next);
+	*bucket = session->next;
+
+	if (session->newer != NULL) {
+		session->newer->older = session->older;
+	} else {
+		netopeer_state.tls_state->sessions_newest = session->older;
+	}
+	if (session->older != NULL) {
+		session->older->newer = session->newer;
+	} else {
+		netopeer_state.tls_state->sessions_oldest = session->newer;
+	}
+	--netopeer_state.tls_state->session_count;
+
+	free(session->der);
+	free(session);
+}
+
+/* SESSION LOCK must be held */
+static struct np_tls_session* tls_session_find(const unsigned char* id, unsigned int id_len) {
+	struct np_tls_session* session;
 
-	/* Check server keys for a change */
-	if (netopeer_options.tls_opts->tls_ctx_change_flag || tlsctx == NULL) {
-		SSL_CTX_free(tlsctx);
-		if ((ret = SSL_CTX_new(TLSv1_2_server_method())) == NULL) {
-			nc_verb_error("%s: failed to create SSL context", __func__);
-			return NULL;
+	for (session = netopeer_state.tls_state->sessions[tls_session_bucket(id, id_len)]; session != NULL; session = session->next) {
+		if (session->id_len == id_len && memcmp(session->id, id, id_len) == 0) {
+			return session;
 		}
-		SSL_CTX_set_verify(ret, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, tls_verify_callback);
+	}
+
+	return NULL;
+}
+
+/* return: 0 - session is kept by the server, OpenSSL keeps ownership of the session */
+static int tls_session_new_cb(SSL* tls, SSL_SESSION* sess) {
+	struct np_tls_session* session;
+	const unsigned char* id;
+	unsigned char* der;
+	unsigned int id_len;
+
+	id = SSL_SESSION_get_id(sess, &id_len);
+	if (id_len == 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH) {
+		return 0;
+	}
+
+	if ((session = calloc(1, sizeof *session)) == NULL) {
+		nc_verb_error("%s: memory allocation failed (%s)", __func__, strerror(errno));
+		return 0;
+	}
+	memcpy(session->id, id, id_len);
+	session->id_len = id_len;
+	session->der_len = i2d_SSL_SESSION(sess, NULL);
+	if (session->der_len <= 0) {
+		free(session);
+		return 0;
+	}
+	if ((session->der = der = malloc(session->der_len)) == NULL) {
+		nc_verb_error("%s: memory allocation failed (%s)", __func__, strerror(errno));
+		free(session);
+		return 0;
+	}
+	i2d_SSL_SESSION(sess, &der);
+	session->expires = time(NULL) + SSL_CTX_get_timeout(SSL_get_SSL_CTX(tls));
+
+	/* SESSION LOCK */
+	pthread_mutex_lock(&netopeer_state.tls_state->session_lock);
+
+	if (netopeer_state.tls_state->session_cache_size == 0) {
+		/* SESSION UNLOCK */
+		pthread_mutex_unlock(&netopeer_state.tls_state->session_lock);
+		free(session->der);
+		free(session);
+		return 0;
+	}
+
+	/* make room by evicting the oldest sessions */
+	while (netopeer_state.tls_state->session_count >= netopeer_state.tls_state->session_cache_size) {
+		tls_session_unlink(netopeer_state.tls_state->sessions_oldest);
+	}
+
+	session->next = netopeer_state.tls_state->sessions[tls_session_bucket(id, id_len)];
+	netopeer_state.tls_state->sessions[tls_session_bucket(id, id_len)] = session;
+	session->older = netopeer_state.tls_state->sessions_newest;
+	if (session->older != NULL) {
+		session->older->newer = session;
+	} else {
+		netopeer_state.tls_state->sessions_oldest = session;
+	}
+	netopeer_state.tls_state->sessions_newest = session;
+	++netopeer_state.tls_state->session_count;
+
+	/* SESSION UNLOCK */
+	pthread_mutex_unlock(&netopeer_state.tls_state->session_lock);
+
+	return 0;
+}
+
+static SSL_SESSION* tls_session_get_cb(SSL* UNUSED(tls), unsigned char* id, int id_len, int* copy) {
+	struct np_tls_session* session;
+	SSL_SESSION* sess = NULL;
+	const unsigned char* der;
 
-		/* TLS_CTX LOCK */
-		pthread_mutex_lock(&netopeer_options.tls_opts->tls_ctx_lock);
+	*copy = 0;
 
-		if (netopeer_options.tls_opts->server_cert == NULL || netopeer_options.tls_opts->server_key == NULL) {
-			nc_verb_warning("Server certificate and/or private key not set, client TLS verification will fail.");
+	/* SESSION LOCK */
+	pthread_mutex_lock(&netopeer_state.tls_state->session_lock);
+
+	session = tls_session_find(id, id_len);
+	if (session != NULL) {
+		if (session->expires <= time(NULL)) {
+			tls_session_unlink(session);
 		} else {
-			cert = base64der_to_cert(netopeer_options.tls_opts->server_cert);
-			if (cert == NULL || SSL_CTX_use_certificate(ret, cert) != 1) {
-				nc_verb_error("Loading the server certificate failed (%s).", ERR_reason_error_string(ERR_get_error()));
-			}
-			X509_free(cert);
+			der = session->der;
+			sess = d2i_SSL_SESSION(NULL, &der, session->der_len);
+		}
+	}
+
+	/* SESSION UNLOCK */
+	pthread_mutex_unlock(&netopeer_state.tls_state->session_lock);
+
+	return sess;
+}
+
+static void tls_session_remove_cb(SSL_CTX* UNUSED(tlsctx), SSL_SESSION* sess) {
+	struct np_tls_session* session;
+	const unsigned char* id;
+	unsigned int id_len;
+
+	id = SSL_SESSION_get_id(sess, &id_len);
+
+	/* SESSION LOCK */
+	pthread_mutex_lock(&netopeer_state.tls_state->session_lock);
+
+	if ((session = tls_session_find(id, id_len)) != NULL) {
+		tls_session_unlink(session);
+	}
+
+	/* SESSION UNLOCK */
+	pthread_mutex_unlock(&netopeer_state.tls_state->session_lock);
+}
+
+/* SESSION LOCK must be held */
+static void tls_ticket_key_rotate(time_t timeout) {
+	struct np_tls_ticket_key* keys = netopeer_state.tls_state->ticket_keys;
+	time_t now = time(NULL);
+
+	if (keys[0].created != 0 && keys[0].created + timeout > now) {
+		return;
+	}
+
+	keys[1] = keys[0];
+	if (RAND_bytes(keys[0].name, sizeof keys[0].name) != 1 || RAND_bytes(keys[0].hmac_key, sizeof keys[0].hmac_key) != 1
+			|| RAND_bytes(keys[0].aes_key, sizeof keys[0].aes_key) != 1) {
+		nc_verb_error("%s: generating a session ticket key failed (%s)", __func__, ERR_reason_error_string(ERR_get_error()));
+		keys[0].created = 0;
+		return;
+	}
+	keys[0].created = now;
+}
+
+/* return: -1 - error, 0 - no key (full handshake), 1 - success, 2 - success, renew the ticket */
+static int tls_ticket_key_cb(SSL* tls, unsigned char* key_name, unsigned char* iv, EVP_CIPHER_CTX* cipher_ctx, HMAC_CTX* hmac_ctx, int enc) {
+	struct np_tls_ticket_key key;
+	int i, ret = 1;
+
+	/* SESSION LOCK */
+	pthread_mutex_lock(&netopeer_state.tls_state->session_lock);
 
-			key = base64der_to_privatekey(netopeer_options.tls_opts->server_key, netopeer_options.tls_opts->server_key_type);
-			if (key == NULL || SSL_CTX_use_PrivateKey(ret, key) != 1) {
-				nc_verb_error("Loading the server key failed (%s).", ERR_reason_error_string(ERR_get_error()));
+	if (enc) {
+		tls_ticket_key_rotate(SSL_CTX_get_timeout(SSL_get_SSL_CTX(tls)));
+		key = netopeer_state.tls_state->ticket_keys[0];
+	} else {
+		for (i = 0; i < 2; ++i) {
+			key = netopeer_state.tls_state->ticket_keys[i];
+			if (key.created != 0 && memcmp(key.name, key_name, sizeof key.name) == 0) {
+				break;
 			}
-			EVP_PKEY_free(key);
 		}
+		if (i == 2) {
+			key.created = 0;
+		} else if (i == 1) {
+			/* issued with the previous key */
+			ret = 2;
+		}
+	}
+
+	/* SESSION UNLOCK */
+	pthread_mutex_unlock(&netopeer_state.tls_state->session_lock);
+
+	if (key.created == 0) {
+		return (enc ? -1 : 0);
+	}
 
-		if (netopeer_options.tls_opts->trusted_certs == NULL) {
-			nc_verb_warning("No trusted certificates set, for TLS verification to pass at least the server certificate CA chain must be trusted.");
+	if (enc) {
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_128_cbc())) != 1) {
+			return -1;
+		}
+		memcpy(key_name, key.name, sizeof key.name);
+		EVP_EncryptInit_ex(cipher_ctx, EVP_aes_128_cbc(), NULL, key.aes_key, iv);
+	} else {
+		EVP_DecryptInit_ex(cipher_ctx, EVP_aes_128_cbc(), NULL, key.aes_key, iv);
+	}
+	HMAC_Init_ex(hmac_ctx, key.hmac_key, sizeof key.hmac_key, EVP_sha256(), NULL);
+
+	return ret;
+}
+
+static unsigned int tls_peer_bucket(const unsigned char* digest) {
+	return ((digest[0] << 8) | digest[1]) % TLS_SESSION_BUCKETS;
+}
+
+/* remember the username of a fully verified client certificate for the resumed sessions */
+static void tls_peer_remember(X509* cert, const char* username, time_t timeout) {
+	struct np_tls_peer* peer, **next;
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	unsigned int digest_len;
+	time_t now = time(NULL);
+
+	if (cert == NULL || username == NULL || X509_digest(cert, EVP_sha256(), digest, &digest_len) != 1) {
+		return;
+	}
+
+	/* SESSION LOCK */
+	pthread_mutex_lock(&netopeer_state.tls_state->session_lock);
+
+	for (next = &netopeer_state.tls_state->peers[tls_peer_bucket(digest)]; (peer = *next) != NULL;) {
+		if (peer->expires <= now || memcmp(peer->digest, digest, sizeof digest) == 0) {
+			*next = peer->next;
+			free(peer->username);
+			free(peer);
 		} else {
-			trusted_store = X509_STORE_new();
+			next = &peer->next;
+		}
+	}
 
-			for (trusted_cert = netopeer_options.tls_opts->trusted_certs; trusted_cert != NULL; trusted_cert = trusted_cert->next) {
-				if (trusted_cert->client_cert) {
-					continue;
-				}
-				cert = base64der_to_cert(trusted_cert->cert);
-				if (cert == NULL) {
-					nc_verb_error("Loading a trusted certificate failed (%s).", ERR_reason_error_string(ERR_get_error()));
-					continue;
-				}
-				X509_STORE_add_cert(trusted_store, cert);
-				X509_free(cert);
-			}
+	if ((peer = malloc(sizeof *peer)) == NULL || (peer->username = strdup(username)) == NULL) {
+		/* SESSION UNLOCK */
+		pthread_mutex_unlock(&netopeer_state.tls_state->session_lock);
+		nc_verb_error("%s: memory allocation failed (%s)", __func__, strerror(errno));
+		free(peer);
+		return;
+	}
+	memcpy(peer->digest, digest, sizeof digest);
+	peer->expires = now + timeout;
+	peer->next = netopeer_state.tls_state->peers[tls_peer_bucket(digest)];
+	netopeer_state.tls_state->peers[tls_peer_bucket(digest)] = peer;
+
+	/* SESSION UNLOCK */
+	pthread_mutex_unlock(&netopeer_state.tls_state->session_lock);
+}
+
+/* return: 0 - username assigned, 1 - the username of the resumed session is not known */
+static int tls_peer_username(struct client_struct_tls* client) {
+	struct np_tls_peer* peer;
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	unsigned int digest_len;
+	CTN_MAP_TYPE map_type;
+	char* name = NULL;
+
+	X509_free(client->cert);
+	client->cert = SSL_get_peer_certificate(client->tls);
+	if (client->cert == NULL || X509_digest(client->cert, EVP_sha256(), digest, &digest_len) != 1) {
+		return 1;
+	}
+
+	/* SESSION LOCK */
+	pthread_mutex_lock(&netopeer_state.tls_state->session_lock);
 
-			SSL_CTX_set_cert_store(ret, trusted_store);
-			trusted_store = NULL;
+	for (peer = netopeer_state.tls_state->peers[tls_peer_bucket(digest)]; peer != NULL; peer = peer->next) {
+		if (peer->expires > time(NULL) && memcmp(peer->digest, digest, sizeof digest) == 0) {
+			client->username = strdup(peer->username);
+			break;
 		}
+	}
 
-		netopeer_options.tls_opts->tls_ctx_change_flag = 0;
+	/* SESSION UNLOCK */
+	pthread_mutex_unlock(&netopeer_state.tls_state->session_lock);
 
-		/* TLS_CTX UNLOCK */
-		pthread_mutex_unlock(&netopeer_options.tls_opts->tls_ctx_lock);
-	} else {
-		ret = tlsctx;
+	if (client->username != NULL) {
+		return 0;
 	}
 
-	return ret;
+	/* forgotten, only the client certificate itself is available */
+	if (tls_cert_to_name(client->cert, &map_type, &name) != 0) {
+		return 1;
+	}
+	if (map_type == CTN_MAP_TYPE_SPECIFIED) {
+		client->username = name;
+	} else if (tls_ctn_get_username_from_cert(client->cert, map_type, &client->username) != 0) {
+		return 1;
+	}
+
+	return 0;
 }
 
-int np_tls_session_count(void) {
-	struct client_struct_tls* client;
-	int count = 0;
+void np_tls_session_flush(void) {
+	struct np_tls_session* session;
+	struct np_tls_peer* peer;
+	unsigned int i;
 
-	for (client = (struct client_struct_tls*)netopeer_state.clients; client != NULL; client = (struct client_struct_tls*)client->next) {
-		if (client->transport != NC_TRANSPORT_TLS) {
-			continue;
+	if (netopeer_state.tls_state == NULL) {
+		/* not initialized yet */
+		return;
+	}
+
+	/* SESSION LOCK */
+	pthread_mutex_lock(&netopeer_state.tls_state->session_lock);
+
+	while ((session = netopeer_state.tls_state->sessions_oldest) != NULL) {
+		tls_session_unlink(session);
+	}
+	for (i = 0; i < TLS_SESSION_BUCKETS; ++i) {
+		while ((peer = netopeer_state.tls_state->peers[i]) != NULL) {
+			netopeer_state.tls_state->peers[i] = peer->next;
+			free(peer->username);
+			free(peer);
 		}
-		++count;
 	}
+	memset(netopeer_state.tls_state->ticket_keys, 0, sizeof netopeer_state.tls_state->ticket_keys);
 
-	return count;
+	/* SESSION UNLOCK */
+	pthread_mutex_unlock(&netopeer_state.tls_state->session_lock);
+}
+
+void np_tls_server_id_ref(SSL_CTX* tlsctx) {
+	CRYPTO_add(&tlsctx->references, 1, CRYPTO_LOCK_SSL_CTX);
+}
+
+SSL_CTX* np_tls_server_id_new(void) {
+	SSL_CTX* ret;
+	X509* cert;
+	EVP_PKEY* key;
+	X509_STORE* trusted_store;
+	struct np_trusted_cert* trusted_cert;
+
+	if ((ret = SSL_CTX_new(TLSv1_2_server_method())) == NULL) {
+		nc_verb_error("%s: failed to create SSL context", __func__);
+		return NULL;
+	}
+	SSL_CTX_set_verify(ret, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, tls_verify_callback);
+	SSL_CTX_set_session_id_context(ret, (unsigned char*)"netopeer", 8);
+
+	/* TLS_CTX LOCK */
+	pthread_mutex_lock(&netopeer_options.tls_opts->tls_ctx_lock);
+
+	/* changes made from now on are picked up by the next context */
+	netopeer_options.tls_opts->tls_ctx_change_flag = 0;
+
+	/* the sessions and ticket keys are kept outside the context to survive its rebuilds */
+	SSL_CTX_set_timeout(ret, netopeer_options.tls_opts->session_timeout);
+	if (netopeer_options.tls_opts->session_cache_size) {
+		SSL_CTX_set_session_cache_mode(ret, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+		SSL_CTX_sess_set_new_cb(ret, tls_session_new_cb);
+		SSL_CTX_sess_set_get_cb(ret, tls_session_get_cb);
+		SSL_CTX_sess_set_remove_cb(ret, tls_session_remove_cb);
+	} else {
+		SSL_CTX_set_session_cache_mode(ret, SSL_SESS_CACHE_OFF);
+	}
+	if (netopeer_options.tls_opts->session_tickets) {
+		SSL_CTX_set_tlsext_ticket_key_cb(ret, tls_ticket_key_cb);
+	} else {
+		SSL_CTX_set_options(ret, SSL_OP_NO_TICKET);
+	}
+
+	/* SESSION LOCK */
+	pthread_mutex_lock(&netopeer_state.tls_state->session_lock);
+
+	netopeer_state.tls_state->session_cache_size = netopeer_options.tls_opts->session_cache_size;
+	while (netopeer_state.tls_state->session_count > netopeer_state.tls_state->session_cache_size) {
+		tls_session_unlink(netopeer_state.tls_state->sessions_oldest);
+	}
+
+	/* SESSION UNLOCK */
+	pthread_mutex_unlock(&netopeer_state.tls_state->session_lock);
+
+	if (netopeer_options.tls_opts->server_cert == NULL || netopeer_options.tls_opts->server_key == NULL) {
+		nc_verb_warning("Server certificate and/or private key not set, client TLS verification will fail.");
+	} else {
+		cert = np_tls_base64der_to_cert(netopeer_options.tls_opts->server_cert);
+		if (cert == NULL || SSL_CTX_use_certificate(ret, cert) != 1) {
+			nc_verb_error("Loading the server certificate failed (%s).", ERR_reason_error_string(ERR_get_error()));
+		}
+		X509_free(cert);
+
+		key = base64der_to_privatekey(netopeer_options.tls_opts->server_key, netopeer_options.tls_opts->server_key_type);
+		if (key == NULL || SSL_CTX_use_PrivateKey(ret, key) != 1) {
+			nc_verb_error("Loading the server key failed (%s).", ERR_reason_error_string(ERR_get_error()));
+		}
+		EVP_PKEY_free(key);
+	}
+
+	if (netopeer_options.tls_opts->trusted_certs == NULL) {
+		nc_verb_warning("No trusted certificates set, for TLS verification to pass at least the server certificate CA chain must be trusted.");
+	} else {
+		trusted_store = X509_STORE_new();
+
+		for (trusted_cert = netopeer_options.tls_opts->trusted_certs; trusted_cert != NULL; trusted_cert = trusted_cert->next) {
+			/* decoded by the configuration callback, the failures were reported there */
+			if (trusted_cert->client_cert || trusted_cert->x509 == NULL) {
+				continue;
+			}
+			X509_STORE_add_cert(trusted_store, trusted_cert->x509);
+		}
+
+		SSL_CTX_set_cert_store(ret, trusted_store);
+		trusted_store = NULL;
+	}
+
+	/* TLS_CTX UNLOCK */
+	pthread_mutex_unlock(&netopeer_options.tls_opts->tls_ctx_lock);
+
+	return ret;
 }
 
 int np_tls_create_client(struct client_struct_tls* new_client, SSL_CTX* tlsctx) {
-	int ret;
+	int flags;
+
+	/* Call Home sockets are still blocking */
+	if (((flags = fcntl(new_client->sock, F_GETFL)) == -1) || (fcntl(new_client->sock, F_SETFL, flags | O_NONBLOCK) == -1)) {
+		nc_verb_error("%s: fcntl failed (%s)", __func__, strerror(errno));
+		return 1;
+	}
 
 	new_client->tls = SSL_new(tlsctx);
 	if (new_client->tls == NULL) {
@@ -1127,24 +1541,68 @@ int np_tls_create_client(struct client_struct_tls* new_client, SSL_CTX* tlsctx)
 	SSL_set_fd(new_client->tls, new_client->sock);
 	SSL_set_mode(new_client->tls, SSL_MODE_AUTO_RETRY);
 
-	/* generate new index for TLS-specific data, for the verify callback */
-	netopeer_state.tls_state->last_tls_idx = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
-	SSL_set_ex_data(new_client->tls, netopeer_state.tls_state->last_tls_idx, new_client);
+	/* for the verify callback */
+	SSL_set_ex_data(new_client->tls, netopeer_state.tls_state->tls_client_idx, new_client);
+	SSL_set_accept_state(new_client->tls);
 
-	while (((ret = SSL_accept(new_client->tls)) == -1) && (SSL_get_error(new_client->tls, ret) == SSL_ERROR_WANT_READ)) {
-		usleep(READ_SLEEP);
-	}
-	if (ret != 1) {
-		nc_verb_error("TLS accept failed (%s).", ERR_reason_error_string(ERR_get_error()));
+	/* the handshake is performed by the engine whenever the socket is ready */
+	clock_gettime(CLOCK_MONOTONIC, &new_client->conn_time);
+	new_client->last_rpc_time = np_clock_msec();
+	new_client->handshake = NP_HANDSHAKE_WANT_READ;
+
+	return 0;
+}
+
+/* return: 0 - nothing happened or still in progress, 1 - handshake finished */
+int np_tls_client_handshake(struct client_struct_tls* client, int expired) {
+	uint64_t conn_msec;
+	int ret;
+
+	ret = SSL_accept(client->tls);
+	if (ret == 1) {
+		if (SSL_session_reused(client->tls)) {
+			if (tls_peer_username(client) != 0) {
+				nc_verb_error("Cert-to-name unsuccessful for a resumed TLS session, dropping the client.");
+				np_stats_auth_failure(NC_TRANSPORT_TLS);
+				SSL_CTX_remove_session(SSL_get_SSL_CTX(client->tls), SSL_get_session(client->tls));
+				client->to_free = 1;
+				return 0;
+			}
+			__sync_add_and_fetch(&netopeer_state.tls_state->resumed_handshakes, 1);
+		} else {
+			tls_peer_remember(client->cert, client->username, SSL_CTX_get_timeout(SSL_get_SSL_CTX(client->tls)));
+			__sync_add_and_fetch(&netopeer_state.tls_state->full_handshakes, 1);
+		}
+		np_stats_hist_add(&netopeer_stats.tls_handshake, &client->conn_time);
+
+		client->handshake = NP_HANDSHAKE_DONE;
+		client->last_rpc_time = np_clock_msec();
+		np_engine_timer((struct client_struct*)client, client->last_rpc_time + netopeer_options.hello_timeout * 1000ULL);
 		return 1;
 	}
 
-	if (fcntl(new_client->sock, F_SETFL, O_NONBLOCK) != 0) {
-		nc_verb_error("%s: fcntl failed (%s)", __func__, strerror(errno));
-		return 1;
+	switch (SSL_get_error(client->tls, ret)) {
+	case SSL_ERROR_WANT_READ:
+		client->handshake = NP_HANDSHAKE_WANT_READ;
+		break;
+	case SSL_ERROR_WANT_WRITE:
+		client->handshake = NP_HANDSHAKE_WANT_WRITE;
+		break;
+	default:
+		nc_verb_error("TLS accept failed (%s).", ERR_reason_error_string(ERR_get_error()));
+		client->to_free = 1;
+		return 0;
 	}
 
-	gettimeofday((struct timeval*)&new_client->last_rpc_time, NULL);
+	if (expired) {
+		conn_msec = np_timespec_msec(&client->conn_time);
+		if (np_clock_msec() >= conn_msec + HANDSHAKE_TIMEOUT * 1000) {
+			nc_verb_warning("TLS handshake took too long, dropping a client.");
+			client->to_free = 1;
+		} else {
+			np_engine_timer((struct client_struct*)client, conn_msec + HANDSHAKE_TIMEOUT * 1000);
+		}
+	}
 
 	return 0;
 }
@@ -1160,6 +1618,10 @@ void np_tls_cleanup(void) {
 	ERR_remove_thread_state(&crypto_tid);
 
 	tls_thread_cleanup();
+	np_tls_session_flush();
+	pthread_mutex_destroy(&netopeer_state.tls_state->session_lock);
+	free(netopeer_state.tls_state->sessions);
+	free(netopeer_state.tls_state->peers);
 	free(netopeer_state.tls_state);
 	netopeer_state.tls_state = NULL;
 }
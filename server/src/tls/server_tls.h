@@ -40,7 +40,9 @@
 #define _SERVER_TLS_H_
 
 #include <openssl/ssl.h>
+#include <openssl/sha.h>
 #include <pthread.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <libnetconf.h>
 
@@ -50,38 +52,106 @@ struct client_struct_tls {
 
 	int sock;
 	struct sockaddr_storage saddr;
-	pthread_t tid;
 	char* username;
 	volatile int to_free;
 	struct client_struct* next;
-
+	struct client_struct* prev;
+
+	int ev_flags;
+	struct client_struct* ev_next;
+	struct ch_app* callhome;
+	int rpc_jobs;
+	int handshake;
+	uint64_t tm_deadline;
+	struct client_struct* tm_next;
+	struct client_struct* tm_prev;
+
+	struct timespec conn_time;			// monotonic timestamp of the new connection
 	SSL* tls;
 	X509* cert;
 	struct nc_session* nc_sess;
-	volatile struct timeval last_rpc_time;	// timestamp of the last RPC either in or out
+	struct np_rpc_job* rpc_job;			// RPC being processed by a worker
+	struct np_subscriber* notif_sub;	// subscription served by the notification dispatcher
+	volatile uint64_t last_rpc_time;	// monotonic msecs of the last RPC either in or out
+};
+
+/* serialized session in the server-side session cache */
+struct np_tls_session {
+	unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+	unsigned int id_len;
+	unsigned char* der;
+	int der_len;
+	time_t expires;
+	struct np_tls_session* next;		/* hash bucket */
+	struct np_tls_session* newer;		/* eviction order */
+	struct np_tls_session* older;
+};
+
+/* username of a client certificate, a resumed session is not verified again */
+struct np_tls_peer {
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	char* username;
+	time_t expires;
+	struct np_tls_peer* next;
+};
+
+struct np_tls_ticket_key {
+	unsigned char name[16];
+	unsigned char hmac_key[16];
+	unsigned char aes_key[16];
+	time_t created;						/* 0 - key not valid */
 };
 
 struct np_state_tls {
-	int last_tls_idx;
+	int tls_client_idx;
 	pthread_mutex_t* tls_mutex_buf;
+
+	/* session resumption state, it outlives the SSL_CTX rebuilds */
+	pthread_mutex_t session_lock;
+	struct np_tls_session** sessions;		/* TLS_SESSION_BUCKETS buckets */
+	struct np_tls_session* sessions_newest;
+	struct np_tls_session* sessions_oldest;
+	unsigned int session_count;
+	unsigned int session_cache_size;
+	struct np_tls_peer** peers;			/* TLS_SESSION_BUCKETS buckets */
+	struct np_tls_ticket_key ticket_keys[2];	/* current and previous key */
+
+	volatile unsigned long full_handshakes;
+	volatile unsigned long resumed_handshakes;
 };
 
 int np_tls_client_netconf_rpc(struct client_struct_tls* client);
 
-int np_tls_client_transport(struct client_struct_tls* client);
+int np_tls_client_transport(struct client_struct_tls* client, int expired);
 
 void np_tls_thread_cleanup(void);
 
 void np_tls_init(void);
 
-SSL_CTX* np_tls_server_id_check(SSL_CTX* ctx);
+void np_tls_server_id_ref(SSL_CTX* tlsctx);
 
-int np_tls_session_count(void);
+/**
+ * @brief Decode a certificate in the base64-encoded DER format
+ *
+ * @param in Encoded certificate
+ *
+ * @return Certificate, NULL on error with the SSL error set.
+ */
+X509* np_tls_base64der_to_cert(const char* in);
+
+SSL_CTX* np_tls_server_id_new(void);
+
+/**
+ * @brief Forget all the resumable TLS sessions and invalidate the issued session tickets
+ */
+void np_tls_session_flush(void);
 
 int np_tls_kill_session(const char* sid, struct client_struct_tls* cur_client);
 
 int np_tls_create_client(struct client_struct_tls* new_client, SSL_CTX* tlsctx);
 
+int np_tls_client_handshake(struct client_struct_tls* client, int expired);
+
 void np_tls_cleanup(void);
 
 void client_free_tls(struct client_struct_tls* client);
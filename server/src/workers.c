@@ -0,0 +1,414 @@
+/**
+ * @file workers.c
+ * @brief Netopeer server RPC worker pool
+ *
+ * Copyright (C) 2015 CESNET, z.s.p.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of the Company nor the names of its contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * ALTERNATIVELY, provided that this notice is retained in full, this
+ * product may be distributed under the terms of the GNU General Public
+ * License (GPL) version 2 or later, in which case the provisions
+ * of the GPL apply INSTEAD OF those given above.
+ *
+ * This software is provided ``as is, and any express or implied
+ * warranties, including, but not limited to, the implied warranties of
+ * merchantability and fitness for a particular purpose are disclaimed.
+ * In no event shall the company or contributors be liable for any
+ * direct, indirect, incidental, special, exemplary, or consequential
+ * damages (including, but not limited to, procurement of substitute
+ * goods or services; loss of use, data, or profits; or business
+ * interruption) however caused and on any theory of liability, whether
+ * in contract, strict liability, or tort (including negligence or
+ * otherwise) arising in any way out of the use of this software, even
+ * if advised of the possibility of such damage.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libnetconf_xml.h>
+
+#include "server.h"
+
+static const char rcsid[] __attribute__((used)) ="$Id: "__FILE__": "RCSID" $";
+
+/* RPCs queued by the sessions of a single user */
+struct np_rpc_flow {
+	char* username;
+	unsigned int weight;				// RPCs taken in a single turn
+	unsigned int taken;					// RPCs taken in the current turn
+	struct np_rpc_job* head;
+	struct np_rpc_job* tail;
+	struct np_rpc_flow* next;			// ring of the flows with queued RPCs
+	struct np_rpc_flow* prev;
+};
+
+/*
+ * Fixed number of threads applying the received RPCs on the datastores.
+ * Every session has at most one RPC queued (it does not read another one
+ * until the reply is sent), so the queue is bounded by the number of
+ * sessions and the replies are sent in the order of the requests.
+ *
+ * The RPCs are queued per user and the users take turns, each one gets
+ * as many RPCs applied in its turn as is its weight. A user with many
+ * sessions thus cannot starve the others. An RPC delayed by the rate
+ * limits is skipped until it is due.
+ */
+static struct {
+	/* WORKERS LOCK */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t exit_cond;
+	pthread_cond_t idle_cond;
+	struct np_rpc_flow* flows;			// the flow whose turn it is
+	unsigned int queued;
+	unsigned int target;
+	unsigned int running;
+	unsigned int busy;					// workers applying an RPC right now
+	int paused;							// no new RPCs are taken from the queue
+} workers = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.exit_cond = PTHREAD_COND_INITIALIZER,
+	.idle_cond = PTHREAD_COND_INITIALIZER
+};
+
+static nc_reply* worker_apply_rpc(struct nc_session* session, nc_rpc* rpc) {
+	nc_reply* reply;
+	struct nc_err* err;
+
+	if ((reply = ncds_apply_rpc2all(session, rpc, NULL)) == NULL) {
+		err = nc_err_new(NC_ERR_OP_FAILED);
+		nc_err_set(err, NC_ERR_PARAM_MSG, "For unknown reason no reply was returned by the library.");
+		reply = nc_reply_error(err);
+	} else if (reply == NCDS_RPC_NOT_APPLICABLE) {
+		err = nc_err_new(NC_ERR_OP_FAILED);
+		nc_err_set(err, NC_ERR_PARAM_MSG, "There is no device/data that could be affected.");
+		nc_reply_free(reply);
+		reply = nc_reply_error(err);
+	}
+
+	return reply;
+}
+
+/* WORKERS LOCK must be held */
+static void flow_unlink(struct np_rpc_flow* flow) {
+	if (flow->next == flow) {
+		workers.flows = NULL;
+	} else {
+		flow->prev->next = flow->next;
+		flow->next->prev = flow->prev;
+		if (workers.flows == flow) {
+			workers.flows = flow->next;
+		}
+	}
+
+	free(flow->username);
+	free(flow);
+}
+
+/* WORKERS LOCK must be held, return: the next due job, NULL and the time the first one is due if none */
+static struct np_rpc_job* workers_pick(uint64_t now, uint64_t* due) {
+	struct np_rpc_flow* flow;
+	struct np_rpc_job** job, *prev, *ret;
+
+	*due = 0;
+	if ((flow = workers.flows) == NULL) {
+		return NULL;
+	}
+
+	do {
+		for (job = &flow->head, prev = NULL; *job != NULL; prev = *job, job = &(*job)->next) {
+			if ((*job)->not_before > now) {
+				if (*due == 0 || (*job)->not_before < *due) {
+					*due = (*job)->not_before;
+				}
+				continue;
+			}
+
+			ret = *job;
+			*job = ret->next;
+			if (flow->tail == ret) {
+				flow->tail = prev;
+			}
+			ret->next = NULL;
+			--workers.queued;
+
+			/* the turn passes to the next user once the weight is used up */
+			if (++flow->taken >= flow->weight) {
+				flow->taken = 0;
+				workers.flows = flow->next;
+			} else {
+				workers.flows = flow;
+			}
+			if (flow->head == NULL) {
+				flow_unlink(flow);
+			}
+			return ret;
+		}
+
+		/* nothing due, skip the turn */
+		flow->taken = 0;
+		flow = flow->next;
+	} while (flow != workers.flows);
+
+	return NULL;
+}
+
+static void* worker_thread(void* UNUSED(arg)) {
+	struct np_rpc_job* job;
+	nc_reply* reply;
+	struct timespec ts;
+	uint64_t now, due;
+
+	/* WORKERS LOCK */
+	pthread_mutex_lock(&workers.lock);
+	while (workers.running <= workers.target) {
+		if (workers.flows == NULL || workers.paused) {
+			pthread_cond_wait(&workers.cond, &workers.lock);
+			continue;
+		}
+
+		now = np_clock_msec();
+		if ((job = workers_pick(now, &due)) == NULL) {
+			/* only delayed RPCs queued, the condition uses the realtime clock */
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += (due - now) / 1000;
+			ts.tv_nsec += ((due - now) % 1000) * 1000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_nsec -= 1000000000;
+				++ts.tv_sec;
+			}
+			pthread_cond_timedwait(&workers.cond, &workers.lock, &ts);
+			continue;
+		}
+		++workers.busy;
+		/* WORKERS UNLOCK */
+		pthread_mutex_unlock(&workers.lock);
+
+		reply = worker_apply_rpc(job->session, job->rpc);
+
+		/* WORKERS LOCK */
+		pthread_mutex_lock(&workers.lock);
+		job->reply = reply;
+		job->done = 1;
+		if (--workers.busy == 0 && workers.paused) {
+			pthread_cond_broadcast(&workers.idle_cond);
+		}
+		/* the job cannot be consumed and the client freed until we unlock */
+		np_engine_kick(job->client);
+	}
+
+	--workers.running;
+	pthread_cond_broadcast(&workers.exit_cond);
+	/* WORKERS UNLOCK */
+	pthread_mutex_unlock(&workers.lock);
+
+#ifdef NP_TLS
+	np_tls_thread_cleanup();
+#endif
+
+	return NULL;
+}
+
+int np_workers_set_count(unsigned int count) {
+	pthread_t thread;
+	int ret = EXIT_SUCCESS, r;
+
+	/* WORKERS LOCK */
+	pthread_mutex_lock(&workers.lock);
+	workers.target = count;
+
+	while (workers.running < workers.target) {
+		if ((r = pthread_create(&thread, NULL, worker_thread, NULL)) != 0) {
+			nc_verb_error("%s: failed to create a thread (%s)", __func__, strerror(r));
+			ret = EXIT_FAILURE;
+			break;
+		}
+		pthread_detach(thread);
+		++workers.running;
+	}
+
+	/* the excessive workers will exit themselves */
+	pthread_cond_broadcast(&workers.cond);
+	/* WORKERS UNLOCK */
+	pthread_mutex_unlock(&workers.lock);
+
+	return ret;
+}
+
+struct np_rpc_job* np_workers_submit(struct client_struct* client, struct nc_session* session, nc_rpc* rpc, unsigned int delay) {
+	struct np_rpc_job* job;
+	struct np_rpc_flow* flow;
+	const char* username = (client->username != NULL ? client->username : "");
+
+	if ((job = calloc(1, sizeof *job)) == NULL) {
+		nc_verb_error("%s: memory allocation failed (%s)", __func__, strerror(errno));
+		return NULL;
+	}
+	job->client = client;
+	job->session = session;
+	job->rpc = rpc;
+	clock_gettime(CLOCK_MONOTONIC, &job->recv_time);
+	job->not_before = np_timespec_msec(&job->recv_time) + delay;
+	++client->rpc_jobs;
+
+	/* WORKERS LOCK */
+	pthread_mutex_lock(&workers.lock);
+	if (workers.running == 0) {
+		/* WORKERS UNLOCK */
+		pthread_mutex_unlock(&workers.lock);
+		nc_verb_error("%s: no RPC workers running", __func__);
+		--client->rpc_jobs;
+		free(job);
+		return NULL;
+	}
+
+	/* find the flow of the user */
+	flow = workers.flows;
+	if (flow != NULL) {
+		do {
+			if (strcmp(flow->username, username) == 0) {
+				break;
+			}
+			flow = flow->next;
+		} while (flow != workers.flows);
+	}
+	if (flow == NULL || strcmp(flow->username, username) != 0) {
+		if ((flow = calloc(1, sizeof *flow)) == NULL || (flow->username = strdup(username)) == NULL) {
+			/* WORKERS UNLOCK */
+			pthread_mutex_unlock(&workers.lock);
+			nc_verb_error("%s: memory allocation failed (%s)", __func__, strerror(errno));
+			free(flow);
+			--client->rpc_jobs;
+			free(job);
+			return NULL;
+		}
+		flow->weight = np_ratelimit_weight(client->username);
+
+		/* a new user waits for its turn after all the others */
+		if (workers.flows == NULL) {
+			flow->next = flow->prev = flow;
+			workers.flows = flow;
+		} else {
+			flow->next = workers.flows;
+			flow->prev = workers.flows->prev;
+			flow->prev->next = flow;
+			workers.flows->prev = flow;
+		}
+	}
+
+	if (flow->tail != NULL) {
+		flow->tail->next = job;
+	} else {
+		flow->head = job;
+	}
+	flow->tail = job;
+	++workers.queued;
+	pthread_cond_signal(&workers.cond);
+	/* WORKERS UNLOCK */
+	pthread_mutex_unlock(&workers.lock);
+
+	return job;
+}
+
+struct np_rpc_job* np_rpc_job_reply(struct client_struct* client, struct nc_session* session, nc_rpc* rpc, nc_reply* reply, const struct timespec* recv_time) {
+	struct np_rpc_job* job;
+
+	if ((job = calloc(1, sizeof *job)) == NULL) {
+		nc_verb_error("%s: memory allocation failed (%s)", __func__, strerror(errno));
+		return NULL;
+	}
+	job->client = client;
+	job->session = session;
+	job->rpc = rpc;
+	job->reply = reply;
+	job->recv_time = *recv_time;
+	/* never queued, no need to lock */
+	job->done = 1;
+	++client->rpc_jobs;
+
+	return job;
+}
+
+int np_rpc_job_done(struct np_rpc_job* job) {
+	int ret;
+
+	/* WORKERS LOCK */
+	pthread_mutex_lock(&workers.lock);
+	ret = job->done;
+	/* WORKERS UNLOCK */
+	pthread_mutex_unlock(&workers.lock);
+
+	return ret;
+}
+
+void np_rpc_job_free(struct np_rpc_job* job) {
+	if (job == NULL) {
+		return;
+	}
+
+	--job->client->rpc_jobs;
+	nc_rpc_free(job->rpc);
+	nc_reply_free(job->reply);
+	free(job);
+}
+
+void np_workers_pause(void) {
+	/* WORKERS LOCK */
+	pthread_mutex_lock(&workers.lock);
+	workers.paused = 1;
+	while (workers.busy > 0) {
+		pthread_cond_wait(&workers.idle_cond, &workers.lock);
+	}
+	/* WORKERS UNLOCK */
+	pthread_mutex_unlock(&workers.lock);
+}
+
+void np_workers_resume(void) {
+	/* WORKERS LOCK */
+	pthread_mutex_lock(&workers.lock);
+	workers.paused = 0;
+	pthread_cond_broadcast(&workers.cond);
+	/* WORKERS UNLOCK */
+	pthread_mutex_unlock(&workers.lock);
+}
+
+unsigned int np_workers_queued(void) {
+	unsigned int ret;
+
+	/* WORKERS LOCK */
+	pthread_mutex_lock(&workers.lock);
+	ret = workers.queued;
+	/* WORKERS UNLOCK */
+	pthread_mutex_unlock(&workers.lock);
+
+	return ret;
+}
+
+void np_workers_cleanup(void) {
+	/* WORKERS LOCK */
+	pthread_mutex_lock(&workers.lock);
+	workers.target = 0;
+	pthread_cond_broadcast(&workers.cond);
+	while (workers.running > 0) {
+		pthread_cond_wait(&workers.exit_cond, &workers.lock);
+	}
+	/* WORKERS UNLOCK */
+	pthread_mutex_unlock(&workers.lock);
+}
@@ -0,0 +1,138 @@
+/**
+ * @file workers.h
+ * @brief Netopeer server RPC worker pool header
+ *
+ * Copyright (C) 2015 CESNET, z.s.p.o.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of the Company nor the names of its contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * ALTERNATIVELY, provided that this notice is retained in full, this
+ * product may be distributed under the terms of the GNU General Public
+ * License (GPL) version 2 or later, in which case the provisions
+ * of the GPL apply INSTEAD OF those given above.
+ *
+ * This software is provided ``as is, and any express or implied
+ * warranties, including, but not limited to, the implied warranties of
+ * merchantability and fitness for a particular purpose are disclaimed.
+ * In no event shall the company or contributors be liable for any
+ * direct, indirect, incidental, special, exemplary, or consequential
+ * damages (including, but not limited to, procurement of substitute
+ * goods or services; loss of use, data, or profits; or business
+ * interruption) however caused and on any theory of liability, whether
+ * in contract, strict liability, or tort (including negligence or
+ * otherwise) arising in any way out of the use of this software, even
+ * if advised of the possibility of such damage.
+ */
+
+#ifndef _WORKERS_H_
+#define _WORKERS_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <libnetconf.h>
+
+struct client_struct;
+
+/* an RPC to be processed by a worker */
+struct np_rpc_job {
+	struct client_struct* client;
+	struct nc_session* session;
+	nc_rpc* rpc;
+	nc_reply* reply;
+	struct timespec recv_time;			// for the RPC latency statistics, monotonic
+	uint64_t not_before;				// monotonic msecs, the RPC is delayed by the rate limits until then
+	int done;							// protected by the workers lock
+	struct np_rpc_job* next;
+};
+
+/**
+ * @brief Start or stop worker threads to have exactly the requested number of them
+ *
+ * @param count Requested number of workers
+ *
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int np_workers_set_count(unsigned int count);
+
+/**
+ * @brief Queue an RPC to be applied on all the datastores by a worker
+ *
+ * The client gets kicked once the reply is ready. It must not be freed
+ * until np_rpc_job_free() is called on the returned job.
+ *
+ * @param client Client of the session
+ * @param session Session which received the RPC
+ * @param rpc RPC to apply, the job takes it over on success
+ * @param delay Number of msecs the RPC must wait before being applied
+ *
+ * @return Queued job, NULL on error.
+ */
+struct np_rpc_job* np_workers_submit(struct client_struct* client, struct nc_session* session, nc_rpc* rpc, unsigned int delay);
+
+/**
+ * @brief Wrap a reply made without a worker into a processed job
+ *
+ * The reply is then sent the same way as the ones made by the workers.
+ *
+ * @param client Client of the session
+ * @param session Session which received the RPC
+ * @param rpc Replied RPC, the job takes it over on success
+ * @param reply Reply to send, the job takes it over on success
+ * @param recv_time Monotonic time the RPC was received at
+ *
+ * @return Processed job, NULL on error.
+ */
+struct np_rpc_job* np_rpc_job_reply(struct client_struct* client, struct nc_session* session, nc_rpc* rpc, nc_reply* reply, const struct timespec* recv_time);
+
+/**
+ * @brief Check whether a job has already been processed
+ *
+ * @param job Job to check
+ *
+ * @return 1 if processed, 0 otherwise.
+ */
+int np_rpc_job_done(struct np_rpc_job* job);
+
+/**
+ * @brief Free a processed job
+ *
+ * @param job Job to free
+ */
+void np_rpc_job_free(struct np_rpc_job* job);
+
+/**
+ * @brief Stop taking the queued RPCs and wait for the ones being applied
+ *
+ * The RPCs keep being queued and are applied after np_workers_resume().
+ */
+void np_workers_pause(void);
+
+/**
+ * @brief Continue applying the queued RPCs
+ */
+void np_workers_resume(void);
+
+/**
+ * @brief Get the number of the RPCs waiting for a worker
+ *
+ * @return Number of the queued RPCs.
+ */
+unsigned int np_workers_queued(void);
+
+/**
+ * @brief Stop all the workers, there must be no jobs left
+ */
+void np_workers_cleanup(void);
+
+#endif /* _WORKERS_H_ */